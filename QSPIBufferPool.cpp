@@ -0,0 +1,71 @@
+#include "QSPIBufferPool.h"
+
+#if QSPI_BUFFER_COUNT < 1 || QSPI_BUFFER_COUNT > 32
+#error "QSPI_BUFFER_COUNT must be 1 to 32"
+#endif
+#if QSPI_BUFFER_SIZE % QSPI_BUFFER_ALIGN
+#error "QSPI_BUFFER_SIZE must be a multiple of QSPI_BUFFER_ALIGN"
+#endif
+
+#define POOL_ALL_USED       ((uint32_t)(((uint64_t)1 << QSPI_BUFFER_COUNT) - 1))
+
+MBED_ALIGN(QSPI_BUFFER_ALIGN) static uint8_t pool_arena[QSPI_BUFFER_COUNT][QSPI_BUFFER_SIZE];
+static volatile uint32_t pool_used = 0;     // bit per buffer taken
+static qspi_buffer_pool_stats_t pool_stats;
+
+void *qspi_buffer_acquire()
+{
+    uint32_t used = pool_used;
+    uint32_t index = 0;
+
+    // The lowest free bit; a failed swap reloads used and tries again
+    do {
+        if (used == POOL_ALL_USED) {
+            core_util_atomic_incr_u32(&pool_stats.failures, 1);
+            return NULL;
+        }
+        index = __builtin_ctz(~used);
+    } while (!core_util_atomic_cas_u32(&pool_used, &used, used | (1UL << index)));
+
+    uint32_t in_use = core_util_atomic_incr_u32(&pool_stats.in_use, 1);
+    uint32_t peak = pool_stats.peak;
+    while (in_use > peak && !core_util_atomic_cas_u32(&pool_stats.peak, &peak, in_use)) {
+    }
+    core_util_atomic_incr_u32(&pool_stats.acquires, 1);
+    return pool_arena[index];
+}
+
+void qspi_buffer_release(void *buffer)
+{
+    if (buffer == NULL) {
+        return;
+    }
+    uint32_t offset = (uint32_t)((uint8_t *)buffer - &pool_arena[0][0]);
+    if (!qspi_buffer_owns(buffer, 1) || offset % QSPI_BUFFER_SIZE) {
+        printf("\nERROR: Released a buffer not from the pool");
+        return;
+    }
+
+    uint32_t bit = 1UL << (offset / QSPI_BUFFER_SIZE);
+    uint32_t used = pool_used;
+    while (!core_util_atomic_cas_u32(&pool_used, &used, used & ~bit)) {
+    }
+    core_util_atomic_decr_u32(&pool_stats.in_use, 1);
+}
+
+bool qspi_buffer_owns(const void *ptr, size_t size)
+{
+    const uint8_t *p = (const uint8_t *)ptr;
+    const uint8_t *start = &pool_arena[0][0];
+    return p >= start && size <= sizeof(pool_arena) && (size_t)(p - start) <= sizeof(pool_arena) - size;
+}
+
+void qspi_buffer_pool_stats(qspi_buffer_pool_stats_t *stats, bool clear)
+{
+    *stats = pool_stats;
+    if (clear) {
+        pool_stats.peak = pool_stats.in_use;
+        pool_stats.acquires = 0;
+        pool_stats.failures = 0;
+    }
+}
@@ -0,0 +1,80 @@
+#ifndef QSPI_BUFFER_POOL_H
+#define QSPI_BUFFER_POOL_H
+
+#include "mbed.h"
+
+// Buffers in the pool, at most 32, and the size of each
+#ifndef QSPI_BUFFER_COUNT
+#define QSPI_BUFFER_COUNT                   4
+#endif
+#ifndef QSPI_BUFFER_SIZE
+#define QSPI_BUFFER_SIZE                    4096
+#endif
+
+// Every buffer starts on this boundary: EasyDMA needs whole words, the
+// tests keep their transfers on 1K boundaries
+#define QSPI_BUFFER_ALIGN                   1024
+
+typedef struct {
+    uint32_t in_use;
+    uint32_t peak;                  // most buffers in use at once
+    uint32_t acquires;
+    uint32_t failures;              // acquires that found the pool empty
+} qspi_buffer_pool_stats_t;
+
+/** Take a buffer of QSPI_BUFFER_SIZE bytes from the static pool
+ *
+ *  Lock free and O(1): a buffer is claimed by setting its bit in a bitmap
+ *  with one compare-and-swap, so it may be called from any thread or
+ *  interrupt. The pool is ordinary RAM, which EasyDMA reaches, so
+ *  QSPIFlash::program sends whole words from a pool buffer without copying
+ *  them to its staging buffer first.
+ *
+ *  @return the buffer, NULL when all are taken
+ */
+void *qspi_buffer_acquire();
+
+/** Give back a buffer from qspi_buffer_acquire; NULL is ignored */
+void qspi_buffer_release(void *buffer);
+
+/** Whether [ptr, ptr + size) lies within the pool */
+bool qspi_buffer_owns(const void *ptr, size_t size);
+
+/** Read the pool counters, and with clear restart them (peak from the
+ *  buffers in use now)
+ */
+void qspi_buffer_pool_stats(qspi_buffer_pool_stats_t *stats, bool clear);
+
+/** A pool buffer held for the lifetime of the object
+ *
+ *  Every return path gives the buffer back. data() is NULL when the pool
+ *  was empty.
+ */
+class QSPIBuffer {
+public:
+    QSPIBuffer() : _data((char *)qspi_buffer_acquire()) {}
+
+    ~QSPIBuffer()
+    {
+        qspi_buffer_release(_data);
+    }
+
+    char *data() const
+    {
+        return _data;
+    }
+
+    size_t size() const
+    {
+        return _data ? QSPI_BUFFER_SIZE : 0;
+    }
+
+private:
+    // Not copyable: the buffer has one owner
+    QSPIBuffer(const QSPIBuffer &);
+    QSPIBuffer &operator=(const QSPIBuffer &);
+
+    char *_data;
+};
+
+#endif // QSPI_BUFFER_POOL_H
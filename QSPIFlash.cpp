@@ -0,0 +1,1501 @@
+#include "QSPIFlash.h"
+
+typedef struct {
+    uint32_t typ_us;
+    uint32_t max_us;
+    uint32_t poll_cap_us;           // longest interval between two polls
+} qspi_flash_op_timing_t;
+
+// Indexed by qspi_flash_op_t. Polling backs off to a quarter of the typical
+// time, which bounds the overshoot past the real completion. Nothing is known
+// about an operation issued elsewhere, so it gets no initial sleep, a poll
+// interval suited to a page program and the longest timeout.
+static const qspi_flash_op_timing_t op_timings[QSPI_FLASH_OP_COUNT] = {
+    { 0,                        QSPI_FLASH_TSE_MAX_US,  QSPI_FLASH_TPP_TYP_US / 4   },
+    { QSPI_FLASH_TPP_TYP_US,    QSPI_FLASH_TPP_MAX_US,  QSPI_FLASH_TPP_TYP_US / 4   },
+    { QSPI_FLASH_TSE_TYP_US,    QSPI_FLASH_TSE_MAX_US,  QSPI_FLASH_TSE_TYP_US / 4   },
+    { QSPI_FLASH_TW_TYP_US,     QSPI_FLASH_TW_MAX_US,   QSPI_FLASH_TW_TYP_US / 4    },
+    { QSPI_FLASH_TBE32_TYP_US,  QSPI_FLASH_TBE32_MAX_US, QSPI_FLASH_TBE32_TYP_US / 4 },
+    { QSPI_FLASH_TBE64_TYP_US,  QSPI_FLASH_TBE64_MAX_US, QSPI_FLASH_TBE64_TYP_US / 4 },
+    { QSPI_FLASH_TCE_TYP_US,    QSPI_FLASH_TCE_MAX_US,  QSPI_FLASH_TCE_TYP_US / 4   },
+};
+
+typedef struct {
+    uint32_t size;
+    uint8_t command;
+    qspi_flash_op_t op;
+    uint8_t type;                   // QSPI_FLASH_ERASE_*
+} qspi_flash_erase_type_t;
+
+// Largest first; the chip erase takes no address and its size, 0 here, is
+// that of the part
+static const qspi_flash_erase_type_t erase_types[] = {
+    { 0,                        QSPI_STD_CMD_CHIP_ERASE,    QSPI_FLASH_OP_CHIP_ERASE,       QSPI_FLASH_ERASE_CHIP    },
+    { QSPI_FLASH_BLOCK64_SIZE,  QSPI_STD_CMD_BLOCK64_ERASE, QSPI_FLASH_OP_BLOCK64_ERASE,    QSPI_FLASH_ERASE_BLOCK64 },
+    { QSPI_FLASH_BLOCK32_SIZE,  QSPI_STD_CMD_BLOCK32_ERASE, QSPI_FLASH_OP_BLOCK32_ERASE,    QSPI_FLASH_ERASE_BLOCK32 },
+    { QSPI_FLASH_SECTOR_SIZE,   QSPI_STD_CMD_SECT_ERASE,    QSPI_FLASH_OP_SECTOR_ERASE,     QSPI_FLASH_ERASE_SECTOR  },
+};
+
+#define ERASE_TYPE_COUNT    (sizeof(erase_types) / sizeof(erase_types[0]))
+
+MBED_WEAK qspi_status_t qspi_flash_hw_autopoll(QSPI *qspi, uint8_t mask, uint8_t match, uint32_t timeout_us)
+{
+    (void)qspi;
+    (void)mask;
+    (void)match;
+    (void)timeout_us;
+    return QSPI_STATUS_INVALID_PARAMETER;
+}
+
+MBED_WEAK qspi_status_t qspi_flash_hw_read_continuous(QSPI *qspi, uint32_t addr, uint8_t mode, bool send_inst, void *buffer, size_t size)
+{
+    (void)qspi;
+    (void)addr;
+    (void)mode;
+    (void)send_inst;
+    (void)buffer;
+    (void)size;
+    return QSPI_STATUS_INVALID_PARAMETER;
+}
+
+MBED_WEAK const void *qspi_flash_hw_map(QSPI *qspi, uint32_t addr, size_t size)
+{
+    (void)qspi;
+    (void)addr;
+    (void)size;
+    return NULL;
+}
+
+MBED_WEAK qspi_status_t qspi_flash_hw_bus_stats(qspi_flash_bus_stats_t *stats, bool clear)
+{
+    (void)stats;
+    (void)clear;
+    return QSPI_STATUS_INVALID_PARAMETER;
+}
+
+MBED_WEAK qspi_status_t qspi_flash_hw_charge(uint64_t *charge_pc)
+{
+    (void)charge_pc;
+    return QSPI_STATUS_INVALID_PARAMETER;
+}
+
+MBED_WEAK qspi_status_t qspi_flash_hw_command_batch(QSPI *qspi, const qspi_flash_command_t *commands, size_t count)
+{
+    (void)qspi;
+    (void)commands;
+    (void)count;
+    return QSPI_STATUS_INVALID_PARAMETER;
+}
+
+MBED_WEAK qspi_status_t qspi_flash_hw_power_fail(uint32_t ops)
+{
+    (void)ops;
+    return QSPI_STATUS_INVALID_PARAMETER;
+}
+
+QSPIFlashLock::QSPIFlashLock() : _depth(0), _locked_us(0)
+{
+    memset(&_stats, 0, sizeof(_stats));
+}
+
+void QSPIFlashLock::lock()
+{
+    uint32_t wait_us = 0;
+
+    if (!_mutex.trylock()) {
+        uint32_t start_us = us_ticker_read();
+        _mutex.lock();
+        wait_us = us_ticker_read() - start_us;
+        _stats.contended++;
+    }
+    if (_depth++ == 0) {
+        _locked_us = us_ticker_read();
+        _stats.locks++;
+        _stats.wait_total_us += wait_us;
+        if (wait_us > _stats.wait_max_us) {
+            _stats.wait_max_us = wait_us;
+        }
+    }
+}
+
+void QSPIFlashLock::unlock()
+{
+    if (--_depth == 0) {
+        uint32_t hold_us = us_ticker_read() - _locked_us;
+        _stats.hold_total_us += hold_us;
+        if (hold_us > _stats.hold_max_us) {
+            _stats.hold_max_us = hold_us;
+        }
+    }
+    _mutex.unlock();
+}
+
+qspi_flash_lock_stats_t QSPIFlashLock::get_stats()
+{
+    // Not counted itself
+    _mutex.lock();
+    qspi_flash_lock_stats_t stats = _stats;
+    _mutex.unlock();
+    return stats;
+}
+
+void QSPIFlashLock::reset_stats()
+{
+    // Not counted itself
+    _mutex.lock();
+    memset(&_stats, 0, sizeof(_stats));
+    _mutex.unlock();
+}
+
+QSPIFlash::QSPIFlash(QSPI *qspi, QSPIReadCache *cache)
+    : _qspi(qspi), _cache(cache), _size(QSPI_FLASH_SIZE), _erase_types(QSPI_FLASH_ERASE_ALL), _addr_bytes(3), _trace_format(QSPI_TRACE_FORMAT_UNKNOWN), _trace_read_opcode(0),
+      _trace_write_opcode(0), _busy(false), _busy_op(QSPI_FLASH_OP_UNKNOWN), _busy_addr(0), _busy_size(0),
+      _suspended_us(0), _hw_autopoll(true), _hw_batch(true), _suspend_enabled(true),
+      _continuous_enabled(false), _continuous(false), _high_performance(false), _deep_down(false),
+      _power_since_us(us_ticker_read()), _sector_buf(NULL), _async_thread(NULL), _async_pending(0), _async_free(QSPI_FLASH_ASYNC_QUEUE_DEPTH),
+      _async_head(0), _async_tail(0)
+{
+    memset(&_wait_stats, 0, sizeof(_wait_stats));
+    memset(&_write_stats, 0, sizeof(_write_stats));
+    memset(&_batch_stats, 0, sizeof(_batch_stats));
+    memset(&_power_stats, 0, sizeof(_power_stats));
+    _busy_timer.start();
+    _suspend_timer.start();
+    _resume_timer.start();
+}
+
+QSPIFlash::~QSPIFlash()
+{
+    if (_async_thread) {
+        // Queued behind any pending request, so those still complete
+        async_request_t request = {};
+        request.stop = true;
+        submit(request);
+        _async_thread->join();
+        delete _async_thread;
+    }
+    free(_sector_buf);
+}
+
+size_t QSPIFlash::stage_page(uint32_t addr, const uint8_t *data, size_t size, const void **staged, size_t *staged_len)
+{
+    size_t lead = addr & 0x3;
+    size_t chunk = QSPI_FLASH_PAGE_SIZE - (addr & (QSPI_FLASH_PAGE_SIZE - 1));
+    if (chunk > size) {
+        chunk = size;
+    }
+
+    // Whole words in a pool buffer are DMA-ready where they are
+    if (lead == 0 && (chunk & 0x3) == 0 && ((uintptr_t)data & 0x3) == 0 && qspi_buffer_owns(data, chunk)) {
+        *staged = data;
+        *staged_len = chunk;
+        return chunk;
+    }
+
+    // Leading and trailing padding is 0xFF so those bytes stay untouched
+    uint8_t *stage = (uint8_t *)_stage;
+    size_t len = (lead + chunk + 3) & ~(size_t)0x3;
+    memset(stage, 0xFF, len);
+    memcpy(stage + lead, data, chunk);
+
+    *staged = _stage;
+    *staged_len = len;
+    return chunk;
+}
+
+qspi_status_t QSPIFlash::send_page(uint32_t page_addr, const void *staged, size_t staged_len)
+{
+    end_continuous();
+#if !QSPI_FLASH_CONTROLLER_AUTO_WREN
+    if (QSPI_STATUS_OK != bus_command(QSPI_STD_CMD_WREN, 0, NULL, 0, NULL, 0)) {
+        return QSPI_STATUS_ERROR;
+    }
+#endif
+    size_t len = staged_len;
+    qspi_status_t result = bus_write(page_addr, staged, &len);
+    if (result != QSPI_STATUS_OK || len != staged_len) {
+        return QSPI_STATUS_ERROR;
+    }
+    return QSPI_STATUS_OK;
+}
+
+qspi_status_t QSPIFlash::read_status(uint8_t *status)
+{
+    char status_value[2];
+
+    end_continuous();
+    _wait_stats.polls++;
+    if (QSPI_STATUS_OK != bus_command(QSPI_STD_CMD_RDSR, 0, NULL, 0, status_value, 2)) {
+        return QSPI_STATUS_ERROR;
+    }
+    *status = status_value[0];
+    return QSPI_STATUS_OK;
+}
+
+qspi_status_t QSPIFlash::bus_command(unsigned int instruction, uint32_t addr, const char *tx_buffer, size_t tx_length,
+                                     char *rx_buffer, size_t rx_length)
+{
+    if (_deep_down && instruction != QSPI_STD_CMD_RDP && QSPI_STATUS_OK != wake()) {
+        return QSPI_STATUS_ERROR;
+    }
+    uint32_t start_us = qspi_trace_start();
+    qspi_status_t result = _qspi->command_transfer(instruction, tx_buffer, tx_length, rx_buffer, rx_length);
+    qspi_trace_record(QSPI_TRACE_COMMAND, instruction, _trace_format, addr, tx_length + rx_length, start_us, result);
+    return result;
+}
+
+// One batch step as driver calls of its own, called locked
+qspi_status_t QSPIFlash::send_command(const qspi_flash_command_t *command, uint32_t trace_addr)
+{
+    uint32_t start_us = us_ticker_read();
+
+    while (true) {
+        _batch_stats.driver_calls++;
+        if (QSPI_STATUS_OK != bus_command(command->instruction, trace_addr, command->tx_buffer, command->tx_length,
+                                          command->rx_buffer, command->rx_length)) {
+            return QSPI_STATUS_ERROR;
+        }
+        if (command->poll_mask == 0 || ((uint8_t)command->rx_buffer[0] & command->poll_mask) == command->poll_match) {
+            return QSPI_STATUS_OK;
+        }
+        if (us_ticker_read() - start_us >= command->poll_timeout_us) {
+            return QSPI_STATUS_ERROR;
+        }
+        wait_us(QSPI_FLASH_POLL_MIN_US);
+    }
+}
+
+qspi_status_t QSPIFlash::bus_read(uint32_t addr, void *buffer, size_t *len)
+{
+    if (_deep_down && QSPI_STATUS_OK != wake()) {
+        return QSPI_STATUS_ERROR;
+    }
+    uint32_t start_us = qspi_trace_start();
+    qspi_status_t result = _qspi->read(addr, (char *)buffer, len);
+    qspi_trace_record(QSPI_TRACE_READ, _trace_read_opcode, _trace_format, addr, *len, start_us, result);
+    return result;
+}
+
+qspi_status_t QSPIFlash::bus_write(uint32_t addr, const void *buffer, size_t *len)
+{
+    if (_deep_down && QSPI_STATUS_OK != wake()) {
+        return QSPI_STATUS_ERROR;
+    }
+    uint32_t start_us = qspi_trace_start();
+    qspi_status_t result = _qspi->write(addr, (const char *)buffer, len);
+    qspi_trace_record(QSPI_TRACE_WRITE, _trace_write_opcode, _trace_format, addr, *len, start_us, result);
+    return result;
+}
+
+void QSPIFlash::sleep_us(uint32_t us)
+{
+    // The RTOS tick is 1ms; only whole ticks can be given back to the scheduler
+    if (us >= 1000) {
+        Thread::wait(us / 1000);
+    }
+    if (us % 1000) {
+        wait_us(us % 1000);
+    }
+}
+
+void QSPIFlash::start_busy(qspi_flash_op_t op, uint32_t addr, uint32_t size)
+{
+    _mutex.lock();
+    if (_cache) {
+        if (size) {
+            _cache->invalidate(addr, size);
+        } else {
+            _cache->invalidate_all();
+        }
+    }
+    _busy = true;
+    _busy_op = op;
+    _busy_addr = addr;
+    _busy_size = size;
+    _suspended_us = 0;
+    _busy_timer.reset();
+    _resume_timer.reset();
+    _mutex.unlock();
+}
+
+uint32_t QSPIFlash::busy_elapsed_us()
+{
+    return _busy_timer.read_us() - _suspended_us;
+}
+
+bool QSPIFlash::can_suspend(uint32_t addr, size_t size)
+{
+    switch (_busy_op) {
+        case QSPI_FLASH_OP_PROGRAM:
+        case QSPI_FLASH_OP_SECTOR_ERASE:
+        case QSPI_FLASH_OP_BLOCK32_ERASE:
+        case QSPI_FLASH_OP_BLOCK64_ERASE:
+            break;
+        default:
+            return false;
+    }
+    if (!_suspend_enabled || _busy_size == 0) {
+        return false;
+    }
+    // Cells that are being changed read back undefined while suspended
+    return addr + size <= _busy_addr || addr >= _busy_addr + _busy_size;
+}
+
+qspi_status_t QSPIFlash::wait_idle()
+{
+    _mutex.lock();
+    bool busy = _busy;
+    _mutex.unlock();
+    return busy ? wait_ready() : QSPI_STATUS_OK;
+}
+
+bool QSPIFlash::suspend()
+{
+    uint32_t ran_us = _resume_timer.read_us();
+    if (ran_us < QSPI_FLASH_RESUME_MIN_US) {
+        wait_us(QSPI_FLASH_RESUME_MIN_US - ran_us);
+    }
+
+    // WIP drops once the part has stopped, or if the operation just completed
+    char status;
+    const qspi_flash_command_t commands[] = {
+        QSPI_FLASH_COMMAND(QSPI_STD_CMD_SUSPEND, NULL, 0, NULL, 0),
+        QSPI_FLASH_COMMAND_POLL(QSPI_STD_CMD_RDSR, &status, QSPI_FLASH_SR_WIP, 0, QSPI_FLASH_TSUS_MAX_US * 2),
+    };
+    _suspend_timer.reset();
+    if (QSPI_STATUS_OK != command_batch(commands, 2)) {
+        resume();
+        return false;
+    }
+    _wait_stats.suspends++;
+    return true;
+}
+
+void QSPIFlash::resume()
+{
+    // Ignored by the part when the operation had already completed
+    bus_command(QSPI_STD_CMD_RESUME, 0, NULL, 0, NULL, 0);
+    _suspended_us += _suspend_timer.read_us();
+    _resume_timer.reset();
+}
+
+void QSPIFlash::set_hw_autopoll(bool enable)
+{
+    _hw_autopoll = enable;
+}
+
+void QSPIFlash::set_hw_batch(bool enable)
+{
+    _hw_batch = enable;
+}
+
+qspi_status_t QSPIFlash::command_batch(const qspi_flash_command_t *commands, size_t count, uint32_t trace_addr)
+{
+    if (commands == NULL || count == 0) {
+        return QSPI_STATUS_INVALID_PARAMETER;
+    }
+    for (size_t i = 0; i < count; i++) {
+        const qspi_flash_command_t *command = &commands[i];
+        if ((command->tx_length && command->tx_buffer == NULL) || command->tx_length > 8 ||
+                (command->rx_length && command->rx_buffer == NULL) || command->rx_length > 8 ||
+                (command->poll_mask && command->rx_length == 0)) {
+            return QSPI_STATUS_INVALID_PARAMETER;
+        }
+    }
+
+    _mutex.lock();
+    end_continuous();
+    qspi_status_t result = QSPI_STATUS_OK;
+    if (_deep_down) {
+        result = wake();
+    }
+
+    bool sent = false;
+    size_t done = 0;
+    if (result == QSPI_STATUS_OK && _hw_batch) {
+        uint32_t start_us = qspi_trace_start();
+        qspi_status_t hw_result = qspi_flash_hw_command_batch(_qspi, commands, count);
+        if (hw_result == QSPI_STATUS_INVALID_PARAMETER) {
+            _hw_batch = false;
+        } else {
+            // One entry per step, all spanning the whole batch
+            for (size_t i = 0; i < count; i++) {
+                qspi_trace_record(QSPI_TRACE_COMMAND, commands[i].instruction, _trace_format, trace_addr,
+                                  commands[i].tx_length + commands[i].rx_length, start_us, hw_result);
+            }
+            _batch_stats.driver_calls++;
+            result = hw_result;
+            sent = true;
+            // The hook does not say how far a failed batch got
+            if (result == QSPI_STATUS_OK) {
+                done = count;
+            }
+        }
+    }
+    for (size_t i = 0; !sent && i < count && result == QSPI_STATUS_OK; i++) {
+        result = send_command(&commands[i], trace_addr);
+        if (result == QSPI_STATUS_OK) {
+            done++;
+        }
+    }
+
+    _batch_stats.batches++;
+    _batch_stats.commands += done;
+    _mutex.unlock();
+    return result;
+}
+
+qspi_flash_batch_stats_t QSPIFlash::get_batch_stats()
+{
+    _mutex.lock();
+    qspi_flash_batch_stats_t stats = _batch_stats;
+    _mutex.unlock();
+    return stats;
+}
+
+void QSPIFlash::reset_batch_stats()
+{
+    _mutex.lock();
+    memset(&_batch_stats, 0, sizeof(_batch_stats));
+    _mutex.unlock();
+}
+
+void QSPIFlash::set_continuous_read(bool enable)
+{
+    _mutex.lock();
+    _continuous_enabled = enable;
+    if (!enable) {
+        end_continuous();
+    }
+    _mutex.unlock();
+}
+
+const void *QSPIFlash::map(uint32_t addr, size_t size)
+{
+    if (!addressable(addr, size) || QSPI_STATUS_OK != wait_idle()) {
+        return NULL;
+    }
+    _mutex.lock();
+    // The controller sends its own read commands through the window
+    end_continuous();
+    if (_deep_down && QSPI_STATUS_OK != wake()) {
+        _mutex.unlock();
+        return NULL;
+    }
+    const void *mapped = qspi_flash_hw_map(_qspi, addr, size);
+    _mutex.unlock();
+    return mapped;
+}
+
+void QSPIFlash::set_read_cache(QSPIReadCache *cache)
+{
+    _mutex.lock();
+    _cache = cache;
+    _mutex.unlock();
+}
+
+void QSPIFlash::set_geometry(uint32_t size, uint8_t erase_types)
+{
+    _size = size;
+    _erase_types = erase_types | QSPI_FLASH_ERASE_SECTOR;
+}
+
+qspi_status_t QSPIFlash::set_address_size(qspi_address_size_t size, bool wren)
+{
+    if (size != QSPI_CFG_ADDR_SIZE_24 && size != QSPI_CFG_ADDR_SIZE_32) {
+        return QSPI_STATUS_INVALID_PARAMETER;
+    }
+
+    // The part ignores the command while busy
+    _op_mutex.lock();
+    qspi_status_t result = wait_idle();
+    const qspi_flash_command_t commands[] = {
+        QSPI_FLASH_COMMAND(QSPI_STD_CMD_WREN, NULL, 0, NULL, 0),
+        QSPI_FLASH_COMMAND((size == QSPI_CFG_ADDR_SIZE_32) ? QSPI_STD_CMD_EN4B : QSPI_STD_CMD_EX4B, NULL, 0, NULL, 0),
+    };
+    bool send_wren = wren && size == QSPI_CFG_ADDR_SIZE_32;
+
+    _mutex.lock();
+    if (result == QSPI_STATUS_OK) {
+        result = command_batch(send_wren ? commands : commands + 1, send_wren ? 2 : 1);
+    }
+    if (result == QSPI_STATUS_OK) {
+        _addr_bytes = (size == QSPI_CFG_ADDR_SIZE_32) ? 4 : 3;
+    }
+    _mutex.unlock();
+    _op_mutex.unlock();
+    return result;
+}
+
+qspi_status_t QSPIFlash::set_power_mode(qspi_flash_power_mode_t mode)
+{
+    char regs[3];
+    bool high_performance = (mode == QSPI_FLASH_POWER_HIGH);
+    bool write = false;
+
+    if (mode >= QSPI_FLASH_POWER_COUNT) {
+        return QSPI_STATUS_INVALID_PARAMETER;
+    }
+
+    // The part ignores the commands while busy
+    _op_mutex.lock();
+    qspi_status_t result = wait_idle();
+    _mutex.lock();
+    end_continuous();
+    if (mode == QSPI_FLASH_POWER_DEEP_DOWN) {
+        if (result == QSPI_STATUS_OK && !_deep_down) {
+            result = bus_command(QSPI_STD_CMD_DP, 0, NULL, 0, NULL, 0);
+            if (result == QSPI_STATUS_OK) {
+                wait_us(QSPI_FLASH_TDP_MAX_US);
+                power_transition(_high_performance, true);
+                _power_stats.deep_power_downs++;
+            }
+        }
+        _mutex.unlock();
+        _op_mutex.unlock();
+        return result;
+    }
+
+    // WRSR takes the status register, then configuration registers 1 and 2
+    const qspi_flash_command_t read_regs[] = {
+        QSPI_FLASH_COMMAND(QSPI_STD_CMD_RDSR, NULL, 0, regs, 1),
+        QSPI_FLASH_COMMAND(QSPI_STD_CMD_RDCR_MX, NULL, 0, regs + 1, 2),
+    };
+    const qspi_flash_command_t write_regs[] = {
+        QSPI_FLASH_COMMAND(QSPI_STD_CMD_WREN, NULL, 0, NULL, 0),
+        QSPI_FLASH_COMMAND(QSPI_STD_CMD_WRSR, regs, 3, NULL, 0),
+    };
+    if (result == QSPI_STATUS_OK) {
+        result = command_batch(read_regs, 2);
+    }
+    if (result == QSPI_STATUS_OK && ((regs[2] & QSPI_FLASH_CR2_HIGH_PERFORMANCE) != 0) != high_performance) {
+        regs[2] ^= QSPI_FLASH_CR2_HIGH_PERFORMANCE;
+        result = command_batch(write_regs, 2);
+        write = (result == QSPI_STATUS_OK);
+    }
+    if (write) {
+        // Not start_busy: the contents stay the same, and so may the read cache
+        _busy = true;
+        _busy_op = QSPI_FLASH_OP_WRITE_STATUS;
+        _busy_addr = 0;
+        _busy_size = 0;
+        _suspended_us = 0;
+        _busy_timer.reset();
+        _resume_timer.reset();
+    }
+    _mutex.unlock();
+
+    if (write) {
+        result = wait_ready();
+    }
+    if (result == QSPI_STATUS_OK) {
+        _mutex.lock();
+        power_transition(high_performance, false);
+        if (write) {
+            _power_stats.switches++;
+        }
+        _mutex.unlock();
+    }
+    _op_mutex.unlock();
+    return result;
+}
+
+qspi_flash_power_mode_t QSPIFlash::get_power_mode() const
+{
+    if (_deep_down) {
+        return QSPI_FLASH_POWER_DEEP_DOWN;
+    }
+    return _high_performance ? QSPI_FLASH_POWER_HIGH : QSPI_FLASH_POWER_LOW;
+}
+
+void QSPIFlash::power_transition(bool high_performance, bool deep_down)
+{
+    uint32_t now_us = us_ticker_read();
+    _power_stats.time_us[get_power_mode()] += now_us - _power_since_us;
+    _power_since_us = now_us;
+    _high_performance = high_performance;
+    _deep_down = deep_down;
+}
+
+qspi_status_t QSPIFlash::wake()
+{
+    uint32_t start_us = us_ticker_read();
+
+    if (QSPI_STATUS_OK != bus_command(QSPI_STD_CMD_RDP, 0, NULL, 0, NULL, 0)) {
+        return QSPI_STATUS_ERROR;
+    }
+    // Commands are ignored until the part is up
+    wait_us(QSPI_FLASH_TRES1_MAX_US);
+    power_transition(_high_performance, false);
+
+    uint32_t wake_us = us_ticker_read() - start_us;
+    _power_stats.wakeups++;
+    _power_stats.wake_total_us += wake_us;
+    if (wake_us > _power_stats.wake_max_us) {
+        _power_stats.wake_max_us = wake_us;
+    }
+    return QSPI_STATUS_OK;
+}
+
+qspi_flash_power_stats_t QSPIFlash::get_power_stats()
+{
+    _mutex.lock();
+    qspi_flash_power_stats_t stats = _power_stats;
+    stats.time_us[get_power_mode()] += us_ticker_read() - _power_since_us;
+    _mutex.unlock();
+    return stats;
+}
+
+void QSPIFlash::reset_power_stats()
+{
+    _mutex.lock();
+    memset(&_power_stats, 0, sizeof(_power_stats));
+    _power_since_us = us_ticker_read();
+    _mutex.unlock();
+}
+
+qspi_address_size_t QSPIFlash::get_address_size() const
+{
+    return (_addr_bytes == 4) ? QSPI_CFG_ADDR_SIZE_32 : QSPI_CFG_ADDR_SIZE_24;
+}
+
+bool QSPIFlash::addressable(uint32_t addr, size_t size) const
+{
+    // 3-byte addresses would wrap around to the start of the part
+    return _addr_bytes == 4 || (addr < QSPI_FLASH_3BYTE_MAX_SIZE && size <= QSPI_FLASH_3BYTE_MAX_SIZE - addr);
+}
+
+void QSPIFlash::set_trace_format(uint8_t format)
+{
+    qspi_bus_width_t address_width = (qspi_bus_width_t)((format >> 2) & 3);
+    qspi_bus_width_t data_width = (qspi_bus_width_t)(format & 3);
+
+    // Opcodes the controller picks for plain reads and programs
+    _trace_format = format;
+    if (format == QSPI_TRACE_FORMAT_UNKNOWN) {
+        _trace_read_opcode = 0;
+        _trace_write_opcode = 0;
+    } else if (data_width == QSPI_CFG_BUS_QUAD) {
+        _trace_read_opcode = (address_width == QSPI_CFG_BUS_QUAD) ? 0xEB : 0x6B;
+        _trace_write_opcode = (address_width == QSPI_CFG_BUS_QUAD) ? 0x38 : 0x32;
+    } else if (data_width == QSPI_CFG_BUS_DUAL) {
+        _trace_read_opcode = (address_width == QSPI_CFG_BUS_DUAL) ? 0xBB : 0x3B;
+        _trace_write_opcode = 0xA2;
+    } else {
+        _trace_read_opcode = 0x0B;
+        _trace_write_opcode = 0x02;
+    }
+}
+
+void QSPIFlash::set_suspend(bool enable)
+{
+    _suspend_enabled = enable;
+}
+
+qspi_flash_wait_stats_t QSPIFlash::get_wait_stats()
+{
+    _mutex.lock();
+    qspi_flash_wait_stats_t stats = _wait_stats;
+    _mutex.unlock();
+    return stats;
+}
+
+void QSPIFlash::reset_wait_stats()
+{
+    _mutex.lock();
+    memset(&_wait_stats, 0, sizeof(_wait_stats));
+    _mutex.unlock();
+}
+
+qspi_flash_lock_stats_t QSPIFlash::get_bus_lock_stats()
+{
+    return _mutex.get_stats();
+}
+
+qspi_flash_lock_stats_t QSPIFlash::get_op_lock_stats()
+{
+    return _op_mutex.get_stats();
+}
+
+void QSPIFlash::reset_lock_stats()
+{
+    _op_mutex.reset_stats();
+    _mutex.reset_stats();
+}
+
+qspi_status_t QSPIFlash::wait_ready(uint32_t *elapsed_us)
+{
+    _mutex.lock();
+    const qspi_flash_op_timing_t *timing = &op_timings[_busy_op];
+    qspi_status_t result = QSPI_STATUS_ERROR;
+    uint8_t status = 0;
+
+    if (!_busy) {
+        // Issued elsewhere: nothing known, count from now, and it may have
+        // changed anything
+        if (_cache) {
+            _cache->invalidate_all();
+        }
+        _busy_op = QSPI_FLASH_OP_UNKNOWN;
+        _busy_size = 0;
+        _suspended_us = 0;
+        _busy_timer.reset();
+        timing = &op_timings[QSPI_FLASH_OP_UNKNOWN];
+    }
+
+    // Sleep through the bulk of the operation before looking at the part
+    uint32_t busy_us = busy_elapsed_us();
+    if (busy_us < timing->typ_us) {
+        _mutex.unlock();
+        sleep_us(timing->typ_us - busy_us);
+        _mutex.lock();
+    }
+
+    if (_hw_autopoll) {
+        busy_us = busy_elapsed_us();
+        uint32_t timeout_us = (busy_us < timing->max_us) ? timing->max_us - busy_us : 0;
+        result = qspi_flash_hw_autopoll(_qspi, QSPI_FLASH_SR_WIP, 0, timeout_us);
+        if (result == QSPI_STATUS_INVALID_PARAMETER) {
+            _hw_autopoll = false;
+        }
+    }
+
+    if (!_hw_autopoll) {
+        uint32_t interval_us = timing->typ_us / 32;
+        if (interval_us < QSPI_FLASH_POLL_MIN_US) {
+            interval_us = QSPI_FLASH_POLL_MIN_US;
+        }
+
+        while (true) {
+            if (QSPI_STATUS_OK != read_status(&status)) {
+                result = QSPI_STATUS_ERROR;
+                break;
+            }
+            if ((status & QSPI_FLASH_SR_WIP) == 0) {
+                result = QSPI_STATUS_OK;
+                break;
+            }
+            if (busy_elapsed_us() >= timing->max_us) {
+                result = QSPI_STATUS_ERROR;
+                break;
+            }
+            _mutex.unlock();
+            sleep_us(interval_us);
+            _mutex.lock();
+            interval_us = (interval_us * 2 < timing->poll_cap_us) ? interval_us * 2 : timing->poll_cap_us;
+        }
+    }
+
+    busy_us = _busy_timer.read_us();
+    _wait_stats.waits++;
+    _wait_stats.last_us = busy_us;
+    _wait_stats.total_us += busy_us;
+    if (busy_us > _wait_stats.max_us) {
+        _wait_stats.max_us = busy_us;
+    }
+    if (result != QSPI_STATUS_OK) {
+        _wait_stats.timeouts++;
+    }
+    if (elapsed_us) {
+        *elapsed_us = busy_us;
+    }
+
+    _busy = false;
+    _busy_op = QSPI_FLASH_OP_UNKNOWN;
+    _mutex.unlock();
+    return result;
+}
+
+qspi_status_t QSPIFlash::send_erase(int type, uint32_t addr)
+{
+    const qspi_flash_erase_type_t *erase = &erase_types[type];
+    uint32_t size = erase_size(type);
+    char addrbytes[4];
+    size_t addr_len = (erase->op == QSPI_FLASH_OP_CHIP_ERASE) ? 0 : _addr_bytes;
+
+    // Big-endian, as many bytes as the part's address mode takes
+    for (size_t i = 0; i < addr_len; i++) {
+        addrbytes[i] = (addr >> (8 * (addr_len - 1 - i))) & 0xFF;
+    }
+
+    const qspi_flash_command_t commands[] = {
+        QSPI_FLASH_COMMAND(QSPI_STD_CMD_WREN, NULL, 0, NULL, 0),
+        QSPI_FLASH_COMMAND(erase->command, addr_len ? addrbytes : NULL, addr_len, NULL, 0),
+    };
+
+    _mutex.lock();
+    if (QSPI_STATUS_OK != command_batch(commands, 2, addr)) {
+        _mutex.unlock();
+        return QSPI_STATUS_ERROR;
+    }
+    start_busy(erase->op, addr - addr % size, size);
+    _mutex.unlock();
+    return QSPI_STATUS_OK;
+}
+
+uint32_t QSPIFlash::erase_size(int type) const
+{
+    return erase_types[type].size ? erase_types[type].size : _size;
+}
+
+qspi_status_t QSPIFlash::erase_sector(uint32_t addr)
+{
+    if (!addressable(addr, 1)) {
+        return QSPI_STATUS_INVALID_PARAMETER;
+    }
+    _op_mutex.lock();
+    qspi_status_t result = wait_idle();
+    if (result == QSPI_STATUS_OK) {
+        result = send_erase(ERASE_TYPE_COUNT - 1, addr);
+    }
+    _op_mutex.unlock();
+    return result;
+}
+
+// Index in erase_types of the command to erase the start of the range with,
+// out of the allowed ones, on a part of chip_size bytes
+static int next_erase(uint32_t addr, size_t remaining, uint8_t allowed, uint32_t chip_size)
+{
+    for (int type = 0; type < (int)ERASE_TYPE_COUNT - 1; type++) {
+        const qspi_flash_erase_type_t *erase = &erase_types[type];
+        uint32_t size = erase->size ? erase->size : chip_size;
+        if (!(allowed & erase->type) || (addr % size) || remaining < size) {
+            continue;
+        }
+        // Only worth it when no smaller command covers the same area faster;
+        // a mix of them is never faster than the fastest one per byte
+        uint64_t split_us = 0;
+        for (int smaller = type + 1; smaller < (int)ERASE_TYPE_COUNT; smaller++) {
+            if (!(allowed & erase_types[smaller].type)) {
+                continue;
+            }
+            uint64_t typ_us = (uint64_t)op_timings[erase_types[smaller].op].typ_us * (size / erase_types[smaller].size);
+            if (split_us == 0 || typ_us < split_us) {
+                split_us = typ_us;
+            }
+        }
+        if (op_timings[erase->op].typ_us <= split_us) {
+            return type;
+        }
+    }
+    return ERASE_TYPE_COUNT - 1;
+}
+
+qspi_status_t QSPIFlash::plan_erase(uint32_t addr, size_t size, qspi_flash_erase_plan_t *plan)
+{
+    if (plan == NULL || (addr & (QSPI_FLASH_SECTOR_SIZE - 1)) || (size & (QSPI_FLASH_SECTOR_SIZE - 1)) ||
+            addr > _size || size > _size - addr || !addressable(addr, size)) {
+        return QSPI_STATUS_INVALID_PARAMETER;
+    }
+
+    memset(plan, 0, sizeof(*plan));
+    while (size) {
+        int type = next_erase(addr, size, _erase_types, _size);
+        switch (erase_types[type].op) {
+            case QSPI_FLASH_OP_CHIP_ERASE:
+                plan->chip++;
+                break;
+            case QSPI_FLASH_OP_BLOCK64_ERASE:
+                plan->blocks64++;
+                break;
+            case QSPI_FLASH_OP_BLOCK32_ERASE:
+                plan->blocks32++;
+                break;
+            default:
+                plan->sectors++;
+                break;
+        }
+        plan->estimated_us += op_timings[erase_types[type].op].typ_us;
+        addr += erase_size(type);
+        size -= erase_size(type);
+    }
+    return QSPI_STATUS_OK;
+}
+
+qspi_status_t QSPIFlash::erase_range(uint32_t addr, size_t size, qspi_flash_erase_plan_t *plan)
+{
+    qspi_flash_erase_plan_t local_plan;
+    qspi_status_t result;
+    Timer timer;
+
+    if (plan == NULL) {
+        plan = &local_plan;
+    }
+    result = plan_erase(addr, size, plan);
+    if (result != QSPI_STATUS_OK) {
+        return result;
+    }
+
+    _op_mutex.lock();
+    result = wait_idle();
+    timer.start();
+    while (size && result == QSPI_STATUS_OK) {
+        int type = next_erase(addr, size, _erase_types, _size);
+        result = send_erase(type, addr);
+        if (result == QSPI_STATUS_OK) {
+            result = wait_ready();
+        }
+        if (result != QSPI_STATUS_OK) {
+            break;
+        }
+        addr += erase_size(type);
+        size -= erase_size(type);
+    }
+    plan->measured_us = timer.read_us();
+    _op_mutex.unlock();
+
+    return result;
+}
+
+qspi_status_t QSPIFlash::read_continuous(uint32_t addr, void *buffer, size_t size)
+{
+    if (_deep_down && QSPI_STATUS_OK != wake()) {
+        return QSPI_STATUS_ERROR;
+    }
+    // Only the first read of a run sends the opcode
+    uint32_t start_us = qspi_trace_start();
+    qspi_status_t result = qspi_flash_hw_read_continuous(_qspi, addr, QSPI_FLASH_MODE_ENHANCE, !_continuous, buffer, size);
+    qspi_trace_record(_continuous ? QSPI_TRACE_READ_CONTINUOUS : QSPI_TRACE_READ, 0xEB,
+                      QSPI_TRACE_FORMAT(QSPI_CFG_BUS_SINGLE, QSPI_CFG_BUS_QUAD, QSPI_CFG_BUS_QUAD), addr, size, start_us, result);
+    if (result == QSPI_STATUS_INVALID_PARAMETER) {
+        _continuous_enabled = false;
+    }
+    _continuous = (result == QSPI_STATUS_OK);
+    return result;
+}
+
+void QSPIFlash::end_continuous()
+{
+    char dummy;
+
+    // One more read with a mode byte that does not keep the part in the mode
+    if (_continuous) {
+        uint32_t start_us = qspi_trace_start();
+        qspi_status_t result = qspi_flash_hw_read_continuous(_qspi, 0, QSPI_FLASH_MODE_EXIT, false, &dummy, 1);
+        qspi_trace_record(QSPI_TRACE_READ_CONTINUOUS, 0xEB,
+                          QSPI_TRACE_FORMAT(QSPI_CFG_BUS_SINGLE, QSPI_CFG_BUS_QUAD, QSPI_CFG_BUS_QUAD), 0, 1, start_us, result);
+        _continuous = false;
+    }
+}
+
+qspi_status_t QSPIFlash::read_bus(uint32_t addr, void *buffer, size_t size)
+{
+    size_t len = size;
+    bool suspended = false;
+    _mutex.lock();
+    while (true) {
+        while (_busy && !can_suspend(addr, size)) {
+            _mutex.unlock();
+            wait_ready();
+            _mutex.lock();
+        }
+        if (!_busy && _continuous_enabled) {
+            qspi_status_t result = read_continuous(addr, buffer, size);
+            if (result != QSPI_STATUS_INVALID_PARAMETER) {
+                _mutex.unlock();
+                return result;
+            }
+        }
+        if (!_busy) {
+            break;
+        }
+        if (suspend()) {
+            suspended = true;
+            break;
+        }
+
+        // The part did not stop: the array cannot be read until it is done
+        _mutex.unlock();
+        qspi_status_t result = wait_ready();
+        if (result != QSPI_STATUS_OK) {
+            return result;
+        }
+        _mutex.lock();
+    }
+    qspi_status_t result = bus_read(addr, buffer, &len);
+    if (suspended) {
+        resume();
+    }
+    _mutex.unlock();
+    if (result != QSPI_STATUS_OK || len != size) {
+        return QSPI_STATUS_ERROR;
+    }
+    return QSPI_STATUS_OK;
+}
+
+qspi_status_t QSPIFlash::read(uint32_t addr, void *buffer, size_t size)
+{
+    uint8_t *data = (uint8_t *)buffer;
+    QSPIReadCache *cache = _cache;
+
+    if (size == 0) {
+        return QSPI_STATUS_OK;
+    }
+    if (buffer == NULL || !addressable(addr, size)) {
+        return QSPI_STATUS_INVALID_PARAMETER;
+    }
+    if (cache == NULL) {
+        return read_bus(addr, buffer, size);
+    }
+
+    // Sector by sector, with consecutive uncached pieces read in one go
+    uint32_t bypass_addr = addr;
+    uint8_t *bypass_data = data;
+    size_t bypass_len = 0;
+    bool fill = cache->should_fill(size);
+    qspi_status_t result = QSPI_STATUS_OK;
+
+    while (size && result == QSPI_STATUS_OK) {
+        uint32_t sector = addr & ~(QSPI_FLASH_SECTOR_SIZE - 1);
+        size_t chunk = sector + QSPI_FLASH_SECTOR_SIZE - addr;
+        if (chunk > size) {
+            chunk = size;
+        }
+
+        bool served = cache->lookup(addr, data, chunk);
+        if (!served && fill) {
+            uint8_t *line = cache->allocate(sector);
+            if (line) {
+                result = read_bus(sector, line, QSPI_FLASH_SECTOR_SIZE);
+                if (result == QSPI_STATUS_OK) {
+                    memcpy(data, line + (addr - sector), chunk);
+                    cache->commit(line);
+                    served = true;
+                } else {
+                    cache->abort(line);
+                }
+            }
+        }
+
+        if (served && bypass_len) {
+            result = read_bus(bypass_addr, bypass_data, bypass_len);
+            bypass_len = 0;
+        }
+        if (!served) {
+            if (bypass_len == 0) {
+                bypass_addr = addr;
+                bypass_data = data;
+            }
+            bypass_len += chunk;
+        }
+
+        addr += chunk;
+        data += chunk;
+        size -= chunk;
+    }
+
+    if (result == QSPI_STATUS_OK && bypass_len) {
+        result = read_bus(bypass_addr, bypass_data, bypass_len);
+    }
+    return result;
+}
+
+qspi_status_t QSPIFlash::program(uint32_t addr, const void *buffer, size_t size)
+{
+    const uint8_t *data = (const uint8_t *)buffer;
+    const void *staged = NULL;
+    size_t staged_len = 0;
+    size_t chunk = 0;
+
+    if (size == 0) {
+        return QSPI_STATUS_OK;
+    }
+    if (buffer == NULL || !addressable(addr, size)) {
+        return QSPI_STATUS_INVALID_PARAMETER;
+    }
+
+    _op_mutex.lock();
+    qspi_status_t result = wait_idle();
+    chunk = stage_page(addr, data, size, &staged, &staged_len);
+    while (result == QSPI_STATUS_OK) {
+        _mutex.lock();
+        result = send_page(addr & ~0x3, staged, staged_len);
+        if (result == QSPI_STATUS_OK) {
+            start_busy(QSPI_FLASH_OP_PROGRAM, addr & ~(QSPI_FLASH_PAGE_SIZE - 1), QSPI_FLASH_PAGE_SIZE);
+        }
+        _mutex.unlock();
+        if (result != QSPI_STATUS_OK) {
+            break;
+        }
+
+        addr += chunk;
+        data += chunk;
+        size -= chunk;
+        if (size == 0) {
+            break;
+        }
+
+        // Stage the next page while this one programs
+        chunk = stage_page(addr, data, size, &staged, &staged_len);
+
+        result = wait_ready();
+        if (result != QSPI_STATUS_OK) {
+            break;
+        }
+    }
+
+    if (result == QSPI_STATUS_OK) {
+        result = wait_ready();
+    }
+    _op_mutex.unlock();
+    return result;
+}
+
+qspi_status_t QSPIFlash::rewrite_sector(uint32_t addr, const uint8_t *data, size_t size)
+{
+    uint32_t sector = addr & ~(QSPI_FLASH_SECTOR_SIZE - 1);
+    QSPIBuffer pooled;
+
+    // A pool buffer also saves staging the pages programmed back
+    uint32_t *sector_buf = (uint32_t *)pooled.data();
+    if (pooled.size() < QSPI_FLASH_SECTOR_SIZE) {
+        if (_sector_buf == NULL) {
+            _sector_buf = (uint32_t *)malloc(QSPI_FLASH_SECTOR_SIZE);
+            if (_sector_buf == NULL) {
+                return QSPI_STATUS_ERROR;
+            }
+        }
+        sector_buf = _sector_buf;
+    }
+
+    uint8_t *buf = (uint8_t *)sector_buf;
+    qspi_status_t result = read(sector, buf, QSPI_FLASH_SECTOR_SIZE);
+    if (result != QSPI_STATUS_OK) {
+        return result;
+    }
+    memcpy(buf + (addr - sector), data, size);
+
+    result = erase_range(sector, QSPI_FLASH_SECTOR_SIZE);
+    if (result != QSPI_STATUS_OK) {
+        return result;
+    }
+    _write_stats.erases++;
+
+    // Blank pages stay as the erase left them
+    for (uint32_t page = 0; page < QSPI_FLASH_SECTOR_SIZE && result == QSPI_STATUS_OK; page += QSPI_FLASH_PAGE_SIZE) {
+        const uint32_t *words = &sector_buf[page / 4];
+        bool blank = true;
+        for (uint32_t i = 0; i < QSPI_FLASH_PAGE_SIZE / 4 && blank; i++) {
+            blank = (words[i] == 0xFFFFFFFF);
+        }
+        if (blank) {
+            _write_stats.pages_skipped++;
+        } else {
+            result = program(sector + page, buf + page, QSPI_FLASH_PAGE_SIZE);
+            _write_stats.pages_programmed++;
+        }
+    }
+    return result;
+}
+
+qspi_status_t QSPIFlash::write_sector(uint32_t addr, const uint8_t *data, size_t size)
+{
+    uint32_t old_words[QSPI_FLASH_PAGE_SIZE / 4];
+    uint32_t new_words[QSPI_FLASH_PAGE_SIZE / 4];
+    uint32_t differ = 0;            // bit per page of the sector
+    qspi_status_t result = QSPI_STATUS_OK;
+    size_t offset = 0;
+
+    while (offset < size) {
+        uint32_t page_addr = addr + offset;
+        size_t chunk = QSPI_FLASH_PAGE_SIZE - (page_addr & (QSPI_FLASH_PAGE_SIZE - 1));
+        if (chunk > size - offset) {
+            chunk = size - offset;
+        }
+
+        // Both copies get the same padding up to a whole word
+        size_t words = (chunk + 3) / 4;
+        memset(old_words, 0xFF, words * 4);
+        memset(new_words, 0xFF, words * 4);
+        result = read(page_addr, old_words, chunk);
+        if (result != QSPI_STATUS_OK) {
+            return result;
+        }
+        memcpy(new_words, data + offset, chunk);
+
+        for (size_t i = 0; i < words; i++) {
+            // Programming can only clear bits
+            if ((old_words[i] & new_words[i]) != new_words[i]) {
+                return rewrite_sector(addr, data, size);
+            }
+            if (old_words[i] != new_words[i]) {
+                differ |= 1UL << ((page_addr & (QSPI_FLASH_SECTOR_SIZE - 1)) / QSPI_FLASH_PAGE_SIZE);
+            }
+        }
+        offset += chunk;
+    }
+
+    _write_stats.erases_avoided++;
+    offset = 0;
+    while (offset < size && result == QSPI_STATUS_OK) {
+        uint32_t page_addr = addr + offset;
+        size_t chunk = QSPI_FLASH_PAGE_SIZE - (page_addr & (QSPI_FLASH_PAGE_SIZE - 1));
+        if (chunk > size - offset) {
+            chunk = size - offset;
+        }
+        if (differ & (1UL << ((page_addr & (QSPI_FLASH_SECTOR_SIZE - 1)) / QSPI_FLASH_PAGE_SIZE))) {
+            result = program(page_addr, data + offset, chunk);
+            _write_stats.pages_programmed++;
+        } else {
+            _write_stats.pages_skipped++;
+        }
+        offset += chunk;
+    }
+    return result;
+}
+
+qspi_status_t QSPIFlash::smart_write(uint32_t addr, const void *buffer, size_t size)
+{
+    const uint8_t *data = (const uint8_t *)buffer;
+    qspi_status_t result = QSPI_STATUS_OK;
+
+    if (size == 0) {
+        return QSPI_STATUS_OK;
+    }
+    if (buffer == NULL || addr > _size || size > _size - addr || !addressable(addr, size)) {
+        return QSPI_STATUS_INVALID_PARAMETER;
+    }
+
+    // Nobody else may program or erase between the compare and the write
+    _op_mutex.lock();
+    _write_stats.writes++;
+    while (size && result == QSPI_STATUS_OK) {
+        size_t chunk = QSPI_FLASH_SECTOR_SIZE - (addr & (QSPI_FLASH_SECTOR_SIZE - 1));
+        if (chunk > size) {
+            chunk = size;
+        }
+        result = write_sector(addr, data, chunk);
+        addr += chunk;
+        data += chunk;
+        size -= chunk;
+    }
+    _op_mutex.unlock();
+    return result;
+}
+
+qspi_flash_write_stats_t QSPIFlash::get_write_stats()
+{
+    _op_mutex.lock();
+    qspi_flash_write_stats_t stats = _write_stats;
+    _op_mutex.unlock();
+    return stats;
+}
+
+void QSPIFlash::reset_write_stats()
+{
+    _op_mutex.lock();
+    memset(&_write_stats, 0, sizeof(_write_stats));
+    _op_mutex.unlock();
+}
+
+qspi_status_t QSPIFlash::submit(const async_request_t &request)
+{
+    _async_free.wait();
+
+    _async_mutex.lock();
+    if (_async_thread == NULL) {
+        _async_thread = new Thread(osPriorityNormal, QSPI_FLASH_ASYNC_STACK_SIZE);
+        if (_async_thread == NULL || osOK != _async_thread->start(callback(this, &QSPIFlash::async_worker))) {
+            delete _async_thread;
+            _async_thread = NULL;
+            _async_mutex.unlock();
+            _async_free.release();
+            return QSPI_STATUS_ERROR;
+        }
+    }
+    _async_queue[_async_head] = request;
+    _async_head = (_async_head + 1) % QSPI_FLASH_ASYNC_QUEUE_DEPTH;
+    _async_mutex.unlock();
+
+    _async_pending.release();
+    return QSPI_STATUS_OK;
+}
+
+void QSPIFlash::async_worker()
+{
+    while (true) {
+        _async_pending.wait();
+
+        _async_mutex.lock();
+        async_request_t request = _async_queue[_async_tail];
+        _async_tail = (_async_tail + 1) % QSPI_FLASH_ASYNC_QUEUE_DEPTH;
+        _async_mutex.unlock();
+
+        if (request.stop) {
+            _async_free.release();
+            break;
+        }
+
+        qspi_status_t result;
+        if (request.write) {
+            result = program(request.addr, request.buffer, request.size);
+        } else {
+            result = read(request.addr, request.buffer, request.size);
+        }
+
+        // Free the slot first so that a completion handler can queue the next request
+        _async_free.release();
+
+        if (request.status) {
+            *request.status = result;
+        }
+        if (request.done) {
+            request.done(result);
+        }
+        if (request.flags) {
+            request.flags->set(request.flag);
+        }
+    }
+}
+
+qspi_status_t QSPIFlash::read_async(uint32_t addr, void *buffer, size_t size, qspi_flash_callback_t done,
+                                    EventFlags *flags, uint32_t flag, qspi_status_t *status)
+{
+    if (buffer == NULL && size) {
+        return QSPI_STATUS_INVALID_PARAMETER;
+    }
+
+    async_request_t request = { false, false, addr, buffer, size, done, flags, flag, status };
+    return submit(request);
+}
+
+qspi_status_t QSPIFlash::write_async(uint32_t addr, const void *buffer, size_t size, qspi_flash_callback_t done,
+                                     EventFlags *flags, uint32_t flag, qspi_status_t *status)
+{
+    if (buffer == NULL && size) {
+        return QSPI_STATUS_INVALID_PARAMETER;
+    }
+
+    async_request_t request = { false, true, addr, (void *)buffer, size, done, flags, flag, status };
+    return submit(request);
+}
+
+qspi_status_t QSPIFlash::stream_read(uint32_t addr, size_t size, char *buf_a, char *buf_b, size_t chunk,
+                                     qspi_flash_stream_t process)
+{
+    // One flag per buffer
+    const uint32_t flag[2] = { 0x1, 0x2 };
+    char *buf[2] = { buf_a, buf_b };
+    qspi_status_t status[2] = { QSPI_STATUS_OK, QSPI_STATUS_OK };
+    qspi_status_t result = QSPI_STATUS_OK;
+    EventFlags done;
+    size_t offset = 0;
+    int current = 0;
+
+    if (buf_a == NULL || buf_b == NULL || chunk == 0 || !process) {
+        return QSPI_STATUS_INVALID_PARAMETER;
+    }
+    if (size == 0) {
+        return QSPI_STATUS_OK;
+    }
+
+    size_t len = (size < chunk) ? size : chunk;
+    result = read_async(addr, buf[0], len, NULL, &done, flag[0], &status[0]);
+
+    while (result == QSPI_STATUS_OK) {
+        done.wait_all(flag[current]);
+        if (status[current] != QSPI_STATUS_OK) {
+            result = status[current];
+            break;
+        }
+
+        // Start filling the other buffer before handing this one out
+        size_t next = offset + len;
+        size_t next_len = (size - next < chunk) ? size - next : chunk;
+        bool pending = false;
+        if (next_len) {
+            result = read_async(addr + next, buf[current ^ 1], next_len, NULL, &done, flag[current ^ 1], &status[current ^ 1]);
+            pending = (result == QSPI_STATUS_OK);
+        }
+
+        if (result == QSPI_STATUS_OK && !process(addr + offset, buf[current], len)) {
+            result = QSPI_STATUS_ERROR;
+        }
+        if (result != QSPI_STATUS_OK || next_len == 0) {
+            // The buffers and flags must not go away under a pending read
+            if (pending) {
+                done.wait_all(flag[current ^ 1]);
+            }
+            break;
+        }
+
+        offset = next;
+        len = next_len;
+        current ^= 1;
+    }
+
+    return result;
+}
+
+typedef struct {
+    uint32_t addr;
+    const uint8_t *expected;
+    size_t mismatch;                // offset of the first difference found
+} verify_context_t;
+
+// Offset of the first byte that differs, len if none; a word at a time when
+// both sides are aligned
+static size_t first_difference(const uint8_t *data, const uint8_t *expected, size_t len)
+{
+    size_t i = 0;
+
+    if ((((uintptr_t)data | (uintptr_t)expected) & 0x3) == 0) {
+        const uint32_t *data_words = (const uint32_t *)data;
+        const uint32_t *expected_words = (const uint32_t *)expected;
+        while (i + 4 <= len && data_words[i / 4] == expected_words[i / 4]) {
+            i += 4;
+        }
+    } else if (memcmp(data, expected, len) == 0) {
+        return len;
+    }
+    while (i < len && data[i] == expected[i]) {
+        i++;
+    }
+    return i;
+}
+
+static bool verify_chunk(verify_context_t *ctx, uint32_t addr, const char *data, size_t len)
+{
+    size_t offset = addr - ctx->addr;
+    size_t differ = first_difference((const uint8_t *)data, ctx->expected + offset, len);
+    if (differ < len) {
+        ctx->mismatch = offset + differ;
+        return false;
+    }
+    return true;
+}
+
+qspi_status_t QSPIFlash::verify(uint32_t addr, const void *expected, size_t size, size_t *mismatch)
+{
+    uint32_t pages[2][QSPI_FLASH_PAGE_SIZE / 4];
+    QSPIBuffer pooled;
+    verify_context_t ctx = { addr, (const uint8_t *)expected, size };
+
+    if (mismatch) {
+        *mismatch = size;
+    }
+    if (size == 0) {
+        return QSPI_STATUS_OK;
+    }
+    if (expected == NULL) {
+        return QSPI_STATUS_INVALID_PARAMETER;
+    }
+
+    char *buf_a = (char *)pages[0];
+    char *buf_b = (char *)pages[1];
+    size_t chunk = sizeof(pages[0]);
+    if (pooled.data()) {
+        chunk = pooled.size() / 2;
+        buf_a = pooled.data();
+        buf_b = buf_a + chunk;
+    }
+
+    qspi_status_t result = stream_read(addr, size, buf_a, buf_b, chunk, callback(verify_chunk, &ctx));
+    if (ctx.mismatch < size) {
+        if (mismatch) {
+            *mismatch = ctx.mismatch;
+        }
+        return QSPI_STATUS_ERROR;
+    }
+    return result;
+}
@@ -0,0 +1,764 @@
+#ifndef QSPI_FLASH_H
+#define QSPI_FLASH_H
+
+#include "mbed.h"
+#include "QSPI.h"
+#include "QSPIBufferPool.h"
+#include "QSPIReadCache.h"
+#include "QSPITrace.h"
+
+// The below values are command codes defined in Datasheet for MX25R6435F Macronix Flash Memory
+// Command for reading status register
+#define QSPI_STD_CMD_RDSR                   0x05
+// Command for writing status register
+#define QSPI_STD_CMD_WRSR                   0x01
+// Command for reading control register (supported only by some memories)
+#define QSPI_STD_CMD_RDCR                   0x35
+// Command for writing control register (supported only by some memories)
+#define QSPI_STD_CMD_WRCR                   0x3E
+// Command for setting Reset Enable (supported only by some memories)
+#define QSPI_STD_CMD_RSTEN                  0x66
+// Command for setting Reset (supported only by some memories)
+#define QSPI_STD_CMD_RST                    0x99
+// Command for setting WREN (supported only by some memories)
+#define QSPI_STD_CMD_WREN                   0x06
+// Command for Sector erase (supported only by some memories)
+#define QSPI_STD_CMD_SECT_ERASE             0x20
+// Command for 32K Block erase
+#define QSPI_STD_CMD_BLOCK32_ERASE          0x52
+// Command for 64K Block erase
+#define QSPI_STD_CMD_BLOCK64_ERASE          0xD8
+// Command for Chip erase (0xC7 is an alias)
+#define QSPI_STD_CMD_CHIP_ERASE             0x60
+// Command for Program/Erase suspend
+#define QSPI_STD_CMD_SUSPEND                0xB0
+// Command for Program/Erase resume
+#define QSPI_STD_CMD_RESUME                 0x30
+// Commands to enter and exit 4-byte address mode (parts above 16 MB)
+#define QSPI_STD_CMD_EN4B                   0xB7
+#define QSPI_STD_CMD_EX4B                   0xE9
+// Command for reading the JEDEC ID (0xC2 first for Macronix)
+#define QSPI_STD_CMD_RDID                   0x9F
+// Command for reading configuration registers 1 and 2 of the MX25R6435F
+#define QSPI_STD_CMD_RDCR_MX                0x15
+// Commands to enter and release deep power-down
+#define QSPI_STD_CMD_DP                     0xB9
+#define QSPI_STD_CMD_RDP                    0xAB
+// Read/Write commands
+#define QSPI_PP_COMMAND_NRF_ENUM            (0x0) //This corresponds to Flash command 0x02
+#define QSPI_READ2O_COMMAND_NRF_ENUM        (0x1) //This corresponds to Flash command 0x3B
+#define QSPI_READ2IO_COMMAND_NRF_ENUM       (0x2) //This corresponds to Flash command 0xBB
+#define QSPI_PP4IO_COMMAND_NRF_ENUM         (0x3) //This corresponds to Flash command 0x38
+#define QSPI_READ4IO_COMMAND_NRF_ENUM       (0x4) //This corresponds to Flash command 0xEB
+
+// 4READ (0xEB) mode bytes. With complementary nibbles the part stays in
+// performance-enhance mode and takes the next transfer's first bits as the
+// address of another 4READ; any other value returns it to normal commands.
+#define QSPI_FLASH_MODE_ENHANCE             0xA5
+#define QSPI_FLASH_MODE_EXIT                0x00
+
+// Status register Write In Progress and Quad Enable bits
+#define QSPI_FLASH_SR_WIP                   0x01
+#define QSPI_FLASH_SR_QE                    0x40
+
+// Configuration register 2 L/H bit: high performance mode when set, ultra
+// low power (the power-on default) when clear
+#define QSPI_FLASH_CR2_HIGH_PERFORMANCE     0x02
+
+// MX25R6435F geometry
+#define QSPI_FLASH_PAGE_SIZE                256
+#define QSPI_FLASH_SECTOR_SIZE              4096
+#define QSPI_FLASH_BLOCK32_SIZE             (32 * 1024)
+#define QSPI_FLASH_BLOCK64_SIZE             (64 * 1024)
+#ifndef QSPI_FLASH_SIZE
+#define QSPI_FLASH_SIZE                     (8 * 1024 * 1024)
+#endif
+
+// Largest part 3-byte addresses reach. Above it the part is switched to
+// 4-byte addresses (see QSPIFlash::set_address_size) and the QSPI object
+// configured with QSPI_FLASH_ADDR_SIZE.
+#define QSPI_FLASH_3BYTE_MAX_SIZE           (16 * 1024 * 1024)
+#define QSPI_FLASH_ADDR_SIZE                ((QSPI_FLASH_SIZE > QSPI_FLASH_3BYTE_MAX_SIZE) ? QSPI_CFG_ADDR_SIZE_32 : QSPI_CFG_ADDR_SIZE_24)
+
+// Erase commands QSPIFlash::erase_range may use
+#define QSPI_FLASH_ERASE_SECTOR             0x01
+#define QSPI_FLASH_ERASE_BLOCK32            0x02
+#define QSPI_FLASH_ERASE_BLOCK64            0x04
+#define QSPI_FLASH_ERASE_CHIP               0x08
+#define QSPI_FLASH_ERASE_ALL                0x0F
+
+// MX25R6435F busy times in microseconds, typical and worst case
+#define QSPI_FLASH_TPP_TYP_US               850
+#define QSPI_FLASH_TPP_MAX_US               4000
+#define QSPI_FLASH_TSE_TYP_US               40000
+#define QSPI_FLASH_TSE_MAX_US               240000
+#define QSPI_FLASH_TBE32_TYP_US             120000
+#define QSPI_FLASH_TBE32_MAX_US             1500000
+#define QSPI_FLASH_TBE64_TYP_US             240000
+#define QSPI_FLASH_TBE64_MAX_US             3000000
+#define QSPI_FLASH_TCE_TYP_US               30000000
+#define QSPI_FLASH_TCE_MAX_US               150000000
+#define QSPI_FLASH_TW_TYP_US                10000
+#define QSPI_FLASH_TW_MAX_US                30000
+#define QSPI_FLASH_TSUS_MAX_US              20
+#define QSPI_FLASH_TDP_MAX_US               10
+#define QSPI_FLASH_TRES1_MAX_US             35
+
+// Shortest interval between two status polls once the typical time has passed
+#define QSPI_FLASH_POLL_MIN_US              10
+
+// Run time an operation gets after a resume before it is suspended again;
+// without it back-to-back reads could keep an erase from ever finishing
+#ifndef QSPI_FLASH_RESUME_MIN_US
+#define QSPI_FLASH_RESUME_MIN_US            100
+#endif
+
+// Requests that can be queued with read_async / write_async before the
+// caller blocks, and the stack of the thread that runs them
+#ifndef QSPI_FLASH_ASYNC_QUEUE_DEPTH
+#define QSPI_FLASH_ASYNC_QUEUE_DEPTH        4
+#endif
+#ifndef QSPI_FLASH_ASYNC_STACK_SIZE
+#define QSPI_FLASH_ASYNC_STACK_SIZE         1024
+#endif
+
+// The NRF52840 QSPI block issues WREN by itself before every page program.
+// Set to 0 for controllers that need it sent explicitly.
+#ifndef QSPI_FLASH_CONTROLLER_AUTO_WREN
+#define QSPI_FLASH_CONTROLLER_AUTO_WREN     1
+#endif
+
+/** Operations the part can be busy with; selects the ready-wait timings */
+typedef enum {
+    QSPI_FLASH_OP_UNKNOWN,          // issued outside QSPIFlash
+    QSPI_FLASH_OP_PROGRAM,
+    QSPI_FLASH_OP_SECTOR_ERASE,
+    QSPI_FLASH_OP_WRITE_STATUS,
+    QSPI_FLASH_OP_BLOCK32_ERASE,
+    QSPI_FLASH_OP_BLOCK64_ERASE,
+    QSPI_FLASH_OP_CHIP_ERASE,
+    QSPI_FLASH_OP_COUNT
+} qspi_flash_op_t;
+
+/** Power modes of the MX25R6435F */
+typedef enum {
+    QSPI_FLASH_POWER_LOW,           // ultra low power, the power-on default
+    QSPI_FLASH_POWER_HIGH,          // high performance: more current, fewer dummy cycles at speed
+    QSPI_FLASH_POWER_DEEP_DOWN,     // deep power-down, released by the next access
+    QSPI_FLASH_POWER_COUNT
+} qspi_flash_power_mode_t;
+
+/** Power mode statistics */
+typedef struct {
+    uint32_t switches;              // between low power and high performance
+    uint32_t deep_power_downs;
+    uint32_t wakeups;               // releases from deep power-down
+    uint32_t wake_max_us;           // longest an access waited for one
+    uint64_t wake_total_us;
+    uint64_t time_us[QSPI_FLASH_POWER_COUNT];   // spent in each mode
+} qspi_flash_power_stats_t;
+
+/** Ready-wait statistics */
+typedef struct {
+    uint32_t waits;
+    uint32_t polls;                 // status register reads issued
+    uint32_t timeouts;
+    uint32_t last_us;               // busy time of the last operation
+    uint32_t max_us;
+    uint64_t total_us;
+    uint32_t suspends;              // operations suspended to serve a read
+} qspi_flash_wait_stats_t;
+
+/** smart_write statistics */
+typedef struct {
+    uint32_t writes;
+    uint32_t erases;                // sectors that had to be erased
+    uint32_t erases_avoided;        // sectors programmed over without an erase
+    uint32_t pages_programmed;
+    uint32_t pages_skipped;         // already held the data
+} qspi_flash_write_stats_t;
+
+/** Lock statistics of one of QSPIFlash's mutexes; a nested lock counts once */
+typedef struct {
+    uint32_t locks;
+    uint32_t contended;             // had to wait for another thread
+    uint64_t wait_total_us;
+    uint32_t wait_max_us;
+    uint64_t hold_total_us;
+    uint32_t hold_max_us;
+} qspi_flash_lock_stats_t;
+
+/** Command batch statistics (see QSPIFlash::command_batch) */
+typedef struct {
+    uint32_t batches;
+    uint32_t commands;              // steps completed, a poll step counting once
+    uint32_t driver_calls;          // calls into the driver or batch hook they took
+} qspi_flash_batch_stats_t;
+
+/** One step of a command batch (see QSPIFlash::command_batch)
+ *
+ *  A step with a poll_mask is a status poll: it is sent again until
+ *  (rx_buffer[0] & poll_mask) == poll_match, for at most poll_timeout_us.
+ */
+typedef struct {
+    uint8_t instruction;
+    const char *tx_buffer;
+    size_t tx_length;
+    char *rx_buffer;
+    size_t rx_length;
+    uint8_t poll_mask;              // 0: sent once
+    uint8_t poll_match;
+    uint32_t poll_timeout_us;
+} qspi_flash_command_t;
+
+#define QSPI_FLASH_COMMAND(inst, tx, tx_len, rx, rx_len) \
+    { (uint8_t)(inst), (tx), (tx_len), (rx), (rx_len), 0, 0, 0 }
+#define QSPI_FLASH_COMMAND_POLL(inst, rx, mask, match, timeout_us) \
+    { (uint8_t)(inst), NULL, 0, (rx), 1, (mask), (match), (timeout_us) }
+
+/** Erase commands chosen for a range, with its typical and actual duration */
+typedef struct {
+    uint32_t sectors;               // 4K sector erases
+    uint32_t blocks32;
+    uint32_t blocks64;
+    uint32_t chip;
+    uint32_t estimated_us;          // sum of the typical times
+    uint32_t measured_us;           // 0 until erased
+} qspi_flash_erase_plan_t;
+
+/** Completion callback of an asynchronous request, gets its result */
+typedef Callback<void(qspi_status_t)> qspi_flash_callback_t;
+
+/** Per-chunk callback of QSPIFlash::stream_read: gets the chunk's flash
+ *  address, data and length, returns false to stop the stream
+ */
+typedef Callback<bool(uint32_t, const char *, size_t)> qspi_flash_stream_t;
+
+/** Hardware status polling hook
+ *
+ *  Controllers that can poll the status register on their own (for example
+ *  the STM32 QUADSPI auto-polling mode) provide this to let the CPU sleep for
+ *  the whole wait. It must return once (status & mask) == match with
+ *  QSPI_STATUS_OK, or QSPI_STATUS_ERROR after timeout_us. The default weak
+ *  definition returns QSPI_STATUS_INVALID_PARAMETER: not supported.
+ */
+qspi_status_t qspi_flash_hw_autopoll(QSPI *qspi, uint8_t mask, uint8_t match, uint32_t timeout_us);
+
+/** Continuous read hook
+ *
+ *  Controllers that can leave out the instruction phase provide this to read
+ *  size bytes at addr with a 4READ (0xEB, 1_4_4) followed by the given mode
+ *  byte and 4 dummy cycles. With send_inst false the transfer starts at the
+ *  address phase, for a part already in performance-enhance mode. The
+ *  default weak definition returns QSPI_STATUS_INVALID_PARAMETER: not
+ *  supported (the NRF52840 always sends the opcode).
+ */
+qspi_status_t qspi_flash_hw_read_continuous(QSPI *qspi, uint32_t addr, uint8_t mode, bool send_inst, void *buffer, size_t size);
+
+/** Memory-mapped window hook
+ *
+ *  Controllers that map the part into the address space (NRF52840 XIP at
+ *  0x12000000, STM32 QUADSPI memory-mapped mode) return the CPU address of
+ *  flash address addr, after setting the mapping up if needed. The default
+ *  weak definition returns NULL: not supported.
+ */
+const void *qspi_flash_hw_map(QSPI *qspi, uint32_t addr, size_t size);
+
+/** Bus sharing counters of the QSPI driver, see qspi_flash_hw_bus_stats */
+typedef struct {
+    uint32_t switches;              // transfers by another bus object, or after new settings
+    uint32_t reconfigurations;      // of those, peripheral registers written
+    uint32_t avoided;               // of those, registers already holding the settings
+} qspi_flash_bus_stats_t;
+
+/** Bus sharing counters hook
+ *
+ *  Drivers that keep the settings applied to the peripheral and skip
+ *  writing them when a bus object taking over has the same ones provide
+ *  this to report how often that happened, clearing the counters if asked.
+ *  The default weak definition returns QSPI_STATUS_INVALID_PARAMETER: the
+ *  driver keeps no counters.
+ */
+qspi_status_t qspi_flash_hw_bus_stats(qspi_flash_bus_stats_t *stats, bool clear);
+
+/** Supply charge hook
+ *
+ *  Boards with a current monitor on the flash supply provide this to
+ *  report the charge the part has drawn since power-on, in picocoulombs
+ *  (pA x s); the difference between two readings over the time between
+ *  them is the average current. The default weak definition returns
+ *  QSPI_STATUS_INVALID_PARAMETER: not measured.
+ */
+qspi_status_t qspi_flash_hw_charge(uint64_t *charge_pc);
+
+/** Command batch hook
+ *
+ *  Boards that can send a sequence of commands without going through the
+ *  driver for each one (a command list in the controller, or the NRF52840
+ *  custom instruction registers written back to back) provide this to send
+ *  count steps under one bus lock and setup, in order, stopping at the
+ *  first that fails. Poll steps are repeated until they match or time out.
+ *  It must return QSPI_STATUS_OK once all steps are done and
+ *  QSPI_STATUS_ERROR otherwise. The default weak definition returns
+ *  QSPI_STATUS_INVALID_PARAMETER: not supported.
+ */
+qspi_status_t qspi_flash_hw_command_batch(QSPI *qspi, const qspi_flash_command_t *commands, size_t count);
+
+/** Power failure hook
+ *
+ *  Test rigs that can switch the flash supply provide this to cut it
+ *  part-way through the ops-th program or erase from the call, leaving that
+ *  operation half done and the part deaf until the supply is back. With ops
+ *  0 the supply is restored; the part then needs initializing again. The
+ *  default weak definition returns QSPI_STATUS_INVALID_PARAMETER: not
+ *  supported.
+ */
+qspi_status_t qspi_flash_hw_power_fail(uint32_t ops);
+
+/** Recursive mutex that times how long it is waited for and held */
+class QSPIFlashLock {
+public:
+    QSPIFlashLock();
+
+    void lock();
+    void unlock();
+
+    qspi_flash_lock_stats_t get_stats();
+    void reset_stats();
+
+private:
+    Mutex _mutex;
+    uint32_t _depth;
+    uint32_t _locked_us;            // when the outermost lock was taken
+    qspi_flash_lock_stats_t _stats;
+};
+
+/** Flash-level operations on top of a QSPI bus object
+ *
+ *  Works in whatever bus format the QSPI object is configured for. All
+ *  operations are thread safe.
+ */
+class QSPIFlash {
+public:
+    /**
+     *  @param qspi     bus object
+     *  @param cache    optional read cache, may be shared with other QSPIFlash
+     *                  objects on the same part
+     */
+    QSPIFlash(QSPI *qspi, QSPIReadCache *cache = NULL);
+    ~QSPIFlash();
+
+    /** Attach a read cache, or detach it with NULL */
+    void set_read_cache(QSPIReadCache *cache);
+
+    /** Adapt to a part other than the MX25R6435F, as found by SFDP discovery
+     *  (see QSPIFlashSFDP.h)
+     *
+     *  The page and sector sizes stay those of the MX25R6435F: parts with a
+     *  smaller page or without the 4K sector erase cannot be used.
+     *
+     *  @param size         bytes of the part used; past 16 MB only reachable
+     *                      with 4-byte addresses
+     *  @param erase_types  QSPI_FLASH_ERASE_* commands the part has; the
+     *                      sector erase is always used, the chip erase only
+     *                      when size is the whole part
+     */
+    void set_geometry(uint32_t size, uint8_t erase_types);
+
+    /** Switch the part between 3- and 4-byte addresses
+     *
+     *  Parts above QSPI_FLASH_3BYTE_MAX_SIZE need 4-byte addresses for the
+     *  rest of the array. QSPI_CFG_ADDR_SIZE_32 sends EN4B (0xB7), after
+     *  which the part takes 4 address bytes in every command that has an
+     *  address; QSPI_CFG_ADDR_SIZE_24 sends EX4B (0xE9). The NRF52840 issues
+     *  the same read and program opcodes either way, so the QSPI object must
+     *  be configured with the same address size; erases carry the address
+     *  as data and follow this setting. A reset or power cycle returns the
+     *  part to 3-byte addresses, so call it again after one.
+     *
+     *  With 3-byte addresses, accesses reaching past 16 MB are refused.
+     *
+     *  @param size     QSPI_CFG_ADDR_SIZE_24 (the default) or QSPI_CFG_ADDR_SIZE_32
+     *  @param wren     send WREN before EN4B, for parts that need it
+     *  @return QSPI_STATUS_INVALID_PARAMETER for other sizes
+     */
+    qspi_status_t set_address_size(qspi_address_size_t size, bool wren = false);
+    qspi_address_size_t get_address_size() const;
+
+    /** Tell the tracer which bus format the QSPI object is configured for
+     *
+     *  Every command, read and write this object issues is recorded with
+     *  qspi_trace_record (see QSPITrace.h). The QSPI object cannot be asked
+     *  for its format, so the entries carry this one, QSPI_TRACE_FORMAT_UNKNOWN
+     *  until set, and the opcodes of plain reads and programs are worked out
+     *  from it.
+     *
+     *  @param format   QSPI_TRACE_FORMAT(inst, address, data) of the bus widths
+     */
+    void set_trace_format(uint8_t format);
+
+    /** Read an arbitrary range
+     *
+     *  A read issued while a program or erase started through this object is
+     *  in progress elsewhere in the part suspends it, reads, and resumes it,
+     *  so the read waits at most QSPI_FLASH_RESUME_MIN_US plus the suspend
+     *  latency instead of the rest of the operation. Reads inside the area
+     *  being programmed or erased, and reads during a chip erase, a status
+     *  register write or an operation of unknown extent, wait for completion.
+     *
+     *  With a read cache attached, cached sectors are copied from RAM and
+     *  missing ones are loaded whole as the cache policy allows.
+     *
+     *  @param addr     flash address
+     *  @param buffer   destination
+     *  @param size     number of bytes
+     *  @return QSPI_STATUS_OK on success
+     */
+    qspi_status_t read(uint32_t addr, void *buffer, size_t size);
+
+    /** Program an arbitrary range, which must have been erased beforehand
+     *
+     *  The range is split at page boundaries and each page gets its own
+     *  WREN + page program. Every chunk is staged word-aligned and padded
+     *  with 0xFF (which programs nothing) as the controller's DMA requires,
+     *  and the next chunk is staged while the current page is programming.
+     *  Chunks of whole words in a buffer from the pool (QSPIBufferPool.h)
+     *  go to the controller as they are. Returns once the last page has
+     *  completed.
+     *
+     *  @param addr     flash address, any alignment
+     *  @param buffer   data to program
+     *  @param size     number of bytes
+     *  @return QSPI_STATUS_OK on success
+     */
+    qspi_status_t program(uint32_t addr, const void *buffer, size_t size);
+
+    /** Replace the contents of an arbitrary range, erasing only where needed
+     *
+     *  Every sector the range touches is read back first and compared word
+     *  by word with the new data. When the new data only clears bits (the
+     *  range is blank, or a 1 -> 0 change) the pages that differ are
+     *  programmed over the existing contents and pages that already hold the
+     *  data are skipped. Otherwise the sector is read into RAM, merged with
+     *  the new data, erased and programmed again, so the rest of it is kept.
+     *  The sector buffer comes from the pool, or is allocated once when the
+     *  pool is empty.
+     *
+     *  @param addr     flash address, any alignment
+     *  @param buffer   data to write
+     *  @param size     number of bytes
+     *  @return QSPI_STATUS_OK once the range holds the data
+     */
+    qspi_status_t smart_write(uint32_t addr, const void *buffer, size_t size);
+
+    qspi_flash_write_stats_t get_write_stats();
+    void reset_write_stats();
+
+    /** Send WREN + 4K sector erase; does not wait for completion
+     *
+     *  @param addr     any address within the sector
+     *  @return QSPI_STATUS_OK on success
+     */
+    qspi_status_t erase_sector(uint32_t addr);
+
+    /** Work out the erase commands erase_range would issue
+     *
+     *  Covers the range with the fewest-microseconds mix of 4K sector, 32K
+     *  and 64K block erases that stays inside it, using a larger command
+     *  wherever it is aligned, fits and is not slower than the smaller ones
+     *  it replaces, and a chip erase for the whole device.
+     *
+     *  @param addr     start, sector aligned
+     *  @param size     length, multiple of the sector size
+     *  @param plan     receives the command counts and estimated time
+     *  @return QSPI_STATUS_INVALID_PARAMETER for an unaligned or out of range request
+     */
+    qspi_status_t plan_erase(uint32_t addr, size_t size, qspi_flash_erase_plan_t *plan);
+
+    /** Erase a range as planned by plan_erase, waiting for each command
+     *
+     *  @param addr     start, sector aligned
+     *  @param size     length, multiple of the sector size
+     *  @param plan     if not NULL, receives the plan and the measured time
+     *  @return QSPI_STATUS_OK once the whole range is erased
+     */
+    qspi_status_t erase_range(uint32_t addr, size_t size, qspi_flash_erase_plan_t *plan = NULL);
+
+    /** Wait for the operation in progress to complete
+     *
+     *  Sleeps for the typical duration of the operation last issued through
+     *  this object, then polls the status register with exponential backoff
+     *  (or lets the controller poll, see qspi_flash_hw_autopoll). The timeout
+     *  is the operation's datasheet maximum. Busy time after an operation
+     *  issued outside QSPIFlash is counted from the call.
+     *
+     *  Waits of a millisecond or more release the CPU to other threads; the
+     *  sub-millisecond remainder is spent in wait_us. Other threads can read
+     *  meanwhile (see read), except while qspi_flash_hw_autopoll holds the bus.
+     *  Time spent suspended does not count towards the timeout.
+     *
+     *  @param elapsed_us   if not NULL, receives the busy time of the operation
+     *  @return QSPI_STATUS_OK once ready, QSPI_STATUS_ERROR on timeout
+     */
+    qspi_status_t wait_ready(uint32_t *elapsed_us = NULL);
+
+    /** Record that an operation was started outside QSPIFlash (for example
+     *  with QSPI::write), so that the next wait_ready uses its timings
+     *
+     *  @param op       operation in progress
+     *  @param addr     start of the area it changes
+     *  @param size     size of that area; 0 if unknown, which keeps reads
+     *                  from suspending it
+     */
+    void start_busy(qspi_flash_op_t op, uint32_t addr = 0, uint32_t size = 0);
+
+    /** Enable or disable use of qspi_flash_hw_autopoll (enabled by default;
+     *  turned off automatically when the target does not provide it)
+     */
+    void set_hw_autopoll(bool enable);
+
+    /** Send a sequence of commands as one transaction
+     *
+     *  The steps go out in order under one hold of the bus mutex, so nothing
+     *  else gets onto the bus in between, stopping at the first that fails.
+     *  Where the board sends the whole sequence at once (see
+     *  qspi_flash_hw_command_batch) every step after the first saves the
+     *  driver call; otherwise each step is a command_transfer of its own.
+     *  Without the hook a poll step is repeated every QSPI_FLASH_POLL_MIN_US
+     *  with the bus held: keep polls to short waits such as a suspend, and
+     *  leave erases to wait_ready, which lets readers in.
+     *
+     *  A program, erase or register write a batch starts is not known to
+     *  this object: poll it to completion in the same batch or declare it
+     *  with start_busy.
+     *
+     *  @param commands     steps, at most 8 bytes each way
+     *  @param count        number of steps
+     *  @param trace_addr   flash address the steps act on, for the trace
+     *  @return QSPI_STATUS_OK once every step was sent and every poll matched,
+     *          QSPI_STATUS_ERROR on a failure or poll timeout,
+     *          QSPI_STATUS_INVALID_PARAMETER for a malformed step
+     */
+    qspi_status_t command_batch(const qspi_flash_command_t *commands, size_t count, uint32_t trace_addr = 0);
+
+    /** Enable or disable use of qspi_flash_hw_command_batch (enabled by
+     *  default; turned off automatically when the target does not provide it)
+     */
+    void set_hw_batch(bool enable);
+
+    qspi_flash_batch_stats_t get_batch_stats();
+    void reset_batch_stats();
+
+    /** Enable or disable suspending programs and erases for reads (enabled
+     *  by default)
+     */
+    void set_suspend(bool enable);
+
+    /** Keep the part in performance-enhance mode between reads (disabled by
+     *  default; stays off when the target does not provide
+     *  qspi_flash_hw_read_continuous)
+     *
+     *  Reads then go out as 4READ with QSPI_FLASH_MODE_ENHANCE and every read
+     *  after the first one skips the opcode. QSPIFlash takes the part out of
+     *  the mode before any other command it sends, but nothing else may use
+     *  the bus meanwhile: disable it before issuing commands through a QSPI
+     *  object directly or through another QSPIFlash.
+     */
+    void set_continuous_read(bool enable);
+
+    /** Get the range as CPU-readable memory, where the controller can map it
+     *
+     *  Waits for any operation in progress first. The pointer reads the
+     *  current contents only until the next program or erase, and must not
+     *  be used while one is in progress.
+     *
+     *  @param addr     flash address
+     *  @param size     number of bytes that will be read through the pointer
+     *  @return pointer to flash address addr, NULL when not supported
+     */
+    const void *map(uint32_t addr, size_t size);
+
+    /** Queue a read and return without waiting for it
+     *
+     *  Requests run one at a time, in submission order, on a worker thread
+     *  created on first use; a read queued after a write sees the written
+     *  data. The QSPI driver itself is blocking, so the transfer (and for
+     *  writes, the program time) is spent on the worker while the caller
+     *  goes on with something else. Blocks only when
+     *  QSPI_FLASH_ASYNC_QUEUE_DEPTH requests are already pending.
+     *
+     *  Completion is signalled by calling done (from the worker thread, it
+     *  must not block for long) and/or setting flag in flags. The buffer must
+     *  stay valid until then.
+     *
+     *  @param addr     flash address
+     *  @param buffer   destination
+     *  @param size     number of bytes
+     *  @param done     called with the result, may be empty
+     *  @param flags    set on completion, may be NULL
+     *  @param flag     flag(s) to set in flags
+     *  @param status   if not NULL, receives the result before done/flags
+     *  @return QSPI_STATUS_OK when queued
+     */
+    qspi_status_t read_async(uint32_t addr, void *buffer, size_t size, qspi_flash_callback_t done,
+                             EventFlags *flags = NULL, uint32_t flag = 0, qspi_status_t *status = NULL);
+
+    /** Queue a program (see program) and return without waiting for it;
+     *  completion and ordering as for read_async
+     */
+    qspi_status_t write_async(uint32_t addr, const void *buffer, size_t size, qspi_flash_callback_t done,
+                              EventFlags *flags = NULL, uint32_t flag = 0, qspi_status_t *status = NULL);
+
+    /** Read a range through two caller buffers of chunk bytes each
+     *
+     *  While process works on one buffer the next chunk is being read into
+     *  the other, so flash transfers overlap with processing.
+     *
+     *  @param addr     flash address
+     *  @param size     number of bytes
+     *  @param buf_a    first buffer of chunk bytes
+     *  @param buf_b    second buffer of chunk bytes
+     *  @param chunk    chunk size
+     *  @param process  called for every chunk in order
+     *  @return QSPI_STATUS_OK when the whole range was read and processed,
+     *          QSPI_STATUS_ERROR on a read failure or when process returned false
+     */
+    qspi_status_t stream_read(uint32_t addr, size_t size, char *buf_a, char *buf_b, size_t chunk,
+                              qspi_flash_stream_t process);
+
+    /** Compare a range of flash with the data expected there
+     *
+     *  Reads with stream_read into the two halves of a pool buffer (two
+     *  pages on the stack when the pool is empty), so each chunk is compared
+     *  a word at a time while the next one is read. RAM use does not depend
+     *  on size. Stops at the first chunk that differs.
+     *
+     *  @param addr     flash address
+     *  @param expected data the range should hold
+     *  @param size     number of bytes
+     *  @param mismatch if not NULL, receives the offset of the first byte
+     *                  that differs, size when none was found
+     *  @return QSPI_STATUS_OK when the range holds expected, QSPI_STATUS_ERROR
+     *          when it differs or a read failed
+     */
+    qspi_status_t verify(uint32_t addr, const void *expected, size_t size, size_t *mismatch = NULL);
+
+    /** Put the part in a power mode
+     *
+     *  Low power and high performance are the L/H bit of configuration
+     *  register 2: the registers are read back and, when the bit differs,
+     *  rewritten with WRSR, which keeps the part busy for tW (10 ms typical)
+     *  and is only worth it ahead of a long transfer. Deep power-down (0xB9)
+     *  stops the part until the next access through this object, which
+     *  releases it (0xAB) and waits tRES1 first; the L/H setting survives.
+     *  Commands sent to the QSPI object directly are ignored meanwhile.
+     *  Waits for any operation in progress. A power cycle returns the part
+     *  to low power.
+     *
+     *  @param mode     QSPI_FLASH_POWER_*
+     *  @return QSPI_STATUS_INVALID_PARAMETER for an unknown mode
+     */
+    qspi_status_t set_power_mode(qspi_flash_power_mode_t mode);
+    qspi_flash_power_mode_t get_power_mode() const;
+
+    qspi_flash_power_stats_t get_power_stats();
+    void reset_power_stats();
+
+    qspi_flash_wait_stats_t get_wait_stats();
+    void reset_wait_stats();
+
+    /** How long threads waited for and held the bus mutex, which guards
+     *  every transfer, and the operation mutex, which keeps programs and
+     *  erases apart
+     */
+    qspi_flash_lock_stats_t get_bus_lock_stats();
+    qspi_flash_lock_stats_t get_op_lock_stats();
+    void reset_lock_stats();
+
+private:
+    typedef struct {
+        bool stop;
+        bool write;
+        uint32_t addr;
+        void *buffer;
+        size_t size;
+        qspi_flash_callback_t done;
+        EventFlags *flags;
+        uint32_t flag;
+        qspi_status_t *status;
+    } async_request_t;
+
+    qspi_status_t submit(const async_request_t &request);
+    qspi_status_t send_erase(int type, uint32_t addr);
+    uint32_t erase_size(int type) const;
+    bool addressable(uint32_t addr, size_t size) const;
+    void async_worker();
+    size_t stage_page(uint32_t addr, const uint8_t *data, size_t size, const void **staged, size_t *staged_len);
+    qspi_status_t send_page(uint32_t page_addr, const void *staged, size_t staged_len);
+    qspi_status_t read_status(uint8_t *status);
+    qspi_status_t bus_command(unsigned int instruction, uint32_t addr, const char *tx_buffer, size_t tx_length,
+                              char *rx_buffer, size_t rx_length);
+    qspi_status_t send_command(const qspi_flash_command_t *command, uint32_t trace_addr);
+    qspi_status_t bus_read(uint32_t addr, void *buffer, size_t *len);
+    qspi_status_t bus_write(uint32_t addr, const void *buffer, size_t *len);
+    qspi_status_t read_bus(uint32_t addr, void *buffer, size_t size);
+    qspi_status_t write_sector(uint32_t addr, const uint8_t *data, size_t size);
+    qspi_status_t rewrite_sector(uint32_t addr, const uint8_t *data, size_t size);
+    qspi_status_t read_continuous(uint32_t addr, void *buffer, size_t size);
+    void end_continuous();
+    qspi_status_t wake();
+    void power_transition(bool high_performance, bool deep_down);
+    qspi_status_t wait_idle();
+    bool can_suspend(uint32_t addr, size_t size);
+    bool suspend();
+    void resume();
+    uint32_t busy_elapsed_us();
+    void sleep_us(uint32_t us);
+
+    QSPI *_qspi;
+    QSPIReadCache *_cache;
+    uint32_t _stage[QSPI_FLASH_PAGE_SIZE / 4];
+    uint32_t _size;
+    uint8_t _erase_types;
+    uint8_t _addr_bytes;            // the part expects, 3 or 4
+    uint8_t _trace_format;
+    uint8_t _trace_read_opcode;     // of plain reads and programs in that format
+    uint8_t _trace_write_opcode;
+
+    // Operation in progress; _mutex guards these and the bus, and is not
+    // held while sleeping so that readers can get in. _op_mutex keeps
+    // programs and erases from different threads apart.
+    bool _busy;
+    qspi_flash_op_t _busy_op;
+    uint32_t _busy_addr;
+    uint32_t _busy_size;
+    Timer _busy_timer;
+    uint32_t _suspended_us;         // part of the busy time spent suspended
+    Timer _suspend_timer;
+    Timer _resume_timer;
+    bool _hw_autopoll;
+    bool _hw_batch;
+    bool _suspend_enabled;
+    bool _continuous_enabled;
+    bool _continuous;               // part in performance-enhance mode
+    qspi_flash_wait_stats_t _wait_stats;
+    qspi_flash_write_stats_t _write_stats;
+    qspi_flash_batch_stats_t _batch_stats;
+    bool _high_performance;         // L/H bit as last set through this object
+    bool _deep_down;
+    uint32_t _power_since_us;       // when the current mode was entered
+    qspi_flash_power_stats_t _power_stats;
+    uint32_t *_sector_buf;          // smart_write read-modify-write, when the pool is empty
+    QSPIFlashLock _mutex;
+    QSPIFlashLock _op_mutex;
+
+    Thread *_async_thread;
+    Mutex _async_mutex;
+    Semaphore _async_pending;
+    Semaphore _async_free;
+    async_request_t _async_queue[QSPI_FLASH_ASYNC_QUEUE_DEPTH];
+    unsigned int _async_head;
+    unsigned int _async_tail;
+};
+
+#endif // QSPI_FLASH_H
@@ -0,0 +1,234 @@
+#include "QSPIFlashBlockDevice.h"
+
+QSPIFlashBlockDevice::QSPIFlashBlockDevice(QSPI *qspi)
+    : _qspi(qspi), _flash(NULL), _has_sfdp(false), _size(QSPI_FLASH_SIZE), _page_addr(0), _page_start(0), _page_end(0)
+{
+    memset(_page, 0xFF, sizeof(_page));
+}
+
+QSPIFlashBlockDevice::~QSPIFlashBlockDevice()
+{
+    deinit();
+}
+
+int QSPIFlashBlockDevice::init()
+{
+    char status = 0;
+
+    _mutex.lock();
+    if (_flash) {
+        _mutex.unlock();
+        return BD_ERROR_OK;
+    }
+
+    qspi_bus_width_t address_width = QSPI_CFG_BUS_SINGLE;
+    qspi_bus_width_t data_width = QSPI_CFG_BUS_SINGLE;
+    _has_sfdp = (QSPI_STATUS_OK == qspi_flash_sfdp_read(_qspi, &_sfdp));
+    if (_has_sfdp) {
+        // QSPIFlash needs 3-byte addresses, or 4-byte ones it can switch
+        // to, pages of at least its own size and the 4K sector erase
+        if (_sfdp.page_size < QSPI_FLASH_PAGE_SIZE || (!_sfdp.address_3byte && _sfdp.address_size != QSPI_CFG_ADDR_SIZE_32) ||
+                !(qspi_flash_sfdp_erase_types(&_sfdp) & QSPI_FLASH_ERASE_SECTOR) ||
+                QSPI_STATUS_OK != qspi_flash_sfdp_enable_quad(_qspi, &_sfdp) ||
+                QSPI_STATUS_OK != qspi_flash_sfdp_configure(_qspi, &_sfdp)) {
+            _mutex.unlock();
+            return BD_ERROR_DEVICE_ERROR;
+        }
+        address_width = _sfdp.address_width;
+        data_width = _sfdp.data_width;
+        _size = qspi_flash_sfdp_usable_size(&_sfdp);
+    } else {
+        // Quad needs QE set in the part; 1_4_4 also gives the 4 line page program
+        if (QSPI_STATUS_OK != _qspi->command_transfer(QSPI_STD_CMD_RDSR, NULL, 0, &status, 1)) {
+            _mutex.unlock();
+            return BD_ERROR_DEVICE_ERROR;
+        }
+        if (status & QSPI_FLASH_SR_QE) {
+            address_width = data_width = QSPI_CFG_BUS_QUAD;
+        }
+        if (QSPI_STATUS_OK != _qspi->configure_format(QSPI_CFG_BUS_SINGLE, address_width, QSPI_FLASH_ADDR_SIZE, QSPI_CFG_BUS_SINGLE, QSPI_CFG_ALT_SIZE_NONE, data_width, 0, 0)) {
+            _mutex.unlock();
+            return BD_ERROR_DEVICE_ERROR;
+        }
+        _size = QSPI_FLASH_SIZE;
+    }
+
+    _flash = new QSPIFlash(_qspi);
+    if (_flash) {
+        _flash->set_trace_format(QSPI_TRACE_FORMAT(QSPI_CFG_BUS_SINGLE, address_width, data_width));
+        if (_has_sfdp) {
+            _flash->set_geometry(_size, qspi_flash_sfdp_erase_types(&_sfdp));
+        }
+        // The QSPI object already sends 4-byte addresses where the part needs them
+        qspi_status_t result = QSPI_STATUS_OK;
+        if (_has_sfdp) {
+            result = qspi_flash_sfdp_enter_4byte(_flash, &_sfdp);
+        } else if (QSPI_FLASH_ADDR_SIZE == QSPI_CFG_ADDR_SIZE_32) {
+            result = _flash->set_address_size(QSPI_CFG_ADDR_SIZE_32);
+        }
+        if (result != QSPI_STATUS_OK) {
+            delete _flash;
+            _flash = NULL;
+        }
+    }
+    _page_start = _page_end = 0;
+    _mutex.unlock();
+    return _flash ? BD_ERROR_OK : BD_ERROR_DEVICE_ERROR;
+}
+
+int QSPIFlashBlockDevice::deinit()
+{
+    _mutex.lock();
+    int result = flush();
+    delete _flash;
+    _flash = NULL;
+    _mutex.unlock();
+    return result;
+}
+
+int QSPIFlashBlockDevice::flush()
+{
+    if (_flash == NULL || _page_end == 0) {
+        return BD_ERROR_OK;
+    }
+    qspi_status_t result = _flash->program(_page_addr + _page_start, _page + _page_start, _page_end - _page_start);
+    memset(_page + _page_start, 0xFF, _page_end - _page_start);
+    _page_start = _page_end = 0;
+    return (result == QSPI_STATUS_OK) ? BD_ERROR_OK : BD_ERROR_DEVICE_ERROR;
+}
+
+int QSPIFlashBlockDevice::sync()
+{
+    _mutex.lock();
+    int result = flush();
+    _mutex.unlock();
+    return result;
+}
+
+int QSPIFlashBlockDevice::read(void *buffer, bd_addr_t addr, bd_size_t size)
+{
+    if (_flash == NULL || !is_valid_read(addr, size)) {
+        return BD_ERROR_DEVICE_ERROR;
+    }
+
+    _mutex.lock();
+    qspi_status_t result = _flash->read(addr, buffer, size);
+
+    // Programming ANDs data into the cells, so the gathered page can be
+    // applied to what the flash holds now
+    if (result == QSPI_STATUS_OK && _page_end) {
+        uint32_t start = _page_addr + _page_start;
+        uint32_t end = _page_addr + _page_end;
+        uint8_t *data = (uint8_t *)buffer;
+        for (uint32_t a = (start > addr) ? start : addr; a < end && a < addr + size; a++) {
+            data[a - addr] &= _page[a - _page_addr];
+        }
+    }
+    _mutex.unlock();
+    return (result == QSPI_STATUS_OK) ? BD_ERROR_OK : BD_ERROR_DEVICE_ERROR;
+}
+
+int QSPIFlashBlockDevice::program(const void *buffer, bd_addr_t addr, bd_size_t size)
+{
+    const uint8_t *data = (const uint8_t *)buffer;
+    int result = BD_ERROR_OK;
+
+    if (_flash == NULL || !is_valid_program(addr, size)) {
+        return BD_ERROR_DEVICE_ERROR;
+    }
+
+    _mutex.lock();
+    while (size && result == BD_ERROR_OK) {
+        uint32_t page_addr = addr & ~(QSPI_FLASH_PAGE_SIZE - 1);
+        uint32_t offset = addr - page_addr;
+        uint32_t chunk = QSPI_FLASH_PAGE_SIZE - offset;
+        if (chunk > size) {
+            chunk = size;
+        }
+
+        if (_page_end && page_addr != _page_addr) {
+            result = flush();
+            if (result != BD_ERROR_OK) {
+                break;
+            }
+        }
+        if (_page_end == 0) {
+            _page_addr = page_addr;
+            _page_start = offset;
+            _page_end = offset + chunk;
+        } else {
+            _page_start = (offset < _page_start) ? offset : _page_start;
+            _page_end = (offset + chunk > _page_end) ? offset + chunk : _page_end;
+        }
+        // Programming the same bytes twice also ANDs them
+        for (uint32_t i = 0; i < chunk; i++) {
+            _page[offset + i] &= data[i];
+        }
+
+        // Appends do not come back to a page once they reach its end
+        if (offset + chunk == QSPI_FLASH_PAGE_SIZE) {
+            result = flush();
+        }
+
+        addr += chunk;
+        data += chunk;
+        size -= chunk;
+    }
+    _mutex.unlock();
+    return result;
+}
+
+int QSPIFlashBlockDevice::erase(bd_addr_t addr, bd_size_t size)
+{
+    if (_flash == NULL || !is_valid_erase(addr, size)) {
+        return BD_ERROR_DEVICE_ERROR;
+    }
+
+    _mutex.lock();
+    int result = BD_ERROR_OK;
+    // Gathered data the erase would wipe out right away is dropped
+    if (_page_end && _page_addr >= addr && _page_addr < addr + size) {
+        memset(_page + _page_start, 0xFF, _page_end - _page_start);
+        _page_start = _page_end = 0;
+    }
+    if (QSPI_STATUS_OK != _flash->erase_range(addr, size)) {
+        result = BD_ERROR_DEVICE_ERROR;
+    }
+    _mutex.unlock();
+    return result;
+}
+
+bd_size_t QSPIFlashBlockDevice::get_read_size() const
+{
+    return 1;
+}
+
+bd_size_t QSPIFlashBlockDevice::get_program_size() const
+{
+    return 1;
+}
+
+bd_size_t QSPIFlashBlockDevice::get_erase_size() const
+{
+    return QSPI_FLASH_SECTOR_SIZE;
+}
+
+int QSPIFlashBlockDevice::get_erase_value() const
+{
+    return 0xFF;
+}
+
+bd_size_t QSPIFlashBlockDevice::size() const
+{
+    return _size;
+}
+
+QSPIFlash *QSPIFlashBlockDevice::get_flash()
+{
+    return _flash;
+}
+
+const qspi_flash_sfdp_t *QSPIFlashBlockDevice::get_sfdp() const
+{
+    return _has_sfdp ? &_sfdp : NULL;
+}
@@ -0,0 +1,74 @@
+#ifndef QSPI_FLASH_BLOCK_DEVICE_H
+#define QSPI_FLASH_BLOCK_DEVICE_H
+
+#include "mbed.h"
+#include "BlockDevice.h"
+#include "QSPI.h"
+#include "QSPIFlash.h"
+#include "QSPIFlashSFDP.h"
+
+/** BlockDevice on a QSPI NOR flash, for LittleFileSystem or FATFileSystem
+ *
+ *  Reads and programs have byte granularity, erases are 4K sectors (ranges
+ *  use 32K/64K block erases where they fit, see QSPIFlash::erase_range).
+ *  Small programs are gathered in a page buffer and sent as one page
+ *  program when they move on to another page, reach the end of the page,
+ *  or on sync/deinit; reads see the gathered data before then.
+ *
+ *  init reads the part's SFDP, enables quad if needed and puts the QSPI
+ *  object in the fastest bus format it allows (see QSPIFlashSFDP.h); the
+ *  size, the block erases used and 4-byte addressing on parts above 16 MB
+ *  come from it too. A part without SFDP is taken for one of QSPI_FLASH_SIZE
+ *  like the MX25R6435F, in 1_4_4 when its QE bit is set, else in 1_1_1.
+ *
+ *  Thread safe.
+ */
+class QSPIFlashBlockDevice : public BlockDevice {
+public:
+    /**
+     *  @param qspi     bus object, reconfigured by init
+     */
+    QSPIFlashBlockDevice(QSPI *qspi);
+    virtual ~QSPIFlashBlockDevice();
+
+    virtual int init();
+    virtual int deinit();
+
+    /** Program the gathered page, if any */
+    virtual int sync();
+
+    virtual int read(void *buffer, bd_addr_t addr, bd_size_t size);
+    virtual int program(const void *buffer, bd_addr_t addr, bd_size_t size);
+    virtual int erase(bd_addr_t addr, bd_size_t size);
+
+    virtual bd_size_t get_read_size() const;
+    virtual bd_size_t get_program_size() const;
+    virtual bd_size_t get_erase_size() const;
+    virtual int get_erase_value() const;
+    virtual bd_size_t size() const;
+
+    /** Flash object used underneath, NULL before init */
+    QSPIFlash *get_flash();
+
+    /** Parameters init found, NULL if the part has no SFDP or before init */
+    const qspi_flash_sfdp_t *get_sfdp() const;
+
+private:
+    int flush();
+
+    QSPI *_qspi;
+    QSPIFlash *_flash;
+    qspi_flash_sfdp_t _sfdp;
+    bool _has_sfdp;
+    uint32_t _size;
+
+    // Gathered programs: page address and the dirty span in _page, the
+    // rest of which is 0xFF so that programming it changes nothing
+    uint8_t _page[QSPI_FLASH_PAGE_SIZE];
+    uint32_t _page_addr;
+    uint32_t _page_start;
+    uint32_t _page_end;
+    Mutex _mutex;
+};
+
+#endif // QSPI_FLASH_BLOCK_DEVICE_H
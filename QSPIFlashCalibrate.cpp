@@ -0,0 +1,230 @@
+#include "QSPIFlashCalibrate.h"
+
+#define CALIBRATE_PATTERN_ADDR      (QSPI_CALIBRATE_ADDR + QSPI_FLASH_PAGE_SIZE)
+#define CALIBRATE_PATTERN_SIZE      QSPI_FLASH_PAGE_SIZE
+
+// Walking ones and zeros, alternating bits, then a count: a read sampled a
+// clock early or late differs from it on every line
+static uint8_t pattern_byte(uint32_t i)
+{
+    if (i < 8) {
+        return (uint8_t)(1 << i);
+    }
+    if (i < 16) {
+        return (uint8_t)~(1 << (i - 8));
+    }
+    if (i < 32) {
+        return (i & 1) ? 0xAA : 0x55;
+    }
+    return (uint8_t)i;
+}
+
+static bool pattern_matches(const uint8_t *data)
+{
+    for (uint32_t i = 0; i < CALIBRATE_PATTERN_SIZE; i++) {
+        if (data[i] != pattern_byte(i)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static uint32_t calibration_check(const qspi_flash_calibration_t *cal)
+{
+    const uint8_t *bytes = (const uint8_t *)cal;
+    uint32_t check = 2166136261UL;
+
+    for (size_t i = 0; i < offsetof(qspi_flash_calibration_t, check); i++) {
+        check = (check ^ bytes[i]) * 16777619UL;
+    }
+    return check;
+}
+
+// The address size is the one flash has the part in
+static qspi_status_t configure(QSPIFlash *flash, QSPI *qspi, qspi_bus_width_t address_width, qspi_bus_width_t data_width,
+                               uint32_t hz, int dummy_cycles)
+{
+    qspi_status_t result = qspi->set_frequency(hz);
+    if (result == QSPI_STATUS_OK) {
+        result = qspi->configure_format(QSPI_CFG_BUS_SINGLE, address_width, flash->get_address_size(), QSPI_CFG_BUS_SINGLE,
+                                        QSPI_CFG_ALT_SIZE_NONE, data_width, dummy_cycles, 0);
+    }
+    return result;
+}
+
+// Pattern reads at the current setting; failures counted in cal
+static bool read_pattern(QSPIFlash *flash, int passes, qspi_flash_calibration_t *cal)
+{
+    uint8_t data[CALIBRATE_PATTERN_SIZE];
+
+    for (int i = 0; i < passes; i++) {
+        if (QSPI_STATUS_OK != flash->read(CALIBRATE_PATTERN_ADDR, data, sizeof(data)) || !pattern_matches(data)) {
+            cal->failed_reads++;
+            return false;
+        }
+    }
+    return true;
+}
+
+static qspi_status_t write_pattern(QSPIFlash *flash)
+{
+    uint8_t data[CALIBRATE_PATTERN_SIZE];
+
+    for (uint32_t i = 0; i < sizeof(data); i++) {
+        data[i] = pattern_byte(i);
+    }
+    return flash->program(CALIBRATE_PATTERN_ADDR, data, sizeof(data));
+}
+
+qspi_status_t qspi_flash_calibration_sweep(QSPIFlash *flash, QSPI *qspi, qspi_bus_width_t address_width,
+                                           qspi_bus_width_t data_width, qspi_flash_calibration_t *cal)
+{
+    uint8_t data[CALIBRATE_PATTERN_SIZE];
+
+    if (flash == NULL || qspi == NULL || cal == NULL) {
+        return QSPI_STATUS_INVALID_PARAMETER;
+    }
+    memset(cal, 0, sizeof(*cal));
+    cal->format = QSPI_TRACE_FORMAT(QSPI_CFG_BUS_SINGLE, address_width, data_width);
+
+    // Pattern in place, written at the defaults
+    qspi_status_t result = configure(flash, qspi, address_width, data_width, QSPI_CALIBRATE_DEFAULT_HZ, 0);
+    if (result == QSPI_STATUS_OK) {
+        result = flash->read(CALIBRATE_PATTERN_ADDR, data, sizeof(data));
+    }
+    if (result == QSPI_STATUS_OK && !pattern_matches(data)) {
+        result = flash->erase_sector(QSPI_CALIBRATE_ADDR);
+        if (result == QSPI_STATUS_OK) {
+            result = write_pattern(flash);
+        }
+    }
+    if (result != QSPI_STATUS_OK) {
+        return result;
+    }
+
+    // Fastest clock first; the first with a passing dummy count wins
+    int divider;
+    int dummy = 0;
+    for (divider = 1; divider <= QSPI_CALIBRATE_MAX_DIVIDER && dummy == 0; divider++) {
+        for (int d = 1; d <= QSPI_CALIBRATE_MAX_DUMMY; d++) {
+            cal->points++;
+            if (QSPI_STATUS_OK == configure(flash, qspi, address_width, data_width, QSPI_CALIBRATE_BASE_HZ / divider, d) &&
+                    read_pattern(flash, QSPI_CALIBRATE_PASSES, cal)) {
+                dummy = d;
+                break;
+            }
+        }
+    }
+    divider--;
+
+    result = QSPI_STATUS_ERROR;
+    if (dummy) {
+        cal->fastest_hz = QSPI_CALIBRATE_BASE_HZ / divider;
+        cal->min_dummy_cycles = dummy;
+
+        // Back off from a failure seen at a faster clock; none when the
+        // fastest clock passed. The dummy cycles that passed at the faster
+        // clock cover the slower one with time to spare.
+        if (divider > 1) {
+            divider += QSPI_CALIBRATE_MARGIN_STEPS;
+            if (divider > QSPI_CALIBRATE_MAX_DIVIDER) {
+                divider = QSPI_CALIBRATE_MAX_DIVIDER;
+            }
+        }
+        cal->hz = QSPI_CALIBRATE_BASE_HZ / divider;
+
+        // A part with a fixed latency reads wrong with any other dummy
+        // count, so the margin is only kept where it reads right
+        static const int dummy_margins[] = { QSPI_CALIBRATE_DUMMY_MARGIN, 0 };
+        for (unsigned int m = 0; m < sizeof(dummy_margins) / sizeof(dummy_margins[0]); m++) {
+            cal->dummy_cycles = dummy + dummy_margins[m];
+            if (QSPI_STATUS_OK == configure(flash, qspi, address_width, data_width, cal->hz, cal->dummy_cycles) &&
+                    read_pattern(flash, QSPI_CALIBRATE_PASSES, cal)) {
+                result = QSPI_STATUS_OK;
+                break;
+            }
+        }
+    }
+
+    cal->magic = QSPI_CALIBRATE_MAGIC;
+    cal->version = QSPI_CALIBRATE_VERSION;
+    cal->check = calibration_check(cal);
+    configure(flash, qspi, address_width, data_width, QSPI_CALIBRATE_DEFAULT_HZ, 0);
+    return result;
+}
+
+qspi_status_t qspi_flash_calibration_load(QSPIFlash *flash, qspi_flash_calibration_t *cal)
+{
+    if (flash == NULL || cal == NULL) {
+        return QSPI_STATUS_INVALID_PARAMETER;
+    }
+    qspi_status_t result = flash->read(QSPI_CALIBRATE_ADDR, cal, sizeof(*cal));
+    if (result == QSPI_STATUS_OK && (cal->magic != QSPI_CALIBRATE_MAGIC || cal->version != QSPI_CALIBRATE_VERSION ||
+                                     cal->check != calibration_check(cal) || cal->hz == 0)) {
+        result = QSPI_STATUS_ERROR;
+    }
+    return result;
+}
+
+qspi_status_t qspi_flash_calibration_save(QSPIFlash *flash, qspi_flash_calibration_t *cal)
+{
+    if (flash == NULL || cal == NULL) {
+        return QSPI_STATUS_INVALID_PARAMETER;
+    }
+    cal->magic = QSPI_CALIBRATE_MAGIC;
+    cal->version = QSPI_CALIBRATE_VERSION;
+    cal->check = calibration_check(cal);
+
+    qspi_status_t result = flash->erase_sector(QSPI_CALIBRATE_ADDR);
+    if (result == QSPI_STATUS_OK) {
+        result = write_pattern(flash);
+    }
+    if (result == QSPI_STATUS_OK) {
+        result = flash->program(QSPI_CALIBRATE_ADDR, cal, sizeof(*cal));
+    }
+    return result;
+}
+
+qspi_status_t qspi_flash_calibration_apply(QSPIFlash *flash, QSPI *qspi, qspi_bus_width_t address_width,
+                                           qspi_bus_width_t data_width, const qspi_flash_calibration_t *cal)
+{
+    if (flash == NULL || qspi == NULL || cal == NULL || cal->hz == 0) {
+        return QSPI_STATUS_INVALID_PARAMETER;
+    }
+    return configure(flash, qspi, address_width, data_width, cal->hz, cal->dummy_cycles);
+}
+
+qspi_status_t qspi_flash_calibrate(QSPIFlash *flash, QSPI *qspi, qspi_bus_width_t address_width,
+                                   qspi_bus_width_t data_width, qspi_flash_calibration_t *cal, bool *swept)
+{
+    if (flash == NULL || qspi == NULL || cal == NULL) {
+        return QSPI_STATUS_INVALID_PARAMETER;
+    }
+    if (swept) {
+        *swept = false;
+    }
+
+    // The record is read at the defaults, which every board manages
+    qspi_status_t result = configure(flash, qspi, address_width, data_width, QSPI_CALIBRATE_DEFAULT_HZ, 0);
+    if (result != QSPI_STATUS_OK) {
+        return result;
+    }
+    if (QSPI_STATUS_OK == qspi_flash_calibration_load(flash, cal) &&
+            cal->format == QSPI_TRACE_FORMAT(QSPI_CFG_BUS_SINGLE, address_width, data_width) &&
+            QSPI_STATUS_OK == qspi_flash_calibration_apply(flash, qspi, address_width, data_width, cal) &&
+            read_pattern(flash, 1, cal)) {
+        return QSPI_STATUS_OK;
+    }
+
+    if (swept) {
+        *swept = true;
+    }
+    result = qspi_flash_calibration_sweep(flash, qspi, address_width, data_width, cal);
+    if (result == QSPI_STATUS_OK) {
+        result = qspi_flash_calibration_save(flash, cal);
+    }
+    if (result == QSPI_STATUS_OK) {
+        result = qspi_flash_calibration_apply(flash, qspi, address_width, data_width, cal);
+    }
+    return result;
+}
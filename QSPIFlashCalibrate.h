@@ -0,0 +1,100 @@
+#ifndef QSPI_FLASH_CALIBRATE_H
+#define QSPI_FLASH_CALIBRATE_H
+
+#include "mbed.h"
+#include "QSPI.h"
+#include "QSPIFlash.h"
+
+// Sector holding the calibration record (first page) and the test pattern
+// (second page); the last one of the flash unless set otherwise
+#ifndef QSPI_CALIBRATE_ADDR
+#define QSPI_CALIBRATE_ADDR                 (QSPI_FLASH_SIZE - QSPI_FLASH_SECTOR_SIZE)
+#endif
+
+// Clocks swept: QSPI_CALIBRATE_BASE_HZ / n for n = 1 .. QSPI_CALIBRATE_MAX_DIVIDER,
+// the NRF52840 SCK dividers (SCKFREQ + 1); the slowest is the QSPI default
+#define QSPI_CALIBRATE_BASE_HZ              32000000
+#define QSPI_CALIBRATE_MAX_DIVIDER          32
+#define QSPI_CALIBRATE_DEFAULT_HZ           ONE_MHZ
+
+// Dummy cycles tried at each clock, from 1 up
+#define QSPI_CALIBRATE_MAX_DUMMY            15
+
+// Pattern reads that must all match for a setting to pass
+#ifndef QSPI_CALIBRATE_PASSES
+#define QSPI_CALIBRATE_PASSES               4
+#endif
+
+// Safety margin: clock dividers backed off from the fastest passing clock,
+// when a faster one failed, and dummy cycles added to the fewest that passed
+#ifndef QSPI_CALIBRATE_MARGIN_STEPS
+#define QSPI_CALIBRATE_MARGIN_STEPS         1
+#endif
+#ifndef QSPI_CALIBRATE_DUMMY_MARGIN
+#define QSPI_CALIBRATE_DUMMY_MARGIN         1
+#endif
+
+#define QSPI_CALIBRATE_MAGIC                0x4C435151      // "QQCL"
+#define QSPI_CALIBRATE_VERSION              1
+
+/** Bus clock and dummy cycles for one bus format, as persisted */
+typedef struct {
+    uint32_t magic;
+    uint8_t version;
+    uint8_t format;                 // QSPI_TRACE_FORMAT it was calibrated in
+    uint8_t dummy_cycles;           // to use, margin included
+    uint8_t min_dummy_cycles;       // fewest that passed at fastest_hz
+    uint32_t hz;                    // to use, margin included
+    uint32_t fastest_hz;            // fastest clock that passed
+    uint16_t points;                // clock and dummy pairs tried
+    uint16_t failed_reads;          // pattern reads that did not match
+    uint32_t check;                 // of the fields above
+} qspi_flash_calibration_t;
+
+/** Sweep the bus clock and dummy cycles for the given format
+ *
+ *  Clocks are tried fastest first. At each, dummy cycles are tried from 1
+ *  up; a pair passes when QSPI_CALIBRATE_PASSES reads of the test pattern
+ *  all match. The first clock with a passing pair is the fastest reliable
+ *  one; the margin is then applied and the result checked once more. The
+ *  dummy margin is dropped if it reads wrong, as on parts that count a
+ *  fixed number of wait cycles.
+ *  Writes the test pattern first if it is not there. Programs and erases
+ *  are done at QSPI_CALIBRATE_DEFAULT_HZ with the part's default dummy
+ *  cycles, and the QSPI object is left that way.
+ *
+ *  @param flash    for the pattern; must not have continuous reads or a
+ *                  read cache on, as they would not read the bus each time
+ *  @param qspi     the bus object under flash
+ *  @param address_width, data_width   the bus format, 1 line instruction
+ *  @param cal      receives the result, not persisted
+ *  @return QSPI_STATUS_ERROR when no setting passed
+ */
+qspi_status_t qspi_flash_calibration_sweep(QSPIFlash *flash, QSPI *qspi, qspi_bus_width_t address_width,
+                                           qspi_bus_width_t data_width, qspi_flash_calibration_t *cal);
+
+/** Read the persisted calibration; QSPI_STATUS_ERROR if there is none valid */
+qspi_status_t qspi_flash_calibration_load(QSPIFlash *flash, qspi_flash_calibration_t *cal);
+
+/** Persist a calibration, with the test pattern; erases the sector */
+qspi_status_t qspi_flash_calibration_save(QSPIFlash *flash, qspi_flash_calibration_t *cal);
+
+/** set_frequency and configure_format with a calibration's clock and dummy
+ *  cycles, and the address size flash has the part in
+ */
+qspi_status_t qspi_flash_calibration_apply(QSPIFlash *flash, QSPI *qspi, qspi_bus_width_t address_width,
+                                           qspi_bus_width_t data_width, const qspi_flash_calibration_t *cal);
+
+/** Apply the persisted calibration, or sweep and persist one
+ *
+ *  A persisted calibration for the same format is applied once one read
+ *  of the pattern with it matches, skipping the sweep. Otherwise (none,
+ *  another format, or the board no longer keeps up) the QSPI object goes
+ *  back to the defaults, and a new calibration is swept, saved and applied.
+ *
+ *  @param swept    set to whether a sweep was needed, may be NULL
+ */
+qspi_status_t qspi_flash_calibrate(QSPIFlash *flash, QSPI *qspi, qspi_bus_width_t address_width,
+                                   qspi_bus_width_t data_width, qspi_flash_calibration_t *cal, bool *swept = NULL);
+
+#endif // QSPI_FLASH_CALIBRATE_H
@@ -0,0 +1,581 @@
+#include "QSPIFlashFTL.h"
+
+// Sector header at the start of the summary page, little-endian words
+#define FTL_MAGIC                   0x4C544651      // "QFTL"
+#define FTL_HEADER_SIZE             16
+#define FTL_HEADER_MAGIC            0
+#define FTL_HEADER_ERASE_COUNT      4
+#define FTL_HEADER_SEQ              8
+
+#define FTL_UNMAPPED                0xFFFF
+#define FTL_FREE_SEQ                0xFFFFFFFF
+
+QSPIFlashFTL::QSPIFlashFTL(QSPIFlash *flash, uint32_t base_addr, unsigned int sectors, bool background_gc)
+    : _flash(flash), _base(base_addr), _sector_count(sectors), _block_count(0), _map(NULL), _sectors(NULL),
+      _free_count(0), _next_seq(0), _active(-1), _next_slot(0), _in_gc(false), _mounted(false),
+      _page_count(0), _background_gc(background_gc), _gc_stop(false), _gc_thread(NULL), _gc_request(0)
+{
+    // Slot numbers have to fit the 16-bit map entries
+    if (_sector_count * QSPI_FTL_SLOTS_PER_SECTOR >= FTL_UNMAPPED) {
+        _sector_count = (FTL_UNMAPPED - 1) / QSPI_FTL_SLOTS_PER_SECTOR;
+    }
+    if (_sector_count > QSPI_FTL_GC_TARGET + 1) {
+        _block_count = (_sector_count - QSPI_FTL_GC_TARGET) * QSPI_FTL_SLOTS_PER_SECTOR *
+                       (100 - QSPI_FTL_OVERPROVISION_PCT) / 100;
+    }
+    _map = new uint16_t[_block_count ? _block_count : 1];
+    _sectors = new sector_t[_sector_count ? _sector_count : 1];
+    memset(&_stats, 0, sizeof(_stats));
+    memset(_page, 0xFF, sizeof(_page));
+}
+
+QSPIFlashFTL::~QSPIFlashFTL()
+{
+    if (_gc_thread) {
+        _mutex.lock();
+        _gc_stop = true;
+        _mutex.unlock();
+        _gc_request.release();
+        _gc_thread->join();
+        delete _gc_thread;
+    }
+    _mutex.lock();
+    if (_mounted) {
+        flush();
+    }
+    _mutex.unlock();
+    delete[] _map;
+    delete[] _sectors;
+}
+
+uint32_t QSPIFlashFTL::sector_addr(unsigned int sector) const
+{
+    return _base + sector * QSPI_FLASH_SECTOR_SIZE;
+}
+
+uint32_t QSPIFlashFTL::slot_addr(uint16_t slot) const
+{
+    return sector_addr(slot / QSPI_FTL_SLOTS_PER_SECTOR) + QSPI_FLASH_PAGE_SIZE +
+           (slot % QSPI_FTL_SLOTS_PER_SECTOR) * QSPI_FTL_BLOCK_SIZE;
+}
+
+bool QSPIFlashFTL::pending(uint16_t slot) const
+{
+    if (_active < 0 || slot / QSPI_FTL_SLOTS_PER_SECTOR != (unsigned int)_active) {
+        return false;
+    }
+    unsigned int index = slot % QSPI_FTL_SLOTS_PER_SECTOR;
+    return index < _next_slot && index >= _next_slot - _page_count;
+}
+
+qspi_status_t QSPIFlashFTL::write_header(unsigned int sector, uint32_t erase_count)
+{
+    uint32_t header[2] = { FTL_MAGIC, erase_count };
+
+    _sectors[sector].erase_count = erase_count;
+    _sectors[sector].seq = FTL_FREE_SEQ;
+    _sectors[sector].valid = 0;
+    _sectors[sector].state = SECTOR_FREE;
+    return _flash->program(sector_addr(sector), header, sizeof(header));
+}
+
+qspi_status_t QSPIFlashFTL::format()
+{
+    uint32_t header[FTL_HEADER_SIZE / 4];
+    qspi_status_t result;
+
+    _mutex.lock();
+    _mounted = false;
+    for (unsigned int s = 0; s < _sector_count; s++) {
+        result = _flash->read(sector_addr(s), header, sizeof(header));
+        if (result != QSPI_STATUS_OK) {
+            _mutex.unlock();
+            return result;
+        }
+        _sectors[s].erase_count = (header[FTL_HEADER_MAGIC / 4] == FTL_MAGIC && header[FTL_HEADER_ERASE_COUNT / 4] != FTL_FREE_SEQ) ?
+                                  header[FTL_HEADER_ERASE_COUNT / 4] : 0;
+    }
+
+    result = _flash->erase_range(_base, _sector_count * QSPI_FLASH_SECTOR_SIZE);
+    for (unsigned int s = 0; s < _sector_count && result == QSPI_STATUS_OK; s++) {
+        result = write_header(s, _sectors[s].erase_count + 1);
+    }
+    _mutex.unlock();
+
+    return (result == QSPI_STATUS_OK) ? mount() : result;
+}
+
+qspi_status_t QSPIFlashFTL::mount()
+{
+    uint32_t header[FTL_HEADER_SIZE / 4];
+    uint32_t max_erase = 0;
+    unsigned int formatted = 0;
+    unsigned int foreign = 0;
+    qspi_status_t result = QSPI_STATUS_OK;
+
+    if (_block_count == 0) {
+        return QSPI_STATUS_INVALID_PARAMETER;
+    }
+
+    _mutex.lock();
+    if (_mounted) {
+        flush();
+    }
+    _mounted = false;
+    _active = -1;
+    _next_slot = 0;
+    _page_count = 0;
+    _next_seq = 0;
+    _free_count = 0;
+    memset(_map, 0xFF, _block_count * sizeof(_map[0]));
+
+    for (unsigned int s = 0; s < _sector_count && result == QSPI_STATUS_OK; s++) {
+        result = _flash->read(sector_addr(s), header, sizeof(header));
+        sector_t *sector = &_sectors[s];
+        sector->valid = 0;
+        if (header[FTL_HEADER_MAGIC / 4] != FTL_MAGIC) {
+            // An erase cut short leaves the start blank (or, on some parts,
+            // random) and the rest anything, so the sector is erased again
+            // below. Data and no header anywhere was never formatted.
+            if (header[FTL_HEADER_MAGIC / 4] != 0xFFFFFFFF) {
+                foreign++;
+            }
+            sector->erase_count = FTL_FREE_SEQ;
+            sector->seq = FTL_FREE_SEQ;
+            sector->state = SECTOR_BLANK;
+            continue;
+        }
+        formatted++;
+        sector->erase_count = header[FTL_HEADER_ERASE_COUNT / 4];
+        sector->seq = header[FTL_HEADER_SEQ / 4];
+        sector->state = (sector->seq == FTL_FREE_SEQ) ? SECTOR_FREE : SECTOR_USED;
+        // A header program cut short leaves the erase count out
+        if (sector->erase_count != FTL_FREE_SEQ && sector->erase_count > max_erase) {
+            max_erase = sector->erase_count;
+        }
+        if (sector->seq != FTL_FREE_SEQ && sector->seq >= _next_seq) {
+            _next_seq = sector->seq + 1;
+        }
+    }
+
+    // Replay the summaries oldest sector first, so newer copies win
+    unsigned int *order = new unsigned int[_sector_count];
+    unsigned int used = 0;
+    for (unsigned int s = 0; s < _sector_count; s++) {
+        if (_sectors[s].state != SECTOR_USED) {
+            continue;
+        }
+        unsigned int i = used++;
+        for (; i > 0 && _sectors[order[i - 1]].seq > _sectors[s].seq; i--) {
+            order[i] = order[i - 1];
+        }
+        order[i] = s;
+    }
+    for (unsigned int n = 0; n < used && result == QSPI_STATUS_OK; n++) {
+        unsigned int s = order[n];
+        result = _flash->read(sector_addr(s) + FTL_HEADER_SIZE, _summary, sizeof(_summary));
+        for (unsigned int i = 0; i < QSPI_FTL_SLOTS_PER_SECTOR && result == QSPI_STATUS_OK; i++) {
+            uint16_t lba = _summary[i];
+            if (lba >= _block_count) {
+                continue;
+            }
+            if (_map[lba] != FTL_UNMAPPED) {
+                _sectors[_map[lba] / QSPI_FTL_SLOTS_PER_SECTOR].valid--;
+            }
+            _map[lba] = s * QSPI_FTL_SLOTS_PER_SECTOR + i;
+            _sectors[s].valid++;
+        }
+    }
+    delete[] order;
+
+    if (result == QSPI_STATUS_OK && formatted == 0 && foreign) {
+        result = QSPI_STATUS_ERROR;
+    }
+    for (unsigned int s = 0; s < _sector_count && result == QSPI_STATUS_OK; s++) {
+        if (_sectors[s].state == SECTOR_BLANK) {
+            result = _flash->erase_range(sector_addr(s), QSPI_FLASH_SECTOR_SIZE);
+            if (result != QSPI_STATUS_OK) {
+                break;
+            }
+            result = write_header(s, max_erase + 1);
+            _stats.mount_erases++;
+        } else if (_sectors[s].state != SECTOR_FREE) {
+            continue;
+        } else if (_sectors[s].erase_count == FTL_FREE_SEQ) {
+            result = write_header(s, max_erase);
+        }
+        _free_count++;
+    }
+    _mounted = (result == QSPI_STATUS_OK);
+    _mutex.unlock();
+
+    if (_mounted && _background_gc && _gc_thread == NULL) {
+        _gc_thread = new Thread(osPriorityBelowNormal, QSPI_FTL_GC_STACK_SIZE);
+        if (_gc_thread == NULL || osOK != _gc_thread->start(callback(this, &QSPIFlashFTL::gc_worker))) {
+            delete _gc_thread;
+            _gc_thread = NULL;
+        }
+    }
+    return result;
+}
+
+qspi_status_t QSPIFlashFTL::flush()
+{
+    if (_page_count == 0) {
+        return QSPI_STATUS_OK;
+    }
+
+    // Data first: a summary entry is only ever found next to its data
+    unsigned int first = _next_slot - _page_count;
+    uint16_t slot = _active * QSPI_FTL_SLOTS_PER_SECTOR + first;
+    unsigned int offset = (first % QSPI_FTL_SLOTS_PER_PAGE) * QSPI_FTL_BLOCK_SIZE;
+    qspi_status_t result = _flash->program(slot_addr(slot), _page + offset, _page_count * QSPI_FTL_BLOCK_SIZE);
+    if (result == QSPI_STATUS_OK) {
+        result = _flash->program(sector_addr(_active) + FTL_HEADER_SIZE + first * sizeof(uint16_t),
+                                 &_page_lba[first % QSPI_FTL_SLOTS_PER_PAGE], _page_count * sizeof(uint16_t));
+    }
+    memset(_page, 0xFF, sizeof(_page));
+    _page_count = 0;
+    _stats.flushes++;
+    return result;
+}
+
+int QSPIFlashFTL::pick_victim(bool wear)
+{
+    int victim = -1;
+    uint32_t min_erase = FTL_FREE_SEQ;
+    uint32_t max_erase = 0;
+
+    for (unsigned int s = 0; s < _sector_count; s++) {
+        max_erase = (_sectors[s].erase_count > max_erase) ? _sectors[s].erase_count : max_erase;
+    }
+    for (unsigned int s = 0; s < _sector_count; s++) {
+        const sector_t *sector = &_sectors[s];
+        if (sector->state != SECTOR_USED) {
+            continue;
+        }
+        if (wear) {
+            // The least erased sector holding data, if it lags behind
+            if (sector->erase_count < min_erase && sector->erase_count + QSPI_FTL_WEAR_DELTA < max_erase) {
+                min_erase = sector->erase_count;
+                victim = s;
+            }
+        } else if (sector->valid < QSPI_FTL_SLOTS_PER_SECTOR && (victim < 0 || sector->valid < _sectors[victim].valid)) {
+            victim = s;
+        }
+    }
+    return victim;
+}
+
+bool QSPIFlashFTL::wear_needed() const
+{
+    uint32_t min_erase = FTL_FREE_SEQ;
+    uint32_t max_erase = 0;
+
+    for (unsigned int s = 0; s < _sector_count; s++) {
+        if (_sectors[s].state == SECTOR_USED && _sectors[s].erase_count < min_erase) {
+            min_erase = _sectors[s].erase_count;
+        }
+        max_erase = (_sectors[s].erase_count > max_erase) ? _sectors[s].erase_count : max_erase;
+    }
+    return min_erase != FTL_FREE_SEQ && min_erase + QSPI_FTL_WEAR_DELTA < max_erase;
+}
+
+qspi_status_t QSPIFlashFTL::reclaim(unsigned int sector)
+{
+    uint8_t data[QSPI_FTL_BLOCK_SIZE];
+    qspi_status_t result;
+
+    _in_gc = true;
+    result = _flash->read(sector_addr(sector) + FTL_HEADER_SIZE, _summary, sizeof(_summary));
+    for (unsigned int i = 0; i < QSPI_FTL_SLOTS_PER_SECTOR && result == QSPI_STATUS_OK; i++) {
+        uint16_t lba = _summary[i];
+        uint16_t slot = sector * QSPI_FTL_SLOTS_PER_SECTOR + i;
+        if (lba >= _block_count || _map[lba] != slot) {
+            continue;
+        }
+        result = _flash->read(slot_addr(slot), data, sizeof(data));
+        if (result == QSPI_STATUS_OK) {
+            result = write_block(lba, data);
+            _stats.relocated++;
+        }
+    }
+
+    // The moved slots have to be on flash before their old copies go
+    if (result == QSPI_STATUS_OK) {
+        result = flush();
+    }
+    if (result == QSPI_STATUS_OK) {
+        result = _flash->erase_range(sector_addr(sector), QSPI_FLASH_SECTOR_SIZE);
+    }
+    if (result == QSPI_STATUS_OK) {
+        result = write_header(sector, _sectors[sector].erase_count + 1);
+        _free_count++;
+        _stats.gc_erases++;
+    }
+    _in_gc = false;
+    return result;
+}
+
+bool QSPIFlashFTL::collect_one(bool wear)
+{
+    // Moving a whole cold sector may need one more free sector than the reserve
+    if (wear && _free_count <= QSPI_FTL_GC_RESERVE + 1) {
+        wear = false;
+    }
+    int victim = pick_victim(wear);
+    if (victim < 0 && wear) {
+        wear = false;
+        victim = pick_victim(false);
+    }
+    if (victim < 0 || QSPI_STATUS_OK != reclaim(victim)) {
+        return false;
+    }
+    if (wear) {
+        _stats.wear_moves++;
+    }
+    return true;
+}
+
+bool QSPIFlashFTL::collect()
+{
+    _mutex.lock();
+    bool collected = _mounted && collect_one(false);
+    _mutex.unlock();
+    return collected;
+}
+
+qspi_status_t QSPIFlashFTL::open_sector()
+{
+    qspi_status_t result = flush();
+    if (result != QSPI_STATUS_OK) {
+        return result;
+    }
+    if (_active >= 0) {
+        _sectors[_active].state = SECTOR_USED;
+        _active = -1;
+    }
+
+    // The reserve is for garbage collection, which must always be able to finish
+    while (!_in_gc && _free_count <= QSPI_FTL_GC_RESERVE) {
+        if (!collect_one(false)) {
+            break;
+        }
+    }
+    // Moving the live slots may have opened a sector with room left
+    if (_active >= 0) {
+        if (_next_slot < QSPI_FTL_SLOTS_PER_SECTOR) {
+            return QSPI_STATUS_OK;
+        }
+        _sectors[_active].state = SECTOR_USED;
+        _active = -1;
+    }
+    if (_free_count == 0 || (!_in_gc && _free_count <= QSPI_FTL_GC_RESERVE)) {
+        return QSPI_STATUS_ERROR;
+    }
+
+    int sector = -1;
+    for (unsigned int s = 0; s < _sector_count; s++) {
+        if (_sectors[s].state == SECTOR_FREE && (sector < 0 || _sectors[s].erase_count < _sectors[sector].erase_count)) {
+            sector = s;
+        }
+    }
+    uint32_t seq = _next_seq++;
+    result = _flash->program(sector_addr(sector) + FTL_HEADER_SEQ, &seq, sizeof(seq));
+    if (result != QSPI_STATUS_OK) {
+        return result;
+    }
+    _sectors[sector].seq = seq;
+    _sectors[sector].state = SECTOR_ACTIVE;
+    _free_count--;
+    _active = sector;
+    _next_slot = 0;
+
+    if (_gc_thread && (_free_count < QSPI_FTL_GC_TARGET || wear_needed())) {
+        _gc_request.release();
+    }
+    return QSPI_STATUS_OK;
+}
+
+qspi_status_t QSPIFlashFTL::write_block(uint16_t lba, const uint8_t *data)
+{
+    uint16_t old = _map[lba];
+    qspi_status_t result;
+
+    _stats.writes++;
+    if (old != FTL_UNMAPPED && pending(old)) {
+        unsigned int index = old % QSPI_FTL_SLOTS_PER_SECTOR;
+        memcpy(&_page[(index % QSPI_FTL_SLOTS_PER_PAGE) * QSPI_FTL_BLOCK_SIZE], data, QSPI_FTL_BLOCK_SIZE);
+        _stats.coalesced++;
+        return QSPI_STATUS_OK;
+    }
+
+    if (_active < 0 || _next_slot == QSPI_FTL_SLOTS_PER_SECTOR) {
+        result = open_sector();
+        if (result != QSPI_STATUS_OK) {
+            return result;
+        }
+        // Garbage collection may have moved the block
+        old = _map[lba];
+    }
+
+    unsigned int index = _next_slot++;
+    memcpy(&_page[(index % QSPI_FTL_SLOTS_PER_PAGE) * QSPI_FTL_BLOCK_SIZE], data, QSPI_FTL_BLOCK_SIZE);
+    _page_lba[index % QSPI_FTL_SLOTS_PER_PAGE] = lba;
+    _page_count++;
+    if (old != FTL_UNMAPPED) {
+        _sectors[old / QSPI_FTL_SLOTS_PER_SECTOR].valid--;
+    }
+    _map[lba] = _active * QSPI_FTL_SLOTS_PER_SECTOR + index;
+    _sectors[_active].valid++;
+    _stats.slots_written++;
+
+    if (_next_slot % QSPI_FTL_SLOTS_PER_PAGE == 0) {
+        return flush();
+    }
+    return QSPI_STATUS_OK;
+}
+
+qspi_status_t QSPIFlashFTL::read_block(uint16_t lba, uint8_t *data)
+{
+    uint16_t slot = _map[lba];
+
+    if (slot == FTL_UNMAPPED) {
+        memset(data, 0xFF, QSPI_FTL_BLOCK_SIZE);
+        return QSPI_STATUS_OK;
+    }
+    if (pending(slot)) {
+        unsigned int index = slot % QSPI_FTL_SLOTS_PER_SECTOR;
+        memcpy(data, &_page[(index % QSPI_FTL_SLOTS_PER_PAGE) * QSPI_FTL_BLOCK_SIZE], QSPI_FTL_BLOCK_SIZE);
+        return QSPI_STATUS_OK;
+    }
+    return _flash->read(slot_addr(slot), data, QSPI_FTL_BLOCK_SIZE);
+}
+
+qspi_status_t QSPIFlashFTL::read(uint32_t addr, void *buffer, size_t size)
+{
+    uint8_t *data = (uint8_t *)buffer;
+    uint8_t block[QSPI_FTL_BLOCK_SIZE];
+    qspi_status_t result = QSPI_STATUS_OK;
+
+    if (buffer == NULL || addr > this->size() || size > this->size() - addr) {
+        return QSPI_STATUS_INVALID_PARAMETER;
+    }
+
+    _mutex.lock();
+    if (!_mounted) {
+        result = QSPI_STATUS_ERROR;
+    }
+    while (size && result == QSPI_STATUS_OK) {
+        uint32_t offset = addr % QSPI_FTL_BLOCK_SIZE;
+        size_t chunk = QSPI_FTL_BLOCK_SIZE - offset;
+        if (chunk > size) {
+            chunk = size;
+        }
+        result = read_block(addr / QSPI_FTL_BLOCK_SIZE, block);
+        memcpy(data, block + offset, chunk);
+        addr += chunk;
+        data += chunk;
+        size -= chunk;
+    }
+    _mutex.unlock();
+    return result;
+}
+
+qspi_status_t QSPIFlashFTL::write(uint32_t addr, const void *buffer, size_t size)
+{
+    const uint8_t *data = (const uint8_t *)buffer;
+    uint8_t block[QSPI_FTL_BLOCK_SIZE];
+    qspi_status_t result = QSPI_STATUS_OK;
+
+    if (buffer == NULL || addr > this->size() || size > this->size() - addr) {
+        return QSPI_STATUS_INVALID_PARAMETER;
+    }
+
+    _mutex.lock();
+    if (!_mounted) {
+        result = QSPI_STATUS_ERROR;
+    }
+    while (size && result == QSPI_STATUS_OK) {
+        uint16_t lba = addr / QSPI_FTL_BLOCK_SIZE;
+        uint32_t offset = addr % QSPI_FTL_BLOCK_SIZE;
+        size_t chunk = QSPI_FTL_BLOCK_SIZE - offset;
+        if (chunk > size) {
+            chunk = size;
+        }
+        if (chunk < QSPI_FTL_BLOCK_SIZE) {
+            result = read_block(lba, block);
+        }
+        if (result == QSPI_STATUS_OK) {
+            memcpy(block + offset, data, chunk);
+            result = write_block(lba, block);
+        }
+        addr += chunk;
+        data += chunk;
+        size -= chunk;
+    }
+    _mutex.unlock();
+    return result;
+}
+
+qspi_status_t QSPIFlashFTL::sync()
+{
+    _mutex.lock();
+    qspi_status_t result = _mounted ? flush() : QSPI_STATUS_ERROR;
+    _mutex.unlock();
+    return result;
+}
+
+void QSPIFlashFTL::gc_worker()
+{
+    while (true) {
+        _gc_request.wait();
+
+        _mutex.lock();
+        // One sector at a time, letting writers in between
+        for (unsigned int i = 0; i < _sector_count && !_gc_stop && _mounted; i++) {
+            bool wear = wear_needed();
+            if (_free_count >= QSPI_FTL_GC_TARGET && !wear) {
+                break;
+            }
+            if (!collect_one(wear)) {
+                break;
+            }
+            _mutex.unlock();
+            _mutex.lock();
+        }
+        bool stop = _gc_stop;
+        _mutex.unlock();
+        if (stop) {
+            break;
+        }
+    }
+}
+
+uint32_t QSPIFlashFTL::size() const
+{
+    return _block_count * QSPI_FTL_BLOCK_SIZE;
+}
+
+uint32_t QSPIFlashFTL::get_erase_count(unsigned int sector)
+{
+    _mutex.lock();
+    uint32_t count = (sector < _sector_count) ? _sectors[sector].erase_count : 0;
+    _mutex.unlock();
+    return count;
+}
+
+qspi_ftl_stats_t QSPIFlashFTL::get_stats()
+{
+    _mutex.lock();
+    qspi_ftl_stats_t stats = _stats;
+    _mutex.unlock();
+    return stats;
+}
+
+void QSPIFlashFTL::reset_stats()
+{
+    _mutex.lock();
+    memset(&_stats, 0, sizeof(_stats));
+    _mutex.unlock();
+}
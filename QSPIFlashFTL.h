@@ -0,0 +1,177 @@
+#ifndef QSPI_FLASH_FTL_H
+#define QSPI_FLASH_FTL_H
+
+#include "mbed.h"
+#include "QSPIFlash.h"
+
+// Logical block: the unit the translation layer maps and rewrites
+#define QSPI_FTL_BLOCK_SIZE                 32
+
+// Every sector starts with a summary page (header + one 16-bit logical
+// block number per slot); the remaining pages hold the slots
+#define QSPI_FTL_SLOTS_PER_PAGE             (QSPI_FLASH_PAGE_SIZE / QSPI_FTL_BLOCK_SIZE)
+#define QSPI_FTL_SLOTS_PER_SECTOR           ((QSPI_FLASH_SECTOR_SIZE - QSPI_FLASH_PAGE_SIZE) / QSPI_FTL_BLOCK_SIZE)
+
+// Share of the slots kept free of live data, so that garbage collection
+// finds sectors that are mostly stale
+#ifndef QSPI_FTL_OVERPROVISION_PCT
+#define QSPI_FTL_OVERPROVISION_PCT          20
+#endif
+
+// Free sectors only garbage collection may take
+#ifndef QSPI_FTL_GC_RESERVE
+#define QSPI_FTL_GC_RESERVE                 1
+#endif
+
+// Free sectors background garbage collection works towards
+#ifndef QSPI_FTL_GC_TARGET
+#define QSPI_FTL_GC_TARGET                  3
+#endif
+
+// Erase count spread above which cold data is moved off its sector
+#ifndef QSPI_FTL_WEAR_DELTA
+#define QSPI_FTL_WEAR_DELTA                 8
+#endif
+
+#ifndef QSPI_FTL_GC_STACK_SIZE
+#define QSPI_FTL_GC_STACK_SIZE              1024
+#endif
+
+typedef struct {
+    uint32_t writes;                // write_block calls
+    uint32_t coalesced;             // writes merged into a block not yet programmed
+    uint32_t slots_written;         // slots programmed, relocations included
+    uint32_t flushes;               // page programs of gathered slots
+    uint32_t relocated;             // live slots moved by garbage collection
+    uint32_t gc_erases;             // sectors reclaimed
+    uint32_t wear_moves;            // of those, cold sectors moved for wear leveling
+    uint32_t mount_erases;          // sectors mount found without a header and erased
+} qspi_ftl_stats_t;
+
+/** Log-structured translation layer over a range of sectors
+ *
+ *  Logical blocks of QSPI_FTL_BLOCK_SIZE bytes are never rewritten in
+ *  place: every write goes to the next free slot of the active sector, and
+ *  a RAM map (2 bytes per logical block) points at the newest copy. Writes
+ *  are gathered per page and programmed together with their summary
+ *  entries once the page fills up or on sync; a block written again before
+ *  then is updated in RAM. The map is rebuilt from the summary pages by
+ *  mount, newest sector last, so anything synced survives a reset. A sector
+ *  without a valid header may be one whose erase was cut short, so mount
+ *  erases it again before using it.
+ *
+ *  Garbage collection reclaims the sector with the fewest live slots by
+ *  moving them to the active sector and erasing it. It runs on a background
+ *  thread that keeps QSPI_FTL_GC_TARGET sectors free, and inline when a
+ *  write finds only the reserve left. Free sectors are taken lowest erase
+ *  count first, and when the erase counts drift more than
+ *  QSPI_FTL_WEAR_DELTA apart the background thread also moves the data off
+ *  the least erased sector. Erase counts are kept in the sector headers.
+ *
+ *  Thread safe. The sectors must not be accessed other than through it.
+ */
+class QSPIFlashFTL {
+public:
+    /**
+     *  @param flash            flash object
+     *  @param base_addr        first sector, sector aligned
+     *  @param sectors          number of sectors, more than QSPI_FTL_GC_TARGET + 1
+     *  @param background_gc    collect garbage on a thread of its own
+     */
+    QSPIFlashFTL(QSPIFlash *flash, uint32_t base_addr, unsigned int sectors, bool background_gc = true);
+    ~QSPIFlashFTL();
+
+    /** Erase the sectors and mount the empty layer; erase counts are kept */
+    qspi_status_t format();
+
+    /** Rebuild the map from flash, erasing the sectors without a valid
+     *  header
+     *
+     *  @return QSPI_STATUS_ERROR when the sectors were never formatted (none
+     *          has a valid header and some hold data)
+     */
+    qspi_status_t mount();
+
+    /** Read any range of the logical space; unwritten blocks read as 0xFF */
+    qspi_status_t read(uint32_t addr, void *buffer, size_t size);
+
+    /** Write any range of the logical space; partial blocks are merged
+     *  with their current contents
+     */
+    qspi_status_t write(uint32_t addr, const void *buffer, size_t size);
+
+    /** Program the gathered slots */
+    qspi_status_t sync();
+
+    /** Reclaim one sector now, as the background thread would
+     *
+     *  @return false when no sector has stale slots
+     */
+    bool collect();
+
+    /** Logical space in bytes */
+    uint32_t size() const;
+
+    /** Erases of a sector so far */
+    uint32_t get_erase_count(unsigned int sector);
+
+    qspi_ftl_stats_t get_stats();
+    void reset_stats();
+
+private:
+    typedef enum {
+        SECTOR_FREE,                // erased, header written
+        SECTOR_ACTIVE,              // being filled
+        SECTOR_USED,
+        SECTOR_BLANK,               // no valid header, found by mount
+    } sector_state_t;
+
+    typedef struct {
+        uint32_t erase_count;
+        uint32_t seq;               // order of use, 0xFFFFFFFF while free
+        uint16_t valid;             // live slots
+        uint8_t state;
+    } sector_t;
+
+    uint32_t sector_addr(unsigned int sector) const;
+    uint32_t slot_addr(uint16_t slot) const;
+    bool pending(uint16_t slot) const;
+    qspi_status_t read_block(uint16_t lba, uint8_t *data);
+    qspi_status_t write_block(uint16_t lba, const uint8_t *data);
+    qspi_status_t flush();
+    qspi_status_t open_sector();
+    qspi_status_t reclaim(unsigned int sector);
+    qspi_status_t write_header(unsigned int sector, uint32_t erase_count);
+    int pick_victim(bool wear);
+    bool wear_needed() const;
+    bool collect_one(bool wear);
+    void gc_worker();
+
+    QSPIFlash *_flash;
+    uint32_t _base;
+    unsigned int _sector_count;
+    uint32_t _block_count;
+    uint16_t *_map;                 // logical block -> slot, 0xFFFF unmapped
+    sector_t *_sectors;
+    unsigned int _free_count;
+    uint32_t _next_seq;
+    int _active;                    // -1: none open
+    unsigned int _next_slot;        // in the active sector
+    bool _in_gc;
+    bool _mounted;
+    qspi_ftl_stats_t _stats;
+
+    // Slots of the active sector's current page not programmed yet
+    uint8_t _page[QSPI_FLASH_PAGE_SIZE];
+    uint16_t _page_lba[QSPI_FTL_SLOTS_PER_PAGE];
+    unsigned int _page_count;
+    uint16_t _summary[QSPI_FTL_SLOTS_PER_SECTOR];
+    Mutex _mutex;
+
+    bool _background_gc;
+    bool _gc_stop;
+    Thread *_gc_thread;
+    Semaphore _gc_request;
+};
+
+#endif // QSPI_FLASH_FTL_H
@@ -0,0 +1,123 @@
+#include "QSPIFlashPower.h"
+
+#define POWER_FLAG_ACTIVITY         0x01
+#define POWER_FLAG_STOP             0x02
+
+QSPIFlashPower::QSPIFlashPower(QSPIFlash *flash, size_t bulk_size, uint32_t low_power_idle_ms,
+                               uint32_t deep_down_idle_ms)
+    : _flash(flash), _bulk_size(bulk_size), _low_power_idle_ms(low_power_idle_ms),
+      _deep_down_idle_ms(deep_down_idle_ms), _active(0), _thread(NULL)
+{
+}
+
+QSPIFlashPower::~QSPIFlashPower()
+{
+    if (_thread) {
+        _events.set(POWER_FLAG_STOP);
+        _thread->join();
+        delete _thread;
+    }
+}
+
+qspi_status_t QSPIFlashPower::begin_transfer(size_t size)
+{
+    qspi_status_t result = QSPI_STATUS_OK;
+
+    _mutex.lock();
+    _active++;
+    if (_bulk_size && size >= _bulk_size) {
+        result = _flash->set_power_mode(QSPI_FLASH_POWER_HIGH);
+    }
+    _mutex.unlock();
+    return result;
+}
+
+void QSPIFlashPower::end_transfer()
+{
+    _mutex.lock();
+    _active--;
+    if (_thread == NULL) {
+        _thread = new Thread(osPriorityBelowNormal, QSPI_POWER_STACK_SIZE);
+        if (_thread == NULL || osOK != _thread->start(callback(this, &QSPIFlashPower::idle_worker))) {
+            delete _thread;
+            _thread = NULL;
+        }
+    }
+    _mutex.unlock();
+
+    // Restarts the idle time
+    _events.set(POWER_FLAG_ACTIVITY);
+}
+
+qspi_status_t QSPIFlashPower::read(uint32_t addr, void *buffer, size_t size)
+{
+    qspi_status_t result = begin_transfer(size);
+    if (result == QSPI_STATUS_OK) {
+        result = _flash->read(addr, buffer, size);
+    }
+    end_transfer();
+    return result;
+}
+
+qspi_status_t QSPIFlashPower::program(uint32_t addr, const void *buffer, size_t size)
+{
+    qspi_status_t result = begin_transfer(size);
+    if (result == QSPI_STATUS_OK) {
+        result = _flash->program(addr, buffer, size);
+    }
+    end_transfer();
+    return result;
+}
+
+qspi_status_t QSPIFlashPower::erase_range(uint32_t addr, size_t size)
+{
+    // The array takes as long in either mode, only the current differs
+    begin_transfer(0);
+    qspi_status_t result = _flash->erase_range(addr, size);
+    end_transfer();
+    return result;
+}
+
+// How long to wait for activity before the next idle step, called locked
+uint32_t QSPIFlashPower::idle_timeout()
+{
+    if (_active) {
+        return osWaitForever;
+    }
+    switch (_flash->get_power_mode()) {
+        case QSPI_FLASH_POWER_HIGH:
+            return _low_power_idle_ms ? _low_power_idle_ms : osWaitForever;
+        case QSPI_FLASH_POWER_LOW:
+            return _deep_down_idle_ms ? _deep_down_idle_ms : osWaitForever;
+        default:
+            return osWaitForever;
+    }
+}
+
+void QSPIFlashPower::idle_worker()
+{
+    while (true) {
+        _mutex.lock();
+        uint32_t timeout = idle_timeout();
+        _mutex.unlock();
+
+        uint32_t flags = _events.wait_any(POWER_FLAG_ACTIVITY | POWER_FLAG_STOP, timeout);
+        if (!(flags & osFlagsError)) {
+            if (flags & POWER_FLAG_STOP) {
+                break;
+            }
+            continue;
+        }
+
+        // Idle for the whole timeout: one step down
+        _mutex.lock();
+        if (_active == 0) {
+            if (_flash->get_power_mode() == QSPI_FLASH_POWER_HIGH) {
+                _flash->set_power_mode(QSPI_FLASH_POWER_LOW);
+            } else if (_flash->get_power_mode() == QSPI_FLASH_POWER_LOW) {
+                _flash->set_power_mode(QSPI_FLASH_POWER_DEEP_DOWN);
+            }
+        }
+        _mutex.unlock();
+    }
+}
@@ -0,0 +1,86 @@
+#ifndef QSPI_FLASH_POWER_H
+#define QSPI_FLASH_POWER_H
+
+#include "mbed.h"
+#include "QSPIFlash.h"
+
+// Transfers of at least this many bytes put the part in high performance
+// mode first (0: never). Switching costs a status register write, tW, and
+// at the NRF52840's 32 MHz high performance only saves a few dummy cycles,
+// so it is off by default; worth it where the bus runs faster than the
+// part's low power limit.
+#ifndef QSPI_POWER_BULK_SIZE
+#define QSPI_POWER_BULK_SIZE                0
+#endif
+
+// Idle time after which high performance mode goes back to low power, and
+// idle time in low power after which the part is put in deep power-down
+// (0: never)
+#ifndef QSPI_POWER_LOW_IDLE_MS
+#define QSPI_POWER_LOW_IDLE_MS              20
+#endif
+#ifndef QSPI_POWER_DEEP_DOWN_IDLE_MS
+#define QSPI_POWER_DEEP_DOWN_IDLE_MS        100
+#endif
+
+#ifndef QSPI_POWER_STACK_SIZE
+#define QSPI_POWER_STACK_SIZE               768
+#endif
+
+/** Power mode policy for a QSPIFlash, driven by the transfers made through it
+ *
+ *  A transfer of bulk_size bytes or more switches the part to high
+ *  performance mode before it starts. Once nothing has gone through
+ *  for low_power_idle_ms, a thread created on first use switches it back
+ *  to low power, and after deep_down_idle_ms more puts it in deep
+ *  power-down; the next access through the QSPIFlash releases it, which
+ *  adds tRES1 to that access. Time, switches and wake-ups per mode are in
+ *  QSPIFlash::get_power_stats.
+ *
+ *  Transfers made on the QSPIFlash directly are served as usual but do not
+ *  count as activity; bracket them with begin_transfer / end_transfer.
+ *  Thread safe.
+ */
+class QSPIFlashPower {
+public:
+    /**
+     *  @param flash                flash object
+     *  @param bulk_size            transfers from this size on get high performance, 0: never
+     *  @param low_power_idle_ms    idle time before going back to low power, 0: never
+     *  @param deep_down_idle_ms    idle time in low power before deep power-down, 0: never
+     */
+    QSPIFlashPower(QSPIFlash *flash, size_t bulk_size = QSPI_POWER_BULK_SIZE,
+                   uint32_t low_power_idle_ms = QSPI_POWER_LOW_IDLE_MS,
+                   uint32_t deep_down_idle_ms = QSPI_POWER_DEEP_DOWN_IDLE_MS);
+
+    /** Stops the thread; the part is left in the mode it is in */
+    ~QSPIFlashPower();
+
+    /** Mark the start of a transfer of size bytes; no idle step is taken
+     *  until the matching end_transfer
+     *
+     *  @return the result of the switch to high performance, if one was needed
+     */
+    qspi_status_t begin_transfer(size_t size);
+    void end_transfer();
+
+    /** QSPIFlash::read, program and erase_range as transfers */
+    qspi_status_t read(uint32_t addr, void *buffer, size_t size);
+    qspi_status_t program(uint32_t addr, const void *buffer, size_t size);
+    qspi_status_t erase_range(uint32_t addr, size_t size);
+
+private:
+    uint32_t idle_timeout();
+    void idle_worker();
+
+    QSPIFlash *_flash;
+    size_t _bulk_size;
+    uint32_t _low_power_idle_ms;
+    uint32_t _deep_down_idle_ms;
+    unsigned int _active;           // transfers in progress
+    Mutex _mutex;
+    EventFlags _events;
+    Thread *_thread;
+};
+
+#endif // QSPI_FLASH_POWER_H
@@ -0,0 +1,182 @@
+#include "QSPIFlashPreErase.h"
+
+#define PRE_ERASE_FLAG_ACTIVITY     0x01
+#define PRE_ERASE_FLAG_ERASED       0x02
+#define PRE_ERASE_FLAG_STOP         0x04
+
+QSPIFlashPreErase::QSPIFlashPreErase(QSPIFlash *flash, uint32_t addr, unsigned int sectors, unsigned int depth,
+                                     uint32_t idle_ms)
+    : _flash(flash), _addr(addr - addr % QSPI_FLASH_SECTOR_SIZE), _sectors(sectors),
+      _depth((depth < sectors) ? depth : sectors - 1), _idle_ms(idle_ms), _next(0), _erased(0),
+      _erasing(false), _active(0), _thread(NULL)
+{
+    memset(&_stats, 0, sizeof(_stats));
+
+    // Without the thread every sector is erased on the writer's time
+    _thread = new Thread(osPriorityLow, QSPI_PRE_ERASE_STACK_SIZE);
+    if (_thread == NULL || osOK != _thread->start(callback(this, &QSPIFlashPreErase::erase_worker))) {
+        delete _thread;
+        _thread = NULL;
+    }
+}
+
+QSPIFlashPreErase::~QSPIFlashPreErase()
+{
+    if (_thread) {
+        _events.set(PRE_ERASE_FLAG_STOP);
+        _thread->join();
+        delete _thread;
+    }
+}
+
+uint32_t QSPIFlashPreErase::sector_addr(unsigned int index) const
+{
+    return _addr + (index % _sectors) * QSPI_FLASH_SECTOR_SIZE;
+}
+
+qspi_status_t QSPIFlashPreErase::next_sector(uint32_t *addr)
+{
+    qspi_status_t result = QSPI_STATUS_OK;
+    bool waited = false;
+
+    if (addr == NULL) {
+        return QSPI_STATUS_INVALID_PARAMETER;
+    }
+
+    begin_transfer();
+    _mutex.lock();
+    // The thread is on this very sector: let it finish rather than erase twice
+    while (_erased == 0 && _erasing) {
+        waited = true;
+        _mutex.unlock();
+        _events.wait_any(PRE_ERASE_FLAG_ERASED);
+        _mutex.lock();
+    }
+
+    uint32_t sector = sector_addr(_next);
+    if (_erased) {
+        _erased--;
+        _stats.pre_erased++;
+        if (waited) {
+            _stats.waited++;
+        }
+    } else {
+        // No erase is started while a transfer is in progress, this one included
+        _mutex.unlock();
+        result = _flash->erase_sector(sector);
+        if (result == QSPI_STATUS_OK) {
+            result = _flash->wait_ready();
+        }
+        _mutex.lock();
+        if (result == QSPI_STATUS_OK) {
+            _stats.foreground_erases++;
+        }
+    }
+    if (result == QSPI_STATUS_OK) {
+        _next = (_next + 1) % _sectors;
+        _stats.sectors++;
+        *addr = sector;
+    }
+    _mutex.unlock();
+    end_transfer();
+    return result;
+}
+
+void QSPIFlashPreErase::begin_transfer()
+{
+    _mutex.lock();
+    _active++;
+    _mutex.unlock();
+}
+
+void QSPIFlashPreErase::end_transfer()
+{
+    _mutex.lock();
+    _active--;
+    _mutex.unlock();
+
+    // Restarts the idle time
+    _events.set(PRE_ERASE_FLAG_ACTIVITY);
+}
+
+qspi_status_t QSPIFlashPreErase::program(uint32_t addr, const void *buffer, size_t size)
+{
+    begin_transfer();
+    qspi_status_t result = _flash->program(addr, buffer, size);
+    end_transfer();
+    return result;
+}
+
+qspi_status_t QSPIFlashPreErase::read(uint32_t addr, void *buffer, size_t size)
+{
+    begin_transfer();
+    qspi_status_t result = _flash->read(addr, buffer, size);
+    end_transfer();
+    return result;
+}
+
+unsigned int QSPIFlashPreErase::erased_ahead()
+{
+    _mutex.lock();
+    unsigned int erased = _erased;
+    _mutex.unlock();
+    return erased;
+}
+
+qspi_pre_erase_stats_t QSPIFlashPreErase::get_stats()
+{
+    _mutex.lock();
+    qspi_pre_erase_stats_t stats = _stats;
+    _mutex.unlock();
+    return stats;
+}
+
+void QSPIFlashPreErase::reset_stats()
+{
+    _mutex.lock();
+    memset(&_stats, 0, sizeof(_stats));
+    _mutex.unlock();
+}
+
+void QSPIFlashPreErase::erase_worker()
+{
+    while (true) {
+        _mutex.lock();
+        bool work = (_erased < _depth);
+        _mutex.unlock();
+
+        // With sectors to erase, wait for the foreground to go quiet;
+        // otherwise for the writer to take one
+        uint32_t flags = _events.wait_any(PRE_ERASE_FLAG_ACTIVITY | PRE_ERASE_FLAG_STOP, work ? _idle_ms : osWaitForever);
+        if (!(flags & osFlagsError)) {
+            if (flags & PRE_ERASE_FLAG_STOP) {
+                break;
+            }
+            continue;
+        }
+
+        _mutex.lock();
+        if (_active || _erased >= _depth) {
+            _mutex.unlock();
+            continue;
+        }
+        uint32_t sector = sector_addr(_next + _erased);
+        _erasing = true;
+        _mutex.unlock();
+
+        // Waits without holding the bus: reads suspend the erase meanwhile
+        qspi_status_t result = _flash->erase_sector(sector);
+        if (result == QSPI_STATUS_OK) {
+            result = _flash->wait_ready();
+        }
+
+        _mutex.lock();
+        _erasing = false;
+        if (result == QSPI_STATUS_OK) {
+            _erased++;
+            _stats.background_erases++;
+        }
+        _mutex.unlock();
+        _events.set(PRE_ERASE_FLAG_ERASED);
+    }
+}
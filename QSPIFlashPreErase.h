@@ -0,0 +1,105 @@
+#ifndef QSPI_FLASH_PRE_ERASE_H
+#define QSPI_FLASH_PRE_ERASE_H
+
+#include "mbed.h"
+#include "QSPIFlash.h"
+
+// Sectors kept erased ahead of the writer
+#ifndef QSPI_PRE_ERASE_DEPTH
+#define QSPI_PRE_ERASE_DEPTH                2
+#endif
+
+// Time without foreground activity before the next sector is erased
+#ifndef QSPI_PRE_ERASE_IDLE_MS
+#define QSPI_PRE_ERASE_IDLE_MS              5
+#endif
+
+#ifndef QSPI_PRE_ERASE_STACK_SIZE
+#define QSPI_PRE_ERASE_STACK_SIZE           768
+#endif
+
+/** Pre-erase statistics */
+typedef struct {
+    uint32_t sectors;               // handed to the writer
+    uint32_t pre_erased;            // of those, erased ahead in the background
+    uint32_t waited;                // of those, still being erased when asked for
+    uint32_t foreground_erases;     // erased on the writer's time
+    uint32_t background_erases;
+} qspi_pre_erase_stats_t;
+
+/** Keeps sectors erased ahead of a writer going round a ring of sectors
+ *
+ *  The writer asks for its next sector with next_sector and gets it erased:
+ *  taken from the sectors a low priority thread erased ahead of it, or
+ *  erased on the spot when the thread did not get to it. The thread keeps
+ *  up to depth sectors past the writer's erased, throwing away what they
+ *  held (the oldest data of a log), and starts an erase only once no
+ *  foreground transfer has gone through this object for idle_ms.
+ *
+ *  An erase cannot be taken back once started, but it holds no lock:
+ *  reads through the QSPIFlash suspend it (see QSPIFlash::read), and a
+ *  program waits for the rest of it. Transfers made on the QSPIFlash
+ *  directly are not seen; bracket them with begin_transfer / end_transfer.
+ *
+ *  One writer thread; any number of readers.
+ */
+class QSPIFlashPreErase {
+public:
+    /**
+     *  @param flash    flash object
+     *  @param addr     first sector of the ring, sector aligned
+     *  @param sectors  sectors in the ring, more than depth
+     *  @param depth    sectors to keep erased ahead of the writer
+     *  @param idle_ms  foreground idle time before each background erase
+     */
+    QSPIFlashPreErase(QSPIFlash *flash, uint32_t addr, unsigned int sectors,
+                      unsigned int depth = QSPI_PRE_ERASE_DEPTH, uint32_t idle_ms = QSPI_PRE_ERASE_IDLE_MS);
+
+    /** Stops the thread once any erase it started is done */
+    ~QSPIFlashPreErase();
+
+    /** Get the next sector of the ring, erased; the thread then works on
+     *  the ones after it
+     *
+     *  @param addr     receives the sector's address
+     *  @return QSPI_STATUS_OK once the sector is erased
+     */
+    qspi_status_t next_sector(uint32_t *addr);
+
+    /** Mark the start and end of a foreground transfer; no erase is started
+     *  from the first until idle_ms after the last
+     */
+    void begin_transfer();
+    void end_transfer();
+
+    /** QSPIFlash::program and read as foreground transfers */
+    qspi_status_t program(uint32_t addr, const void *buffer, size_t size);
+    qspi_status_t read(uint32_t addr, void *buffer, size_t size);
+
+    /** Sectors past the writer's that are erased */
+    unsigned int erased_ahead();
+
+    qspi_pre_erase_stats_t get_stats();
+    void reset_stats();
+
+private:
+    uint32_t sector_addr(unsigned int index) const;
+    void start_thread();
+    void erase_worker();
+
+    QSPIFlash *_flash;
+    uint32_t _addr;
+    unsigned int _sectors;
+    unsigned int _depth;
+    uint32_t _idle_ms;
+    unsigned int _next;             // ring index of the writer's next sector
+    unsigned int _erased;           // erased sectors from _next on
+    bool _erasing;                  // the thread is erasing the one after those
+    unsigned int _active;           // foreground transfers in progress
+    qspi_pre_erase_stats_t _stats;
+    Mutex _mutex;
+    EventFlags _events;
+    Thread *_thread;
+};
+
+#endif // QSPI_FLASH_PRE_ERASE_H
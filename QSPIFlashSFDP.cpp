@@ -0,0 +1,351 @@
+#include "QSPIFlashSFDP.h"
+#include "QSPIFlash.h"
+
+// Status register 2 access for the quad enable methods that need it
+#define SFDP_CMD_RDSR2              0x35
+#define SFDP_CMD_WRSR2              0x31
+#define SFDP_CMD_RDSR2_BIT7         0x3F
+#define SFDP_CMD_WRSR2_BIT7         0x3E
+
+// Parameter headers looked at for the basic flash parameter table
+#define SFDP_MAX_HEADERS            8
+
+// Bytes a custom instruction returns
+#define SFDP_READ_CHUNK             8
+
+// Read opcodes the controller issues for plain reads in each mode
+static const uint8_t controller_read_opcodes[QSPI_SFDP_READ_COUNT] = { 0x0B, 0x3B, 0xBB, 0x6B, 0xEB };
+
+static void parse_read(uint32_t bits, qspi_sfdp_read_t *read)
+{
+    read->supported = true;
+    read->opcode = (bits >> 8) & 0xFF;
+    read->mode_cycles = (bits >> 5) & 0x07;
+    read->dummy_cycles = (bits & 0x1F) + read->mode_cycles;
+}
+
+static void parse_erase(uint32_t bits, qspi_sfdp_erase_t *erase)
+{
+    uint8_t size_exp = bits & 0xFF;
+
+    erase->size = (size_exp && size_exp < 32) ? 1UL << size_exp : 0;
+    erase->opcode = (bits >> 8) & 0xFF;
+}
+
+qspi_status_t qspi_flash_sfdp_parse(const uint32_t *dwords, unsigned int count, qspi_flash_sfdp_t *sfdp)
+{
+    if (dwords == NULL || sfdp == NULL || count < QSPI_SFDP_BFPT_MIN_DWORDS) {
+        return QSPI_STATUS_INVALID_PARAMETER;
+    }
+
+    memset(sfdp, 0, sizeof(*sfdp));
+    uint32_t dword1 = dwords[0];
+    uint32_t address_bytes = (dword1 >> 17) & 0x03;
+    sfdp->address_3byte = (address_bytes != 2);
+    sfdp->address_4byte = (address_bytes != 0);
+
+    // Density in bits: N + 1, or 2^N with the top bit set
+    uint32_t density = dwords[1];
+    if (density & 0x80000000) {
+        uint32_t exp = density & 0x7FFFFFFF;
+        sfdp->size = (exp >= 3 && exp < 35) ? (uint32_t)(1ULL << (exp - 3)) : 0;
+    } else {
+        sfdp->size = (density >> 3) + 1;
+    }
+
+    sfdp->reads[QSPI_SFDP_READ_1_1_1].supported = true;
+    sfdp->reads[QSPI_SFDP_READ_1_1_1].opcode = 0x0B;
+    sfdp->reads[QSPI_SFDP_READ_1_1_1].dummy_cycles = 8;
+    if (dword1 & (1UL << 21)) {
+        parse_read(dwords[2], &sfdp->reads[QSPI_SFDP_READ_1_4_4]);
+    }
+    if (dword1 & (1UL << 22)) {
+        parse_read(dwords[2] >> 16, &sfdp->reads[QSPI_SFDP_READ_1_1_4]);
+    }
+    if (dword1 & (1UL << 16)) {
+        parse_read(dwords[3], &sfdp->reads[QSPI_SFDP_READ_1_1_2]);
+    }
+    if (dword1 & (1UL << 20)) {
+        parse_read(dwords[3] >> 16, &sfdp->reads[QSPI_SFDP_READ_1_2_2]);
+    }
+
+    parse_erase(dwords[7], &sfdp->erases[0]);
+    parse_erase(dwords[7] >> 16, &sfdp->erases[1]);
+    parse_erase(dwords[8], &sfdp->erases[2]);
+    parse_erase(dwords[8] >> 16, &sfdp->erases[3]);
+    // A JESD216 table may only list the 4K erase in DWORD1
+    if (sfdp->erases[0].size == 0 && (dword1 & 0x03) == 0x01) {
+        sfdp->erases[0].size = 4096;
+        sfdp->erases[0].opcode = (dword1 >> 8) & 0xFF;
+    }
+
+    sfdp->page_size = (count >= 11) ? 1UL << ((dwords[10] >> 4) & 0x0F) : 256;
+    if (count >= 15) {
+        sfdp->quad_enable = (qspi_sfdp_quad_enable_t)((dwords[14] >> 20) & 0x07);
+        sfdp->continuous_read = (dwords[14] >> 9) & 1;
+    } else {
+        sfdp->quad_enable = QSPI_SFDP_QE_UNKNOWN;
+    }
+    if (count >= 16) {
+        sfdp->enter_4byte = (dwords[15] >> 24) & 0xFF;
+    }
+
+    qspi_flash_sfdp_select(sfdp);
+    return QSPI_STATUS_OK;
+}
+
+void qspi_flash_sfdp_select(qspi_flash_sfdp_t *sfdp)
+{
+    static const struct {
+        qspi_sfdp_read_mode_t mode;
+        qspi_bus_width_t address_width;
+        qspi_bus_width_t data_width;
+    } candidates[] = {
+        { QSPI_SFDP_READ_1_1_1, QSPI_CFG_BUS_SINGLE, QSPI_CFG_BUS_SINGLE },
+        { QSPI_SFDP_READ_1_1_4, QSPI_CFG_BUS_SINGLE, QSPI_CFG_BUS_QUAD   },
+        { QSPI_SFDP_READ_1_4_4, QSPI_CFG_BUS_QUAD,   QSPI_CFG_BUS_QUAD   },
+    };
+    static const unsigned int lines[] = { 1, 2, 4 };
+    uint32_t best_cycles = 0;
+
+    sfdp->address_size = QSPI_CFG_ADDR_SIZE_24;
+    if (sfdp->size > QSPI_FLASH_3BYTE_MAX_SIZE && sfdp->address_4byte &&
+            (sfdp->enter_4byte & (QSPI_SFDP_4BYTE_ENTER_B7 | QSPI_SFDP_4BYTE_ENTER_WREN_B7))) {
+        sfdp->address_size = QSPI_CFG_ADDR_SIZE_32;
+    }
+    unsigned int address_bits = (sfdp->address_size == QSPI_CFG_ADDR_SIZE_32) ? 32 : 24;
+
+    for (unsigned int i = 0; i < sizeof(candidates) / sizeof(candidates[0]); i++) {
+        const qspi_sfdp_read_t *read = &sfdp->reads[candidates[i].mode];
+        bool quad = (candidates[i].data_width == QSPI_CFG_BUS_QUAD);
+        if (!read->supported || read->opcode != controller_read_opcodes[candidates[i].mode] ||
+                (quad && sfdp->quad_enable == QSPI_SFDP_QE_UNKNOWN)) {
+            continue;
+        }
+        // Instruction, address, dummy, one page of data
+        uint32_t cycles = 8 + address_bits / lines[candidates[i].address_width] + read->dummy_cycles +
+                          QSPI_FLASH_PAGE_SIZE * 8 / lines[candidates[i].data_width];
+        if (best_cycles == 0 || cycles < best_cycles) {
+            best_cycles = cycles;
+            sfdp->read_mode = candidates[i].mode;
+            sfdp->address_width = candidates[i].address_width;
+            sfdp->data_width = candidates[i].data_width;
+            sfdp->dummy_cycles = read->dummy_cycles;
+        }
+    }
+}
+
+// As custom instructions: the NRF52840 read instruction field only takes
+// its READOC opcodes. The 3-byte address and the dummy cycles go out as
+// data, and each one returns at most 8 bytes.
+static qspi_status_t read_sfdp(QSPI *qspi, uint32_t addr, void *buffer, size_t size)
+{
+    char *data = (char *)buffer;
+    char tx[3 + QSPI_SFDP_DUMMY_CYCLES / 8];
+
+    memset(tx, 0, sizeof(tx));
+    while (size) {
+        size_t chunk = (size < SFDP_READ_CHUNK) ? size : SFDP_READ_CHUNK;
+        tx[0] = (char)(addr >> 16);
+        tx[1] = (char)(addr >> 8);
+        tx[2] = (char)addr;
+        if (QSPI_STATUS_OK != qspi->command_transfer(QSPI_STD_CMD_RDSFDP, tx, sizeof(tx), data, chunk)) {
+            return QSPI_STATUS_ERROR;
+        }
+        addr += chunk;
+        data += chunk;
+        size -= chunk;
+    }
+    return QSPI_STATUS_OK;
+}
+
+qspi_status_t qspi_flash_sfdp_read(QSPI *qspi, qspi_flash_sfdp_t *sfdp)
+{
+    uint8_t header[8];
+    uint8_t bfpt[QSPI_SFDP_BFPT_MAX_DWORDS * 4];
+    uint32_t dwords[QSPI_SFDP_BFPT_MAX_DWORDS];
+    qspi_status_t result = QSPI_STATUS_ERROR;
+
+    do {
+        if (QSPI_STATUS_OK != read_sfdp(qspi, 0, header, sizeof(header))) {
+            break;
+        }
+        uint32_t signature = header[0] | (header[1] << 8) | (header[2] << 16) | ((uint32_t)header[3] << 24);
+        if (signature != QSPI_SFDP_SIGNATURE || header[5] != 1) {
+            break;
+        }
+
+        // The first parameter header is the basic flash parameter table's,
+        // a later one of the same ID may be a newer revision of it
+        unsigned int headers = header[6] + 1;
+        uint32_t table_addr = 0;
+        unsigned int table_dwords = 0;
+        for (unsigned int i = 0; i < headers && i < SFDP_MAX_HEADERS; i++) {
+            if (QSPI_STATUS_OK != read_sfdp(qspi, 8 + i * 8, header, sizeof(header))) {
+                table_dwords = 0;
+                break;
+            }
+            if (header[0] != 0x00 || header[7] != 0xFF || header[2] != 1 || header[3] < QSPI_SFDP_BFPT_MIN_DWORDS) {
+                continue;
+            }
+            if (table_dwords == 0 || header[1] > sfdp->minor) {
+                table_addr = header[4] | (header[5] << 8) | (header[6] << 16);
+                table_dwords = (header[3] < QSPI_SFDP_BFPT_MAX_DWORDS) ? header[3] : QSPI_SFDP_BFPT_MAX_DWORDS;
+                sfdp->major = header[2];
+                sfdp->minor = header[1];
+            }
+        }
+        if (table_dwords == 0 || QSPI_STATUS_OK != read_sfdp(qspi, table_addr, bfpt, table_dwords * 4)) {
+            break;
+        }
+
+        for (unsigned int i = 0; i < table_dwords; i++) {
+            dwords[i] = bfpt[i * 4] | (bfpt[i * 4 + 1] << 8) | (bfpt[i * 4 + 2] << 16) | ((uint32_t)bfpt[i * 4 + 3] << 24);
+        }
+        uint8_t major = sfdp->major;
+        uint8_t minor = sfdp->minor;
+        result = qspi_flash_sfdp_parse(dwords, table_dwords, sfdp);
+        sfdp->major = major;
+        sfdp->minor = minor;
+    } while (false);
+
+    qspi->configure_format(QSPI_CFG_BUS_SINGLE, QSPI_CFG_BUS_SINGLE, QSPI_CFG_ADDR_SIZE_24, QSPI_CFG_BUS_SINGLE,
+                           QSPI_CFG_ALT_SIZE_NONE, QSPI_CFG_BUS_SINGLE, 0, 0);
+    return (result == QSPI_STATUS_OK) ? QSPI_STATUS_OK : QSPI_STATUS_ERROR;
+}
+
+static qspi_status_t wait_write_status(QSPI *qspi)
+{
+    char status = QSPI_FLASH_SR_WIP;
+
+    for (uint32_t waited_us = 0; waited_us <= QSPI_FLASH_TW_MAX_US; waited_us += QSPI_FLASH_POLL_MIN_US * 10) {
+        if (QSPI_STATUS_OK != qspi->command_transfer(QSPI_STD_CMD_RDSR, NULL, 0, &status, 1)) {
+            return QSPI_STATUS_ERROR;
+        }
+        if (!(status & QSPI_FLASH_SR_WIP)) {
+            return QSPI_STATUS_OK;
+        }
+        wait_us(QSPI_FLASH_POLL_MIN_US * 10);
+    }
+    return QSPI_STATUS_ERROR;
+}
+
+// WREN, then the status write
+static qspi_status_t write_status(QSPI *qspi, unsigned int instruction, const char *data, size_t size)
+{
+    if (QSPI_STATUS_OK != qspi->command_transfer(QSPI_STD_CMD_WREN, NULL, 0, NULL, 0) ||
+            QSPI_STATUS_OK != qspi->command_transfer(instruction, data, size, NULL, 0)) {
+        return QSPI_STATUS_ERROR;
+    }
+    return wait_write_status(qspi);
+}
+
+qspi_status_t qspi_flash_sfdp_enable_quad(QSPI *qspi, const qspi_flash_sfdp_t *sfdp)
+{
+    char status[2] = { 0, 0 };
+    qspi_status_t result = QSPI_STATUS_OK;
+
+    if (sfdp->data_width != QSPI_CFG_BUS_QUAD && sfdp->address_width != QSPI_CFG_BUS_QUAD) {
+        return QSPI_STATUS_OK;
+    }
+
+    switch (sfdp->quad_enable) {
+        case QSPI_SFDP_QE_NONE:
+            break;
+
+        case QSPI_SFDP_QE_SR1_BIT6:
+            result = qspi->command_transfer(QSPI_STD_CMD_RDSR, NULL, 0, status, 1);
+            if (result == QSPI_STATUS_OK && !(status[0] & QSPI_FLASH_SR_QE)) {
+                status[0] |= QSPI_FLASH_SR_QE;
+                result = write_status(qspi, QSPI_STD_CMD_WRSR, status, 1);
+            }
+            break;
+
+        case QSPI_SFDP_QE_SR2_BIT1:
+        case QSPI_SFDP_QE_SR2_BIT1_WRSR2:
+            // No way to read status register 2: write it with QE alone
+            result = qspi->command_transfer(QSPI_STD_CMD_RDSR, NULL, 0, status, 1);
+            if (result == QSPI_STATUS_OK) {
+                status[1] = 0x02;
+                result = write_status(qspi, QSPI_STD_CMD_WRSR, status, 2);
+            }
+            break;
+
+        case QSPI_SFDP_QE_SR2_BIT1_RDSR2:
+            if (QSPI_STATUS_OK != qspi->command_transfer(QSPI_STD_CMD_RDSR, NULL, 0, &status[0], 1) ||
+                    QSPI_STATUS_OK != qspi->command_transfer(SFDP_CMD_RDSR2, NULL, 0, &status[1], 1)) {
+                result = QSPI_STATUS_ERROR;
+            } else if (!(status[1] & 0x02)) {
+                status[1] |= 0x02;
+                result = write_status(qspi, QSPI_STD_CMD_WRSR, status, 2);
+            }
+            break;
+
+        case QSPI_SFDP_QE_SR2_BIT1_WRSR2_31:
+            result = qspi->command_transfer(SFDP_CMD_RDSR2, NULL, 0, &status[1], 1);
+            if (result == QSPI_STATUS_OK && !(status[1] & 0x02)) {
+                status[1] |= 0x02;
+                result = write_status(qspi, SFDP_CMD_WRSR2, &status[1], 1);
+            }
+            break;
+
+        case QSPI_SFDP_QE_SR2_BIT7:
+            result = qspi->command_transfer(SFDP_CMD_RDSR2_BIT7, NULL, 0, &status[1], 1);
+            if (result == QSPI_STATUS_OK && !(status[1] & 0x80)) {
+                status[1] |= 0x80;
+                result = write_status(qspi, SFDP_CMD_WRSR2_BIT7, &status[1], 1);
+            }
+            break;
+
+        default:
+            result = QSPI_STATUS_INVALID_PARAMETER;
+            break;
+    }
+    return result;
+}
+
+qspi_status_t qspi_flash_sfdp_enter_4byte(QSPIFlash *flash, const qspi_flash_sfdp_t *sfdp)
+{
+    if (sfdp->address_size != QSPI_CFG_ADDR_SIZE_32) {
+        return QSPI_STATUS_OK;
+    }
+    // EN4B alone where the part takes it, as WREN would leave WEL set
+    return flash->set_address_size(QSPI_CFG_ADDR_SIZE_32, !(sfdp->enter_4byte & QSPI_SFDP_4BYTE_ENTER_B7));
+}
+
+qspi_status_t qspi_flash_sfdp_configure(QSPI *qspi, const qspi_flash_sfdp_t *sfdp)
+{
+    return qspi->configure_format(QSPI_CFG_BUS_SINGLE, sfdp->address_width, sfdp->address_size, QSPI_CFG_BUS_SINGLE,
+                                  QSPI_CFG_ALT_SIZE_NONE, sfdp->data_width, sfdp->dummy_cycles, 0);
+}
+
+uint8_t qspi_flash_sfdp_erase_types(const qspi_flash_sfdp_t *sfdp)
+{
+    static const struct {
+        uint32_t size;
+        uint8_t opcode;
+        uint8_t type;
+    } erase_types[] = {
+        { QSPI_FLASH_SECTOR_SIZE,   QSPI_STD_CMD_SECT_ERASE,    QSPI_FLASH_ERASE_SECTOR  },
+        { QSPI_FLASH_BLOCK32_SIZE,  QSPI_STD_CMD_BLOCK32_ERASE, QSPI_FLASH_ERASE_BLOCK32 },
+        { QSPI_FLASH_BLOCK64_SIZE,  QSPI_STD_CMD_BLOCK64_ERASE, QSPI_FLASH_ERASE_BLOCK64 },
+    };
+    uint8_t types = (sfdp->size == QSPI_FLASH_SIZE && qspi_flash_sfdp_usable_size(sfdp) == sfdp->size) ? QSPI_FLASH_ERASE_CHIP : 0;
+
+    for (unsigned int i = 0; i < sizeof(erase_types) / sizeof(erase_types[0]); i++) {
+        for (unsigned int e = 0; e < sizeof(sfdp->erases) / sizeof(sfdp->erases[0]); e++) {
+            if (sfdp->erases[e].size == erase_types[i].size && sfdp->erases[e].opcode == erase_types[i].opcode) {
+                types |= erase_types[i].type;
+            }
+        }
+    }
+    return types;
+}
+
+uint32_t qspi_flash_sfdp_usable_size(const qspi_flash_sfdp_t *sfdp)
+{
+    if (sfdp->address_size == QSPI_CFG_ADDR_SIZE_32 || sfdp->size < QSPI_FLASH_3BYTE_MAX_SIZE) {
+        return sfdp->size;
+    }
+    return QSPI_FLASH_3BYTE_MAX_SIZE;
+}
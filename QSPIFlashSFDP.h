@@ -0,0 +1,135 @@
+#ifndef QSPI_FLASH_SFDP_H
+#define QSPI_FLASH_SFDP_H
+
+#include "mbed.h"
+#include "QSPI.h"
+#include "QSPIFlash.h"
+
+// Read SFDP: 3-byte address, 8 dummy cycles, 1-1-1
+#define QSPI_STD_CMD_RDSFDP                 0x5A
+#define QSPI_SFDP_DUMMY_CYCLES              8
+#define QSPI_SFDP_SIGNATURE                 0x50444653      // "SFDP"
+
+// Basic flash parameter table: 9 DWORDs in JESD216, 16 from JESD216B on
+#define QSPI_SFDP_BFPT_MIN_DWORDS           9
+#define QSPI_SFDP_BFPT_MAX_DWORDS           16
+
+// Ways to enter 4-byte address mode (BFPT DWORD16) QSPIFlash::set_address_size has
+#define QSPI_SFDP_4BYTE_ENTER_B7            0x01            // EN4B
+#define QSPI_SFDP_4BYTE_ENTER_WREN_B7       0x02            // WREN, then EN4B
+
+/** Read modes of the basic flash parameter table, as instruction-address-data lines */
+typedef enum {
+    QSPI_SFDP_READ_1_1_1,           // fast read 0x0B, always there
+    QSPI_SFDP_READ_1_1_2,
+    QSPI_SFDP_READ_1_2_2,
+    QSPI_SFDP_READ_1_1_4,
+    QSPI_SFDP_READ_1_4_4,
+    QSPI_SFDP_READ_COUNT
+} qspi_sfdp_read_mode_t;
+
+/** How the part's quad enable bit is set (BFPT DWORD15 QER) */
+typedef enum {
+    QSPI_SFDP_QE_NONE,              // no QE bit to set
+    QSPI_SFDP_QE_SR2_BIT1,          // bit 1 of status register 2, WRSR with 2 bytes
+    QSPI_SFDP_QE_SR1_BIT6,          // bit 6 of status register 1, WRSR with 1 byte
+    QSPI_SFDP_QE_SR2_BIT7,          // bit 7 of status register 2, read 0x3F, write 0x3E
+    QSPI_SFDP_QE_SR2_BIT1_WRSR2,    // as SR2_BIT1, a 1-byte WRSR does not clear it
+    QSPI_SFDP_QE_SR2_BIT1_RDSR2,    // as SR2_BIT1_WRSR2, status register 2 read with 0x35
+    QSPI_SFDP_QE_SR2_BIT1_WRSR2_31, // as SR2_BIT1_RDSR2, written with 0x31
+    QSPI_SFDP_QE_UNKNOWN = 0xFF,    // table older than JESD216A
+} qspi_sfdp_quad_enable_t;
+
+typedef struct {
+    bool supported;
+    uint8_t opcode;
+    uint8_t dummy_cycles;           // wait states plus mode clocks
+    uint8_t mode_cycles;
+} qspi_sfdp_read_t;
+
+typedef struct {
+    uint32_t size;                  // 0: not supported
+    uint8_t opcode;
+} qspi_sfdp_erase_t;
+
+/** What the basic flash parameter table says about the part, and the bus
+ *  format chosen from it
+ */
+typedef struct {
+    uint8_t major;                  // BFPT revision
+    uint8_t minor;
+    uint32_t size;                  // bytes
+    uint32_t page_size;             // 256 before JESD216A
+    bool address_3byte;             // 3-byte addressing available
+    bool address_4byte;             // 4-byte addressing available
+    uint8_t enter_4byte;            // QSPI_SFDP_4BYTE_ENTER_* and other methods, 0 before JESD216B
+    qspi_sfdp_read_t reads[QSPI_SFDP_READ_COUNT];
+    qspi_sfdp_erase_t erases[4];
+    qspi_sfdp_quad_enable_t quad_enable;
+    bool continuous_read;           // 0-4-4 mode (reads without the instruction)
+
+    // Fastest read mode the bus format can use; see qspi_flash_sfdp_select
+    qspi_sfdp_read_mode_t read_mode;
+    qspi_bus_width_t address_width;
+    qspi_bus_width_t data_width;
+    int dummy_cycles;
+    qspi_address_size_t address_size;   // 32 for a part above 16 MB that EN4B switches over
+} qspi_flash_sfdp_t;
+
+/** Decode a basic flash parameter table
+ *
+ *  @param dwords   the table, DWORD1 first
+ *  @param count    DWORDs in it, at least QSPI_SFDP_BFPT_MIN_DWORDS
+ *  @param sfdp     receives the parameters and, from qspi_flash_sfdp_select,
+ *                  the bus format
+ *  @return QSPI_STATUS_INVALID_PARAMETER for a short table
+ */
+qspi_status_t qspi_flash_sfdp_parse(const uint32_t *dwords, unsigned int count, qspi_flash_sfdp_t *sfdp);
+
+/** Choose the bus format with the fewest clocks for a page read
+ *
+ *  Only formats QSPIFlash can also program in are candidates: 1_4_4, 1_1_4
+ *  and 1_1_1. The table lists no page program modes, so a quad format is
+ *  taken to program with the matching 4-line opcode (0x38 or 0x32), and is
+ *  only chosen when the way to enable quad is known. Dual formats are left
+ *  out, as the NRF52840 would program them with 0xA2, which parts like the
+ *  MX25R6435F do not have. The controller picks the read opcode from the
+ *  bus widths, so a mode whose table opcode differs is passed over too.
+ *
+ *  Parts above QSPI_FLASH_3BYTE_MAX_SIZE get 4-byte addresses when EN4B
+ *  switches them over (QSPI_SFDP_4BYTE_ENTER_B7 or _WREN_B7); the first
+ *  16 MB are all that can be used of the others.
+ */
+void qspi_flash_sfdp_select(qspi_flash_sfdp_t *sfdp);
+
+/** Read and decode the part's SFDP and select its fastest bus format
+ *
+ *  Leaves the QSPI object configured for 1_1_1 with no dummy cycles.
+ *
+ *  @return QSPI_STATUS_ERROR when the part has no valid SFDP
+ */
+qspi_status_t qspi_flash_sfdp_read(QSPI *qspi, qspi_flash_sfdp_t *sfdp);
+
+/** Set the quad enable bit the way the table says, if the selected format
+ *  needs it and it is not set already; waits for the status register write
+ */
+qspi_status_t qspi_flash_sfdp_enable_quad(QSPI *qspi, const qspi_flash_sfdp_t *sfdp);
+
+/** Switch the part to 4-byte addresses the way the table says, if the
+ *  selected format uses them; QSPI_STATUS_OK with nothing to do otherwise
+ */
+qspi_status_t qspi_flash_sfdp_enter_4byte(QSPIFlash *flash, const qspi_flash_sfdp_t *sfdp);
+
+/** configure_format with the selected format, dummy cycles and address size */
+qspi_status_t qspi_flash_sfdp_configure(QSPI *qspi, const qspi_flash_sfdp_t *sfdp);
+
+/** QSPI_FLASH_ERASE_* erase commands of QSPIFlash the part has, for
+ *  QSPIFlash::set_geometry; the chip erase only for a part of
+ *  QSPI_FLASH_SIZE that can be addressed in full
+ */
+uint8_t qspi_flash_sfdp_erase_types(const qspi_flash_sfdp_t *sfdp);
+
+/** Bytes of the part QSPIFlash can reach with the selected address size */
+uint32_t qspi_flash_sfdp_usable_size(const qspi_flash_sfdp_t *sfdp);
+
+#endif // QSPI_FLASH_SFDP_H
@@ -0,0 +1,336 @@
+#include "QSPIFlashSectorMap.h"
+#include "QSPIBufferPool.h"
+
+// Area header, little-endian words; the bitmap follows it and the journal
+// the bitmap, on an entry boundary
+#define SECTOR_MAP_MAGIC            0x504D5351      // "QSMP"
+#define SECTOR_MAP_HEADER_SIZE      32
+#define SECTOR_MAP_HEADER_MAGIC     0
+#define SECTOR_MAP_HEADER_SEQ       4
+#define SECTOR_MAP_HEADER_SEQ_INV   8
+#define SECTOR_MAP_HEADER_ADDR      12
+#define SECTOR_MAP_HEADER_SECTORS   16
+#define SECTOR_MAP_HEADER_WORDS     5
+
+// Journal entry: sector | state << 24, then its complement
+#define SECTOR_MAP_ENTRY_SIZE       8
+#define SECTOR_MAP_MAX_SECTORS      0xFFFFFF
+#define SECTOR_MAP_BLANK            0xFFFFFFFF
+
+// Entries read at a time by mount
+#define SECTOR_MAP_READ_ENTRIES     32
+
+QSPIFlashSectorMap::QSPIFlashSectorMap(QSPIFlash *flash, uint32_t addr, unsigned int sectors, uint32_t map_addr,
+                                       unsigned int journal_entries)
+    : _flash(flash), _addr(addr), _sectors(sectors), _map_addr(map_addr), _entries(journal_entries),
+      _bitmap_size(0), _journal_offset(0), _area_size(0), _bitmap(NULL), _area(0), _seq(0), _next(0),
+      _mounted(false)
+{
+    if (_sectors > SECTOR_MAP_MAX_SECTORS) {
+        _sectors = SECTOR_MAP_MAX_SECTORS;
+    }
+    _bitmap_size = (_sectors + 3) / 4;
+    _journal_offset = SECTOR_MAP_HEADER_SIZE +
+                      (_bitmap_size + SECTOR_MAP_ENTRY_SIZE - 1) / SECTOR_MAP_ENTRY_SIZE * SECTOR_MAP_ENTRY_SIZE;
+    _area_size = map_size(_sectors, _entries) / 2;
+
+    // Every sector unknown until mounted
+    _bitmap = new uint8_t[_bitmap_size ? _bitmap_size : 1];
+    memset(_bitmap, 0xFF, _bitmap_size);
+    memset(&_stats, 0, sizeof(_stats));
+}
+
+QSPIFlashSectorMap::~QSPIFlashSectorMap()
+{
+    delete[] _bitmap;
+}
+
+uint32_t QSPIFlashSectorMap::map_size(unsigned int sectors, unsigned int journal_entries)
+{
+    uint32_t bitmap_size = (sectors + 3) / 4;
+    uint32_t size = SECTOR_MAP_HEADER_SIZE +
+                    (bitmap_size + SECTOR_MAP_ENTRY_SIZE - 1) / SECTOR_MAP_ENTRY_SIZE * SECTOR_MAP_ENTRY_SIZE +
+                    journal_entries * SECTOR_MAP_ENTRY_SIZE;
+    return 2 * ((size + QSPI_FLASH_SECTOR_SIZE - 1) / QSPI_FLASH_SECTOR_SIZE * QSPI_FLASH_SECTOR_SIZE);
+}
+
+uint32_t QSPIFlashSectorMap::area_addr(unsigned int area) const
+{
+    return _map_addr + area * _area_size;
+}
+
+uint32_t QSPIFlashSectorMap::entry_addr(unsigned int entry) const
+{
+    return area_addr(_area) + _journal_offset + entry * SECTOR_MAP_ENTRY_SIZE;
+}
+
+qspi_sector_state_t QSPIFlashSectorMap::state(unsigned int sector) const
+{
+    return (qspi_sector_state_t)((_bitmap[sector / 4] >> ((sector % 4) * 2)) & 0x03);
+}
+
+void QSPIFlashSectorMap::set_state(unsigned int sector, qspi_sector_state_t state)
+{
+    unsigned int shift = (sector % 4) * 2;
+    _bitmap[sector / 4] = (uint8_t)((_bitmap[sector / 4] & ~(0x03 << shift)) | (state << shift));
+}
+
+bool QSPIFlashSectorMap::in_range(uint32_t addr, size_t size) const
+{
+    return addr >= _addr && addr - _addr < _sectors * QSPI_FLASH_SECTOR_SIZE &&
+           size <= _sectors * QSPI_FLASH_SECTOR_SIZE - (addr - _addr);
+}
+
+// A header programmed in part leaves a field that does not match; called locked
+bool QSPIFlashSectorMap::read_header(unsigned int area, uint32_t *seq)
+{
+    uint32_t header[SECTOR_MAP_HEADER_WORDS];
+
+    if (QSPI_STATUS_OK != _flash->read(area_addr(area), header, sizeof(header))) {
+        return false;
+    }
+    *seq = header[SECTOR_MAP_HEADER_SEQ / 4];
+    return header[SECTOR_MAP_HEADER_MAGIC / 4] == SECTOR_MAP_MAGIC &&
+           header[SECTOR_MAP_HEADER_SEQ_INV / 4] == ~*seq &&
+           header[SECTOR_MAP_HEADER_ADDR / 4] == _addr &&
+           header[SECTOR_MAP_HEADER_SECTORS / 4] == _sectors;
+}
+
+// Write the RAM bitmap to the area not holding the map, header last; called locked
+qspi_status_t QSPIFlashSectorMap::write_map()
+{
+    unsigned int area = _area ^ 1;
+    uint32_t seq = _seq + 1;
+    uint32_t header[SECTOR_MAP_HEADER_WORDS] = { SECTOR_MAP_MAGIC, seq, ~seq, _addr, _sectors };
+
+    qspi_status_t result = _flash->erase_range(area_addr(area), _area_size);
+    if (result == QSPI_STATUS_OK) {
+        result = _flash->program(area_addr(area) + SECTOR_MAP_HEADER_SIZE, _bitmap, _bitmap_size);
+    }
+    // Until the header is complete the other area holds the map
+    if (result == QSPI_STATUS_OK) {
+        result = _flash->program(area_addr(area), header, sizeof(header));
+    }
+    if (result == QSPI_STATUS_OK) {
+        _area = area;
+        _seq = seq;
+        _next = 0;
+        _stats.compactions++;
+    }
+    return result;
+}
+
+// Change a sector's state in RAM and on flash; called locked
+qspi_status_t QSPIFlashSectorMap::record(unsigned int sector, qspi_sector_state_t state)
+{
+    if (this->state(sector) == state) {
+        return QSPI_STATUS_OK;
+    }
+    set_state(sector, state);
+    if (_next >= _entries) {
+        return write_map();
+    }
+
+    uint32_t entry[2] = { sector | ((uint32_t)state << 24), 0 };
+    entry[1] = ~entry[0];
+    qspi_status_t result = _flash->program(entry_addr(_next), entry, sizeof(entry));
+    // An entry programmed even in part is not programmed over
+    _next++;
+    _stats.journal_entries++;
+    return result;
+}
+
+qspi_status_t QSPIFlashSectorMap::mount()
+{
+    uint32_t entries[2 * SECTOR_MAP_READ_ENTRIES];
+    uint32_t seq[2];
+    bool valid[2];
+    qspi_status_t result;
+
+    _mutex.lock();
+    _mounted = false;
+    valid[0] = read_header(0, &seq[0]);
+    valid[1] = read_header(1, &seq[1]);
+    if (!valid[0] && !valid[1]) {
+        _mutex.unlock();
+        return QSPI_STATUS_ERROR;
+    }
+    _area = (valid[1] && (!valid[0] || seq[1] > seq[0])) ? 1 : 0;
+    _seq = seq[_area];
+    result = _flash->read(area_addr(_area) + SECTOR_MAP_HEADER_SIZE, _bitmap, _bitmap_size);
+
+    // Replay the journal up to its first blank entry
+    _next = 0;
+    bool end = false;
+    for (unsigned int first = 0; first < _entries && !end && result == QSPI_STATUS_OK;
+            first += SECTOR_MAP_READ_ENTRIES) {
+        unsigned int count = (_entries - first < SECTOR_MAP_READ_ENTRIES) ? _entries - first : SECTOR_MAP_READ_ENTRIES;
+        result = _flash->read(entry_addr(first), entries, count * SECTOR_MAP_ENTRY_SIZE);
+        for (unsigned int i = 0; i < count && result == QSPI_STATUS_OK; i++) {
+            uint32_t value = entries[2 * i];
+            uint32_t check = entries[2 * i + 1];
+            if (value == SECTOR_MAP_BLANK && check == SECTOR_MAP_BLANK) {
+                end = true;
+                break;
+            }
+            _next = first + i + 1;
+            unsigned int sector = value & SECTOR_MAP_MAX_SECTORS;
+            unsigned int state = value >> 24;
+            if (check != ~value || sector >= _sectors || state >= QSPI_SECTOR_UNKNOWN) {
+                _stats.torn_entries++;
+                continue;
+            }
+            set_state(sector, (qspi_sector_state_t)state);
+            _stats.replayed++;
+        }
+    }
+    _mounted = (result == QSPI_STATUS_OK);
+    _mutex.unlock();
+    return result;
+}
+
+qspi_status_t QSPIFlashSectorMap::rebuild()
+{
+    QSPIBuffer buffer;
+    char page[QSPI_FLASH_PAGE_SIZE];
+    char *data = page;
+    size_t chunk = sizeof(page);
+    qspi_status_t result = QSPI_STATUS_OK;
+    uint32_t seq[2];
+
+    // A sector per read when the pool has a buffer that big
+    if (buffer.size() >= QSPI_FLASH_SECTOR_SIZE) {
+        data = buffer.data();
+        chunk = QSPI_FLASH_SECTOR_SIZE;
+    }
+
+    _mutex.lock();
+    _mounted = false;
+    for (unsigned int s = 0; s < _sectors && result == QSPI_STATUS_OK; s++) {
+        qspi_sector_state_t found = QSPI_SECTOR_ERASED;
+        uint32_t addr = _addr + s * QSPI_FLASH_SECTOR_SIZE;
+        for (uint32_t offset = 0; offset < QSPI_FLASH_SECTOR_SIZE && found == QSPI_SECTOR_ERASED &&
+                result == QSPI_STATUS_OK; offset += chunk) {
+            result = _flash->read(addr + offset, data, chunk);
+            for (size_t i = 0; i < chunk; i++) {
+                if (data[i] != (char)0xFF) {
+                    found = QSPI_SECTOR_IN_USE;
+                    break;
+                }
+            }
+        }
+        set_state(s, found);
+        _stats.sectors_scanned++;
+    }
+
+    // Past any map already there, so that mount takes this one
+    if (result == QSPI_STATUS_OK) {
+        bool valid[2] = { read_header(0, &seq[0]), read_header(1, &seq[1]) };
+        _area = (valid[1] && (!valid[0] || seq[1] > seq[0])) ? 1 : valid[0] ? 0 : 1;
+        _seq = valid[_area] ? seq[_area] : 0;
+        result = write_map();
+    }
+    _mounted = (result == QSPI_STATUS_OK);
+    _mutex.unlock();
+    return result;
+}
+
+qspi_status_t QSPIFlashSectorMap::compact()
+{
+    _mutex.lock();
+    qspi_status_t result = _mounted ? write_map() : QSPI_STATUS_ERROR;
+    _mutex.unlock();
+    return result;
+}
+
+qspi_status_t QSPIFlashSectorMap::program(uint32_t addr, const void *buffer, size_t size)
+{
+    if (buffer == NULL || size == 0 || !in_range(addr, size)) {
+        return QSPI_STATUS_INVALID_PARAMETER;
+    }
+
+    _mutex.lock();
+    qspi_status_t result = _mounted ? QSPI_STATUS_OK : QSPI_STATUS_ERROR;
+    unsigned int last = (addr + size - 1 - _addr) / QSPI_FLASH_SECTOR_SIZE;
+    for (unsigned int s = (addr - _addr) / QSPI_FLASH_SECTOR_SIZE; s <= last && result == QSPI_STATUS_OK; s++) {
+        result = record(s, QSPI_SECTOR_IN_USE);
+    }
+    if (result == QSPI_STATUS_OK) {
+        result = _flash->program(addr, buffer, size);
+    }
+    _mutex.unlock();
+    return result;
+}
+
+qspi_status_t QSPIFlashSectorMap::erase_range(uint32_t addr, size_t size)
+{
+    if (size == 0 || !in_range(addr, size) || addr % QSPI_FLASH_SECTOR_SIZE || size % QSPI_FLASH_SECTOR_SIZE) {
+        return QSPI_STATUS_INVALID_PARAMETER;
+    }
+
+    _mutex.lock();
+    qspi_status_t result = _mounted ? _flash->erase_range(addr, size) : QSPI_STATUS_ERROR;
+    for (uint32_t offset = 0; offset < size && result == QSPI_STATUS_OK; offset += QSPI_FLASH_SECTOR_SIZE) {
+        result = record((addr + offset - _addr) / QSPI_FLASH_SECTOR_SIZE, QSPI_SECTOR_ERASED);
+    }
+    _mutex.unlock();
+    return result;
+}
+
+qspi_status_t QSPIFlashSectorMap::mark_dirty(uint32_t addr, size_t size)
+{
+    if (size == 0 || !in_range(addr, size)) {
+        return QSPI_STATUS_INVALID_PARAMETER;
+    }
+
+    _mutex.lock();
+    qspi_status_t result = _mounted ? QSPI_STATUS_OK : QSPI_STATUS_ERROR;
+    unsigned int last = (addr + size - 1 - _addr) / QSPI_FLASH_SECTOR_SIZE;
+    for (unsigned int s = (addr - _addr) / QSPI_FLASH_SECTOR_SIZE; s <= last && result == QSPI_STATUS_OK; s++) {
+        if (state(s) == QSPI_SECTOR_IN_USE) {
+            result = record(s, QSPI_SECTOR_DIRTY);
+        }
+    }
+    _mutex.unlock();
+    return result;
+}
+
+qspi_sector_state_t QSPIFlashSectorMap::get_state(uint32_t addr)
+{
+    if (!in_range(addr, 1)) {
+        return QSPI_SECTOR_UNKNOWN;
+    }
+    _mutex.lock();
+    qspi_sector_state_t sector_state = state((addr - _addr) / QSPI_FLASH_SECTOR_SIZE);
+    _mutex.unlock();
+    return sector_state;
+}
+
+unsigned int QSPIFlashSectorMap::count(qspi_sector_state_t sector_state)
+{
+    unsigned int sectors = 0;
+
+    _mutex.lock();
+    for (unsigned int s = 0; s < _sectors; s++) {
+        if (state(s) == sector_state) {
+            sectors++;
+        }
+    }
+    _mutex.unlock();
+    return sectors;
+}
+
+qspi_sector_map_stats_t QSPIFlashSectorMap::get_stats()
+{
+    _mutex.lock();
+    qspi_sector_map_stats_t stats = _stats;
+    _mutex.unlock();
+    return stats;
+}
+
+void QSPIFlashSectorMap::reset_stats()
+{
+    _mutex.lock();
+    memset(&_stats, 0, sizeof(_stats));
+    _mutex.unlock();
+}
@@ -0,0 +1,121 @@
+#ifndef QSPI_FLASH_SECTOR_MAP_H
+#define QSPI_FLASH_SECTOR_MAP_H
+
+#include "mbed.h"
+#include "QSPIFlash.h"
+
+// State changes the journal takes before the map is written afresh
+#ifndef QSPI_SECTOR_MAP_JOURNAL_ENTRIES
+#define QSPI_SECTOR_MAP_JOURNAL_ENTRIES     512
+#endif
+
+typedef enum {
+    QSPI_SECTOR_ERASED = 0,         // blank, ready to program
+    QSPI_SECTOR_IN_USE,             // may hold data
+    QSPI_SECTOR_DIRTY,              // holds data nobody needs, to be erased
+    QSPI_SECTOR_UNKNOWN,            // outside the map
+} qspi_sector_state_t;
+
+typedef struct {
+    uint32_t journal_entries;       // state changes appended
+    uint32_t compactions;           // maps written afresh
+    uint32_t replayed;              // entries applied by mount
+    uint32_t torn_entries;          // entries found half programmed by mount
+    uint32_t sectors_scanned;       // blank checked by rebuild
+} qspi_sector_map_stats_t;
+
+/** Persistent map of which sectors of a range are erased, in use or dirty
+ *
+ *  The states are kept in RAM, 2 bits per sector, and on flash as that
+ *  bitmap followed by a journal of the changes made since, in one of two
+ *  areas at map_addr. mount reads the bitmap and replays the journal, so
+ *  the time it takes grows with the map rather than with the range; rebuild
+ *  works the states out by blank checking every sector, for a map that was
+ *  never written. When the journal is full the map is written afresh to the
+ *  other area, whose header goes last, so that the area with the newest
+ *  complete header always holds the map.
+ *
+ *  A journal entry is a word and its complement, which a program cut short
+ *  cannot leave matching; mount skips such entries. Changes are recorded
+ *  so that a power cut at any point leaves a sector erased in the map only
+ *  if it is: a sector is recorded in use before it is programmed, and
+ *  erased once the erase completed. A cut only ever makes the map claim too
+ *  little, a sector erased but not recorded so.
+ *
+ *  Thread safe. Program and erase the range through this object only.
+ */
+class QSPIFlashSectorMap {
+public:
+    /**
+     *  @param flash            flash object
+     *  @param addr             first sector of the range, sector aligned
+     *  @param sectors          sectors in the range
+     *  @param map_addr         where the map is kept, sector aligned, map_size
+     *                          bytes outside the range
+     *  @param journal_entries  state changes between two writes of the map
+     */
+    QSPIFlashSectorMap(QSPIFlash *flash, uint32_t addr, unsigned int sectors, uint32_t map_addr,
+                       unsigned int journal_entries = QSPI_SECTOR_MAP_JOURNAL_ENTRIES);
+    ~QSPIFlashSectorMap();
+
+    /** Flash the map of a range of sectors takes, both areas */
+    static uint32_t map_size(unsigned int sectors, unsigned int journal_entries = QSPI_SECTOR_MAP_JOURNAL_ENTRIES);
+
+    /** Load the map from flash
+     *
+     *  @return QSPI_STATUS_ERROR when there is no map of this range
+     */
+    qspi_status_t mount();
+
+    /** Blank check every sector of the range and write the map afresh */
+    qspi_status_t rebuild();
+
+    /** Write the map afresh to the other area, emptying the journal */
+    qspi_status_t compact();
+
+    /** QSPIFlash::program, recording the sectors in use first */
+    qspi_status_t program(uint32_t addr, const void *buffer, size_t size);
+
+    /** QSPIFlash::erase_range, recording the sectors erased once it succeeded */
+    qspi_status_t erase_range(uint32_t addr, size_t size);
+
+    /** Record the sectors in use in a range as dirty; erased ones stay so */
+    qspi_status_t mark_dirty(uint32_t addr, size_t size);
+
+    /** State of the sector holding addr */
+    qspi_sector_state_t get_state(uint32_t addr);
+
+    /** Sectors in a state */
+    unsigned int count(qspi_sector_state_t state);
+
+    qspi_sector_map_stats_t get_stats();
+    void reset_stats();
+
+private:
+    uint32_t area_addr(unsigned int area) const;
+    uint32_t entry_addr(unsigned int entry) const;
+    qspi_sector_state_t state(unsigned int sector) const;
+    void set_state(unsigned int sector, qspi_sector_state_t state);
+    qspi_status_t record(unsigned int sector, qspi_sector_state_t state);
+    bool read_header(unsigned int area, uint32_t *seq);
+    qspi_status_t write_map();
+    bool in_range(uint32_t addr, size_t size) const;
+
+    QSPIFlash *_flash;
+    uint32_t _addr;
+    unsigned int _sectors;
+    uint32_t _map_addr;
+    unsigned int _entries;
+    uint32_t _bitmap_size;
+    uint32_t _journal_offset;       // in an area
+    uint32_t _area_size;
+    uint8_t *_bitmap;               // 2 bits per sector, as on flash
+    unsigned int _area;             // holding the map
+    uint32_t _seq;                  // of the map in _area
+    unsigned int _next;             // free journal entry
+    bool _mounted;
+    qspi_sector_map_stats_t _stats;
+    Mutex _mutex;
+};
+
+#endif // QSPI_FLASH_SECTOR_MAP_H
@@ -0,0 +1,168 @@
+#include "QSPIReadCache.h"
+#include "QSPIFlash.h"
+
+// Sector of a line invalidated while it was being filled; matches no address
+#define READ_CACHE_STALE        0xFFFFFFFF
+
+QSPIReadCache::QSPIReadCache(unsigned int lines, qspi_read_cache_policy_t policy)
+    : _lines(NULL), _line_count(0), _policy(policy), _use_counter(0)
+{
+    memset(&_stats, 0, sizeof(_stats));
+
+    _lines = new line_t[lines];
+    for (unsigned int i = 0; i < lines; i++) {
+        _lines[i].data = (uint8_t *)malloc(QSPI_FLASH_SECTOR_SIZE);
+        if (_lines[i].data == NULL) {
+            printf("\nERROR: read cache line alloc failed");
+            break;
+        }
+        _lines[i].sector = 0;
+        _lines[i].last_use = 0;
+        _lines[i].valid = false;
+        _lines[i].filling = false;
+        _line_count++;
+    }
+}
+
+QSPIReadCache::~QSPIReadCache()
+{
+    for (unsigned int i = 0; i < _line_count; i++) {
+        free(_lines[i].data);
+    }
+    delete[] _lines;
+}
+
+bool QSPIReadCache::lookup(uint32_t addr, void *buffer, size_t size)
+{
+    uint32_t sector = addr & ~(QSPI_FLASH_SECTOR_SIZE - 1);
+
+    _mutex.lock();
+    for (unsigned int i = 0; i < _line_count; i++) {
+        line_t *line = &_lines[i];
+        if (line->valid && line->sector == sector) {
+            memcpy(buffer, line->data + (addr - sector), size);
+            line->last_use = ++_use_counter;
+            _stats.hits++;
+            _mutex.unlock();
+            return true;
+        }
+    }
+    _stats.misses++;
+    _mutex.unlock();
+    return false;
+}
+
+bool QSPIReadCache::should_fill(size_t read_size) const
+{
+    if (_line_count == 0) {
+        return false;
+    }
+    return _policy == QSPI_READ_CACHE_FILL_ALL || read_size < QSPI_FLASH_SECTOR_SIZE;
+}
+
+uint8_t *QSPIReadCache::allocate(uint32_t sector_addr)
+{
+    line_t *victim = NULL;
+
+    _mutex.lock();
+    for (unsigned int i = 0; i < _line_count; i++) {
+        line_t *line = &_lines[i];
+        if (line->filling) {
+            continue;
+        }
+        if (!line->valid) {
+            victim = line;
+            break;
+        }
+        if (victim == NULL || line->last_use < victim->last_use) {
+            victim = line;
+        }
+    }
+    if (victim) {
+        if (victim->valid) {
+            _stats.evictions++;
+        }
+        victim->valid = false;
+        victim->filling = true;
+        victim->sector = sector_addr;
+    }
+    _mutex.unlock();
+
+    return victim ? victim->data : NULL;
+}
+
+QSPIReadCache::line_t *QSPIReadCache::find_line(uint8_t *data)
+{
+    for (unsigned int i = 0; i < _line_count; i++) {
+        if (_lines[i].data == data) {
+            return &_lines[i];
+        }
+    }
+    return NULL;
+}
+
+void QSPIReadCache::commit(uint8_t *line_data)
+{
+    _mutex.lock();
+    line_t *line = find_line(line_data);
+    if (line && line->filling) {
+        // An invalidation that raced with the fill leaves the line empty
+        line->filling = false;
+        line->valid = (line->sector != READ_CACHE_STALE);
+        line->last_use = ++_use_counter;
+        if (line->valid) {
+            _stats.fills++;
+        }
+    }
+    _mutex.unlock();
+}
+
+void QSPIReadCache::abort(uint8_t *line_data)
+{
+    _mutex.lock();
+    line_t *line = find_line(line_data);
+    if (line) {
+        line->filling = false;
+        line->valid = false;
+    }
+    _mutex.unlock();
+}
+
+void QSPIReadCache::invalidate(uint32_t addr, size_t size)
+{
+    _mutex.lock();
+    for (unsigned int i = 0; i < _line_count; i++) {
+        line_t *line = &_lines[i];
+        if ((line->valid || line->filling) && line->sector < addr + size && addr < line->sector + QSPI_FLASH_SECTOR_SIZE) {
+            if (line->valid) {
+                _stats.invalidations++;
+            }
+            line->valid = false;
+            // Keep the line reserved for its filler, but never let it turn valid
+            if (line->filling) {
+                line->sector = READ_CACHE_STALE;
+            }
+        }
+    }
+    _mutex.unlock();
+}
+
+void QSPIReadCache::invalidate_all()
+{
+    invalidate(0, 0xFFFFFFFF);
+}
+
+qspi_read_cache_stats_t QSPIReadCache::get_stats()
+{
+    _mutex.lock();
+    qspi_read_cache_stats_t stats = _stats;
+    _mutex.unlock();
+    return stats;
+}
+
+void QSPIReadCache::reset_stats()
+{
+    _mutex.lock();
+    memset(&_stats, 0, sizeof(_stats));
+    _mutex.unlock();
+}
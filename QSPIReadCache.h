@@ -0,0 +1,85 @@
+#ifndef QSPI_READ_CACHE_H
+#define QSPI_READ_CACHE_H
+
+#include "mbed.h"
+
+/** When a read that misses fills a cache line */
+typedef enum {
+    QSPI_READ_CACHE_FILL_ALL,       // every miss loads the whole sector
+    QSPI_READ_CACHE_FILL_SMALL,     // only reads shorter than a sector do; larger
+                                    // (streaming) reads bypass the cache
+} qspi_read_cache_policy_t;
+
+typedef struct {
+    uint32_t hits;                  // sector-sized pieces of reads served from RAM
+    uint32_t misses;
+    uint32_t fills;                 // lines loaded from flash
+    uint32_t evictions;
+    uint32_t invalidations;         // lines dropped because of a write or erase
+} qspi_read_cache_stats_t;
+
+/** Sector-granular RAM cache of flash contents with LRU replacement
+ *
+ *  Attached to one or more QSPIFlash objects on the same part, which look
+ *  up reads in it and invalidate it on every program and erase they issue.
+ *  A wait_ready for an operation QSPIFlash did not issue itself (a raw
+ *  QSPI::write through any QSPI object, followed by WaitForMemReady) drops
+ *  the whole cache, as the area it changed is not known. Anything else that
+ *  changes the flash must call invalidate.
+ *
+ *  Thread safe.
+ */
+class QSPIReadCache {
+public:
+    /**
+     *  @param lines    number of sectors kept, each takes QSPI_FLASH_SECTOR_SIZE bytes of heap
+     *  @param policy   see qspi_read_cache_policy_t
+     */
+    QSPIReadCache(unsigned int lines, qspi_read_cache_policy_t policy = QSPI_READ_CACHE_FILL_ALL);
+    ~QSPIReadCache();
+
+    /** Copy [addr, addr + size), which must lie within one sector, if cached
+     *
+     *  @return true on a hit
+     */
+    bool lookup(uint32_t addr, void *buffer, size_t size);
+
+    /** Whether a read of read_size bytes that missed should fill a line */
+    bool should_fill(size_t read_size) const;
+
+    /** Take the least recently used line for a sector; the caller reads the
+     *  sector into it and then calls commit, or abort if the read failed
+     *
+     *  @return QSPI_FLASH_SECTOR_SIZE bytes to fill, NULL without lines
+     */
+    uint8_t *allocate(uint32_t sector_addr);
+    void commit(uint8_t *line);
+    void abort(uint8_t *line);
+
+    /** Drop every line overlapping [addr, addr + size) */
+    void invalidate(uint32_t addr, size_t size);
+    void invalidate_all();
+
+    qspi_read_cache_stats_t get_stats();
+    void reset_stats();
+
+private:
+    typedef struct {
+        uint8_t *data;
+        uint32_t sector;
+        uint32_t last_use;
+        bool valid;
+        bool filling;               // allocated, not committed yet
+    } line_t;
+
+    line_t *find_line(uint8_t *data);
+
+    line_t *_lines;
+    unsigned int _line_count;
+    qspi_read_cache_policy_t _policy;
+    uint32_t _use_counter;
+    qspi_read_cache_stats_t _stats;
+    Mutex _mutex;
+};
+
+#endif // QSPI_READ_CACHE_H
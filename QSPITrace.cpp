@@ -0,0 +1,92 @@
+#include "QSPITrace.h"
+
+#if (QSPI_TRACE_DEPTH & (QSPI_TRACE_DEPTH - 1)) != 0
+#error "QSPI_TRACE_DEPTH must be a power of two"
+#endif
+
+static qspi_trace_entry_t trace_ring[QSPI_TRACE_DEPTH];
+static volatile uint32_t trace_head = 0;        // seq of the last slot claimed
+static volatile bool trace_enabled = true;
+
+#if QSPI_TRACE_ENABLED
+void qspi_trace_record(qspi_trace_kind_t kind, uint8_t opcode, uint8_t format, uint32_t addr, size_t length,
+                       uint32_t start_us, qspi_status_t status)
+{
+    if (!trace_enabled) {
+        return;
+    }
+    uint32_t end_us = us_ticker_read();
+    uint32_t seq = core_util_atomic_incr_u32(&trace_head, 1);
+    volatile qspi_trace_entry_t *entry = &trace_ring[seq & (QSPI_TRACE_DEPTH - 1)];
+
+    // Unpublished until the fields are in place
+    entry->seq = 0;
+    MBED_BARRIER();
+    entry->start_us = start_us;
+    entry->end_us = end_us;
+    entry->addr = addr;
+    entry->length = (length > 0xFFFF) ? 0xFFFF : (uint16_t)length;
+    entry->kind = kind;
+    entry->opcode = opcode;
+    entry->format = format;
+    entry->status = (int8_t)status;
+    MBED_BARRIER();
+    entry->seq = seq;
+}
+#endif
+
+void qspi_trace_enable(bool enable)
+{
+    trace_enabled = enable;
+}
+
+void qspi_trace_clear()
+{
+    trace_head = 0;
+    for (int i = 0; i < QSPI_TRACE_DEPTH; i++) {
+        trace_ring[i].seq = 0;
+    }
+}
+
+uint32_t qspi_trace_count()
+{
+    return trace_head;
+}
+
+size_t qspi_trace_snapshot(qspi_trace_entry_t *entries, size_t max)
+{
+    uint32_t head = trace_head;
+    uint32_t first = (head > QSPI_TRACE_DEPTH) ? head - QSPI_TRACE_DEPTH + 1 : 1;
+    size_t count = 0;
+
+    for (uint32_t seq = first; seq <= head && count < max; seq++) {
+        const volatile qspi_trace_entry_t *entry = &trace_ring[seq & (QSPI_TRACE_DEPTH - 1)];
+        if (entry->seq != seq) {
+            continue;
+        }
+        MBED_BARRIER();
+        memcpy(&entries[count], (const void *)entry, sizeof(qspi_trace_entry_t));
+        MBED_BARRIER();
+        // Overwritten while copying
+        if (entry->seq != seq) {
+            continue;
+        }
+        entries[count].seq = seq;
+        count++;
+    }
+    return count;
+}
+
+void qspi_trace_dump()
+{
+    static qspi_trace_entry_t entries[QSPI_TRACE_DEPTH];
+    size_t count = qspi_trace_snapshot(entries, QSPI_TRACE_DEPTH);
+
+    printf("\n#TRACE,seq,kind,opcode,format,addr,length,start_us,end_us,status");
+    for (size_t i = 0; i < count; i++) {
+        const qspi_trace_entry_t *entry = &entries[i];
+        printf("\nTRACE,%lu,%u,0x%02X,0x%02X,0x%lX,%u,%lu,%lu,%d", (unsigned long)entry->seq, entry->kind,
+               entry->opcode, entry->format, (unsigned long)entry->addr, entry->length,
+               (unsigned long)entry->start_us, (unsigned long)entry->end_us, entry->status);
+    }
+}
@@ -0,0 +1,94 @@
+#ifndef QSPI_TRACE_H
+#define QSPI_TRACE_H
+
+#include "mbed.h"
+#include "QSPI.h"
+
+// Set to 0 to compile the tracer out; qspi_trace_record is then an inline
+// no-op the compiler drops along with its arguments
+#ifndef QSPI_TRACE_ENABLED
+#define QSPI_TRACE_ENABLED                  1
+#endif
+
+// Entries kept, a power of two; older ones are overwritten
+#ifndef QSPI_TRACE_DEPTH
+#define QSPI_TRACE_DEPTH                    64
+#endif
+
+// Bus format of an entry: instruction, address and data widths, two bits
+// each (qspi_bus_width_t), as in the 1_4_4 style names
+#define QSPI_TRACE_FORMAT(inst, address, data)  ((uint8_t)(((inst) << 4) | ((address) << 2) | (data)))
+#define QSPI_TRACE_FORMAT_UNKNOWN           0xFF
+
+typedef enum {
+    QSPI_TRACE_COMMAND,             // command_transfer
+    QSPI_TRACE_READ,
+    QSPI_TRACE_WRITE,
+    QSPI_TRACE_READ_CONTINUOUS,     // 4READ without the instruction phase
+} qspi_trace_kind_t;
+
+typedef struct {
+    uint32_t seq;                   // 1 for the first transaction traced, 0 while being written
+    uint32_t start_us;
+    uint32_t end_us;
+    uint32_t addr;
+    uint16_t length;
+    uint8_t kind;                   // qspi_trace_kind_t
+    uint8_t opcode;                 // 0 when the bus format was not known
+    uint8_t format;
+    int8_t status;                  // qspi_status_t
+    uint16_t reserved;
+} qspi_trace_entry_t;
+
+/** Timestamp to pass to qspi_trace_record as the start of a transaction */
+inline uint32_t qspi_trace_start()
+{
+#if QSPI_TRACE_ENABLED
+    return us_ticker_read();
+#else
+    return 0;
+#endif
+}
+
+/** Record a finished transaction
+ *
+ *  Lock free: may be called from any thread or interrupt. A slot is claimed
+ *  with one atomic increment and published by writing its sequence number
+ *  last, so readers skip entries still being written or overwritten.
+ */
+#if QSPI_TRACE_ENABLED
+void qspi_trace_record(qspi_trace_kind_t kind, uint8_t opcode, uint8_t format, uint32_t addr, size_t length,
+                       uint32_t start_us, qspi_status_t status);
+#else
+inline void qspi_trace_record(qspi_trace_kind_t kind, uint8_t opcode, uint8_t format, uint32_t addr, size_t length,
+                              uint32_t start_us, qspi_status_t status)
+{
+    (void)kind;
+    (void)opcode;
+    (void)format;
+    (void)addr;
+    (void)length;
+    (void)start_us;
+    (void)status;
+}
+#endif
+
+/** Turn recording on or off at run time; on by default */
+void qspi_trace_enable(bool enable);
+
+/** Forget all entries */
+void qspi_trace_clear();
+
+/** Transactions recorded since the last clear, including overwritten ones */
+uint32_t qspi_trace_count();
+
+/** Copy the complete entries still in the ring, oldest first
+ *
+ *  @return number of entries copied
+ */
+size_t qspi_trace_snapshot(qspi_trace_entry_t *entries, size_t max);
+
+/** Print the ring as TRACE lines for tools/trace_decode.py */
+void qspi_trace_dump();
+
+#endif // QSPI_TRACE_H
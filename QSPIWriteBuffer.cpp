@@ -0,0 +1,294 @@
+#include "QSPIWriteBuffer.h"
+
+#define WRITE_BUFFER_FLAG_DIRTY     0x01
+#define WRITE_BUFFER_FLAG_STOP      0x02
+
+QSPIWriteBuffer::QSPIWriteBuffer(QSPIFlash *flash, unsigned int pages, uint32_t timeout_ms)
+    : _flash(flash), _pages(NULL), _page_count(0), _timeout_ms(timeout_ms), _error(QSPI_STATUS_OK), _thread(NULL)
+{
+    memset(&_stats, 0, sizeof(_stats));
+
+    _pages = new page_t[pages];
+    for (unsigned int i = 0; i < pages; i++) {
+        _pages[i].data = (uint8_t *)malloc(QSPI_FLASH_PAGE_SIZE);
+        if (_pages[i].data == NULL) {
+            printf("\nERROR: write buffer page alloc failed");
+            break;
+        }
+        memset(_pages[i].data, 0xFF, QSPI_FLASH_PAGE_SIZE);
+        _pages[i].addr = 0;
+        _pages[i].start = 0;
+        _pages[i].end = 0;
+        _pages[i].since_us = 0;
+        _page_count++;
+    }
+}
+
+QSPIWriteBuffer::~QSPIWriteBuffer()
+{
+    if (_thread) {
+        _events.set(WRITE_BUFFER_FLAG_STOP);
+        _thread->join();
+        delete _thread;
+    }
+    sync();
+    for (unsigned int i = 0; i < _page_count; i++) {
+        free(_pages[i].data);
+    }
+    delete[] _pages;
+}
+
+// Called locked
+QSPIWriteBuffer::page_t *QSPIWriteBuffer::find_page(uint32_t page_addr)
+{
+    for (unsigned int i = 0; i < _page_count; i++) {
+        if (_pages[i].end && _pages[i].addr == page_addr) {
+            return &_pages[i];
+        }
+    }
+    return NULL;
+}
+
+// A free buffer for page_addr, programming the page gathered longest if
+// there is none, NULL if that fails; called locked
+QSPIWriteBuffer::page_t *QSPIWriteBuffer::take_page(uint32_t page_addr, qspi_status_t *result)
+{
+    page_t *oldest = NULL;
+
+    *result = QSPI_STATUS_OK;
+    for (unsigned int i = 0; i < _page_count; i++) {
+        page_t *page = &_pages[i];
+        if (page->end == 0) {
+            oldest = page;
+            break;
+        }
+        if (oldest == NULL || (int32_t)(page->since_us - oldest->since_us) < 0) {
+            oldest = page;
+        }
+    }
+    if (oldest && oldest->end) {
+        _stats.evictions++;
+        *result = flush_page(oldest);
+        if (*result != QSPI_STATUS_OK) {
+            return NULL;
+        }
+    }
+    if (oldest) {
+        oldest->addr = page_addr;
+        oldest->since_us = us_ticker_read();
+    }
+    return oldest;
+}
+
+// Program the span written and free the buffer, keeping it gathered if
+// the program fails; called locked
+qspi_status_t QSPIWriteBuffer::flush_page(page_t *page)
+{
+    qspi_status_t result = _flash->program(page->addr + page->start, page->data + page->start, page->end - page->start);
+    _stats.page_programs++;
+    if (result != QSPI_STATUS_OK) {
+        _stats.failed_flushes++;
+        return result;
+    }
+    memset(page->data + page->start, 0xFF, page->end - page->start);
+    page->start = page->end = 0;
+    return result;
+}
+
+qspi_status_t QSPIWriteBuffer::program(uint32_t addr, const void *buffer, size_t size)
+{
+    const uint8_t *data = (const uint8_t *)buffer;
+    qspi_status_t result = QSPI_STATUS_OK;
+    bool gathered = false;
+
+    _mutex.lock();
+    _stats.writes++;
+    while (size && result == QSPI_STATUS_OK) {
+        uint32_t page_addr = addr - addr % QSPI_FLASH_PAGE_SIZE;
+        uint32_t offset = addr - page_addr;
+        size_t chunk = QSPI_FLASH_PAGE_SIZE - offset;
+        if (chunk > size) {
+            chunk = size;
+        }
+
+        page_t *page = find_page(page_addr);
+        if (page) {
+            _stats.merged++;
+        } else if (chunk < QSPI_FLASH_PAGE_SIZE) {
+            page = take_page(page_addr, &result);
+        }
+        if (page == NULL) {
+            // A whole page with nothing gathered, or no buffers
+            if (result == QSPI_STATUS_OK) {
+                result = _flash->program(addr, data, chunk);
+                _stats.page_programs++;
+            }
+        } else {
+            for (size_t i = 0; i < chunk; i++) {
+                page->data[offset + i] &= data[i];
+            }
+            if (page->end == 0) {
+                page->start = offset;
+                page->end = offset + chunk;
+            } else {
+                page->start = (offset < page->start) ? offset : page->start;
+                page->end = (offset + chunk > page->end) ? offset + chunk : page->end;
+            }
+            if (page->start == 0 && page->end == QSPI_FLASH_PAGE_SIZE) {
+                _stats.full_flushes++;
+                result = flush_page(page);
+            }
+            if (page->end) {
+                gathered = true;
+            }
+        }
+        addr += chunk;
+        data += chunk;
+        size -= chunk;
+    }
+
+    if (result == QSPI_STATUS_OK && _error != QSPI_STATUS_OK) {
+        result = _error;
+    }
+    _error = QSPI_STATUS_OK;
+
+    if (gathered && _timeout_ms && _thread == NULL) {
+        _thread = new Thread(osPriorityBelowNormal, QSPI_WRITE_BUFFER_STACK_SIZE);
+        if (_thread == NULL || osOK != _thread->start(callback(this, &QSPIWriteBuffer::flush_worker))) {
+            delete _thread;
+            _thread = NULL;
+        }
+    }
+    _mutex.unlock();
+
+    if (gathered) {
+        _events.set(WRITE_BUFFER_FLAG_DIRTY);
+    }
+    return result;
+}
+
+qspi_status_t QSPIWriteBuffer::read(uint32_t addr, void *buffer, size_t size)
+{
+    uint8_t *data = (uint8_t *)buffer;
+
+    _mutex.lock();
+    qspi_status_t result = _flash->read(addr, buffer, size);
+    for (unsigned int i = 0; i < _page_count && result == QSPI_STATUS_OK; i++) {
+        const page_t *page = &_pages[i];
+        if (page->end == 0) {
+            continue;
+        }
+        // What the flash will hold once the page is programmed
+        uint32_t start = page->addr + page->start;
+        uint32_t end = page->addr + page->end;
+        for (uint32_t a = (start > addr) ? start : addr; a < end && a < addr + size; a++) {
+            data[a - addr] &= page->data[a - page->addr];
+        }
+    }
+    _mutex.unlock();
+    return result;
+}
+
+qspi_status_t QSPIWriteBuffer::erase_range(uint32_t addr, size_t size)
+{
+    _mutex.lock();
+    for (unsigned int i = 0; i < _page_count; i++) {
+        page_t *page = &_pages[i];
+        if (page->end && page->addr >= addr && page->addr < addr + size) {
+            memset(page->data + page->start, 0xFF, page->end - page->start);
+            page->start = page->end = 0;
+        }
+    }
+    qspi_status_t result = _flash->erase_range(addr, size);
+    _mutex.unlock();
+    return result;
+}
+
+qspi_status_t QSPIWriteBuffer::sync()
+{
+    qspi_status_t result = QSPI_STATUS_OK;
+
+    _mutex.lock();
+    for (unsigned int i = 0; i < _page_count; i++) {
+        if (_pages[i].end) {
+            _stats.sync_flushes++;
+            if (QSPI_STATUS_OK != flush_page(&_pages[i])) {
+                result = QSPI_STATUS_ERROR;
+            }
+        }
+    }
+    if (_error != QSPI_STATUS_OK) {
+        result = QSPI_STATUS_ERROR;
+        _error = QSPI_STATUS_OK;
+    }
+    _mutex.unlock();
+    return result;
+}
+
+unsigned int QSPIWriteBuffer::dirty_pages()
+{
+    unsigned int dirty = 0;
+
+    _mutex.lock();
+    for (unsigned int i = 0; i < _page_count; i++) {
+        if (_pages[i].end) {
+            dirty++;
+        }
+    }
+    _mutex.unlock();
+    return dirty;
+}
+
+qspi_write_buffer_stats_t QSPIWriteBuffer::get_stats()
+{
+    _mutex.lock();
+    qspi_write_buffer_stats_t stats = _stats;
+    _mutex.unlock();
+    return stats;
+}
+
+void QSPIWriteBuffer::reset_stats()
+{
+    _mutex.lock();
+    memset(&_stats, 0, sizeof(_stats));
+    _mutex.unlock();
+}
+
+void QSPIWriteBuffer::flush_worker()
+{
+    while (true) {
+        // Program the pages that are due, and sleep until the next one is
+        uint32_t wait_ms = osWaitForever;
+        _mutex.lock();
+        uint32_t now_us = us_ticker_read();
+        for (unsigned int i = 0; i < _page_count; i++) {
+            page_t *page = &_pages[i];
+            if (page->end == 0) {
+                continue;
+            }
+            uint32_t age_us = now_us - page->since_us;
+            if (age_us >= _timeout_ms * 1000) {
+                _stats.timeout_flushes++;
+                qspi_status_t result = flush_page(page);
+                if (result == QSPI_STATUS_OK) {
+                    continue;
+                }
+                // Reported by the next program or sync; try again after
+                // another timeout
+                _error = result;
+                page->since_us = now_us;
+                age_us = 0;
+            }
+            uint32_t due_ms = (_timeout_ms * 1000 - age_us + 999) / 1000;
+            if (due_ms < wait_ms) {
+                wait_ms = due_ms;
+            }
+        }
+        _mutex.unlock();
+
+        uint32_t flags = _events.wait_any(WRITE_BUFFER_FLAG_DIRTY | WRITE_BUFFER_FLAG_STOP, wait_ms);
+        if (!(flags & osFlagsError) && (flags & WRITE_BUFFER_FLAG_STOP)) {
+            break;
+        }
+    }
+}
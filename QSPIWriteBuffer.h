@@ -0,0 +1,116 @@
+#ifndef QSPI_WRITE_BUFFER_H
+#define QSPI_WRITE_BUFFER_H
+
+#include "mbed.h"
+#include "QSPIFlash.h"
+
+// Pages gathered at a time
+#ifndef QSPI_WRITE_BUFFER_PAGES
+#define QSPI_WRITE_BUFFER_PAGES             4
+#endif
+
+// Longest a write stays in RAM before it is programmed (0: until the page
+// fills up, is evicted or sync)
+#ifndef QSPI_WRITE_BUFFER_TIMEOUT_MS
+#define QSPI_WRITE_BUFFER_TIMEOUT_MS        50
+#endif
+
+#ifndef QSPI_WRITE_BUFFER_STACK_SIZE
+#define QSPI_WRITE_BUFFER_STACK_SIZE        768
+#endif
+
+typedef struct {
+    uint32_t writes;                // program calls
+    uint32_t merged;                // pieces of writes that went into a page already gathered
+    uint32_t page_programs;         // programs issued, one page at most each
+    uint32_t full_flushes;          // pages programmed once the span written reached both ends
+    uint32_t sync_flushes;
+    uint32_t timeout_flushes;
+    uint32_t evictions;             // pages programmed early to make room
+    uint32_t failed_flushes;        // page programs that failed, the page kept
+} qspi_write_buffer_stats_t;
+
+/** Write-back buffer gathering small programs into page programs
+ *
+ *  Programs are copied into RAM pages and sent to the flash as one
+ *  program per page: once the span written in a page reaches both its
+ *  ends, when its buffer is needed for another page (the page gathered
+ *  longest goes), on sync, or QSPI_WRITE_BUFFER_TIMEOUT_MS after it was
+ *  first written, from a thread created on first use. Writes of whole
+ *  pages that have nothing gathered go to the flash directly.
+ *
+ *  Bytes not written stay 0xFF in the page buffer, which programs
+ *  nothing, and writes to the same bytes are ANDed as programming them
+ *  twice would, so the flash ends up as without the buffer. Reads through
+ *  this object see the gathered data; reads through the QSPIFlash do not
+ *  until it is programmed. Program and erase the area through this object
+ *  only, and sync before a power cut.
+ *
+ *  A page whose program fails stays gathered and is tried again on the
+ *  next flush. A failure in the thread is returned by the next program or
+ *  sync.
+ *
+ *  Thread safe.
+ */
+class QSPIWriteBuffer {
+public:
+    /**
+     *  @param flash        flash object
+     *  @param pages        page buffers, QSPI_FLASH_PAGE_SIZE bytes of heap each
+     *  @param timeout_ms   longest a write is held back, 0: no limit
+     */
+    QSPIWriteBuffer(QSPIFlash *flash, unsigned int pages = QSPI_WRITE_BUFFER_PAGES,
+                    uint32_t timeout_ms = QSPI_WRITE_BUFFER_TIMEOUT_MS);
+
+    /** Programs whatever is gathered and stops the thread */
+    ~QSPIWriteBuffer();
+
+    /** Program an arbitrary range, which must have been erased beforehand;
+     *  returns once it is gathered, programming only the pages that fill
+     *  up or make room
+     */
+    qspi_status_t program(uint32_t addr, const void *buffer, size_t size);
+
+    /** Read an arbitrary range, gathered data included */
+    qspi_status_t read(uint32_t addr, void *buffer, size_t size);
+
+    /** Drop what is gathered for the range and erase it (see
+     *  QSPIFlash::erase_range)
+     */
+    qspi_status_t erase_range(uint32_t addr, size_t size);
+
+    /** Program every gathered page */
+    qspi_status_t sync();
+
+    /** Pages currently gathered */
+    unsigned int dirty_pages();
+
+    qspi_write_buffer_stats_t get_stats();
+    void reset_stats();
+
+private:
+    typedef struct {
+        uint8_t *data;
+        uint32_t addr;              // page address
+        uint32_t start;             // span written, empty when end is 0
+        uint32_t end;
+        uint32_t since_us;          // first write since the last flush
+    } page_t;
+
+    page_t *find_page(uint32_t page_addr);
+    page_t *take_page(uint32_t page_addr, qspi_status_t *result);
+    qspi_status_t flush_page(page_t *page);
+    void flush_worker();
+
+    QSPIFlash *_flash;
+    page_t *_pages;
+    unsigned int _page_count;
+    uint32_t _timeout_ms;
+    qspi_status_t _error;           // timeout flush failure not yet reported
+    qspi_write_buffer_stats_t _stats;
+    Mutex _mutex;
+    EventFlags _events;
+    Thread *_thread;
+};
+
+#endif // QSPI_WRITE_BUFFER_H
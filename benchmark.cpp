@@ -0,0 +1,1474 @@
+#include "mbed.h"
+#include "QSPI.h"
+#include "qspi_test.h"
+#include "benchmark.h"
+#include "QSPIFlashBlockDevice.h"
+#include "QSPIFlashFTL.h"
+#include "QSPIFlashSFDP.h"
+#include "QSPIFlashCalibrate.h"
+#include "QSPIFlashPower.h"
+#include "QSPIFlashPreErase.h"
+#include "QSPIWriteBuffer.h"
+#include "QSPIFlashSectorMap.h"
+#include <time.h>
+
+// Benchmarks run well clear of the area the tests use (0x1000 - 0x12000)
+#define BENCH_FLASH_ADDR            0x100000
+#define BENCH_MAX_SIZE              (_1_K_ * 64)
+#define BENCH_ITERATIONS            8
+#define BENCH_CACHE_LINES           (BENCH_MAX_SIZE / QSPI_FLASH_SECTOR_SIZE)
+
+// File system style traffic on the block device
+#define BENCH_FS_HEADER             64
+#define BENCH_FS_RECORD             32
+#define BENCH_FS_FILE_SIZE          _4_K_
+#define BENCH_FS_READ_SIZE          512
+
+// Sustained small writes through the translation layer: 80% of them go to
+// the first 20% of the records
+#define BENCH_FTL_ADDR              0x200000
+#define BENCH_FTL_SECTORS           64
+#define BENCH_FTL_RECORD            16
+#define BENCH_FTL_WRITES            4000
+
+// Threads sharing myFlash, each erasing, programming and reading back its
+// own sectors a page at a time
+#define BENCH_MT_ADDR               0x300000
+#define BENCH_MT_MAX_THREADS        8
+#define BENCH_MT_SECTORS            2
+#define BENCH_MT_ROUNDS             2
+#define BENCH_MT_PAGES              (BENCH_MT_SECTORS * BENCH_MT_ROUNDS * (_4_K_ / QSPI_FLASH_PAGE_SIZE))
+
+// Image checked as an OTA update would be, in 1_4_4 only
+#define BENCH_VERIFY_IMAGE          (_1_K_ * 1024)
+
+// Idle periods compared in standby and deep power-down, and the rounds of
+// the bursty workload the power policies are run on: a bulk read, a short
+// gap, a small read, a long idle time
+#define BENCH_POWER_ROUNDS          8
+#define BENCH_POWER_GAP_MS          10
+#define BENCH_POWER_IDLE_MS         500
+#define BENCH_POWER_SMALL           256
+
+// Log written a record at a time with a pause before each, erasing every
+// sector just before its first record or with QSPIFlashPreErase; once with
+// pauses longer than an erase and once with shorter ones
+#define BENCH_PRE_ERASE_ADDR        0x380000
+#define BENCH_PRE_ERASE_SECTORS     8
+#define BENCH_PRE_ERASE_RECORD      _1_K_
+#define BENCH_PRE_ERASE_RECORDS     32
+
+// 16 B writes, as in TestWriteReadSimple, filling a sector one after the
+// other or alternating between two sectors
+#define BENCH_WBUF_ADDR             0x3A0000
+#define BENCH_WBUF_RECORD           16
+#define BENCH_WBUF_WRITES           (_4_K_ / BENCH_WBUF_RECORD)
+
+// Parts the start-up with a sector map is timed for, as far as the part
+// goes; the map covers all of it but its own area at the top
+#define BENCH_MAP_MAX_SIZES         2
+#define BENCH_MAP_SIZES             { 8 * _1_K_ * _1_K_, 128 * _1_K_ * _1_K_ }
+
+// Runs of each command sequence, with one driver call per command and batched
+#define BENCH_BATCH_ITERATIONS      8
+
+// Calls timed to get the cost of recording one trace entry
+#define BENCH_TRACE_RECORDS         100000
+
+typedef struct {
+    const char *name;
+    qspi_bus_width_t address_width;
+    qspi_bus_width_t data_width;
+    bool program;               // false: the part has no matching program command
+} bench_format_t;
+
+static const bench_format_t bench_formats[] = {
+    { "1_1_1", QSPI_CFG_BUS_SINGLE, QSPI_CFG_BUS_SINGLE, true  },
+    { "1_1_4", QSPI_CFG_BUS_SINGLE, QSPI_CFG_BUS_QUAD,   true  },
+    { "1_4_4", QSPI_CFG_BUS_QUAD,   QSPI_CFG_BUS_QUAD,   true  },
+    { "1_1_2", QSPI_CFG_BUS_SINGLE, QSPI_CFG_BUS_DUAL,   false },
+    { "1_2_2", QSPI_CFG_BUS_DUAL,   QSPI_CFG_BUS_DUAL,   false },
+};
+
+static const unsigned int bench_sizes[] = { 16, 64, 256, _1_K_, _4_K_, _1_K_ * 16, _1_K_ * 64 };
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+
+static char *bench_tx_buf = NULL;
+static char *bench_rx_buf = NULL;
+
+static int CompareUint32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of an already sorted sample set
+static uint32_t Percentile(const uint32_t *sorted, int count, int pct)
+{
+    int rank = (pct * count + 99) / 100;
+    return sorted[(rank > 0 ? rank : 1) - 1];
+}
+
+static void ReportResult(const char *format, const char *op, unsigned int size, uint32_t *samples, int count)
+{
+    uint64_t total_us = 0;
+    for (int i = 0; i < count; i++) {
+        // Nothing is faster than the 1us timer resolution
+        if (samples[i] == 0) {
+            samples[i] = 1;
+        }
+        total_us += samples[i];
+    }
+    qsort(samples, count, sizeof(samples[0]), CompareUint32);
+
+    // bytes per microsecond is MB/s (10^6 bytes)
+    double mbps = total_us ? ((double)size * count) / (double)total_us : 0.0;
+    printf("\nBENCH,%s,%s,%u,%d,%.3f,%lu,%lu", format, op, size, count, mbps,
+           (unsigned long)Percentile(samples, count, 50), (unsigned long)Percentile(samples, count, 99));
+}
+
+static bool EraseRegion(unsigned int flash_addr, unsigned int size)
+{
+    for (unsigned int offset = 0; offset < size; offset += _4_K_) {
+        if (false == SectorErase(flash_addr + offset) || false == WaitForMemReady()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool BenchRead(const bench_format_t *fmt, unsigned int size)
+{
+    uint32_t samples[BENCH_ITERATIONS];
+    Timer timer;
+
+    for (int i = 0; i < BENCH_ITERATIONS; i++) {
+        size_t buf_len = size;
+        timer.reset();
+        timer.start();
+        int result = myQspi->read(BENCH_FLASH_ADDR, bench_rx_buf, &buf_len);
+        timer.stop();
+        if (result != QSPI_STATUS_OK || buf_len != size) {
+            printf("\nERROR: Read failed");
+            return false;
+        }
+        samples[i] = timer.read_us();
+    }
+    ReportResult(fmt->name, "read", size, samples, BENCH_ITERATIONS);
+    return true;
+}
+
+// QSPIFlash::read with the data already in the read cache
+static bool BenchCachedRead(const bench_format_t *fmt, unsigned int size)
+{
+    uint32_t samples[BENCH_ITERATIONS];
+    Timer timer;
+
+    if (QSPI_STATUS_OK != myFlash->read(BENCH_FLASH_ADDR, bench_rx_buf, size)) {
+        printf("\nERROR: Read failed");
+        return false;
+    }
+    for (int i = 0; i < BENCH_ITERATIONS; i++) {
+        timer.reset();
+        timer.start();
+        qspi_status_t result = myFlash->read(BENCH_FLASH_ADDR, bench_rx_buf, size);
+        timer.stop();
+        if (result != QSPI_STATUS_OK) {
+            printf("\nERROR: Read failed");
+            return false;
+        }
+        samples[i] = timer.read_us();
+    }
+    ReportResult(fmt->name, "read_cached", size, samples, BENCH_ITERATIONS);
+    return true;
+}
+
+// Back-to-back QSPIFlash::read calls walking through the flash, with or
+// without keeping the part in continuous read mode between them
+static bool BenchSequentialRead(const bench_format_t *fmt, unsigned int size, bool continuous)
+{
+    uint32_t samples[BENCH_ITERATIONS];
+    uint32_t addr = BENCH_FLASH_ADDR;
+    Timer timer;
+
+    myFlash->set_continuous_read(continuous);
+    // The first read of a run still sends the opcode
+    qspi_status_t result = myFlash->read(addr, bench_rx_buf, size);
+    for (int i = 0; i < BENCH_ITERATIONS && result == QSPI_STATUS_OK; i++) {
+        addr += size;
+        timer.reset();
+        timer.start();
+        result = myFlash->read(addr, bench_rx_buf, size);
+        timer.stop();
+        samples[i] = timer.read_us();
+    }
+    myFlash->set_continuous_read(false);
+    if (result != QSPI_STATUS_OK) {
+        printf("\nERROR: Read failed");
+        return false;
+    }
+    ReportResult(fmt->name, continuous ? "read_seq_continuous" : "read_seq", size, samples, BENCH_ITERATIONS);
+    return true;
+}
+
+// Raw QSPI::write + WaitForMemReady, or QSPIFlash::program when use_engine is set
+static bool BenchProgram(const bench_format_t *fmt, unsigned int size, bool use_engine)
+{
+    uint32_t samples[BENCH_ITERATIONS];
+    unsigned int erase_size = (size + _4_K_ - 1) & ~(_4_K_ - 1);
+    Timer timer;
+
+    for (int i = 0; i < BENCH_ITERATIONS; i++) {
+        if (false == EraseRegion(BENCH_FLASH_ADDR, erase_size)) {
+            printf("\nERROR: SectorErase failed(addr = 0x%08X)\n", BENCH_FLASH_ADDR);
+            return false;
+        }
+
+        size_t buf_len = size;
+        int result;
+        bool ready = true;
+        timer.reset();
+        timer.start();
+        if (use_engine) {
+            result = myFlash->program(BENCH_FLASH_ADDR, bench_tx_buf, size);
+        } else {
+            result = myQspi->write(BENCH_FLASH_ADDR, bench_tx_buf, &buf_len);
+            ready = WaitForMemReady();
+        }
+        timer.stop();
+        if (result != QSPI_STATUS_OK || buf_len != size || !ready) {
+            printf("\nERROR: Write failed");
+            return false;
+        }
+        samples[i] = timer.read_us();
+    }
+    ReportResult(fmt->name, use_engine ? "program_engine" : "program", size, samples, BENCH_ITERATIONS);
+    return true;
+}
+
+// Appending records to a log: erase + program each time, as the tests do,
+// or smart_write onto the blank area left by one erase up front
+static bool BenchLogWrite(const bench_format_t *fmt, unsigned int size, bool smart)
+{
+    uint32_t samples[BENCH_ITERATIONS];
+    unsigned int area = (size * BENCH_ITERATIONS + _4_K_ - 1) & ~(_4_K_ - 1);
+    Timer timer;
+
+    if (QSPI_STATUS_OK != myFlash->erase_range(BENCH_FLASH_ADDR, area)) {
+        printf("\nERROR: Erase failed(addr = 0x%08X)\n", BENCH_FLASH_ADDR);
+        return false;
+    }
+    for (int i = 0; i < BENCH_ITERATIONS; i++) {
+        uint32_t addr = BENCH_FLASH_ADDR + i * size;
+        qspi_status_t result;
+        timer.reset();
+        timer.start();
+        if (smart) {
+            result = myFlash->smart_write(addr, bench_tx_buf, size);
+        } else {
+            uint32_t sector = addr & ~(_4_K_ - 1);
+            result = EraseRegion(sector, ((addr + size - sector) + _4_K_ - 1) & ~(_4_K_ - 1)) ?
+                     myFlash->program(addr, bench_tx_buf, size) : QSPI_STATUS_ERROR;
+        }
+        timer.stop();
+        if (result != QSPI_STATUS_OK) {
+            printf("\nERROR: Write failed");
+            return false;
+        }
+        samples[i] = timer.read_us();
+    }
+    ReportResult(fmt->name, smart ? "log_smart_write" : "log_erase_program", size, samples, BENCH_ITERATIONS);
+    return true;
+}
+
+// Fills [BENCH_FLASH_ADDR, + size) with copies of bench_tx_buf for BenchVerify
+static bool PrepareVerifyArea(unsigned int size)
+{
+    if (QSPI_STATUS_OK != myFlash->erase_range(BENCH_FLASH_ADDR, size)) {
+        printf("\nERROR: Erase failed(addr = 0x%08X)\n", BENCH_FLASH_ADDR);
+        return false;
+    }
+    for (unsigned int offset = 0; offset < size; offset += BENCH_MAX_SIZE) {
+        if (QSPI_STATUS_OK != myFlash->program(BENCH_FLASH_ADDR + offset, bench_tx_buf, BENCH_MAX_SIZE)) {
+            printf("\nERROR: Program failed");
+            return false;
+        }
+    }
+    return true;
+}
+
+// Checking the flash holds what was programmed: read into bench_rx_buf and
+// memcmp, or QSPIFlash::verify; BENCH_MAX_SIZE at a time for larger sizes
+static bool BenchVerify(const bench_format_t *fmt, unsigned int size, bool streaming)
+{
+    uint32_t samples[BENCH_ITERATIONS];
+    unsigned int piece = (size < BENCH_MAX_SIZE) ? size : BENCH_MAX_SIZE;
+    Timer timer;
+
+    for (int i = 0; i < BENCH_ITERATIONS; i++) {
+        bool same = true;
+        timer.reset();
+        timer.start();
+        for (unsigned int offset = 0; offset < size && same; offset += piece) {
+            if (streaming) {
+                same = (QSPI_STATUS_OK == myFlash->verify(BENCH_FLASH_ADDR + offset, bench_tx_buf, piece));
+            } else {
+                same = (QSPI_STATUS_OK == myFlash->read(BENCH_FLASH_ADDR + offset, bench_rx_buf, piece)) &&
+                       (0 == memcmp(bench_rx_buf, bench_tx_buf, piece));
+            }
+        }
+        timer.stop();
+        if (!same) {
+            printf("\nERROR: Verify failed");
+            return false;
+        }
+        samples[i] = timer.read_us();
+    }
+    ReportResult(fmt->name, streaming ? "verify" : "read_compare", size, samples, BENCH_ITERATIONS);
+    return true;
+}
+
+static bool BenchErase(const bench_format_t *fmt, unsigned int size)
+{
+    uint32_t samples[BENCH_ITERATIONS];
+    Timer timer;
+
+    for (int i = 0; i < BENCH_ITERATIONS; i++) {
+        timer.reset();
+        timer.start();
+        bool erased = EraseRegion(BENCH_FLASH_ADDR, size);
+        timer.stop();
+        if (!erased) {
+            printf("\nERROR: SectorErase failed(addr = 0x%08X)\n", BENCH_FLASH_ADDR);
+            return false;
+        }
+        samples[i] = timer.read_us();
+    }
+    ReportResult(fmt->name, "erase", size, samples, BENCH_ITERATIONS);
+    return true;
+}
+
+// Same as BenchErase with the commands picked by QSPIFlash::erase_range
+static bool BenchEraseRange(const bench_format_t *fmt, unsigned int size)
+{
+    uint32_t samples[BENCH_ITERATIONS];
+    qspi_flash_erase_plan_t plan;
+
+    for (int i = 0; i < BENCH_ITERATIONS; i++) {
+        if (QSPI_STATUS_OK != myFlash->erase_range(BENCH_FLASH_ADDR, size, &plan)) {
+            printf("\nERROR: Erase failed(addr = 0x%08X)\n", BENCH_FLASH_ADDR);
+            return false;
+        }
+        samples[i] = plan.measured_us;
+    }
+    ReportResult(fmt->name, "erase_range", size, samples, BENCH_ITERATIONS);
+    return true;
+}
+
+// Appends a file's worth of small records at addr, through the block device
+// (which gathers them into pages) or with one QSPIFlash::program per record
+static bool BenchFsAppend(QSPIFlashBlockDevice *bd, bd_addr_t addr, bool direct)
+{
+    for (unsigned int offset = 0; offset < BENCH_FS_FILE_SIZE; offset += BENCH_FS_RECORD) {
+        if (direct) {
+            if (QSPI_STATUS_OK != bd->get_flash()->program(addr + offset, bench_tx_buf + offset, BENCH_FS_RECORD)) {
+                return false;
+            }
+        } else if (BD_ERROR_OK != bd->program(bench_tx_buf + offset, addr + offset, BENCH_FS_RECORD)) {
+            return false;
+        }
+    }
+    return BD_ERROR_OK == bd->sync();
+}
+
+// A file per iteration: a metadata sector erased and written on create, then
+// a data sector, erased beforehand, appended to in small records and read
+// back in buffer sized chunks
+// SFDP discovery as QSPIFlashBlockDevice::init does it, and what it found
+static void BenchSFDP()
+{
+    uint32_t samples[BENCH_ITERATIONS];
+    qspi_flash_sfdp_t sfdp;
+    Timer timer;
+
+    for (int i = 0; i < BENCH_ITERATIONS; i++) {
+        timer.reset();
+        timer.start();
+        qspi_status_t result = qspi_flash_sfdp_read(myQspi, &sfdp);
+        timer.stop();
+        if (result != QSPI_STATUS_OK) {
+            printf("\nERROR: SFDP read failed");
+            return;
+        }
+        samples[i] = timer.read_us();
+    }
+    ReportResult("sfdp", "discover", QSPI_SFDP_BFPT_MAX_DWORDS * 4, samples, BENCH_ITERATIONS);
+    printf("\n#SFDP,size,page_size,read_mode,dummy_cycles,quad_enable,erase_types");
+    printf("\nSFDP,%lu,%lu,%d,%d,%d,0x%X", (unsigned long)sfdp.size, (unsigned long)sfdp.page_size, sfdp.read_mode,
+           sfdp.dummy_cycles, sfdp.quad_enable, qspi_flash_sfdp_erase_types(&sfdp));
+}
+
+// 16 B reads alternating between myQspi and myQspiOther, both in 1_4_4:
+// first with the 6 dummy cycles given explicitly to myQspiOther, a format
+// that differs in the registers only, then with the same settings; then
+// myQspi alone
+static void BenchBusSharing()
+{
+    static const char *ops[3] = { "pingpong_other_format", "pingpong_same_format", "single" };
+    uint32_t samples[BENCH_ITERATIONS * 4];
+    qspi_flash_bus_stats_t stats[3];
+    bool counted = (QSPI_STATUS_OK == qspi_flash_hw_bus_stats(&stats[0], true));
+    Timer timer;
+
+    if (myQspiOther == NULL) {
+        return;
+    }
+    for (int op = 0; op < 3; op++) {
+        if (QSPI_STATUS_OK != myQspi->configure_format(QSPI_CFG_BUS_SINGLE, QSPI_CFG_BUS_QUAD, QSPI_FLASH_ADDR_SIZE, QSPI_CFG_BUS_SINGLE, QSPI_CFG_ALT_SIZE_NONE, QSPI_CFG_BUS_QUAD, 0, 0) ||
+                QSPI_STATUS_OK != myQspiOther->configure_format(QSPI_CFG_BUS_SINGLE, QSPI_CFG_BUS_QUAD, QSPI_FLASH_ADDR_SIZE, QSPI_CFG_BUS_SINGLE, QSPI_CFG_ALT_SIZE_NONE, QSPI_CFG_BUS_QUAD, (op == 0) ? 6 : 0, 0)) {
+            printf("\nERROR: Failed configuring QSPI driver");
+            return;
+        }
+        for (int i = 0; i < (int)ARRAY_SIZE(samples); i++) {
+            QSPI *qspi = (op < 2 && (i & 1)) ? myQspiOther : myQspi;
+            size_t buf_len = 16;
+            timer.reset();
+            timer.start();
+            qspi_status_t result = qspi->read(BENCH_FLASH_ADDR, bench_rx_buf, &buf_len);
+            timer.stop();
+            if (result != QSPI_STATUS_OK) {
+                printf("\nERROR: Read failed");
+                return;
+            }
+            samples[i] = timer.read_us();
+        }
+        qspi_flash_hw_bus_stats(&stats[op], true);
+        ReportResult("bus", ops[op], 16, samples, ARRAY_SIZE(samples));
+    }
+    myQspiOther->configure_format(QSPI_CFG_BUS_SINGLE, QSPI_CFG_BUS_SINGLE, QSPI_FLASH_ADDR_SIZE, QSPI_CFG_BUS_SINGLE, QSPI_CFG_ALT_SIZE_NONE, QSPI_CFG_BUS_SINGLE, 0, 0);
+
+    if (counted) {
+        printf("\n#BUS,op,switches,reconfigurations,avoided");
+        for (int op = 0; op < 3; op++) {
+            printf("\nBUS,%s,%lu,%lu,%lu", ops[op], (unsigned long)stats[op].switches,
+                   (unsigned long)stats[op].reconfigurations, (unsigned long)stats[op].avoided);
+        }
+    }
+}
+
+typedef struct {
+    int id;
+    int errors;
+    uint32_t elapsed_us;
+    uint32_t read_us[BENCH_MT_PAGES];
+    uint32_t program_us[BENCH_MT_PAGES];
+    uint32_t erase_us[BENCH_MT_SECTORS * BENCH_MT_ROUNDS];
+} bench_mt_thread_t;
+
+static bench_mt_thread_t bench_mt_threads[BENCH_MT_MAX_THREADS];
+
+static char BenchMtByte(int id, int round, uint32_t offset)
+{
+    return (char)(id * 37 + round * 11 + offset * 7 + (offset >> 8));
+}
+
+static void BenchMtWorker(bench_mt_thread_t *ctx)
+{
+    char tx_buf[QSPI_FLASH_PAGE_SIZE];
+    char rx_buf[QSPI_FLASH_PAGE_SIZE];
+    uint32_t base = BENCH_MT_ADDR + ctx->id * BENCH_MT_SECTORS * _4_K_;
+    int pages = 0;
+    int erases = 0;
+    Timer elapsed;
+    Timer timer;
+
+    elapsed.start();
+    for (int round = 0; round < BENCH_MT_ROUNDS; round++) {
+        for (uint32_t offset = 0; offset < BENCH_MT_SECTORS * _4_K_; offset += sizeof(tx_buf)) {
+            if ((offset % _4_K_) == 0) {
+                timer.reset();
+                timer.start();
+                ctx->errors += (QSPI_STATUS_OK != myFlash->erase_sector(base + offset));
+                timer.stop();
+                ctx->erase_us[erases++] = timer.read_us();
+            }
+            for (uint32_t i = 0; i < sizeof(tx_buf); i++) {
+                tx_buf[i] = BenchMtByte(ctx->id, round, offset + i);
+            }
+            timer.reset();
+            timer.start();
+            ctx->errors += (QSPI_STATUS_OK != myFlash->program(base + offset, tx_buf, sizeof(tx_buf)));
+            timer.stop();
+            ctx->program_us[pages] = timer.read_us();
+            timer.reset();
+            timer.start();
+            ctx->errors += (QSPI_STATUS_OK != myFlash->read(base + offset, rx_buf, sizeof(rx_buf)));
+            timer.stop();
+            ctx->read_us[pages++] = timer.read_us();
+            ctx->errors += (0 != memcmp(rx_buf, tx_buf, sizeof(rx_buf)));
+        }
+    }
+    elapsed.stop();
+    ctx->elapsed_us = elapsed.read_us();
+}
+
+static void ReportLockStats(int threads, const char *name, const qspi_flash_lock_stats_t *stats)
+{
+    uint32_t locks = stats->locks ? stats->locks : 1;
+    printf("\nMT_LOCK,%d,%s,%lu,%lu,%lu,%lu,%lu,%lu", threads, name, (unsigned long)stats->locks,
+           (unsigned long)stats->contended, (unsigned long)(stats->wait_total_us / locks), (unsigned long)stats->wait_max_us,
+           (unsigned long)(stats->hold_total_us / locks), (unsigned long)stats->hold_max_us);
+}
+
+// 1 to BENCH_MT_MAX_THREADS threads at once: latency of their operations,
+// the data they moved per second, how evenly they got through (Jain's
+// index over the threads' rates, 1000 when equal) and the lock statistics;
+// every thread's data is checked afterwards
+static void BenchContention()
+{
+    static uint32_t samples[BENCH_MT_MAX_THREADS * BENCH_MT_PAGES];
+    static const int thread_counts[] = { 1, 2, 4, 8 };
+    qspi_flash_lock_stats_t op_stats[ARRAY_SIZE(thread_counts)];
+    qspi_flash_lock_stats_t bus_stats[ARRAY_SIZE(thread_counts)];
+    uint32_t summary[ARRAY_SIZE(thread_counts)][6];
+    char rx_buf[QSPI_FLASH_PAGE_SIZE];
+    Timer timer;
+
+    for (unsigned int c = 0; c < ARRAY_SIZE(thread_counts); c++) {
+        int n = thread_counts[c];
+        Thread *threads[BENCH_MT_MAX_THREADS];
+        char name[16];                  // "mt" and any int
+        int errors = 0;
+
+        myFlash->reset_lock_stats();
+        timer.reset();
+        timer.start();
+        for (int t = 0; t < n; t++) {
+            memset(&bench_mt_threads[t], 0, sizeof(bench_mt_threads[t]));
+            bench_mt_threads[t].id = t;
+            threads[t] = new Thread();
+            threads[t]->start(callback(BenchMtWorker, &bench_mt_threads[t]));
+        }
+        for (int t = 0; t < n; t++) {
+            threads[t]->join();
+            delete threads[t];
+        }
+        timer.stop();
+        op_stats[c] = myFlash->get_op_lock_stats();
+        bus_stats[c] = myFlash->get_bus_lock_stats();
+
+        // Data integrity: the last round of every thread
+        for (int t = 0; t < n; t++) {
+            uint32_t base = BENCH_MT_ADDR + t * BENCH_MT_SECTORS * _4_K_;
+            errors += bench_mt_threads[t].errors;
+            for (uint32_t offset = 0; offset < BENCH_MT_SECTORS * _4_K_; offset += sizeof(rx_buf)) {
+                errors += (QSPI_STATUS_OK != myFlash->read(base + offset, rx_buf, sizeof(rx_buf)));
+                for (uint32_t i = 0; i < sizeof(rx_buf); i++) {
+                    errors += (rx_buf[i] != BenchMtByte(t, BENCH_MT_ROUNDS - 1, offset + i));
+                }
+            }
+        }
+        if (errors) {
+            printf("\nERROR: %d errors with %d threads", errors, n);
+        }
+
+        snprintf(name, sizeof(name), "mt%d", n);
+        int count = 0;
+        for (int t = 0; t < n; t++) {
+            memcpy(&samples[count], bench_mt_threads[t].read_us, sizeof(bench_mt_threads[t].read_us));
+            count += BENCH_MT_PAGES;
+        }
+        ReportResult(name, "read", QSPI_FLASH_PAGE_SIZE, samples, count);
+        count = 0;
+        for (int t = 0; t < n; t++) {
+            memcpy(&samples[count], bench_mt_threads[t].program_us, sizeof(bench_mt_threads[t].program_us));
+            count += BENCH_MT_PAGES;
+        }
+        ReportResult(name, "program", QSPI_FLASH_PAGE_SIZE, samples, count);
+        count = 0;
+        for (int t = 0; t < n; t++) {
+            memcpy(&samples[count], bench_mt_threads[t].erase_us, sizeof(bench_mt_threads[t].erase_us));
+            count += BENCH_MT_SECTORS * BENCH_MT_ROUNDS;
+        }
+        ReportResult(name, "erase", _4_K_, samples, count);
+
+        // Jain's fairness index over rates of equal work: (sum r)^2 / (n * sum r^2)
+        double sum = 0.0;
+        double sum_sq = 0.0;
+        uint32_t slowest = 0;
+        uint32_t fastest = 0xFFFFFFFF;
+        for (int t = 0; t < n; t++) {
+            uint32_t us = bench_mt_threads[t].elapsed_us ? bench_mt_threads[t].elapsed_us : 1;
+            double rate = 1.0 / us;
+            sum += rate;
+            sum_sq += rate * rate;
+            slowest = (us > slowest) ? us : slowest;
+            fastest = (us < fastest) ? us : fastest;
+        }
+        uint32_t elapsed_us = timer.read_us() ? timer.read_us() : 1;
+        uint64_t bytes = (uint64_t)n * BENCH_MT_PAGES * QSPI_FLASH_PAGE_SIZE * 2;
+        summary[c][0] = elapsed_us;
+        summary[c][1] = (uint32_t)(bytes * 1000 / elapsed_us);
+        summary[c][2] = (uint32_t)(sum * sum / (n * sum_sq) * 1000 + 0.5);
+        summary[c][3] = slowest;
+        summary[c][4] = fastest;
+        summary[c][5] = errors;
+    }
+
+    printf("\n#MT,threads,elapsed_us,kb_per_s,fairness_x1000,slowest_us,fastest_us,errors");
+    for (unsigned int c = 0; c < ARRAY_SIZE(thread_counts); c++) {
+        printf("\nMT,%d,%lu,%lu,%lu,%lu,%lu,%lu", thread_counts[c], (unsigned long)summary[c][0],
+               (unsigned long)summary[c][1], (unsigned long)summary[c][2], (unsigned long)summary[c][3],
+               (unsigned long)summary[c][4], (unsigned long)summary[c][5]);
+    }
+    printf("\n#MT_LOCK,threads,lock,locks,contended,wait_avg_us,wait_max_us,hold_avg_us,hold_max_us");
+    for (unsigned int c = 0; c < ARRAY_SIZE(thread_counts); c++) {
+        ReportLockStats(thread_counts[c], "op", &op_stats[c]);
+        ReportLockStats(thread_counts[c], "bus", &bus_stats[c]);
+    }
+}
+
+// BENCH_MAX_SIZE reads and 4K programs at the current clock and dummy cycles
+static bool TimeReadProgram(QSPIFlash *flash, uint32_t *read_samples, uint32_t *program_samples)
+{
+    Timer timer;
+
+    for (int i = 0; i < BENCH_ITERATIONS; i++) {
+        timer.reset();
+        timer.start();
+        qspi_status_t result = flash->read(BENCH_FLASH_ADDR, bench_rx_buf, BENCH_MAX_SIZE);
+        timer.stop();
+        read_samples[i] = timer.read_us();
+        if (result != QSPI_STATUS_OK || QSPI_STATUS_OK != flash->erase_sector(BENCH_FLASH_ADDR) ||
+                QSPI_STATUS_OK != flash->wait_ready()) {
+            printf("\nERROR: Read or erase failed");
+            return false;
+        }
+        timer.reset();
+        timer.start();
+        result = flash->program(BENCH_FLASH_ADDR, bench_tx_buf, _4_K_);
+        timer.stop();
+        program_samples[i] = timer.read_us();
+        if (result != QSPI_STATUS_OK) {
+            printf("\nERROR: Program failed");
+            return false;
+        }
+    }
+    return true;
+}
+
+static uint64_t SumSamples(const uint32_t *samples)
+{
+    uint64_t total = 0;
+    for (int i = 0; i < BENCH_ITERATIONS; i++) {
+        total += samples[i] ? samples[i] : 1;
+    }
+    return total;
+}
+
+// Each format at the default clock, then calibrated: the sweep, the boot
+// that finds the record, and what the calibrated setting gains
+static void BenchCalibrate()
+{
+    uint32_t read_samples[2][BENCH_ITERATIONS];
+    uint32_t program_samples[2][BENCH_ITERATIONS];
+    uint32_t sweep_us[ARRAY_SIZE(bench_formats)];
+    uint32_t load_us[ARRAY_SIZE(bench_formats)];
+    qspi_flash_calibration_t cal[ARRAY_SIZE(bench_formats)];
+    uint32_t gain_x100[ARRAY_SIZE(bench_formats)][2];
+    QSPIFlash flash(myQspi);
+    Timer timer;
+
+    if (QSPI_FLASH_ADDR_SIZE == QSPI_CFG_ADDR_SIZE_32) {
+        flash.set_address_size(QSPI_CFG_ADDR_SIZE_32);
+    }
+    for (unsigned int f = 0; f < ARRAY_SIZE(bench_formats); f++) {
+        const bench_format_t *fmt = &bench_formats[f];
+        bool swept = false;
+        cal[f].hz = 0;
+        if (!fmt->program) {
+            continue;
+        }
+        flash.set_trace_format(QSPI_TRACE_FORMAT(QSPI_CFG_BUS_SINGLE, fmt->address_width, fmt->data_width));
+        if (QSPI_STATUS_OK != myQspi->set_frequency(QSPI_CALIBRATE_DEFAULT_HZ) ||
+                QSPI_STATUS_OK != myQspi->configure_format(QSPI_CFG_BUS_SINGLE, fmt->address_width, QSPI_FLASH_ADDR_SIZE, QSPI_CFG_BUS_SINGLE, QSPI_CFG_ALT_SIZE_NONE, fmt->data_width, 0, 0) ||
+                !TimeReadProgram(&flash, read_samples[0], program_samples[0]) ||
+                QSPI_STATUS_OK != flash.erase_sector(QSPI_CALIBRATE_ADDR)) {
+            continue;
+        }
+
+        timer.reset();
+        timer.start();
+        qspi_status_t result = qspi_flash_calibrate(&flash, myQspi, fmt->address_width, fmt->data_width, &cal[f], &swept);
+        timer.stop();
+        sweep_us[f] = timer.read_us();
+        timer.reset();
+        timer.start();
+        if (result == QSPI_STATUS_OK) {
+            result = qspi_flash_calibrate(&flash, myQspi, fmt->address_width, fmt->data_width, &cal[f], &swept);
+        }
+        timer.stop();
+        load_us[f] = timer.read_us();
+        if (result != QSPI_STATUS_OK || swept || !TimeReadProgram(&flash, read_samples[1], program_samples[1])) {
+            printf("\nERROR: Calibration failed for %s", fmt->name);
+            cal[f].hz = 0;
+            continue;
+        }
+        gain_x100[f][0] = (uint32_t)(SumSamples(read_samples[0]) * 100 / SumSamples(read_samples[1]));
+        gain_x100[f][1] = (uint32_t)(SumSamples(program_samples[0]) * 100 / SumSamples(program_samples[1]));
+        ReportResult(fmt->name, "read_calibrated", BENCH_MAX_SIZE, read_samples[1], BENCH_ITERATIONS);
+        ReportResult(fmt->name, "program_calibrated", _4_K_, program_samples[1], BENCH_ITERATIONS);
+    }
+    myQspi->set_frequency(QSPI_CALIBRATE_DEFAULT_HZ);
+
+    printf("\n#CALIBRATE,format,hz,dummy_cycles,fastest_hz,min_dummy_cycles,points,failed_reads,sweep_us,load_us,read_gain_x100,program_gain_x100");
+    for (unsigned int f = 0; f < ARRAY_SIZE(bench_formats); f++) {
+        if (cal[f].hz) {
+            printf("\nCALIBRATE,%s,%lu,%d,%lu,%d,%d,%d,%lu,%lu,%lu,%lu", bench_formats[f].name, (unsigned long)cal[f].hz,
+                   cal[f].dummy_cycles, (unsigned long)cal[f].fastest_hz, cal[f].min_dummy_cycles, cal[f].points,
+                   cal[f].failed_reads, (unsigned long)sweep_us[f], (unsigned long)load_us[f],
+                   (unsigned long)gain_x100[f][0], (unsigned long)gain_x100[f][1]);
+        }
+    }
+}
+
+static void BenchBlockDevice()
+{
+    QSPIFlashBlockDevice bd(myQspi);
+    uint32_t samples[4][BENCH_ITERATIONS];
+    static const char *ops[4] = { "fs_create", "fs_append", "fs_append_direct", "fs_read" };
+    Timer timer;
+    bool ok = (BD_ERROR_OK == bd.init());
+
+    for (int i = 0; i < BENCH_ITERATIONS && ok; i++) {
+        bd_addr_t meta = BENCH_FLASH_ADDR + i * 2 * _4_K_;
+        bd_addr_t data = meta + _4_K_;
+
+        timer.reset();
+        timer.start();
+        ok = BD_ERROR_OK == bd.erase(meta, _4_K_) && BD_ERROR_OK == bd.program(bench_tx_buf, meta, BENCH_FS_HEADER) &&
+             BD_ERROR_OK == bd.sync();
+        timer.stop();
+        samples[0][i] = timer.read_us();
+
+        for (int direct = 1; direct >= 0 && ok; direct--) {
+            ok = (BD_ERROR_OK == bd.erase(data, BENCH_FS_FILE_SIZE));
+            timer.reset();
+            timer.start();
+            ok = ok && BenchFsAppend(&bd, data, direct);
+            timer.stop();
+            samples[direct ? 2 : 1][i] = timer.read_us();
+        }
+
+        timer.reset();
+        timer.start();
+        for (unsigned int offset = 0; offset < BENCH_FS_FILE_SIZE && ok; offset += BENCH_FS_READ_SIZE) {
+            ok = (BD_ERROR_OK == bd.read(bench_rx_buf + offset, data + offset, BENCH_FS_READ_SIZE));
+        }
+        timer.stop();
+        samples[3][i] = timer.read_us();
+        ok = ok && (0 == memcmp(bench_tx_buf, bench_rx_buf, BENCH_FS_FILE_SIZE));
+    }
+    if (BD_ERROR_OK != bd.deinit() || !ok) {
+        printf("\nERROR: Block device workload failed");
+        return;
+    }
+
+    for (int op = 0; op < 4; op++) {
+        ReportResult("bd", ops[op], (op == 0) ? BENCH_FS_HEADER : BENCH_FS_FILE_SIZE, samples[op], BENCH_ITERATIONS);
+    }
+}
+
+static void BenchFTL()
+{
+    QSPIFlashFTL ftl(myFlash, BENCH_FTL_ADDR, BENCH_FTL_SECTORS);
+    uint32_t *samples = (uint32_t *)malloc(BENCH_FTL_WRITES * sizeof(uint32_t));
+    uint32_t seed = 1;
+    uint64_t total_us = 0;
+    Timer timer;
+    bool ok = (samples != NULL && QSPI_STATUS_OK == ftl.format());
+
+    // Cold contents everywhere first
+    for (uint32_t offset = 0; offset < ftl.size() && ok; offset += BENCH_MAX_SIZE) {
+        uint32_t len = (ftl.size() - offset < BENCH_MAX_SIZE) ? ftl.size() - offset : BENCH_MAX_SIZE;
+        ok = (QSPI_STATUS_OK == ftl.write(offset, bench_tx_buf, len));
+    }
+    ok = ok && (QSPI_STATUS_OK == ftl.sync());
+    ftl.reset_stats();
+
+    uint32_t records = ftl.size() / BENCH_FTL_RECORD;
+    for (int i = 0; i < BENCH_FTL_WRITES && ok; i++) {
+        seed = seed * 1103515245 + 12345;
+        uint32_t r = seed >> 8;
+        uint32_t record = (r % 10 < 8) ? (r / 10) % (records / 5) : (r / 10) % records;
+        timer.reset();
+        timer.start();
+        ok = (QSPI_STATUS_OK == ftl.write(record * BENCH_FTL_RECORD, bench_tx_buf + (i % 256), BENCH_FTL_RECORD));
+        timer.stop();
+        samples[i] = timer.read_us();
+        total_us += samples[i];
+    }
+    ok = ok && (QSPI_STATUS_OK == ftl.sync());
+    if (!ok) {
+        printf("\nERROR: FTL workload failed");
+        free(samples);
+        return;
+    }
+    ReportResult("ftl", "ftl_write", BENCH_FTL_RECORD, samples, BENCH_FTL_WRITES);
+    free(samples);
+
+    // Write amplification is slots programmed per slot written by the caller
+    qspi_ftl_stats_t stats = ftl.get_stats();
+    uint32_t host_slots = stats.writes - stats.relocated - stats.coalesced;
+    printf("\n#FTL,writes,iops,gc_erases,wear_moves,relocated,write_amp_x100");
+    printf("\nFTL,%d,%lu,%lu,%lu,%lu,%lu", BENCH_FTL_WRITES, (unsigned long)(total_us ? BENCH_FTL_WRITES * 1000000ULL / total_us : 0),
+           (unsigned long)stats.gc_erases, (unsigned long)stats.wear_moves, (unsigned long)stats.relocated,
+           (unsigned long)(host_slots ? stats.slots_written * 100ULL / host_slots : 0));
+
+    // Erase count of every sector of the area, format included
+    printf("\n#FTL_ERASES,min,max,counts...");
+    uint32_t min_erase = 0xFFFFFFFF;
+    uint32_t max_erase = 0;
+    for (int s = 0; s < BENCH_FTL_SECTORS; s++) {
+        uint32_t count = ftl.get_erase_count(s);
+        min_erase = (count < min_erase) ? count : min_erase;
+        max_erase = (count > max_erase) ? count : max_erase;
+    }
+    printf("\nFTL_ERASES,%lu,%lu", (unsigned long)min_erase, (unsigned long)max_erase);
+    for (int s = 0; s < BENCH_FTL_SECTORS; s++) {
+        printf(",%lu", (unsigned long)ftl.get_erase_count(s));
+    }
+}
+
+#if QSPI_TRACE_ENABLED
+// CPU time of BENCH_TRACE_RECORDS calls in ns per call. clock() rather than
+// Timer: on the host Timer runs on the simulator's clock, which CPU work
+// does not advance.
+static uint32_t TimeTraceRecords()
+{
+    clock_t start = clock();
+    for (int i = 0; i < BENCH_TRACE_RECORDS; i++) {
+        qspi_trace_record(QSPI_TRACE_COMMAND, QSPI_STD_CMD_RDSR, QSPI_TRACE_FORMAT_UNKNOWN, 0, 2, qspi_trace_start(), QSPI_STATUS_OK);
+    }
+    return (uint32_t)((double)(clock() - start) * 1e9 / CLOCKS_PER_SEC / BENCH_TRACE_RECORDS);
+}
+
+static void BenchTrace()
+{
+    uint32_t enabled_ns = TimeTraceRecords();
+    qspi_trace_enable(false);
+    uint32_t disabled_ns = TimeTraceRecords();
+    qspi_trace_enable(true);
+    printf("\n#TRACE_COST,records,ns_per_record,ns_per_record_disabled");
+    printf("\nTRACE_COST,%d,%lu,%lu", BENCH_TRACE_RECORDS, (unsigned long)enabled_ns, (unsigned long)disabled_ns);
+
+    // A short sample for tools/trace_decode.py: erase, program 300 B, read it back
+    qspi_trace_clear();
+    if (QSPI_STATUS_OK != myFlash->erase_sector(BENCH_FLASH_ADDR) || QSPI_STATUS_OK != myFlash->wait_ready() ||
+            QSPI_STATUS_OK != myFlash->program(BENCH_FLASH_ADDR, bench_tx_buf, 300) ||
+            QSPI_STATUS_OK != myFlash->read(BENCH_FLASH_ADDR, bench_rx_buf, 300)) {
+        printf("\nERROR: Trace sample failed");
+        return;
+    }
+    qspi_trace_dump();
+}
+#endif // QSPI_TRACE_ENABLED
+
+// Charge the flash supply has delivered, 0 where the board does not measure it
+static uint64_t ReadCharge()
+{
+    uint64_t charge_pc = 0;
+    qspi_flash_hw_charge(&charge_pc);
+    return charge_pc;
+}
+
+// pC per us is uA
+static uint32_t AverageNanoamps(uint64_t charge_pc, uint64_t us)
+{
+    return us ? (uint32_t)(charge_pc * 1000 / us) : 0;
+}
+
+// 1_4_4 calibrated in each mode, so high performance gets the fewer dummy
+// cycles it needs, then BENCH_MAX_SIZE reads and 4K programs with the
+// average current drawn during them. Leaves the part in low power with its
+// calibration applied.
+static bool BenchPowerModes(qspi_flash_calibration_t *low_cal)
+{
+    static const char *names[2] = { "power_low", "power_high" };
+    qspi_flash_calibration_t cal[2];
+    uint32_t read_samples[BENCH_ITERATIONS];
+    uint32_t program_samples[BENCH_ITERATIONS];
+    uint32_t switch_us[2];
+    uint32_t avg_na[2][2];
+    Timer timer;
+
+    myFlash->set_trace_format(QSPI_TRACE_FORMAT(QSPI_CFG_BUS_SINGLE, QSPI_CFG_BUS_QUAD, QSPI_CFG_BUS_QUAD));
+    for (int m = 1; m >= 0; m--) {
+        timer.reset();
+        timer.start();
+        qspi_status_t result = myFlash->set_power_mode(m ? QSPI_FLASH_POWER_HIGH : QSPI_FLASH_POWER_LOW);
+        timer.stop();
+        switch_us[m] = timer.read_us();
+        if (result == QSPI_STATUS_OK) {
+            result = qspi_flash_calibration_sweep(myFlash, myQspi, QSPI_CFG_BUS_QUAD, QSPI_CFG_BUS_QUAD, &cal[m]);
+        }
+        if (result == QSPI_STATUS_OK) {
+            result = qspi_flash_calibration_apply(myFlash, myQspi, QSPI_CFG_BUS_QUAD, QSPI_CFG_BUS_QUAD, &cal[m]);
+        }
+        if (result != QSPI_STATUS_OK) {
+            printf("\nERROR: Calibration in %s failed", names[m]);
+            return false;
+        }
+
+        uint64_t charge = ReadCharge();
+        uint64_t total_us = 0;
+        for (int i = 0; i < BENCH_ITERATIONS && result == QSPI_STATUS_OK; i++) {
+            timer.reset();
+            timer.start();
+            result = myFlash->read(BENCH_FLASH_ADDR, bench_rx_buf, BENCH_MAX_SIZE);
+            timer.stop();
+            read_samples[i] = timer.read_us();
+            total_us += read_samples[i];
+        }
+        avg_na[m][0] = AverageNanoamps(ReadCharge() - charge, total_us);
+
+        // The erases are left out of the program figures
+        charge = 0;
+        total_us = 0;
+        for (int i = 0; i < BENCH_ITERATIONS && result == QSPI_STATUS_OK; i++) {
+            result = myFlash->erase_sector(BENCH_FLASH_ADDR);
+            if (result == QSPI_STATUS_OK) {
+                result = myFlash->wait_ready();
+            }
+            uint64_t start = ReadCharge();
+            timer.reset();
+            timer.start();
+            if (result == QSPI_STATUS_OK) {
+                result = myFlash->program(BENCH_FLASH_ADDR, bench_tx_buf, _4_K_);
+            }
+            timer.stop();
+            charge += ReadCharge() - start;
+            program_samples[i] = timer.read_us();
+            total_us += program_samples[i];
+        }
+        avg_na[m][1] = AverageNanoamps(charge, total_us);
+        if (result != QSPI_STATUS_OK) {
+            printf("\nERROR: Read or program in %s failed", names[m]);
+            return false;
+        }
+        ReportResult(names[m], "read", BENCH_MAX_SIZE, read_samples, BENCH_ITERATIONS);
+        ReportResult(names[m], "program", _4_K_, program_samples, BENCH_ITERATIONS);
+    }
+
+    printf("\n#POWER,mode,hz,dummy_cycles,switch_us,read_avg_na,program_avg_na");
+    for (int m = 0; m < 2; m++) {
+        printf("\nPOWER,%s,%lu,%d,%lu,%lu,%lu", names[m], (unsigned long)cal[m].hz, cal[m].dummy_cycles,
+               (unsigned long)switch_us[m], (unsigned long)avg_na[m][0], (unsigned long)avg_na[m][1]);
+    }
+    *low_cal = cal[0];
+    return true;
+}
+
+// An idle period followed by a small read, in standby and in deep
+// power-down: the average current over both against the read's latency,
+// which in deep power-down includes the release
+static void BenchPowerIdle()
+{
+    static const uint32_t idle_ms[] = { 1, 10, 100, 1000 };
+    Timer timer;
+    Timer read_timer;
+
+    printf("\n#POWER_IDLE,idle_ms,standby_avg_na,deep_down_avg_na,standby_read_us,deep_down_read_us");
+    for (unsigned int i = 0; i < ARRAY_SIZE(idle_ms); i++) {
+        uint32_t avg_na[2];
+        uint32_t read_us[2];
+        for (int deep = 0; deep < 2; deep++) {
+            uint64_t charge = ReadCharge();
+            timer.reset();
+            timer.start();
+            if (deep) {
+                myFlash->set_power_mode(QSPI_FLASH_POWER_DEEP_DOWN);
+            }
+            Thread::wait(idle_ms[i]);
+            read_timer.reset();
+            read_timer.start();
+            qspi_status_t result = myFlash->read(BENCH_FLASH_ADDR, bench_rx_buf, BENCH_POWER_SMALL);
+            read_timer.stop();
+            timer.stop();
+            if (result != QSPI_STATUS_OK) {
+                printf("\nERROR: Read after idle failed");
+                return;
+            }
+            avg_na[deep] = AverageNanoamps(ReadCharge() - charge, timer.read_us());
+            read_us[deep] = read_timer.read_us();
+        }
+        printf("\nPOWER_IDLE,%lu,%lu,%lu,%lu,%lu", (unsigned long)idle_ms[i], (unsigned long)avg_na[0],
+               (unsigned long)avg_na[1], (unsigned long)read_us[0], (unsigned long)read_us[1]);
+    }
+}
+
+// QSPIFlashPower settings on BENCH_POWER_ROUNDS rounds of the bursty workload
+static void BenchPowerPolicy()
+{
+    typedef struct {
+        const char *name;
+        size_t bulk_size;
+        uint32_t deep_down_idle_ms;
+    } bench_policy_t;
+    static const bench_policy_t policies[] = {
+        { "always_low", 0,                      0                               },
+        { "deep_down",  0,                      QSPI_POWER_DEEP_DOWN_IDLE_MS    },
+        { "bulk_high",  BENCH_MAX_SIZE,         QSPI_POWER_DEEP_DOWN_IDLE_MS    },
+    };
+    Timer timer;
+    Timer read_timer;
+
+    printf("\n#POWER_POLICY,policy,rounds,avg_na,bulk_read_avg_us,small_read_avg_us,switches,deep_power_downs,wakeups");
+    for (unsigned int p = 0; p < ARRAY_SIZE(policies); p++) {
+        const bench_policy_t *policy = &policies[p];
+        uint64_t read_us[2] = { 0, 0 };
+        qspi_status_t result = QSPI_STATUS_OK;
+
+        myFlash->set_power_mode(QSPI_FLASH_POWER_LOW);
+        myFlash->reset_power_stats();
+        uint64_t charge = ReadCharge();
+        timer.reset();
+        timer.start();
+        {
+            QSPIFlashPower power(myFlash, policy->bulk_size, QSPI_POWER_LOW_IDLE_MS, policy->deep_down_idle_ms);
+            for (int r = 0; r < BENCH_POWER_ROUNDS && result == QSPI_STATUS_OK; r++) {
+                for (int small = 0; small < 2 && result == QSPI_STATUS_OK; small++) {
+                    read_timer.reset();
+                    read_timer.start();
+                    result = power.read(BENCH_FLASH_ADDR, bench_rx_buf, small ? BENCH_POWER_SMALL : BENCH_MAX_SIZE);
+                    read_timer.stop();
+                    read_us[small] += read_timer.read_us();
+                    Thread::wait(small ? BENCH_POWER_IDLE_MS : BENCH_POWER_GAP_MS);
+                }
+            }
+        }
+        timer.stop();
+        if (result != QSPI_STATUS_OK) {
+            printf("\nERROR: Power policy %s failed", policy->name);
+            continue;
+        }
+        qspi_flash_power_stats_t stats = myFlash->get_power_stats();
+        printf("\nPOWER_POLICY,%s,%d,%lu,%lu,%lu,%lu,%lu,%lu", policy->name, BENCH_POWER_ROUNDS,
+               (unsigned long)AverageNanoamps(ReadCharge() - charge, timer.read_us()),
+               (unsigned long)(read_us[0] / BENCH_POWER_ROUNDS), (unsigned long)(read_us[1] / BENCH_POWER_ROUNDS),
+               (unsigned long)stats.switches, (unsigned long)stats.deep_power_downs, (unsigned long)stats.wakeups);
+    }
+    myFlash->set_power_mode(QSPI_FLASH_POWER_LOW);
+}
+
+static void BenchPower()
+{
+    qspi_flash_calibration_t cal;
+
+    if (BenchPowerModes(&cal)) {
+        BenchPowerIdle();
+        BenchPowerPolicy();
+    }
+    myFlash->set_power_mode(QSPI_FLASH_POWER_LOW);
+    myQspi->set_frequency(QSPI_CALIBRATE_DEFAULT_HZ);
+}
+
+// Command sequences of the erase, init and power paths
+static bool BatchEraseSector()
+{
+    return QSPI_STATUS_OK == myFlash->erase_sector(BENCH_FLASH_ADDR) && WaitForMemReady();
+}
+
+// WREN, erase and the poll for its end as one batch
+static bool BatchErasePoll()
+{
+    char addrbytes[4];
+    char status = 0;
+    size_t addr_len = (myFlash->get_address_size() == QSPI_CFG_ADDR_SIZE_32) ? 4 : 3;
+
+    for (size_t i = 0; i < addr_len; i++) {
+        addrbytes[i] = (BENCH_FLASH_ADDR >> (8 * (addr_len - 1 - i))) & 0xFF;
+    }
+    const qspi_flash_command_t commands[] = {
+        QSPI_FLASH_COMMAND(QSPI_STD_CMD_WREN, NULL, 0, NULL, 0),
+        QSPI_FLASH_COMMAND(QSPI_STD_CMD_SECT_ERASE, addrbytes, addr_len, NULL, 0),
+        QSPI_FLASH_COMMAND_POLL(QSPI_STD_CMD_RDSR, &status, QSPI_FLASH_SR_WIP, 0, QSPI_FLASH_TSE_MAX_US),
+    };
+    return QSPI_STATUS_OK == myFlash->command_batch(commands, ARRAY_SIZE(commands), BENCH_FLASH_ADDR);
+}
+
+static bool BatchInit()
+{
+    return InitializeFlashMem();
+}
+
+// Reads the configuration back and finds nothing to change
+static bool BatchPowerRegs()
+{
+    return QSPI_STATUS_OK == myFlash->set_power_mode(QSPI_FLASH_POWER_LOW);
+}
+
+static void BenchCommandBatch()
+{
+    static const struct {
+        const char *name;
+        bool (*run)();
+    } sequences[] = {
+        { "erase_sector",   BatchEraseSector },
+        { "erase_poll",     BatchErasePoll },
+        { "init",           BatchInit },
+        { "power_regs",     BatchPowerRegs },
+    };
+    uint32_t samples[BENCH_BATCH_ITERATIONS];
+    uint64_t total_us[2];
+    qspi_flash_batch_stats_t stats[2];
+    char op[32];
+    Timer timer;
+
+    printf("\n#BATCH,sequence,commands,calls_separate,calls_batched,separate_us,batched_us,saved_ns_per_call");
+    for (unsigned int q = 0; q < ARRAY_SIZE(sequences); q++) {
+        bool ok = true;
+        for (int batched = 0; batched < 2 && ok; batched++) {
+            myFlash->set_hw_batch(batched == 1);
+            myFlash->reset_batch_stats();
+            total_us[batched] = 0;
+            for (int i = 0; i < BENCH_BATCH_ITERATIONS && ok; i++) {
+                timer.reset();
+                timer.start();
+                ok = sequences[q].run();
+                timer.stop();
+                samples[i] = timer.read_us();
+                total_us[batched] += samples[i];
+            }
+            stats[batched] = myFlash->get_batch_stats();
+            if (!ok) {
+                printf("\nERROR: %s failed", sequences[q].name);
+                break;
+            }
+            snprintf(op, sizeof(op), batched ? "%s_batched" : "%s", sequences[q].name);
+            ReportResult("cmd", op, 0, samples, BENCH_BATCH_ITERATIONS);
+        }
+        if (!ok) {
+            continue;
+        }
+
+        // The time saved over the driver calls saved; 0 where the board
+        // sends every command through the driver either way
+        uint32_t calls_saved = (stats[0].driver_calls > stats[1].driver_calls) ? stats[0].driver_calls - stats[1].driver_calls : 0;
+        uint64_t saved_us = (total_us[0] > total_us[1]) ? total_us[0] - total_us[1] : 0;
+        printf("\nBATCH,%s,%lu,%lu,%lu,%lu,%lu,%lu", sequences[q].name,
+               (unsigned long)(stats[1].commands / BENCH_BATCH_ITERATIONS),
+               (unsigned long)(stats[0].driver_calls / BENCH_BATCH_ITERATIONS),
+               (unsigned long)(stats[1].driver_calls / BENCH_BATCH_ITERATIONS),
+               (unsigned long)(total_us[0] / BENCH_BATCH_ITERATIONS), (unsigned long)(total_us[1] / BENCH_BATCH_ITERATIONS),
+               (unsigned long)(calls_saved ? saved_us * 1000 / calls_saved : 0));
+    }
+    myFlash->set_hw_batch(true);
+}
+
+static bool BenchPreEraseRun(uint32_t gap_ms, bool background)
+{
+    uint32_t samples[BENCH_PRE_ERASE_RECORDS];
+    uint32_t addr = 0;
+    qspi_status_t result = QSPI_STATUS_OK;
+    char op[32];
+    Timer timer;
+
+    QSPIFlashPreErase *pre_erase = background ? new QSPIFlashPreErase(myFlash, BENCH_PRE_ERASE_ADDR, BENCH_PRE_ERASE_SECTORS) : NULL;
+    for (int r = 0; r < BENCH_PRE_ERASE_RECORDS && result == QSPI_STATUS_OK; r++) {
+        uint32_t offset = (r * BENCH_PRE_ERASE_RECORD) % QSPI_FLASH_SECTOR_SIZE;
+        Thread::wait(gap_ms);
+        timer.reset();
+        timer.start();
+        if (offset == 0) {
+            if (pre_erase) {
+                result = pre_erase->next_sector(&addr);
+            } else {
+                unsigned int sector = (r * BENCH_PRE_ERASE_RECORD / QSPI_FLASH_SECTOR_SIZE) % BENCH_PRE_ERASE_SECTORS;
+                addr = BENCH_PRE_ERASE_ADDR + sector * QSPI_FLASH_SECTOR_SIZE;
+                result = (SectorErase(addr) && WaitForMemReady()) ? QSPI_STATUS_OK : QSPI_STATUS_ERROR;
+            }
+        }
+        if (result == QSPI_STATUS_OK) {
+            result = pre_erase ? pre_erase->program(addr + offset, bench_tx_buf, BENCH_PRE_ERASE_RECORD) :
+                     myFlash->program(addr + offset, bench_tx_buf, BENCH_PRE_ERASE_RECORD);
+        }
+        timer.stop();
+        samples[r] = timer.read_us();
+    }
+    if (result != QSPI_STATUS_OK) {
+        printf("\nERROR: Log write failed(addr = 0x%08lX)", (unsigned long)addr);
+        delete pre_erase;
+        return false;
+    }
+
+    snprintf(op, sizeof(op), "%s_gap%lu", background ? "write_pre_erased" : "write_erase_first", (unsigned long)gap_ms);
+    ReportResult("pre_erase", op, BENCH_PRE_ERASE_RECORD, samples, BENCH_PRE_ERASE_RECORDS);
+    if (pre_erase) {
+        qspi_pre_erase_stats_t stats = pre_erase->get_stats();
+        printf("\nPRE_ERASE,%lu,%lu,%lu,%lu,%lu,%lu", (unsigned long)gap_ms, (unsigned long)stats.sectors,
+               (unsigned long)stats.pre_erased, (unsigned long)stats.waited, (unsigned long)stats.foreground_erases,
+               (unsigned long)stats.background_erases);
+        delete pre_erase;
+    }
+    return true;
+}
+
+static void BenchPreErase()
+{
+    static const uint32_t gaps_ms[] = { 50, 10 };
+
+    printf("\n#PRE_ERASE,gap_ms,sectors,pre_erased,waited,foreground_erases,background_erases");
+    for (unsigned int g = 0; g < ARRAY_SIZE(gaps_ms); g++) {
+        if (BenchPreEraseRun(gaps_ms[g], false)) {
+            BenchPreEraseRun(gaps_ms[g], true);
+        }
+    }
+}
+
+// Time of all the writes, a final sync included; 0 on failure
+static uint64_t BenchWriteBufferRun(const char *pattern, bool streams, QSPIWriteBuffer *wbuf, uint32_t *programs)
+{
+    static uint32_t samples[BENCH_WBUF_WRITES];
+    uint64_t total_us = 0;
+    qspi_status_t result = QSPI_STATUS_OK;
+    char op[32];
+    Timer timer;
+
+    if (!EraseRegion(BENCH_WBUF_ADDR, 2 * _4_K_)) {
+        return 0;
+    }
+    for (int i = 0; i < BENCH_WBUF_WRITES && result == QSPI_STATUS_OK; i++) {
+        uint32_t addr = streams ? BENCH_WBUF_ADDR + (i % 2) * _4_K_ + (i / 2) * BENCH_WBUF_RECORD : BENCH_WBUF_ADDR + i * BENCH_WBUF_RECORD;
+        timer.reset();
+        timer.start();
+        result = wbuf ? wbuf->program(addr, bench_tx_buf + i * BENCH_WBUF_RECORD, BENCH_WBUF_RECORD) :
+                 myFlash->program(addr, bench_tx_buf + i * BENCH_WBUF_RECORD, BENCH_WBUF_RECORD);
+        timer.stop();
+        samples[i] = timer.read_us();
+        total_us += samples[i];
+    }
+    if (wbuf && result == QSPI_STATUS_OK) {
+        timer.reset();
+        timer.start();
+        result = wbuf->sync();
+        timer.stop();
+        total_us += timer.read_us();
+    }
+    if (result != QSPI_STATUS_OK) {
+        printf("\nERROR: %s writes failed", pattern);
+        return 0;
+    }
+    *programs = wbuf ? wbuf->get_stats().page_programs : BENCH_WBUF_WRITES;
+
+    snprintf(op, sizeof(op), "%s_%s", wbuf ? "write_buffered" : "write_direct", pattern);
+    ReportResult("wbuf", op, BENCH_WBUF_RECORD, samples, BENCH_WBUF_WRITES);
+    return total_us ? total_us : 1;
+}
+
+static void BenchWriteBuffer()
+{
+    static const char *patterns[] = { "sequential", "two_streams" };
+
+    printf("\n#WBUF,pattern,writes,programs_direct,programs_buffered,direct_kb_per_s,buffered_kb_per_s");
+    for (unsigned int p = 0; p < ARRAY_SIZE(patterns); p++) {
+        QSPIWriteBuffer wbuf(myFlash);
+        uint32_t programs[2];
+        uint64_t direct_us = BenchWriteBufferRun(patterns[p], p == 1, NULL, &programs[0]);
+        uint64_t buffered_us = direct_us ? BenchWriteBufferRun(patterns[p], p == 1, &wbuf, &programs[1]) : 0;
+        if (buffered_us == 0) {
+            continue;
+        }
+        // Bytes per millisecond is KB/s (10^3 bytes)
+        printf("\nWBUF,%s,%d,%lu,%lu,%lu,%lu", patterns[p], BENCH_WBUF_WRITES, (unsigned long)programs[0],
+               (unsigned long)programs[1], (unsigned long)(_4_K_ * 1000ULL / direct_us),
+               (unsigned long)(_4_K_ * 1000ULL / buffered_us));
+    }
+}
+
+// InitializeFlashMem with no map, with a map to write from a scan (the
+// first start) and with one to mount, its journal all but full
+static void BenchSectorMap()
+{
+    static const uint32_t sizes[BENCH_MAP_MAX_SIZES] = BENCH_MAP_SIZES;
+    uint32_t samples[3][BENCH_ITERATIONS];
+    char zero = 0;
+    Timer timer;
+
+    printf("\n#SECTOR_MAP,size_mb,sectors,map_bytes,journal_entries,init_us,init_scan_us,init_mount_us");
+    for (int n = 0; n < BENCH_MAP_MAX_SIZES && sizes[n] <= QSPI_FLASH_SIZE; n++) {
+        unsigned int sectors = sizes[n] / QSPI_FLASH_SECTOR_SIZE;
+        sectors -= QSPIFlashSectorMap::map_size(sectors) / QSPI_FLASH_SECTOR_SIZE;
+        uint32_t map_addr = sectors * QSPI_FLASH_SECTOR_SIZE;
+        uint32_t entries = 0;
+        bool ok = EraseRegion(map_addr, QSPIFlashSectorMap::map_size(sectors));
+
+        for (int i = 0; i < BENCH_ITERATIONS && ok; i++) {
+            timer.reset();
+            timer.start();
+            ok = InitializeFlashMem();
+            timer.stop();
+            samples[0][i] = timer.read_us();
+        }
+
+        QSPIFlashSectorMap map(myFlash, 0, sectors, map_addr);
+        mySectorMap = &map;
+        timer.reset();
+        timer.start();
+        ok = ok && InitializeFlashMem();
+        timer.stop();
+        samples[1][0] = timer.read_us();
+
+        // A change per entry on the sectors below the map, short of a rewrite
+        for (uint32_t addr = map_addr - QSPI_FLASH_SECTOR_SIZE; ok && entries + 2 < QSPI_SECTOR_MAP_JOURNAL_ENTRIES;
+                addr -= QSPI_FLASH_SECTOR_SIZE) {
+            ok = (QSPI_STATUS_OK == map.program(addr, &zero, 1) && QSPI_STATUS_OK == map.mark_dirty(addr, 1));
+            entries = map.get_stats().journal_entries;
+        }
+
+        for (int i = 0; i < BENCH_ITERATIONS && ok; i++) {
+            QSPIFlashSectorMap remount(myFlash, 0, sectors, map_addr);
+            mySectorMap = &remount;
+            timer.reset();
+            timer.start();
+            ok = InitializeFlashMem() && remount.get_stats().sectors_scanned == 0;
+            timer.stop();
+            samples[2][i] = timer.read_us();
+        }
+        mySectorMap = NULL;
+        if (!ok) {
+            printf("\nERROR: Sector map start-up failed");
+            return;
+        }
+
+        ReportResult("sector_map", "init", sizes[n], samples[0], BENCH_ITERATIONS);
+        ReportResult("sector_map", "init_scan", sizes[n], samples[1], 1);
+        ReportResult("sector_map", "init_mount", sizes[n], samples[2], BENCH_ITERATIONS);
+        printf("\nSECTOR_MAP,%lu,%u,%lu,%lu,%lu,%lu,%lu", (unsigned long)(sizes[n] / (_1_K_ * _1_K_)), sectors,
+               (unsigned long)QSPIFlashSectorMap::map_size(sectors), (unsigned long)entries,
+               (unsigned long)Percentile(samples[0], BENCH_ITERATIONS, 50), (unsigned long)samples[1][0],
+               (unsigned long)Percentile(samples[2], BENCH_ITERATIONS, 50));
+    }
+}
+
+void RunBenchmarks()
+{
+    bench_tx_buf = (char *)malloc(BENCH_MAX_SIZE);
+    bench_rx_buf = (char *)malloc(BENCH_MAX_SIZE);
+    if (bench_tx_buf == NULL || bench_rx_buf == NULL) {
+        printf("\nERROR: benchmark buffer alloc failed");
+        free(bench_tx_buf);
+        free(bench_rx_buf);
+        return;
+    }
+    for (int i = 0; i < BENCH_MAX_SIZE; i++) {
+        bench_tx_buf[i] = (char)(i * 7 + 3);
+    }
+
+    QSPIReadCache cache(BENCH_CACHE_LINES);
+    myFlash->reset_wait_stats();
+    myFlash->reset_write_stats();
+    printf("\n#BENCH,format,op,size_bytes,iterations,mb_per_s,p50_us,p99_us");
+    for (unsigned int f = 0; f < ARRAY_SIZE(bench_formats); f++) {
+        const bench_format_t *fmt = &bench_formats[f];
+        if (QSPI_STATUS_OK != myQspi->configure_format(QSPI_CFG_BUS_SINGLE, fmt->address_width, QSPI_FLASH_ADDR_SIZE, QSPI_CFG_BUS_SINGLE, QSPI_CFG_ALT_SIZE_NONE, fmt->data_width, 0, 0)) {
+            printf("\nERROR: Failed configuring QSPI driver for %s", fmt->name);
+            continue;
+        }
+        myFlash->set_trace_format(QSPI_TRACE_FORMAT(QSPI_CFG_BUS_SINGLE, fmt->address_width, fmt->data_width));
+        if (false == InitializeFlashMem()) {
+            printf("\nERROR: Unable to initialize flash memory for %s", fmt->name);
+            continue;
+        }
+
+        for (unsigned int s = 0; s < ARRAY_SIZE(bench_sizes); s++) {
+            BenchRead(fmt, bench_sizes[s]);
+        }
+        myFlash->set_read_cache(&cache);
+        for (unsigned int s = 0; s < ARRAY_SIZE(bench_sizes); s++) {
+            BenchCachedRead(fmt, bench_sizes[s]);
+        }
+        myFlash->set_read_cache(NULL);
+        // Continuous reads are always 1_4_4, compare them in that format only
+        if (fmt->address_width == QSPI_CFG_BUS_QUAD) {
+            for (unsigned int s = 0; s < ARRAY_SIZE(bench_sizes) && bench_sizes[s] <= _1_K_; s++) {
+                BenchSequentialRead(fmt, bench_sizes[s], false);
+                BenchSequentialRead(fmt, bench_sizes[s], true);
+            }
+        }
+        if (fmt->program) {
+            for (unsigned int s = 0; s < ARRAY_SIZE(bench_sizes); s++) {
+                BenchProgram(fmt, bench_sizes[s], false);
+            }
+            for (unsigned int s = 0; s < ARRAY_SIZE(bench_sizes); s++) {
+                BenchProgram(fmt, bench_sizes[s], true);
+            }
+            bool image = (fmt->address_width == QSPI_CFG_BUS_QUAD);
+            if (PrepareVerifyArea(image ? BENCH_VERIFY_IMAGE : BENCH_MAX_SIZE)) {
+                for (unsigned int s = 0; s < ARRAY_SIZE(bench_sizes); s++) {
+                    if (bench_sizes[s] >= _4_K_) {
+                        BenchVerify(fmt, bench_sizes[s], false);
+                        BenchVerify(fmt, bench_sizes[s], true);
+                    }
+                }
+                if (image) {
+                    BenchVerify(fmt, BENCH_VERIFY_IMAGE, false);
+                    BenchVerify(fmt, BENCH_VERIFY_IMAGE, true);
+                }
+            }
+            for (unsigned int s = 0; s < ARRAY_SIZE(bench_sizes) && bench_sizes[s] <= _4_K_; s++) {
+                BenchLogWrite(fmt, bench_sizes[s], false);
+                BenchLogWrite(fmt, bench_sizes[s], true);
+            }
+            for (unsigned int s = 0; s < ARRAY_SIZE(bench_sizes); s++) {
+                if (bench_sizes[s] >= _4_K_) {
+                    BenchErase(fmt, bench_sizes[s]);
+                    BenchEraseRange(fmt, bench_sizes[s]);
+                }
+            }
+        }
+    }
+
+    BenchSFDP();
+    BenchBlockDevice();
+    BenchFTL();
+#if QSPI_TRACE_ENABLED
+    BenchTrace();
+#endif
+    BenchCalibrate();
+    BenchBusSharing();
+    BenchContention();
+    BenchPower();
+    BenchCommandBatch();
+    BenchPreErase();
+    BenchWriteBuffer();
+    BenchSectorMap();
+
+    // Cost of waiting for the part over the whole run: status reads issued
+    // per wait is what the CPU spends instead of sleeping
+    qspi_flash_wait_stats_t stats = myFlash->get_wait_stats();
+    printf("\n#WAIT,waits,polls,timeouts,avg_us,max_us");
+    printf("\nWAIT,%lu,%lu,%lu,%lu,%lu", (unsigned long)stats.waits, (unsigned long)stats.polls,
+           (unsigned long)stats.timeouts, (unsigned long)(stats.waits ? stats.total_us / stats.waits : 0),
+           (unsigned long)stats.max_us);
+
+    // Erases the log_smart_write rows did without
+    qspi_flash_write_stats_t write_stats = myFlash->get_write_stats();
+    printf("\n#WRITE,writes,erases,erases_avoided,pages_programmed,pages_skipped");
+    printf("\nWRITE,%lu,%lu,%lu,%lu,%lu", (unsigned long)write_stats.writes, (unsigned long)write_stats.erases,
+           (unsigned long)write_stats.erases_avoided, (unsigned long)write_stats.pages_programmed,
+           (unsigned long)write_stats.pages_skipped);
+
+    // Hits and misses of the read_cached rows, the warm-up read of each size included
+    qspi_read_cache_stats_t cache_stats = cache.get_stats();
+    printf("\n#CACHE,hits,misses,fills,evictions,invalidations");
+    printf("\nCACHE,%lu,%lu,%lu,%lu,%lu\n", (unsigned long)cache_stats.hits, (unsigned long)cache_stats.misses,
+           (unsigned long)cache_stats.fills, (unsigned long)cache_stats.evictions, (unsigned long)cache_stats.invalidations);
+
+    free(bench_rx_buf);
+    free(bench_tx_buf);
+    bench_rx_buf = NULL;
+    bench_tx_buf = NULL;
+}
@@ -0,0 +1,10 @@
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+// Sweeps read/program/erase over the bus formats used by the tests and prints
+// one "BENCH,..." CSV row per (format, operation, size). The header row starts
+// with "#BENCH" so the rows can be cut out of the console log and compared
+// against a saved baseline with tools/bench_compare.py.
+void RunBenchmarks();
+
+#endif // BENCHMARK_H
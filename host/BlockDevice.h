@@ -0,0 +1,79 @@
+/* Host stand-in for mbed-os features/storage/blockdevice/BlockDevice.h.
+ *
+ * Same interface and error codes as the mbed class, so block devices written
+ * against it build unchanged on the target.
+ */
+#ifndef MBED_BLOCK_DEVICE_H
+#define MBED_BLOCK_DEVICE_H
+
+#include <stdint.h>
+
+typedef uint64_t bd_addr_t;
+typedef uint64_t bd_size_t;
+
+enum bd_error {
+    BD_ERROR_OK                 = 0,        // no error
+    BD_ERROR_DEVICE_ERROR       = -4001,    // device specific error
+};
+
+class BlockDevice {
+public:
+    virtual ~BlockDevice() {}
+
+    virtual int init() = 0;
+    virtual int deinit() = 0;
+
+    virtual int sync()
+    {
+        return 0;
+    }
+
+    virtual int read(void *buffer, bd_addr_t addr, bd_size_t size) = 0;
+    virtual int program(const void *buffer, bd_addr_t addr, bd_size_t size) = 0;
+
+    virtual int erase(bd_addr_t addr, bd_size_t size)
+    {
+        (void)addr;
+        (void)size;
+        return 0;
+    }
+
+    virtual int trim(bd_addr_t addr, bd_size_t size)
+    {
+        (void)addr;
+        (void)size;
+        return 0;
+    }
+
+    virtual bd_size_t get_read_size() const = 0;
+    virtual bd_size_t get_program_size() const = 0;
+
+    virtual bd_size_t get_erase_size() const
+    {
+        return get_program_size();
+    }
+
+    virtual int get_erase_value() const
+    {
+        return -1;
+    }
+
+    virtual bd_size_t size() const = 0;
+
+    bool is_valid_read(bd_addr_t addr, bd_size_t size) const
+    {
+        return addr % get_read_size() == 0 && size % get_read_size() == 0 && addr + size <= this->size();
+    }
+
+    bool is_valid_program(bd_addr_t addr, bd_size_t size) const
+    {
+        return addr % get_program_size() == 0 && size % get_program_size() == 0 && addr + size <= this->size();
+    }
+
+    bool is_valid_erase(bd_addr_t addr, bd_size_t size) const
+    {
+        return addr % get_erase_size() == 0 && size % get_erase_size() == 0 && addr + size <= this->size();
+    }
+};
+
+#endif // MBED_BLOCK_DEVICE_H
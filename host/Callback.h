@@ -0,0 +1,79 @@
+/* Host stand-in for mbed platform/Callback.h */
+#ifndef MBED_CALLBACK_H
+#define MBED_CALLBACK_H
+
+#include <functional>
+
+namespace mbed {
+
+template <typename F>
+class Callback;
+
+template <typename R, typename... Args>
+class Callback<R(Args...)> {
+public:
+    Callback(R(*func)(Args...) = 0)
+    {
+        if (func) {
+            _func = func;
+        }
+    }
+
+    template <typename T, typename U>
+    Callback(U *obj, R(T::*method)(Args...))
+    {
+        _func = [obj, method](Args... args) {
+            return (obj->*method)(args...);
+        };
+    }
+
+    template <typename T, typename U>
+    Callback(R(*func)(T *, Args...), U *arg)
+    {
+        _func = [func, arg](Args... args) {
+            return func(arg, args...);
+        };
+    }
+
+    R call(Args... args) const
+    {
+        return _func(args...);
+    }
+
+    R operator()(Args... args) const
+    {
+        return _func(args...);
+    }
+
+    operator bool() const
+    {
+        return (bool)_func;
+    }
+
+private:
+    std::function<R(Args...)> _func;
+};
+
+template <typename R, typename... Args>
+Callback<R(Args...)> callback(R(*func)(Args...) = 0)
+{
+    return Callback<R(Args...)>(func);
+}
+
+template <typename T, typename U, typename R, typename... Args>
+Callback<R(Args...)> callback(U *obj, R(T::*method)(Args...))
+{
+    return Callback<R(Args...)>(obj, method);
+}
+
+template <typename T, typename U, typename R, typename... Args>
+Callback<R(Args...)> callback(R(*func)(T *, Args...), U *arg)
+{
+    return Callback<R(Args...)>(func, arg);
+}
+
+}
+
+using namespace mbed;
+
+#endif // MBED_CALLBACK_H
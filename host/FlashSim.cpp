@@ -0,0 +1,784 @@
+#include "FlashSim.h"
+
+#include <string.h>
+#include <algorithm>
+
+// Opcodes understood by the model
+#define SIM_CMD_WRSR            0x01
+#define SIM_CMD_PP              0x02
+#define SIM_CMD_READ            0x03
+#define SIM_CMD_WRDI            0x04
+#define SIM_CMD_RDSR            0x05
+#define SIM_CMD_WREN            0x06
+#define SIM_CMD_FAST_READ       0x0B
+#define SIM_CMD_RDCR            0x15
+#define SIM_CMD_SE              0x20
+#define SIM_CMD_PP4O            0x32
+#define SIM_CMD_PP4IO           0x38
+#define SIM_CMD_DREAD           0x3B
+#define SIM_CMD_RDSCUR          0x2B
+#define SIM_CMD_RDSFDP          0x5A
+#define SIM_CMD_RESUME          0x30
+#define SIM_CMD_BE32K           0x52
+#define SIM_CMD_CE              0x60
+#define SIM_CMD_RSTEN           0x66
+#define SIM_CMD_QREAD           0x6B
+#define SIM_CMD_RST             0x99
+#define SIM_CMD_RDID            0x9F
+#define SIM_CMD_RDP             0xAB
+#define SIM_CMD_SUSPEND         0xB0
+#define SIM_CMD_DP              0xB9
+#define SIM_CMD_2READ           0xBB
+#define SIM_CMD_CE_ALT          0xC7
+#define SIM_CMD_BE              0xD8
+#define SIM_CMD_4READ           0xEB
+#define SIM_CMD_EN4B            0xB7
+#define SIM_CMD_EX4B            0xE9
+
+// SFDP of the MX25R6435F: header, one parameter header and the JESD216B basic
+// flash parameter table (16 DWORDs, little-endian) at 0x30. The Macronix
+// vendor table is left out.
+static const uint8_t mx25r6435f_sfdp[] = {
+    'S', 'F', 'D', 'P', 0x06, 0x01, 0x00, 0xFF,     // rev 1.6, 1 parameter header
+    0x00, 0x06, 0x01, 0x10, 0x30, 0x00, 0x00, 0xFF, // BFPT rev 1.6, 16 DWORDs at 0x30
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xE5, 0x20, 0xF1, 0xFF,     // 1: 4K erase 0x20, 1-1-2, 1-2-2, 1-4-4, 1-1-4, 3-byte address
+    0xFF, 0xFF, 0xFF, 0x03,     // 2: 64Mbit
+    0x44, 0xEB, 0x08, 0x6B,     // 3: 1-4-4 0xEB 4 dummy + 2 mode, 1-1-4 0x6B 8 dummy
+    0x08, 0x3B, 0x04, 0xBB,     // 4: 1-1-2 0x3B 8 dummy, 1-2-2 0xBB 4 dummy
+    0xEE, 0xFF, 0xFF, 0xFF,     // 5: no 2-2-2, no 4-4-4
+    0xFF, 0xFF, 0x00, 0xFF,     // 6
+    0xFF, 0xFF, 0x00, 0xFF,     // 7
+    0x0C, 0x20, 0x0F, 0x52,     // 8: 4K 0x20, 32K 0x52
+    0x10, 0xD8, 0x00, 0x00,     // 9: 64K 0xD8
+    0x22, 0x02, 0x06, 0x01,     // 10: erase times 48 ms, 128 ms, 256 ms
+    0x81, 0x2D, 0x00, 0x47,     // 11: 256 B pages, program 896 us, chip erase 32 s
+    0x00, 0x00, 0x10, 0x33,     // 12: suspend latency 20 us, 128 us between resume and suspend
+    0x30, 0xB0, 0x30, 0xB0,     // 13: suspend 0xB0, resume 0x30
+    0x04, 0xBD, 0xD5, 0x5C,     // 14: deep power-down 0xB9 / 0xAB, 30 us, WIP polling
+    0x00, 0x02, 0x20, 0x00,     // 15: QE is status register bit 6, 0-4-4 mode
+    0x01, 0x10, 0x00, 0x00,     // 16: 3-byte only, 0x66/0x99 reset
+};
+
+// Typical figures from the MX25R6435F datasheet, high-performance mode; the
+// currents are rounded, the array times taken to be the same in both modes.
+// QE starts set: InitializeFlashMem issues WRSR without a preceding WREN, which
+// the part ignores, so the quad tests rely on QE being set already.
+const FlashSimPart FLASH_SIM_MX25R6435F = {
+    "MX25R6435F",
+    { 0xC2, 0x28, 0x17 },
+    8 * 1024 * 1024,
+    256,
+    4096,
+    FLASH_SIM_SR_QE,
+    850,            // tPP
+    40000,          // tSE
+    120000,         // tBE32K
+    240000,         // tBE
+    30000000,       // tCE
+    10000,          // tW
+    20,             // tESL / tPSL
+    mx25r6435f_sfdp,
+    sizeof(mx25r6435f_sfdp),
+    33000000,       // dummy cycles of the SFDP table, ultra low power mode
+    false,
+    10,             // tDP
+    30,             // tRES1, as in SFDP DWORD14
+    80000000,       // high performance mode
+    5000,           // standby
+    10,             // deep power-down
+    { 3000000, 7000000 },   // reading, ultra low power / high performance
+    { 3000000, 4500000 },   // programming or erasing
+};
+
+// SFDP of the MX25L25645G as far as the model goes: the MX25R6435F table
+// with 3- or 4-byte addresses, 256Mbit, and EN4B / EX4B in DWORD16
+static const uint8_t mx25l25645g_sfdp[] = {
+    'S', 'F', 'D', 'P', 0x06, 0x01, 0x00, 0xFF,     // rev 1.6, 1 parameter header
+    0x00, 0x06, 0x01, 0x10, 0x30, 0x00, 0x00, 0xFF, // BFPT rev 1.6, 16 DWORDs at 0x30
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xE5, 0x20, 0xF3, 0xFF,     // 1: 4K erase 0x20, 1-1-2, 1-2-2, 1-4-4, 1-1-4, 3- or 4-byte address
+    0xFF, 0xFF, 0xFF, 0x0F,     // 2: 256Mbit
+    0x44, 0xEB, 0x08, 0x6B,     // 3: 1-4-4 0xEB 4 dummy + 2 mode, 1-1-4 0x6B 8 dummy
+    0x08, 0x3B, 0x04, 0xBB,     // 4: 1-1-2 0x3B 8 dummy, 1-2-2 0xBB 4 dummy
+    0xEE, 0xFF, 0xFF, 0xFF,     // 5: no 2-2-2, no 4-4-4
+    0xFF, 0xFF, 0x00, 0xFF,     // 6
+    0xFF, 0xFF, 0x00, 0xFF,     // 7
+    0x0C, 0x20, 0x0F, 0x52,     // 8: 4K 0x20, 32K 0x52
+    0x10, 0xD8, 0x00, 0x00,     // 9: 64K 0xD8
+    0x22, 0x02, 0x06, 0x01,     // 10: erase times 48 ms, 128 ms, 256 ms
+    0x81, 0x2D, 0x00, 0x47,     // 11: 256 B pages, program 896 us, chip erase 32 s
+    0x00, 0x00, 0x10, 0x33,     // 12: suspend latency 20 us, 128 us between resume and suspend
+    0x30, 0xB0, 0x30, 0xB0,     // 13: suspend 0xB0, resume 0x30
+    0x04, 0xBD, 0xD5, 0x5C,     // 14: deep power-down 0xB9 / 0xAB, 30 us, WIP polling
+    0x00, 0x02, 0x20, 0x00,     // 15: QE is status register bit 6, 0-4-4 mode
+    0x01, 0x50, 0x00, 0x01,     // 16: enter 4-byte with 0xB7, exit with 0xE9, 0x66/0x99 reset
+};
+
+// A 256Mbit part for trying out 4-byte addresses. The timings are kept those
+// of the MX25R6435F, which QSPIFlash's waits are tuned for, so that only the
+// addressing differs.
+const FlashSimPart FLASH_SIM_MX25L25645G = {
+    "MX25L25645G",
+    { 0xC2, 0x20, 0x19 },
+    32 * 1024 * 1024,
+    256,
+    4096,
+    FLASH_SIM_SR_QE,
+    850,            // tPP
+    40000,          // tSE
+    120000,         // tBE32K
+    240000,         // tBE
+    30000000,       // tCE
+    10000,          // tW
+    20,             // tESL / tPSL
+    mx25l25645g_sfdp,
+    sizeof(mx25l25645g_sfdp),
+    33000000,
+    true,
+    10,
+    30,
+    80000000,
+    5000,
+    10,
+    { 3000000, 7000000 },
+    { 3000000, 4500000 },
+};
+
+// SFDP of the MX66L1G45G: the MX25L25645G table at 1Gbit
+static const uint8_t mx66l1g45g_sfdp[] = {
+    'S', 'F', 'D', 'P', 0x06, 0x01, 0x00, 0xFF,     // rev 1.6, 1 parameter header
+    0x00, 0x06, 0x01, 0x10, 0x30, 0x00, 0x00, 0xFF, // BFPT rev 1.6, 16 DWORDs at 0x30
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xE5, 0x20, 0xF3, 0xFF,     // 1: 4K erase 0x20, 1-1-2, 1-2-2, 1-4-4, 1-1-4, 3- or 4-byte address
+    0xFF, 0xFF, 0xFF, 0x3F,     // 2: 1Gbit
+    0x44, 0xEB, 0x08, 0x6B,     // 3: 1-4-4 0xEB 4 dummy + 2 mode, 1-1-4 0x6B 8 dummy
+    0x08, 0x3B, 0x04, 0xBB,     // 4: 1-1-2 0x3B 8 dummy, 1-2-2 0xBB 4 dummy
+    0xEE, 0xFF, 0xFF, 0xFF,     // 5: no 2-2-2, no 4-4-4
+    0xFF, 0xFF, 0x00, 0xFF,     // 6
+    0xFF, 0xFF, 0x00, 0xFF,     // 7
+    0x0C, 0x20, 0x0F, 0x52,     // 8: 4K 0x20, 32K 0x52
+    0x10, 0xD8, 0x00, 0x00,     // 9: 64K 0xD8
+    0x22, 0x02, 0x06, 0x01,     // 10: erase times 48 ms, 128 ms, 256 ms
+    0x81, 0x2D, 0x00, 0x47,     // 11: 256 B pages, program 896 us, chip erase 32 s
+    0x00, 0x00, 0x10, 0x33,     // 12: suspend latency 20 us, 128 us between resume and suspend
+    0x30, 0xB0, 0x30, 0xB0,     // 13: suspend 0xB0, resume 0x30
+    0x04, 0xBD, 0xD5, 0x5C,     // 14: deep power-down 0xB9 / 0xAB, 30 us, WIP polling
+    0x00, 0x02, 0x20, 0x00,     // 15: QE is status register bit 6, 0-4-4 mode
+    0x01, 0x50, 0x00, 0x01,     // 16: enter 4-byte with 0xB7, exit with 0xE9, 0x66/0x99 reset
+};
+
+// A 1Gbit part with the MX25L25645G's commands and timings, for looking at
+// what grows with the size of the part
+const FlashSimPart FLASH_SIM_MX66L1G45G = {
+    "MX66L1G45G",
+    { 0xC2, 0x20, 0x1B },
+    128 * 1024 * 1024,
+    256,
+    4096,
+    FLASH_SIM_SR_QE,
+    850,            // tPP
+    40000,          // tSE
+    120000,         // tBE32K
+    240000,         // tBE
+    30000000,       // tCE
+    10000,          // tW
+    20,             // tESL / tPSL
+    mx66l1g45g_sfdp,
+    sizeof(mx66l1g45g_sfdp),
+    33000000,
+    true,
+    10,
+    30,
+    80000000,
+    5000,
+    10,
+    { 3000000, 7000000 },
+    { 3000000, 4500000 },
+};
+
+#if defined(QSPI_SIM_MX25L25645G)
+const FlashSimPart &FLASH_SIM_DEFAULT_PART = FLASH_SIM_MX25L25645G;
+#elif defined(QSPI_SIM_MX66L1G45G)
+const FlashSimPart &FLASH_SIM_DEFAULT_PART = FLASH_SIM_MX66L1G45G;
+#else
+const FlashSimPart &FLASH_SIM_DEFAULT_PART = FLASH_SIM_MX25R6435F;
+#endif
+
+FlashSim &FlashSim::instance()
+{
+    static FlashSim sim;
+    return sim;
+}
+
+FlashSim::FlashSim() : _bus_free_ns(0), _board_max_hz(0), _cut_ops(0), _powered(true)
+{
+    reset(FLASH_SIM_DEFAULT_PART);
+}
+
+void FlashSim::reset(const FlashSimPart &part)
+{
+    std::lock_guard<std::mutex> guard(_lock);
+    _part = part;
+    _mem.assign(part.size, 0xFF);
+    _sr = part.sr_power_on;
+    _cr[0] = 0;
+    _cr[1] = 0;
+    _wel = false;
+    _reset_enabled = false;
+    _busy_until_ns = 0;
+    _busy_kind = BUSY_NONE;
+    _busy_addr = 0;
+    _busy_size = 0;
+    _suspended = BUSY_NONE;
+    _suspended_ns = 0;
+    _enhance = false;
+    _addr4 = false;
+    _dpd = false;
+    _dpd_ns = 0;
+    _awake_ns = 0;
+    _charge_ns = SimClock::now_ns();
+    _charge_rem = 0;
+    _cut_ops = 0;
+    _powered = true;
+    memset(&_stats, 0, sizeof(_stats));
+}
+
+void FlashSim::cut_power(uint32_t ops)
+{
+    std::lock_guard<std::mutex> guard(_lock);
+    _cut_ops = ops;
+}
+
+void FlashSim::restore_power()
+{
+    std::lock_guard<std::mutex> guard(_lock);
+    _cut_ops = 0;
+    if (_powered) {
+        return;
+    }
+    _wel = false;
+    _reset_enabled = false;
+    _busy_until_ns = 0;
+    _busy_kind = BUSY_NONE;
+    _suspended = BUSY_NONE;
+    _enhance = false;
+    _addr4 = false;
+    _dpd = false;
+    _awake_ns = 0;
+    _powered = true;
+}
+
+// Counts a program or erase towards the power cut; true for the one it hits
+bool FlashSim::power_fails()
+{
+    if (_cut_ops == 0 || --_cut_ops) {
+        return false;
+    }
+    _powered = false;
+    _wel = false;
+    return true;
+}
+
+void FlashSim::set_board_max_hz(uint32_t hz)
+{
+    std::lock_guard<std::mutex> guard(_lock);
+    _board_max_hz = hz;
+}
+
+uint64_t FlashSim::busy_until_ns()
+{
+    std::lock_guard<std::mutex> guard(_lock);
+    return _busy_until_ns;
+}
+
+FlashSimStats FlashSim::stats()
+{
+    std::lock_guard<std::mutex> guard(_lock);
+    account(SimClock::now_ns());
+    return _stats;
+}
+
+void FlashSim::clear_stats()
+{
+    std::lock_guard<std::mutex> guard(_lock);
+    account(SimClock::now_ns());
+    memset(&_stats, 0, sizeof(_stats));
+    _charge_rem = 0;
+}
+
+void FlashSim::add_charge(uint64_t ns, uint32_t na)
+{
+    uint64_t charge = ns * na + _charge_rem;
+    _stats.charge_fc += charge / 1000;
+    _charge_rem = charge % 1000;
+}
+
+// Current drawn with the bus idle, from where it was accounted up to t_ns
+void FlashSim::account(uint64_t t_ns)
+{
+    uint64_t from = _charge_ns;
+    if (t_ns <= from) {
+        return;
+    }
+    if (from < _busy_until_ns) {
+        uint64_t end = std::min(t_ns, _busy_until_ns);
+        add_charge(end - from, _part.i_busy_na[high_performance()]);
+        from = end;
+    }
+    if (_dpd && from < _dpd_ns) {
+        uint64_t end = std::min(t_ns, _dpd_ns);
+        add_charge(end - from, _part.i_standby_na);
+        from = end;
+    }
+    add_charge(t_ns - from, _dpd ? _part.i_dpd_na : _part.i_standby_na);
+    _charge_ns = t_ns;
+}
+
+bool FlashSim::transfer(const FlashSimTransfer &xfer, uint32_t hz, uint32_t overhead_ns)
+{
+    std::unique_lock<std::mutex> guard(_lock);
+
+    uint64_t start = std::max(SimClock::now_ns() + overhead_ns, _bus_free_ns);
+    uint64_t dur = (bus_cycles(xfer) * 1000000000ULL + hz - 1) / hz;
+
+    // A part in deep power-down does not draw the active current
+    account(start);
+    add_charge(dur, _dpd ? _part.i_dpd_na : _part.i_bus_na[high_performance()]);
+    _charge_ns = std::max(_charge_ns, start + dur);
+
+    // The command takes effect when chip select is released
+    bool accepted = execute(xfer, start + dur);
+
+    // Sampled a clock early: the controller shifts in the bus lines' pull-ups first
+    if (xfer.rx_len && sampled_early(xfer, hz)) {
+        uint8_t lines = xfer.data_lines;
+        uint8_t carry = (uint8_t)(0xFF << (8 - lines));
+        for (size_t i = 0; i < xfer.rx_len; i++) {
+            uint8_t b = xfer.rx[i];
+            xfer.rx[i] = carry | (uint8_t)(b >> lines);
+            carry = (uint8_t)(b << (8 - lines));
+        }
+        _stats.late_reads++;
+    }
+
+    _bus_free_ns = start + dur;
+    _stats.transfers++;
+    _stats.bus_ns += dur;
+    if (!accepted) {
+        _stats.ignored++;
+    }
+    // Other threads may run while the clock moves on
+    guard.unlock();
+    SimClock::sync_to_ns(start + dur);
+    return accepted;
+}
+
+int FlashSim::default_dummy_cycles(uint8_t opcode) const
+{
+    switch (opcode) {
+        case SIM_CMD_FAST_READ:
+        case SIM_CMD_DREAD:
+        case SIM_CMD_QREAD:
+        case SIM_CMD_RDSFDP:
+            return 8;
+        case SIM_CMD_2READ:
+            return 4;
+        case SIM_CMD_4READ:
+            return 6;       // 2 mode cycles + 4 dummy
+        default:
+            return 0;
+    }
+}
+
+uint64_t FlashSim::bus_cycles(const FlashSimTransfer &xfer) const
+{
+    uint64_t cycles = xfer.inst_lines ? 8 / xfer.inst_lines : 0;
+    if (xfer.addr_bytes) {
+        cycles += (xfer.addr_bytes * 8) / xfer.addr_lines;
+    }
+    if (xfer.alt_bytes) {
+        cycles += (xfer.alt_bytes * 8) / xfer.alt_lines;
+    }
+    int dummy = xfer.dummy_cycles;
+    if (dummy < 0) {
+        dummy = default_dummy_cycles(xfer.opcode);
+        if (xfer.alt_bytes && dummy >= 2) {
+            dummy -= 2;
+        }
+    }
+    cycles += dummy;
+    uint64_t data_bits = (uint64_t)(xfer.tx_len + xfer.rx_len) * 8;
+    cycles += (data_bits + xfer.data_lines - 1) / xfer.data_lines;
+    return cycles;
+}
+
+bool FlashSim::sampled_early(const FlashSimTransfer &xfer, uint32_t hz) const
+{
+    if (_board_max_hz && hz > _board_max_hz) {
+        return true;
+    }
+    int needed = default_dummy_cycles(xfer.opcode);
+    if (xfer.dummy_cycles < 0 || needed == 0) {
+        return false;
+    }
+    // Mode clocks of 4READ count as wait cycles, but cannot be cut
+    int wait = xfer.dummy_cycles + (xfer.alt_bytes ? (xfer.alt_bytes * 8) / xfer.alt_lines : 0);
+    if (xfer.opcode == SIM_CMD_4READ && wait < 2) {
+        return true;
+    }
+    // As a custom instruction, the SFDP dummy cycles go out as data after
+    // the address
+    if (xfer.opcode == SIM_CMD_RDSFDP && xfer.addr_bytes == 0 && xfer.tx_len > 3) {
+        wait += (int)(xfer.tx_len - 3) * 8 / xfer.data_lines;
+    }
+    uint32_t dummy_hz = high_performance() ? _part.dummy_hz_hp : _part.dummy_hz;
+    return (uint64_t)wait * dummy_hz < (uint64_t)needed * hz;
+}
+
+uint32_t FlashSim::command_address(const FlashSimTransfer &xfer) const
+{
+    if (xfer.addr_bytes) {
+        return (xfer.addr_bytes == 4) ? xfer.addr : (xfer.addr & 0xFFFFFF);
+    }
+    // Custom instructions carry the address big-endian in the data phase
+    uint32_t addr = 0;
+    for (size_t i = 0; i < xfer.tx_len && i < 4; i++) {
+        addr = (addr << 8) | xfer.tx[i];
+    }
+    return addr;
+}
+
+bool FlashSim::address_matches(const FlashSimTransfer &xfer, uint8_t opcode) const
+{
+    // SFDP is always read with a 3-byte address
+    size_t expected = (_addr4 && opcode != SIM_CMD_RDSFDP) ? 4 : 3;
+
+    // With a byte more or less the part would take data or dummy bits for
+    // address bits; the model ignores such commands rather than act on a
+    // garbled address. An erase also needs chip select to rise right after
+    // the address.
+    if (xfer.addr_bytes) {
+        return xfer.addr_bytes == expected;
+    }
+    return xfer.tx_len == expected;
+}
+
+void FlashSim::start_busy(uint64_t t_ns, uint32_t dur_us, BusyKind kind, uint32_t addr, uint32_t size)
+{
+    _busy_until_ns = t_ns + (uint64_t)dur_us * 1000;
+    _busy_kind = kind;
+    _busy_addr = addr;
+    _busy_size = size;
+    _stats.busy_ns += (uint64_t)dur_us * 1000;
+}
+
+bool FlashSim::suspend(uint64_t t_ns)
+{
+    if (!busy_at(t_ns) || (_busy_kind != BUSY_PROGRAM && _busy_kind != BUSY_ERASE)) {
+        return false;
+    }
+    // The array stops after the suspend latency, with the rest still to do
+    _suspended = _busy_kind;
+    _suspended_ns = _busy_until_ns - t_ns;
+    _busy_until_ns = t_ns + (uint64_t)_part.t_sus_us * 1000;
+    _busy_kind = BUSY_OTHER;
+    _stats.suspends++;
+    return true;
+}
+
+bool FlashSim::resume(uint64_t t_ns)
+{
+    if (_suspended == BUSY_NONE) {
+        return false;
+    }
+    _busy_until_ns = t_ns + _suspended_ns;
+    _busy_kind = _suspended;
+    _suspended = BUSY_NONE;
+    return true;
+}
+
+void FlashSim::do_read(uint32_t addr, uint8_t *rx, size_t len)
+{
+    for (size_t i = 0; i < len; i++) {
+        rx[i] = _mem[(addr + i) % _part.size];
+    }
+    _stats.bytes_read += len;
+}
+
+void FlashSim::do_program(uint32_t addr, const uint8_t *tx, size_t len)
+{
+    uint32_t page_base = (addr % _part.size) & ~(_part.page_size - 1);
+    uint32_t offset = addr & (_part.page_size - 1);
+
+    // Only the last page_size bytes clocked in are latched; the rest wrap
+    if (len > _part.page_size) {
+        offset = (offset + len - _part.page_size) % _part.page_size;
+        tx += len - _part.page_size;
+        len = _part.page_size;
+    }
+    for (size_t i = 0; i < len; i++) {
+        _mem[page_base + ((offset + i) % _part.page_size)] &= tx[i];
+    }
+    _stats.page_programs++;
+    _stats.bytes_programmed += len;
+}
+
+void FlashSim::do_erase(uint32_t addr, uint32_t size)
+{
+    uint32_t base = (addr % _part.size) & ~(size - 1);
+    memset(&_mem[base], 0xFF, size);
+    _stats.erases++;
+}
+
+bool FlashSim::execute(const FlashSimTransfer &xfer, uint64_t t_ns)
+{
+    bool busy = busy_at(t_ns);
+    bool quad = (xfer.data_lines == 4) || (xfer.addr_bytes && xfer.addr_lines == 4);
+    uint8_t opcode = xfer.opcode;
+
+    if (xfer.rx_len) {
+        memset(xfer.rx, 0xFF, xfer.rx_len);
+    }
+    if (!_powered) {
+        return false;
+    }
+
+    // In deep power-down only the release is listened to, and after it
+    // nothing until the part is up again
+    if (_dpd) {
+        if (xfer.inst_lines == 0 || opcode != SIM_CMD_RDP) {
+            return false;
+        }
+        _dpd = false;
+        _awake_ns = t_ns + (uint64_t)_part.t_res1_us * 1000;
+        _stats.wakeups++;
+        return true;
+    }
+    if (t_ns < _awake_ns) {
+        return false;
+    }
+
+    // In performance-enhance mode the first bits clocked in are the address
+    // of another 4READ. An opcode would be taken for address bits; the model
+    // ignores such commands rather than return data from a garbled address.
+    if (_enhance) {
+        if (xfer.inst_lines) {
+            return false;
+        }
+        opcode = SIM_CMD_4READ;
+    } else if (xfer.inst_lines == 0) {
+        return false;
+    }
+
+    if (opcode == SIM_CMD_RDSR) {
+        uint8_t sr = _sr | (_wel ? FLASH_SIM_SR_WEL : 0);
+        if (busy) {
+            sr |= FLASH_SIM_SR_WIP | FLASH_SIM_SR_WEL;
+        }
+        memset(xfer.rx, sr, xfer.rx_len);
+        _stats.status_reads++;
+        return true;
+    }
+    if (opcode == SIM_CMD_SUSPEND) {
+        return suspend(t_ns);
+    }
+
+    // Everything else is ignored while the array is busy
+    if (busy) {
+        return false;
+    }
+
+    // Nothing may be programmed or erased until a suspended operation resumes
+    if (_suspended != BUSY_NONE) {
+        switch (opcode) {
+            case SIM_CMD_WRSR:
+            case SIM_CMD_PP:
+            case SIM_CMD_PP4O:
+            case SIM_CMD_PP4IO:
+            case SIM_CMD_SE:
+            case SIM_CMD_BE32K:
+            case SIM_CMD_BE:
+            case SIM_CMD_CE:
+            case SIM_CMD_CE_ALT:
+                return false;
+            default:
+                break;
+        }
+    }
+
+    bool reset_enabled = _reset_enabled;
+    _reset_enabled = false;
+
+    switch (opcode) {
+        case SIM_CMD_RSTEN:
+            _reset_enabled = true;
+            return true;
+
+        case SIM_CMD_RST:
+            if (!reset_enabled) {
+                return false;
+            }
+            _wel = false;
+            _addr4 = false;
+            return true;
+
+        case SIM_CMD_EN4B:
+        case SIM_CMD_EX4B:
+            if (!_part.addr_4byte) {
+                return false;
+            }
+            _addr4 = (opcode == SIM_CMD_EN4B);
+            return true;
+
+        case SIM_CMD_WREN:
+            _wel = true;
+            return true;
+
+        case SIM_CMD_DP:
+            _dpd = true;
+            _dpd_ns = t_ns + (uint64_t)_part.t_dp_us * 1000;
+            _stats.deep_power_downs++;
+            return true;
+
+        case SIM_CMD_RDP:
+            // Already up: the electronic signature, not modelled
+            return true;
+
+        case SIM_CMD_WRDI:
+            _wel = false;
+            return true;
+
+        case SIM_CMD_RDSFDP:
+            // As a custom instruction the 3-byte address and the 8 dummy
+            // cycles, one byte, travel as data
+            if (xfer.addr_bytes ? !address_matches(xfer, opcode) : xfer.tx_len != 4) {
+                return false;
+            }
+            for (size_t i = 0; i < xfer.rx_len; i++) {
+                uint32_t addr = (xfer.addr_bytes ? command_address(xfer) : command_address(xfer) >> 8) + i;
+                xfer.rx[i] = (addr < _part.sfdp_size) ? _part.sfdp[addr] : 0xFF;
+            }
+            return true;
+
+        case SIM_CMD_RDID:
+            for (size_t i = 0; i < xfer.rx_len && i < 3; i++) {
+                xfer.rx[i] = _part.jedec_id[i];
+            }
+            return true;
+
+        case SIM_CMD_RDCR:
+            for (size_t i = 0; i < xfer.rx_len; i++) {
+                xfer.rx[i] = _cr[i & 1];
+            }
+            return true;
+
+        case SIM_CMD_WRSR:
+            if (!_wel || xfer.tx_len == 0) {
+                return false;
+            }
+            _sr = xfer.tx[0] & ~(FLASH_SIM_SR_WIP | FLASH_SIM_SR_WEL);
+            if (xfer.tx_len > 1) {
+                _cr[0] = xfer.tx[1];
+            }
+            if (xfer.tx_len > 2) {
+                _cr[1] = xfer.tx[2];
+            }
+            _wel = false;
+            start_busy(t_ns, _part.t_w_us, BUSY_OTHER);
+            return true;
+
+        case SIM_CMD_RDSCUR:
+            memset(xfer.rx, (_suspended == BUSY_PROGRAM) ? FLASH_SIM_SCUR_PSB :
+                   (_suspended == BUSY_ERASE) ? FLASH_SIM_SCUR_ESB : 0, xfer.rx_len);
+            return true;
+
+        case SIM_CMD_RESUME:
+            return resume(t_ns);
+
+        case SIM_CMD_READ:
+        case SIM_CMD_FAST_READ:
+        case SIM_CMD_DREAD:
+        case SIM_CMD_2READ:
+        case SIM_CMD_QREAD:
+        case SIM_CMD_4READ:
+            if ((quad && !(_sr & FLASH_SIM_SR_QE)) || !address_matches(xfer, opcode)) {
+                return false;
+            }
+            do_read(command_address(xfer), xfer.rx, xfer.rx_len);
+            if (_suspended != BUSY_NONE) {
+                // What half-programmed or half-erased cells return is undefined
+                uint32_t addr = command_address(xfer);
+                for (size_t i = 0; i < xfer.rx_len; i++) {
+                    if ((addr + i) % _part.size - _busy_addr < _busy_size) {
+                        xfer.rx[i] = 0x00;
+                    }
+                }
+            }
+            if (opcode == SIM_CMD_4READ) {
+                // The mode byte is the first one after the address
+                _enhance = xfer.alt_bytes && FLASH_SIM_MODE_ENHANCE(xfer.alt >> ((xfer.alt_bytes - 1) * 8));
+            }
+            return true;
+
+        case SIM_CMD_PP:
+        case SIM_CMD_PP4O:
+        case SIM_CMD_PP4IO:
+            if (!_wel || (quad && !(_sr & FLASH_SIM_SR_QE)) || !address_matches(xfer, opcode)) {
+                return false;
+            }
+            _wel = false;
+            if (power_fails()) {
+                do_program(command_address(xfer), xfer.tx, xfer.tx_len / 2);
+                return true;
+            }
+            do_program(command_address(xfer), xfer.tx, xfer.tx_len);
+            start_busy(t_ns, _part.t_pp_us, BUSY_PROGRAM, (command_address(xfer) % _part.size) & ~(_part.page_size - 1), _part.page_size);
+            return true;
+
+        case SIM_CMD_SE:
+        case SIM_CMD_BE32K:
+        case SIM_CMD_BE:
+            if (!_wel || !address_matches(xfer, opcode)) {
+                return false;
+            }
+            _wel = false;
+            {
+                uint32_t size = (opcode == SIM_CMD_SE) ? _part.sector_size : (opcode == SIM_CMD_BE32K) ? 32 * 1024 : 64 * 1024;
+                uint32_t dur = (opcode == SIM_CMD_SE) ? _part.t_se_us : (opcode == SIM_CMD_BE32K) ? _part.t_be32_us : _part.t_be64_us;
+                if (power_fails()) {
+                    memset(&_mem[(command_address(xfer) % _part.size) & ~(size - 1)], 0xFF, size / 2);
+                    return true;
+                }
+                do_erase(command_address(xfer), size);
+                start_busy(t_ns, dur, BUSY_ERASE, (command_address(xfer) % _part.size) & ~(size - 1), size);
+            }
+            return true;
+
+        case SIM_CMD_CE:
+        case SIM_CMD_CE_ALT:
+            if (!_wel) {
+                return false;
+            }
+            _wel = false;
+            if (power_fails()) {
+                memset(&_mem[0], 0xFF, _part.size / 2);
+                return true;
+            }
+            do_erase(0, _part.size);
+            start_busy(t_ns, _part.t_ce_us, BUSY_OTHER);
+            return true;
+
+        default:
+            return false;
+    }
+}
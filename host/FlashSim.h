@@ -0,0 +1,251 @@
+/* Host-side model of a serial NOR flash (MX25R6435F by default) used to run
+ * the QSPI test suite on Linux.
+ *
+ * Nothing in here is built for the target: the whole host/ directory is
+ * excluded from mbed builds by host/.mbedignore.
+ */
+#ifndef FLASH_SIM_H
+#define FLASH_SIM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <mutex>
+#include <vector>
+
+#include "SimScheduler.h"
+
+/** Static description of a simulated flash part */
+struct FlashSimPart {
+    const char *name;
+    uint8_t jedec_id[3];
+    uint32_t size;              // bytes
+    uint32_t page_size;         // program page
+    uint32_t sector_size;       // smallest erase unit
+    uint8_t sr_power_on;        // status register value at power-on
+
+    // Typical operation times in microseconds
+    uint32_t t_pp_us;           // page program
+    uint32_t t_se_us;           // 4K sector erase
+    uint32_t t_be32_us;         // 32K block erase
+    uint32_t t_be64_us;         // 64K block erase
+    uint32_t t_ce_us;           // chip erase
+    uint32_t t_w_us;            // write status register
+    uint32_t t_sus_us;          // program/erase suspend latency
+
+    // JESD216 SFDP image returned by RDSFDP (0x5A), from address 0
+    const uint8_t *sfdp;
+    uint32_t sfdp_size;
+
+    // Clock the reads' default dummy cycles are needed at: the array takes
+    // a fixed time to deliver, so at slower clocks fewer cycles do
+    uint32_t dummy_hz;
+
+    // Takes EN4B (0xB7) / EX4B (0xE9) to switch to 4-byte addresses and back
+    bool addr_4byte;
+
+    // Deep power-down entry (tDP) and release (tRES1) times in microseconds
+    uint32_t t_dp_us;
+    uint32_t t_res1_us;
+
+    // dummy_hz in high performance mode (L/H bit of configuration register 2)
+    uint32_t dummy_hz_hp;
+
+    // Supply current in nanoamps: in standby and deep power-down, and while
+    // the bus is clocked or the array programs or erases, in ultra low power
+    // and high performance mode. The bus figure is taken to hold at any clock.
+    uint32_t i_standby_na;
+    uint32_t i_dpd_na;
+    uint32_t i_bus_na[2];
+    uint32_t i_busy_na[2];
+};
+
+/** MX25R6435F, 64Mbit, as fitted on the NRF52840_DK */
+extern const FlashSimPart FLASH_SIM_MX25R6435F;
+
+/** MX25L25645G, 256Mbit, with 4-byte addresses above 16 MB */
+extern const FlashSimPart FLASH_SIM_MX25L25645G;
+
+/** MX66L1G45G, 1Gbit, the MX25L25645G's command set */
+extern const FlashSimPart FLASH_SIM_MX66L1G45G;
+
+/** Part the simulator powers up as: the MX25R6435F, the MX25L25645G when
+ *  built with -DQSPI_SIM_MX25L25645G (and -DQSPI_FLASH_SIZE=0x2000000 for
+ *  the application), or the MX66L1G45G with -DQSPI_SIM_MX66L1G45G (and
+ *  -DQSPI_FLASH_SIZE=0x8000000)
+ */
+extern const FlashSimPart &FLASH_SIM_DEFAULT_PART;
+
+/** One chip-select cycle on the bus, as issued by the controller model */
+struct FlashSimTransfer {
+    uint8_t opcode;
+    uint8_t inst_lines;         // 0: no instruction phase (performance-enhance mode)
+    uint8_t addr_bytes;         // 0: no address phase (address, if any, travels as data)
+    uint8_t addr_lines;
+    uint32_t addr;
+    uint8_t alt_bytes;
+    uint8_t alt_lines;
+    uint32_t alt;
+    int dummy_cycles;           // < 0: use the part's default for the opcode
+    uint8_t data_lines;
+    const uint8_t *tx;
+    size_t tx_len;
+    uint8_t *rx;
+    size_t rx_len;
+};
+
+/** Counters kept by the simulator, useful for benchmarks */
+struct FlashSimStats {
+    uint32_t transfers;
+    uint32_t ignored;           // commands dropped because the part was busy or not enabled
+    uint32_t status_reads;
+    uint32_t page_programs;
+    uint32_t erases;
+    uint64_t bytes_read;
+    uint64_t bytes_programmed;
+    uint64_t bus_ns;            // time the bus was driven
+    uint64_t busy_ns;           // time the array was busy programming or erasing
+    uint32_t suspends;
+    uint32_t late_reads;        // reads sampled a clock early, see set_board_max_hz
+    uint32_t deep_power_downs;
+    uint32_t wakeups;           // releases from deep power-down
+    uint64_t charge_fc;         // drawn from the supply, femtocoulombs (nA x us)
+};
+
+/** Status register bits */
+#define FLASH_SIM_SR_WIP        0x01
+#define FLASH_SIM_SR_WEL        0x02
+#define FLASH_SIM_SR_QE         0x40
+
+/** Configuration register 2 L/H bit: high performance mode when set */
+#define FLASH_SIM_CR2_LH        0x02
+
+/** 4READ mode bytes: the part stays in performance-enhance mode, skipping
+ *  the instruction of the next read, while the nibbles are complements
+ */
+#define FLASH_SIM_MODE_ENHANCE(mode)    ((((mode) ^ ((mode) >> 4)) & 0x0F) == 0x0F)
+
+/** Security register bits */
+#define FLASH_SIM_SCUR_PSB      0x04        // program suspended
+#define FLASH_SIM_SCUR_ESB      0x08        // erase suspended
+
+class FlashSim {
+public:
+    /** The single flash part hanging off the simulated QSPI pins */
+    static FlashSim &instance();
+
+    /** Power-cycle the part: contents erased, volatile state cleared */
+    void reset(const FlashSimPart &part = FLASH_SIM_DEFAULT_PART);
+
+    /** Cut the supply part-way through the ops-th program or erase from now
+     *
+     *  That program latches the first half of its bytes, or the erase
+     *  blanks the first half of its area, and the part ignores everything
+     *  after it, the bus reading 0xFF, until restore_power. 0 disarms.
+     */
+    void cut_power(uint32_t ops);
+
+    /** Disarm cut_power, and power the part back up if the cut came: the
+     *  array and the non-volatile registers are kept, everything else is as
+     *  after a reset
+     */
+    void restore_power();
+
+    /** Perform one bus transfer at the given clock.
+     *
+     *  Advances the calling thread's clock by overhead_ns plus the bus time.
+     *  Returns false when the part ignored the command.
+     */
+    bool transfer(const FlashSimTransfer &xfer, uint32_t hz, uint32_t overhead_ns);
+
+    /** Virtual time at which the current program/erase completes (0 if idle) */
+    uint64_t busy_until_ns();
+
+    /** Fastest clock the board's traces carry read data at (0: no limit)
+     *
+     *  Above it, and when a read has fewer dummy cycles than the part needs
+     *  at its clock, the controller samples one clock before the data: what
+     *  it gets is shifted by a clock, the first bits being 1. Runs of 0x00
+     *  or 0xFF read back unchanged. Not cleared by reset.
+     */
+    void set_board_max_hz(uint32_t hz);
+
+    const FlashSimPart &part() const
+    {
+        return _part;
+    }
+
+    /** Counters; the charge includes the current drawn up to the calling
+     *  thread's time
+     */
+    FlashSimStats stats();
+    void clear_stats();
+
+    /** Direct access to the array, for test setup and verification only */
+    uint8_t *array()
+    {
+        return &_mem[0];
+    }
+
+private:
+    FlashSim();
+
+    /** What the array is busy with; only programs and erases can be suspended */
+    enum BusyKind {
+        BUSY_NONE,
+        BUSY_PROGRAM,
+        BUSY_ERASE,
+        BUSY_OTHER,
+    };
+
+    bool execute(const FlashSimTransfer &xfer, uint64_t t_ns);
+    bool busy_at(uint64_t t_ns) const
+    {
+        return t_ns < _busy_until_ns;
+    }
+    void start_busy(uint64_t t_ns, uint32_t dur_us, BusyKind kind, uint32_t addr = 0, uint32_t size = 0);
+    bool suspend(uint64_t t_ns);
+    bool resume(uint64_t t_ns);
+    uint32_t command_address(const FlashSimTransfer &xfer) const;
+    bool address_matches(const FlashSimTransfer &xfer, uint8_t opcode) const;
+    int default_dummy_cycles(uint8_t opcode) const;
+    uint64_t bus_cycles(const FlashSimTransfer &xfer) const;
+    bool sampled_early(const FlashSimTransfer &xfer, uint32_t hz) const;
+    bool high_performance() const
+    {
+        return (_cr[1] & FLASH_SIM_CR2_LH) != 0;
+    }
+    void account(uint64_t t_ns);
+    void add_charge(uint64_t ns, uint32_t na);
+    void do_read(uint32_t addr, uint8_t *rx, size_t len);
+    void do_program(uint32_t addr, const uint8_t *tx, size_t len);
+    void do_erase(uint32_t addr, uint32_t size);
+    bool power_fails();
+
+    std::mutex _lock;
+    FlashSimPart _part;
+    std::vector<uint8_t> _mem;
+    uint8_t _sr;                // non-volatile bits only, WIP/WEL derived
+    uint8_t _cr[2];
+    bool _wel;
+    bool _reset_enabled;
+    uint64_t _busy_until_ns;
+    BusyKind _busy_kind;
+    uint32_t _busy_addr;        // area being programmed/erased
+    uint32_t _busy_size;
+    BusyKind _suspended;        // BUSY_NONE unless suspended
+    uint64_t _suspended_ns;     // busy time left when suspended
+    bool _enhance;              // performance-enhance (continuous read) mode
+    bool _addr4;                // 4-byte address mode
+    bool _dpd;                  // deep power-down, from _dpd_ns
+    uint64_t _dpd_ns;
+    uint64_t _awake_ns;         // commands ignored until then, after a release
+    uint64_t _charge_ns;        // time the charge is accounted up to
+    uint64_t _charge_rem;       // below a femtocoulomb, nA x ns
+    uint64_t _bus_free_ns;
+    uint32_t _board_max_hz;
+    uint32_t _cut_ops;          // programs and erases to the power cut, 0: none
+    bool _powered;
+    FlashSimStats _stats;
+};
+
+#endif // FLASH_SIM_H
@@ -0,0 +1,16 @@
+/* Host stand-in for the target PinNames.h: only the pins main.cpp uses */
+#ifndef MBED_PINNAMES_H
+#define MBED_PINNAMES_H
+
+typedef enum {
+    QSPI_PIN_IO0,
+    QSPI_PIN_IO1,
+    QSPI_PIN_IO2,
+    QSPI_PIN_IO3,
+    QSPI_PIN_SCK,
+    QSPI_PIN_CSN,
+
+    NC = (int)0xFFFFFFFF
+} PinName;
+
+#endif // MBED_PINNAMES_H
@@ -0,0 +1,429 @@
+#include "QSPI.h"
+#include "FlashSim.h"
+
+#include <string.h>
+#include <algorithm>
+
+#include "rtos.h"
+
+// Cost of writing the interface registers when another QSPI object takes
+// the bus with other settings: a new clock needs the peripheral deactivated
+// and activated again, a new format only the IFCONFIG0 write
+#define QSPI_SIM_INIT_NS        20000
+#define QSPI_SIM_REG_WRITE_NS   500
+
+// NRF52840 SCK = 32 MHz / (SCKFREQ + 1)
+#define QSPI_SIM_SCK_BASE_HZ    32000000
+
+// NRF52840 READOC / WRITEOC encodings accepted by the custom read/write
+// calls; the target has no way to send any other opcode through them
+static const uint8_t nrf_readoc[] = { 0x0B, 0x3B, 0xBB, 0x6B, 0xEB };
+static const uint8_t nrf_writeoc[] = { 0x02, 0xA2, 0x32, 0x38 };
+
+static rtos::Mutex qspi_mutex;
+
+QSPI *QSPI::_owner = NULL;
+qspi_sim_regs_t QSPI::_applied;
+bool QSPI::_applied_valid = false;
+qspi_sim_bus_stats_t QSPI::_bus_stats;
+
+static uint8_t bus_lines(qspi_bus_width_t width)
+{
+    return (width == QSPI_CFG_BUS_QUAD) ? 4 : (width == QSPI_CFG_BUS_DUAL) ? 2 : 1;
+}
+
+QSPI::QSPI(PinName io0, PinName io1, PinName io2, PinName io3, PinName sclk, PinName ssel)
+    : _inst_width(QSPI_CFG_BUS_SINGLE),
+      _address_width(QSPI_CFG_BUS_SINGLE),
+      _address_size(QSPI_CFG_ADDR_SIZE_24),
+      _alt_width(QSPI_CFG_BUS_SINGLE),
+      _alt_size(QSPI_CFG_ALT_SIZE_NONE),
+      _data_width(QSPI_CFG_BUS_SINGLE),
+      _dummy_cycles(0),
+      _mode(0),
+      _hz(ONE_MHZ),
+      _changed(true),
+      _batch_overhead_ns(QSPI_SIM_CALL_OVERHEAD_NS)
+{
+    (void)io0;
+    (void)io1;
+    (void)io2;
+    (void)io3;
+    (void)sclk;
+    (void)ssel;
+    update_regs();
+}
+
+qspi_status_t QSPI::configure_format(qspi_bus_width_t inst_width,
+                                     qspi_bus_width_t address_width,
+                                     qspi_address_size_t address_size,
+                                     qspi_bus_width_t alt_width,
+                                     qspi_alt_size_t alt_size,
+                                     qspi_bus_width_t data_width,
+                                     int dummy_cycles,
+                                     int mode)
+{
+    if (dummy_cycles < 0 || mode < 0 || mode > 3) {
+        return QSPI_STATUS_INVALID_PARAMETER;
+    }
+    lock();
+    _inst_width = inst_width;
+    _address_width = address_width;
+    _address_size = address_size;
+    _alt_width = alt_width;
+    _alt_size = alt_size;
+    _data_width = data_width;
+    _dummy_cycles = dummy_cycles;
+    _mode = mode;
+    update_regs();
+    unlock();
+    return QSPI_STATUS_OK;
+}
+
+qspi_status_t QSPI::set_frequency(int hz)
+{
+    if (hz <= 0) {
+        return QSPI_STATUS_INVALID_PARAMETER;
+    }
+    lock();
+    _hz = hz;
+    update_regs();
+    unlock();
+    return QSPI_STATUS_OK;
+}
+
+void QSPI::lock()
+{
+    qspi_mutex.lock();
+}
+
+void QSPI::unlock()
+{
+    qspi_mutex.unlock();
+}
+
+void QSPI::update_regs()
+{
+    static const uint8_t readoc[3][3] = {
+        // address single, dual, quad by data single, dual, quad
+        { 0, 1, 3 },
+        { 0, 2, 3 },
+        { 0, 2, 4 },
+    };
+    static const uint8_t writeoc[3][3] = {
+        { 0, 1, 2 },
+        { 0, 1, 2 },
+        { 0, 1, 3 },
+    };
+    uint32_t sckfreq = (QSPI_SIM_SCK_BASE_HZ + _hz - 1) / _hz - 1;
+
+    _regs.ifconfig0 = readoc[_address_width][_data_width] | (writeoc[_address_width][_data_width] << 3) |
+                      ((_address_size == QSPI_CFG_ADDR_SIZE_32) ? (1UL << 6) : 0);
+    _regs.ifconfig1 = ((sckfreq > 31) ? 31UL : sckfreq) << 28;
+    _regs.format = (uint32_t)_inst_width | ((uint32_t)_alt_width << 2) | ((uint32_t)_alt_size << 4) |
+                   ((uint32_t)_mode << 8) | ((uint32_t)_dummy_cycles << 16);
+    _changed = true;
+}
+
+bool QSPI::acquire()
+{
+    // Registers are only written when they differ from those in place,
+    // whichever object wrote them
+    if (_owner == this && !_changed) {
+        return true;
+    }
+    _bus_stats.switches++;
+    if (!_applied_valid || _applied.ifconfig1 != _regs.ifconfig1) {
+        SimClock::advance_ns(QSPI_SIM_INIT_NS);
+        _bus_stats.reconfigurations++;
+    } else if (_applied.ifconfig0 != _regs.ifconfig0 || _applied.format != _regs.format) {
+        SimClock::advance_ns(QSPI_SIM_REG_WRITE_NS);
+        _bus_stats.reconfigurations++;
+    } else {
+        _bus_stats.avoided++;
+    }
+    _applied = _regs;
+    _applied_valid = true;
+    _owner = this;
+    _changed = false;
+    return true;
+}
+
+qspi_sim_bus_stats_t QSPI::sim_bus_stats(bool clear)
+{
+    qspi_mutex.lock();
+    qspi_sim_bus_stats_t stats = _bus_stats;
+    if (clear) {
+        memset(&_bus_stats, 0, sizeof(_bus_stats));
+    }
+    qspi_mutex.unlock();
+    return stats;
+}
+
+int QSPI::read_opcode(unsigned int instruction) const
+{
+    if (instruction < sizeof(nrf_readoc)) {
+        return nrf_readoc[instruction];
+    }
+    return -1;
+}
+
+int QSPI::write_opcode(unsigned int instruction) const
+{
+    if (instruction < sizeof(nrf_writeoc)) {
+        return nrf_writeoc[instruction];
+    }
+    return -1;
+}
+
+void QSPI::fill_transfer(FlashSimTransfer &xfer, int opcode, unsigned int address, unsigned int alt) const
+{
+    xfer.opcode = opcode;
+    xfer.inst_lines = bus_lines(_inst_width);
+    xfer.addr_bytes = (_address_size == QSPI_CFG_ADDR_SIZE_32) ? 4 : 3;
+    xfer.addr_lines = bus_lines(_address_width);
+    xfer.addr = address;
+    xfer.alt_bytes = (_alt_size == QSPI_CFG_ALT_SIZE_NONE) ? 0 : (int)_alt_size;
+    xfer.alt_lines = bus_lines(_alt_width);
+    xfer.alt = alt;
+    xfer.dummy_cycles = _dummy_cycles ? _dummy_cycles : -1;
+    xfer.data_lines = bus_lines(_data_width);
+    xfer.tx = NULL;
+    xfer.tx_len = 0;
+    xfer.rx = NULL;
+    xfer.rx_len = 0;
+
+    // The NRF controller derives the line usage from the opcode itself
+    switch (opcode) {
+        case 0x0B: xfer.addr_lines = 1; xfer.data_lines = 1; break;
+        case 0x3B: xfer.addr_lines = 1; xfer.data_lines = 2; break;
+        case 0xBB: xfer.addr_lines = 2; xfer.data_lines = 2; break;
+        case 0x6B: xfer.addr_lines = 1; xfer.data_lines = 4; break;
+        case 0xEB: xfer.addr_lines = 4; xfer.data_lines = 4; break;
+        case 0x02: xfer.addr_lines = 1; xfer.data_lines = 1; break;
+        case 0xA2: xfer.addr_lines = 1; xfer.data_lines = 2; break;
+        case 0x32: xfer.addr_lines = 1; xfer.data_lines = 4; break;
+        case 0x38: xfer.addr_lines = 4; xfer.data_lines = 4; break;
+        default: break;
+    }
+}
+
+void QSPI::wait_ready()
+{
+    FlashSim &sim = FlashSim::instance();
+    uint8_t sr = 0;
+    FlashSimTransfer xfer = { 0x05, 1, 0, 1, 0, 0, 1, 0, 0, 1, NULL, 0, &sr, 1 };
+
+    do {
+        sim.transfer(xfer, _hz, 0);
+        if (sr & FLASH_SIM_SR_WIP) {
+            SimClock::sync_to_ns(sim.busy_until_ns());
+        }
+    } while (sr & FLASH_SIM_SR_WIP);
+}
+
+qspi_status_t QSPI::read(unsigned int address, char *rx_buffer, size_t *rx_length)
+{
+    int opcode;
+    if (_data_width == QSPI_CFG_BUS_QUAD) {
+        opcode = (_address_width == QSPI_CFG_BUS_QUAD) ? 0xEB : 0x6B;
+    } else if (_data_width == QSPI_CFG_BUS_DUAL) {
+        opcode = (_address_width == QSPI_CFG_BUS_DUAL) ? 0xBB : 0x3B;
+    } else {
+        opcode = 0x0B;
+    }
+    return do_read(opcode, address, 0, rx_buffer, rx_length);
+}
+
+qspi_status_t QSPI::read(unsigned int instruction, unsigned int address, unsigned int alt, char *rx_buffer, size_t *rx_length)
+{
+    int opcode = read_opcode(instruction);
+    if (opcode < 0) {
+        return QSPI_STATUS_INVALID_PARAMETER;
+    }
+    return do_read(opcode, address, alt, rx_buffer, rx_length);
+}
+
+qspi_status_t QSPI::do_read(int opcode, unsigned int address, unsigned int alt, char *rx_buffer, size_t *rx_length)
+{
+    if (rx_buffer == NULL || rx_length == NULL) {
+        return QSPI_STATUS_INVALID_PARAMETER;
+    }
+
+    FlashSimTransfer xfer;
+    lock();
+    acquire();
+    fill_transfer(xfer, opcode, address, alt);
+    xfer.rx = (uint8_t *)rx_buffer;
+    xfer.rx_len = *rx_length;
+    FlashSim::instance().transfer(xfer, _hz, QSPI_SIM_CALL_OVERHEAD_NS);
+    unlock();
+
+    return QSPI_STATUS_OK;
+}
+
+qspi_status_t QSPI::write(unsigned int address, const char *tx_buffer, size_t *tx_length)
+{
+    int opcode;
+    if (_data_width == QSPI_CFG_BUS_QUAD) {
+        opcode = (_address_width == QSPI_CFG_BUS_QUAD) ? 0x38 : 0x32;
+    } else if (_data_width == QSPI_CFG_BUS_DUAL) {
+        opcode = 0xA2;
+    } else {
+        opcode = 0x02;
+    }
+    return do_write(opcode, address, 0, tx_buffer, tx_length);
+}
+
+qspi_status_t QSPI::write(unsigned int instruction, unsigned int address, unsigned int alt, const char *tx_buffer, size_t *tx_length)
+{
+    int opcode = write_opcode(instruction);
+    if (opcode < 0) {
+        return QSPI_STATUS_INVALID_PARAMETER;
+    }
+    return do_write(opcode, address, alt, tx_buffer, tx_length);
+}
+
+qspi_status_t QSPI::do_write(int opcode, unsigned int address, unsigned int alt, const char *tx_buffer, size_t *tx_length)
+{
+    if (tx_buffer == NULL || tx_length == NULL) {
+        return QSPI_STATUS_INVALID_PARAMETER;
+    }
+
+    FlashSim &sim = FlashSim::instance();
+    uint32_t page_size = sim.part().page_size;
+    const uint8_t *data = (const uint8_t *)tx_buffer;
+    size_t remaining = *tx_length;
+    uint32_t overhead = QSPI_SIM_CALL_OVERHEAD_NS;
+
+    lock();
+    acquire();
+    while (remaining) {
+        size_t chunk = page_size - (address & (page_size - 1));
+        if (chunk > remaining) {
+            chunk = remaining;
+        }
+
+        // The controller polls WIP itself between pages, but returns as
+        // soon as the last page is handed over
+        if (overhead == 0) {
+            wait_ready();
+        }
+
+        FlashSimTransfer wren = { 0x06, 1, 0, 1, 0, 0, 1, 0, 0, 1, NULL, 0, NULL, 0 };
+        sim.transfer(wren, _hz, overhead);
+        overhead = 0;
+
+        FlashSimTransfer xfer;
+        fill_transfer(xfer, opcode, address, alt);
+        xfer.tx = data;
+        xfer.tx_len = chunk;
+        sim.transfer(xfer, _hz, 0);
+
+        address += chunk;
+        data += chunk;
+        remaining -= chunk;
+    }
+    unlock();
+
+    return QSPI_STATUS_OK;
+}
+
+qspi_status_t QSPI::command_transfer(unsigned int instruction, const char *tx_buffer, size_t tx_length, const char *rx_buffer, size_t rx_length)
+{
+    // Custom instructions are limited to 8 data bytes each way on the NRF52840
+    if ((tx_length && tx_buffer == NULL) || (rx_length && rx_buffer == NULL) || tx_length > 8 || rx_length > 8) {
+        return QSPI_STATUS_INVALID_PARAMETER;
+    }
+
+    FlashSimTransfer xfer = { (uint8_t)instruction, 1, 0, 1, 0, 0, 1, 0, 0, 1,
+                              (const uint8_t *)tx_buffer, tx_length,
+                              (uint8_t *)rx_buffer, rx_length
+                            };
+    lock();
+    acquire();
+    FlashSim::instance().transfer(xfer, _hz, QSPI_SIM_CALL_OVERHEAD_NS);
+    unlock();
+
+    return QSPI_STATUS_OK;
+}
+
+qspi_status_t QSPI::sim_autopoll(uint8_t mask, uint8_t match, uint32_t timeout_us)
+{
+    FlashSim &sim = FlashSim::instance();
+    uint64_t deadline = SimClock::now_ns() + (uint64_t)timeout_us * 1000;
+    uint8_t sr = 0;
+    FlashSimTransfer xfer = { 0x05, 1, 0, 1, 0, 0, 1, 0, 0, 1, NULL, 0, &sr, 1 };
+
+    lock();
+    acquire();
+    sim.transfer(xfer, _hz, QSPI_SIM_CALL_OVERHEAD_NS);
+    while ((sr & mask) != match && SimClock::now_ns() < deadline) {
+        SimClock::sync_to_ns(std::min(sim.busy_until_ns(), deadline));
+        sim.transfer(xfer, _hz, 0);
+    }
+    unlock();
+
+    return ((sr & mask) == match) ? QSPI_STATUS_OK : QSPI_STATUS_ERROR;
+}
+
+void QSPI::sim_batch_begin()
+{
+    lock();
+    acquire();
+    _batch_overhead_ns = QSPI_SIM_CALL_OVERHEAD_NS;
+}
+
+qspi_status_t QSPI::sim_batch_command(unsigned int instruction, const char *tx_buffer, size_t tx_length,
+                                      char *rx_buffer, size_t rx_length, uint8_t poll_mask, uint8_t poll_match,
+                                      uint32_t poll_timeout_us)
+{
+    if ((tx_length && tx_buffer == NULL) || (rx_length && rx_buffer == NULL) || tx_length > 8 || rx_length > 8 ||
+            (poll_mask && rx_length == 0)) {
+        return QSPI_STATUS_INVALID_PARAMETER;
+    }
+
+    FlashSim &sim = FlashSim::instance();
+    uint64_t deadline = SimClock::now_ns() + (uint64_t)poll_timeout_us * 1000;
+    FlashSimTransfer xfer = { (uint8_t)instruction, 1, 0, 1, 0, 0, 1, 0, 0, 1,
+                              (const uint8_t *)tx_buffer, tx_length,
+                              (uint8_t *)rx_buffer, rx_length
+                            };
+    sim.transfer(xfer, _hz, _batch_overhead_ns);
+    _batch_overhead_ns = QSPI_SIM_BATCH_STEP_NS;
+    while (poll_mask && ((uint8_t)rx_buffer[0] & poll_mask) != poll_match) {
+        if (SimClock::now_ns() >= deadline) {
+            return QSPI_STATUS_ERROR;
+        }
+        SimClock::sync_to_ns(std::min(sim.busy_until_ns(), deadline));
+        sim.transfer(xfer, _hz, QSPI_SIM_BATCH_STEP_NS);
+    }
+    return QSPI_STATUS_OK;
+}
+
+void QSPI::sim_batch_end()
+{
+    unlock();
+}
+
+qspi_status_t QSPI::sim_read_continuous(unsigned int address, uint8_t mode, bool send_inst, char *rx_buffer, size_t rx_length)
+{
+    if (rx_buffer == NULL) {
+        return QSPI_STATUS_INVALID_PARAMETER;
+    }
+
+    FlashSimTransfer xfer;
+    lock();
+    acquire();
+    fill_transfer(xfer, 0xEB, address, mode);
+    xfer.inst_lines = send_inst ? 1 : 0;
+    xfer.alt_bytes = 1;
+    xfer.alt_lines = 4;
+    xfer.dummy_cycles = -1;
+    xfer.rx = (uint8_t *)rx_buffer;
+    xfer.rx_len = rx_length;
+    FlashSim::instance().transfer(xfer, _hz, QSPI_SIM_CALL_OVERHEAD_NS);
+    unlock();
+
+    return QSPI_STATUS_OK;
+}
@@ -0,0 +1,150 @@
+/* Host stand-in for mbed-os drivers/QSPI.h.
+ *
+ * Same public interface as the QSPI driver this application is written
+ * against, but transfers go to the FlashSim model instead of a peripheral.
+ * The controller side mimics the NRF52840 QSPI block: plain reads/writes pick
+ * the opcode from the configured bus widths, custom read/write instructions
+ * must be the NRF READOC/WRITEOC enums (0-4 and 0-3; anything else is
+ * rejected, as the target cannot send it), and writes are split at page
+ * boundaries with an automatic WREN per page.
+ */
+#ifndef MBED_QSPI_H
+#define MBED_QSPI_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "PinNames.h"
+
+typedef enum qspi_status {
+    QSPI_STATUS_ERROR = -1,
+    QSPI_STATUS_INVALID_PARAMETER = -2,
+    QSPI_STATUS_OK = 0,
+} qspi_status_t;
+
+typedef enum qspi_bus_width {
+    QSPI_CFG_BUS_SINGLE,
+    QSPI_CFG_BUS_DUAL,
+    QSPI_CFG_BUS_QUAD,
+} qspi_bus_width_t;
+
+typedef enum qspi_address_size {
+    QSPI_CFG_ADDR_SIZE_8,
+    QSPI_CFG_ADDR_SIZE_16,
+    QSPI_CFG_ADDR_SIZE_24,
+    QSPI_CFG_ADDR_SIZE_32,
+} qspi_address_size_t;
+
+typedef enum qspi_alt_size {
+    QSPI_CFG_ALT_SIZE_NONE,
+    QSPI_CFG_ALT_SIZE_8,
+    QSPI_CFG_ALT_SIZE_16,
+    QSPI_CFG_ALT_SIZE_24,
+    QSPI_CFG_ALT_SIZE_32,
+} qspi_alt_size_t;
+
+#define ONE_MHZ     1000000
+
+// Software cost of one driver call (HAL entry, task start, completion event)
+#define QSPI_SIM_CALL_OVERHEAD_NS   5000
+
+// Cost of each further command of a batch: the custom instruction registers
+// written directly and the READY event waited for, without a driver call
+#define QSPI_SIM_BATCH_STEP_NS      1000
+
+/** NRF52840 QSPI registers a bus object needs, worked out whenever its
+ *  settings change, so that taking the bus over is a compare and a copy
+ */
+typedef struct {
+    uint32_t ifconfig0;         // READOC, WRITEOC, ADDRMODE
+    uint32_t ifconfig1;         // SCKFREQ
+    uint32_t format;            // the other format fields and dummy cycles
+} qspi_sim_regs_t;
+
+/** Host only: how often the bus changed hands and what that cost */
+typedef struct {
+    uint32_t switches;          // transfers by another object, or after new settings
+    uint32_t reconfigurations;  // of those, registers written
+    uint32_t avoided;           // of those, registers already right
+} qspi_sim_bus_stats_t;
+
+class QSPI {
+public:
+    QSPI(PinName io0, PinName io1, PinName io2, PinName io3, PinName sclk, PinName ssel = NC);
+    virtual ~QSPI() {}
+
+    qspi_status_t configure_format(qspi_bus_width_t inst_width,
+                                   qspi_bus_width_t address_width,
+                                   qspi_address_size_t address_size,
+                                   qspi_bus_width_t alt_width,
+                                   qspi_alt_size_t alt_size,
+                                   qspi_bus_width_t data_width,
+                                   int dummy_cycles,
+                                   int mode);
+
+    qspi_status_t set_frequency(int hz = ONE_MHZ);
+
+    qspi_status_t read(unsigned int address, char *rx_buffer, size_t *rx_length);
+    qspi_status_t write(unsigned int address, const char *tx_buffer, size_t *tx_length);
+    qspi_status_t read(unsigned int instruction, unsigned int address, unsigned int alt, char *rx_buffer, size_t *rx_length);
+    qspi_status_t write(unsigned int instruction, unsigned int address, unsigned int alt, const char *tx_buffer, size_t *tx_length);
+    qspi_status_t command_transfer(unsigned int instruction, const char *tx_buffer, size_t tx_length, const char *rx_buffer, size_t rx_length);
+
+    /** Host only: poll the status register in "hardware" without CPU cost,
+     *  used by the qspi_flash_hw_autopoll hook
+     */
+    qspi_status_t sim_autopoll(uint8_t mask, uint8_t match, uint32_t timeout_us);
+
+    /** Host only: 4READ with a mode byte, optionally without the instruction
+     *  phase, used by the qspi_flash_hw_read_continuous hook
+     */
+    qspi_status_t sim_read_continuous(unsigned int address, uint8_t mode, bool send_inst, char *rx_buffer, size_t rx_length);
+
+    /** Host only: commands sent back to back under one lock and bus setup,
+     *  used by the qspi_flash_hw_command_batch hook. The first command costs
+     *  a driver call, the others QSPI_SIM_BATCH_STEP_NS each; a command with
+     *  a poll_mask is repeated until (rx_buffer[0] & poll_mask) == poll_match.
+     */
+    void sim_batch_begin();
+    qspi_status_t sim_batch_command(unsigned int instruction, const char *tx_buffer, size_t tx_length,
+                                    char *rx_buffer, size_t rx_length, uint8_t poll_mask, uint8_t poll_match,
+                                    uint32_t poll_timeout_us);
+    void sim_batch_end();
+
+    /** Host only: bus sharing counters of all objects, optionally cleared */
+    static qspi_sim_bus_stats_t sim_bus_stats(bool clear = false);
+
+protected:
+    virtual void lock();
+    virtual void unlock();
+
+private:
+    bool acquire();
+    void update_regs();
+    int read_opcode(unsigned int instruction) const;
+    int write_opcode(unsigned int instruction) const;
+    qspi_status_t do_read(int opcode, unsigned int address, unsigned int alt, char *rx_buffer, size_t *rx_length);
+    qspi_status_t do_write(int opcode, unsigned int address, unsigned int alt, const char *tx_buffer, size_t *tx_length);
+    void fill_transfer(struct FlashSimTransfer &xfer, int opcode, unsigned int address, unsigned int alt) const;
+    void wait_ready();
+
+    static QSPI *_owner;
+    static qspi_sim_regs_t _applied;
+    static bool _applied_valid;
+    static qspi_sim_bus_stats_t _bus_stats;
+
+    qspi_bus_width_t _inst_width;
+    qspi_bus_width_t _address_width;
+    qspi_address_size_t _address_size;
+    qspi_bus_width_t _alt_width;
+    qspi_alt_size_t _alt_size;
+    qspi_bus_width_t _data_width;
+    int _dummy_cycles;
+    int _mode;
+    int _hz;
+    qspi_sim_regs_t _regs;
+    bool _changed;              // settings changed since this object last had the bus
+    uint32_t _batch_overhead_ns;    // of the next command of a batch
+};
+
+#endif // MBED_QSPI_H
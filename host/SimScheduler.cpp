@@ -0,0 +1,172 @@
+#include "SimScheduler.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+static std::mutex sched_mutex;
+static std::vector<SimThread *> sched_threads;
+static SimThread *sched_running = NULL;
+static unsigned int sched_next_id = 0;
+static thread_local SimThread *sched_self = NULL;
+
+// Time at which a thread can next run, SIM_FOREVER if it cannot
+static uint64_t ready_at(const SimThread *thread)
+{
+    if (thread->state == SimThread::RUNNABLE) {
+        return thread->now_ns;
+    }
+    if (thread->state == SimThread::BLOCKED) {
+        return thread->deadline_ns;
+    }
+    return SIM_FOREVER;
+}
+
+static SimThread *pick_next(const SimThread *exclude)
+{
+    SimThread *next = NULL;
+    for (size_t i = 0; i < sched_threads.size(); i++) {
+        SimThread *thread = sched_threads[i];
+        if (thread == exclude || ready_at(thread) == SIM_FOREVER) {
+            continue;
+        }
+        if (next == NULL || ready_at(thread) < ready_at(next)) {
+            next = thread;
+        }
+    }
+    return next;
+}
+
+// Hand the CPU to next and wait until it comes back to the caller
+static void switch_to(std::unique_lock<std::mutex> &guard, SimThread *self, SimThread *next)
+{
+    if (next->state == SimThread::BLOCKED) {
+        // Deadline reached without a wake-up
+        next->now_ns = next->deadline_ns;
+        next->state = SimThread::RUNNABLE;
+        next->woken = false;
+    }
+    sched_running = next;
+    next->cv.notify_one();
+    if (self) {
+        self->cv.wait(guard, [self]() {
+            return sched_running == self;
+        });
+    }
+}
+
+std::mutex &SimScheduler::lock()
+{
+    return sched_mutex;
+}
+
+SimThread *SimScheduler::current(std::unique_lock<std::mutex> &guard)
+{
+    (void)guard;
+    if (sched_self == NULL) {
+        sched_self = create(0);
+        if (sched_running == NULL) {
+            sched_running = sched_self;
+        }
+    }
+    return sched_self;
+}
+
+SimThread *SimScheduler::create(uint64_t start_ns)
+{
+    SimThread *thread = new SimThread;
+    thread->id = sched_next_id++;
+    thread->now_ns = start_ns;
+    thread->deadline_ns = SIM_FOREVER;
+    thread->state = SimThread::RUNNABLE;
+    thread->woken = false;
+    sched_threads.push_back(thread);
+    return thread;
+}
+
+void SimScheduler::attach(std::unique_lock<std::mutex> &guard, SimThread *thread)
+{
+    sched_self = thread;
+    thread->cv.wait(guard, [thread]() {
+        return sched_running == thread;
+    });
+}
+
+void SimScheduler::exit(std::unique_lock<std::mutex> &guard)
+{
+    SimThread *self = current(guard);
+    self->state = SimThread::EXITED;
+    for (size_t i = 0; i < self->joiners.size(); i++) {
+        wake(guard, self->joiners[i]);
+    }
+    self->joiners.clear();
+
+    SimThread *next = pick_next(self);
+    if (next) {
+        switch_to(guard, NULL, next);
+    } else {
+        sched_running = NULL;
+    }
+}
+
+bool SimScheduler::block(std::unique_lock<std::mutex> &guard, uint64_t deadline_ns)
+{
+    SimThread *self = current(guard);
+    self->state = SimThread::BLOCKED;
+    self->deadline_ns = deadline_ns;
+    self->woken = false;
+
+    SimThread *next = pick_next(NULL);
+    if (next == NULL) {
+        fprintf(stderr, "\nSIM: deadlock, every thread is blocked\n");
+        abort();
+    }
+    if (next == self) {
+        switch_to(guard, NULL, self);
+    } else {
+        switch_to(guard, self, next);
+    }
+    return self->woken;
+}
+
+void SimScheduler::wake(std::unique_lock<std::mutex> &guard, SimThread *thread)
+{
+    SimThread *self = current(guard);
+    if (thread->state != SimThread::BLOCKED) {
+        return;
+    }
+    thread->state = SimThread::RUNNABLE;
+    thread->woken = true;
+    if (thread->now_ns < self->now_ns) {
+        thread->now_ns = self->now_ns;
+    }
+}
+
+void SimScheduler::advance_to(std::unique_lock<std::mutex> &guard, uint64_t t_ns)
+{
+    SimThread *self = current(guard);
+    if (t_ns > self->now_ns) {
+        self->now_ns = t_ns;
+    }
+    SimThread *next = pick_next(self);
+    if (next && ready_at(next) < self->now_ns) {
+        switch_to(guard, self, next);
+    }
+}
+
+uint64_t SimClock::now_ns()
+{
+    std::unique_lock<std::mutex> guard(sched_mutex);
+    return SimScheduler::current(guard)->now_ns;
+}
+
+void SimClock::advance_ns(uint64_t ns)
+{
+    std::unique_lock<std::mutex> guard(sched_mutex);
+    SimScheduler::advance_to(guard, SimScheduler::current(guard)->now_ns + ns);
+}
+
+void SimClock::sync_to_ns(uint64_t t_ns)
+{
+    std::unique_lock<std::mutex> guard(sched_mutex);
+    SimScheduler::advance_to(guard, t_ns);
+}
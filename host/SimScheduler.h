@@ -0,0 +1,91 @@
+/* Virtual time and thread scheduling for the host build.
+ *
+ * Nothing in here is built for the target: the whole host/ directory is
+ * excluded from mbed builds by host/.mbedignore.
+ */
+#ifndef SIM_SCHEDULER_H
+#define SIM_SCHEDULER_H
+
+#include <stdint.h>
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
+/** Virtual time base of the host build.
+ *
+ * Each thread carries its own notion of "now". Bus transfers, flash busy
+ * periods and sleeps advance it, so a Timer reports what the operation would
+ * have cost on the target rather than how fast the host happens to be.
+ */
+class SimClock {
+public:
+    /** Current virtual time of the calling thread */
+    static uint64_t now_ns();
+
+    /** Let the calling thread spend ns of virtual time */
+    static void advance_ns(uint64_t ns);
+
+    /** Move the calling thread's clock forward to t_ns (never backwards) */
+    static void sync_to_ns(uint64_t t_ns);
+};
+
+#define SIM_FOREVER     UINT64_MAX
+
+/** Scheduler entry of one host thread */
+struct SimThread {
+    enum State {
+        RUNNABLE,
+        BLOCKED,            // until woken, or until deadline_ns if not SIM_FOREVER
+        EXITED,
+    };
+
+    unsigned int id;
+    uint64_t now_ns;
+    uint64_t deadline_ns;
+    State state;
+    bool woken;
+    std::condition_variable cv;
+    std::vector<SimThread *> joiners;
+};
+
+/** Runs the host threads like a single-core RTOS on the virtual clock.
+ *
+ * Only one thread executes at a time: the runnable one that is furthest
+ * behind in virtual time (lowest id on a tie). A thread whose clock moves
+ * past another runnable thread's hands over to it, and a blocked thread is
+ * picked again once woken or when its deadline is the earliest time left.
+ * Everything shared between threads is thus touched in virtual time order
+ * and runs are exactly repeatable.
+ *
+ * The RTOS primitives in rtos.cpp keep their state under lock() and use
+ * block()/wake() to wait for each other.
+ */
+class SimScheduler {
+public:
+    static std::mutex &lock();
+
+    /** Entry of the calling thread; the first caller becomes the running thread */
+    static SimThread *current(std::unique_lock<std::mutex> &guard);
+
+    /** Add a thread that starts at start_ns; it runs once attach()ed and scheduled */
+    static SimThread *create(uint64_t start_ns);
+
+    /** First call on a thread made by create(): waits for its turn */
+    static void attach(std::unique_lock<std::mutex> &guard, SimThread *thread);
+
+    /** Last call on a thread: wakes its joiners and passes on the CPU */
+    static void exit(std::unique_lock<std::mutex> &guard);
+
+    /** Give up the CPU until woken or, unless SIM_FOREVER, deadline_ns.
+     *  Returns true when woken, false on the deadline.
+     */
+    static bool block(std::unique_lock<std::mutex> &guard, uint64_t deadline_ns = SIM_FOREVER);
+
+    /** Make a blocked thread runnable at the caller's time (or its own, if later) */
+    static void wake(std::unique_lock<std::mutex> &guard, SimThread *thread);
+
+    /** Move the caller's clock to t_ns and let threads that are behind it run */
+    static void advance_to(std::unique_lock<std::mutex> &guard, uint64_t t_ns);
+};
+
+#endif // SIM_SCHEDULER_H
@@ -0,0 +1,22 @@
+/* Host stand-in for cmsis_os.h: delays spend virtual time */
+#ifndef CMSIS_OS_H
+#define CMSIS_OS_H
+
+#include <stdint.h>
+#include "FlashSim.h"
+
+typedef enum {
+    osOK = 0,
+    osErrorTimeout = -2,
+} osStatus;
+
+#define osFlagsError            0x80000000U
+#define osFlagsErrorTimeout     0xFFFFFFFEU
+
+inline osStatus osDelay(uint32_t millisec)
+{
+    SimClock::advance_ns((uint64_t)millisec * 1000000);
+    return osOK;
+}
+
+#endif // CMSIS_OS_H
@@ -0,0 +1,129 @@
+/* Host stand-in for mbed.h: just enough of the platform API for this
+ * application, with time taken from the simulator's virtual clock.
+ */
+#ifndef MBED_H
+#define MBED_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "FlashSim.h"
+#include "PinNames.h"
+#include "rtos.h"
+
+#define MBED_WEAK __attribute__((weak))
+#define MBED_ALIGN(N) __attribute__((aligned(N)))
+
+// platform/mbed_toolchain.h and mbed_critical.h
+#define MBED_BARRIER() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+inline uint32_t core_util_atomic_incr_u32(volatile uint32_t *valuePtr, uint32_t delta)
+{
+    return __atomic_add_fetch(valuePtr, delta, __ATOMIC_SEQ_CST);
+}
+
+inline uint32_t core_util_atomic_decr_u32(volatile uint32_t *valuePtr, uint32_t delta)
+{
+    return __atomic_sub_fetch(valuePtr, delta, __ATOMIC_SEQ_CST);
+}
+
+inline bool core_util_atomic_cas_u32(volatile uint32_t *ptr, uint32_t *expectedCurrentValue, uint32_t desiredValue)
+{
+    return __atomic_compare_exchange_n(ptr, expectedCurrentValue, desiredValue, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+// platform/mbed_stats.h: always enabled on the host, see mbed_stats.cpp
+#define MBED_HEAP_STATS_ENABLED 1
+
+typedef struct {
+    uint32_t current_size;      // bytes allocated now
+    uint32_t max_size;          // most bytes allocated at any one time
+    uint32_t total_size;        // bytes ever allocated
+    uint32_t alloc_cnt;         // allocations outstanding
+    uint32_t alloc_fail_cnt;
+} mbed_stats_heap_t;
+
+void mbed_stats_heap_get(mbed_stats_heap_t *stats);
+
+inline void wait_us(int us)
+{
+    SimClock::advance_ns((uint64_t)us * 1000);
+}
+
+inline void wait_ms(int ms)
+{
+    SimClock::advance_ns((uint64_t)ms * 1000000);
+}
+
+inline void wait(float s)
+{
+    SimClock::advance_ns((uint64_t)(s * 1e9f));
+}
+
+inline uint32_t us_ticker_read()
+{
+    return (uint32_t)(SimClock::now_ns() / 1000);
+}
+
+class Timer {
+public:
+    Timer() : _running(false), _start_ns(0), _elapsed_ns(0) {}
+
+    void start()
+    {
+        if (!_running) {
+            _start_ns = SimClock::now_ns();
+            _running = true;
+        }
+    }
+
+    void stop()
+    {
+        if (_running) {
+            _elapsed_ns += SimClock::now_ns() - _start_ns;
+            _running = false;
+        }
+    }
+
+    void reset()
+    {
+        _start_ns = SimClock::now_ns();
+        _elapsed_ns = 0;
+    }
+
+    int read_us()
+    {
+        return (int)(elapsed_ns() / 1000);
+    }
+
+    int read_ms()
+    {
+        return (int)(elapsed_ns() / 1000000);
+    }
+
+    float read()
+    {
+        return elapsed_ns() / 1e9f;
+    }
+
+    uint64_t read_high_resolution_us()
+    {
+        return elapsed_ns() / 1000;
+    }
+
+private:
+    uint64_t elapsed_ns()
+    {
+        // Another thread may have started the timer at a later virtual time
+        uint64_t now = SimClock::now_ns();
+        return _elapsed_ns + ((_running && now > _start_ns) ? now - _start_ns : 0);
+    }
+
+    bool _running;
+    uint64_t _start_ns;
+    uint64_t _elapsed_ns;
+};
+
+#endif // MBED_H
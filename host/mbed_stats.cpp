@@ -0,0 +1,122 @@
+/* Host heap statistics for mbed_stats_heap_get.
+ *
+ * glibc lets a program replace malloc and friends; these count what passes
+ * through and hand the work on to glibc's own allocator. Sizes are the
+ * usable size of each block, which can be a few bytes over what was asked
+ * for. Everything on the heap counts: the C++ runtime and the simulator's
+ * threads as well as the application.
+ */
+#include <malloc.h>
+#include <errno.h>
+
+#include "mbed.h"
+
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t nmemb, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+void __libc_free(void *ptr);
+}
+
+static mbed_stats_heap_t heap_stats;
+
+static void *count_alloc(void *ptr, size_t size)
+{
+    if (ptr == NULL) {
+        if (size) {
+            __atomic_add_fetch(&heap_stats.alloc_fail_cnt, 1, __ATOMIC_RELAXED);
+        }
+        return NULL;
+    }
+    uint32_t usable = (uint32_t)malloc_usable_size(ptr);
+    uint32_t current = __atomic_add_fetch(&heap_stats.current_size, usable, __ATOMIC_RELAXED);
+    uint32_t max = __atomic_load_n(&heap_stats.max_size, __ATOMIC_RELAXED);
+    while (current > max && !__atomic_compare_exchange_n(&heap_stats.max_size, &max, current, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+    __atomic_add_fetch(&heap_stats.total_size, usable, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&heap_stats.alloc_cnt, 1, __ATOMIC_RELAXED);
+    return ptr;
+}
+
+static void count_free(void *ptr)
+{
+    if (ptr) {
+        __atomic_sub_fetch(&heap_stats.current_size, (uint32_t)malloc_usable_size(ptr), __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&heap_stats.alloc_cnt, 1, __ATOMIC_RELAXED);
+    }
+}
+
+extern "C" {
+
+void *malloc(size_t size)
+{
+    return count_alloc(__libc_malloc(size), size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    return count_alloc(__libc_calloc(nmemb, size), nmemb * size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    if (ptr == NULL) {
+        return malloc(size);
+    }
+    uint32_t old_usable = (uint32_t)malloc_usable_size(ptr);
+    void *moved = __libc_realloc(ptr, size);
+    if (moved == NULL) {
+        if (size) {
+            __atomic_add_fetch(&heap_stats.alloc_fail_cnt, 1, __ATOMIC_RELAXED);
+            return NULL;
+        }
+        // realloc(ptr, 0) freed the block
+        __atomic_sub_fetch(&heap_stats.current_size, old_usable, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&heap_stats.alloc_cnt, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    __atomic_sub_fetch(&heap_stats.current_size, old_usable, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&heap_stats.alloc_cnt, 1, __ATOMIC_RELAXED);
+    return count_alloc(moved, size);
+}
+
+void *memalign(size_t alignment, size_t size)
+{
+    return count_alloc(__libc_memalign(alignment, size), size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+    return memalign(alignment, size);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    if (alignment < sizeof(void *) || (alignment & (alignment - 1))) {
+        return EINVAL;
+    }
+    void *ptr = memalign(alignment, size);
+    if (ptr == NULL) {
+        return ENOMEM;
+    }
+    *memptr = ptr;
+    return 0;
+}
+
+void free(void *ptr)
+{
+    count_free(ptr);
+    __libc_free(ptr);
+}
+
+}
+
+void mbed_stats_heap_get(mbed_stats_heap_t *stats)
+{
+    stats->current_size = __atomic_load_n(&heap_stats.current_size, __ATOMIC_RELAXED);
+    stats->max_size = __atomic_load_n(&heap_stats.max_size, __ATOMIC_RELAXED);
+    stats->total_size = __atomic_load_n(&heap_stats.total_size, __ATOMIC_RELAXED);
+    stats->alloc_cnt = __atomic_load_n(&heap_stats.alloc_cnt, __ATOMIC_RELAXED);
+    stats->alloc_fail_cnt = __atomic_load_n(&heap_stats.alloc_fail_cnt, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,85 @@
+/* Host implementation of the QSPIFlash hardware hooks.
+ *
+ * The NRF52840 has no status auto-polling, so by default the simulator does
+ * not offer it either; build with -DQSPI_SIM_HW_AUTOPOLL to model a controller
+ * that has it (STM32 QUADSPI style: the CPU sleeps for the whole wait).
+ *
+ * Continuous reads are always available: QSPIFlash only uses them when asked
+ * to. They model a controller that can leave out the instruction phase
+ * (STM32 QUADSPI instruction mode "none"), which the NRF52840 cannot.
+ *
+ * The host QSPI driver compares register images when the bus changes hands
+ * and counts what it skipped; that is reported through the bus stats hook.
+ *
+ * Command batches model a board that writes the NRF52840 custom instruction
+ * registers itself for every command after the first instead of calling the
+ * driver again (see QSPI_SIM_BATCH_STEP_NS), polling in a tight loop.
+ *
+ * The charge hook reports the simulator's supply current model, as a
+ * current monitor on the flash supply would.
+ *
+ * The power failure hook cuts the simulated part's supply as described at
+ * FlashSim::cut_power.
+ */
+#include "../QSPIFlash.h"
+#include "FlashSim.h"
+
+#ifdef QSPI_SIM_HW_AUTOPOLL
+
+qspi_status_t qspi_flash_hw_autopoll(QSPI *qspi, uint8_t mask, uint8_t match, uint32_t timeout_us)
+{
+    return qspi->sim_autopoll(mask, match, timeout_us);
+}
+
+#endif
+
+qspi_status_t qspi_flash_hw_read_continuous(QSPI *qspi, uint32_t addr, uint8_t mode, bool send_inst, void *buffer, size_t size)
+{
+    return qspi->sim_read_continuous(addr, mode, send_inst, (char *)buffer, size);
+}
+
+qspi_status_t qspi_flash_hw_command_batch(QSPI *qspi, const qspi_flash_command_t *commands, size_t count)
+{
+    qspi_status_t result = QSPI_STATUS_OK;
+
+    qspi->sim_batch_begin();
+    for (size_t i = 0; i < count && result == QSPI_STATUS_OK; i++) {
+        const qspi_flash_command_t *command = &commands[i];
+        result = qspi->sim_batch_command(command->instruction, command->tx_buffer, command->tx_length,
+                                         command->rx_buffer, command->rx_length, command->poll_mask,
+                                         command->poll_match, command->poll_timeout_us);
+    }
+    qspi->sim_batch_end();
+    return result;
+}
+
+qspi_status_t qspi_flash_hw_bus_stats(qspi_flash_bus_stats_t *stats, bool clear)
+{
+    if (stats == NULL) {
+        return QSPI_STATUS_INVALID_PARAMETER;
+    }
+    qspi_sim_bus_stats_t sim_stats = QSPI::sim_bus_stats(clear);
+    stats->switches = sim_stats.switches;
+    stats->reconfigurations = sim_stats.reconfigurations;
+    stats->avoided = sim_stats.avoided;
+    return QSPI_STATUS_OK;
+}
+
+qspi_status_t qspi_flash_hw_charge(uint64_t *charge_pc)
+{
+    if (charge_pc == NULL) {
+        return QSPI_STATUS_INVALID_PARAMETER;
+    }
+    *charge_pc = FlashSim::instance().stats().charge_fc / 1000;
+    return QSPI_STATUS_OK;
+}
+
+qspi_status_t qspi_flash_hw_power_fail(uint32_t ops)
+{
+    if (ops) {
+        FlashSim::instance().cut_power(ops);
+    } else {
+        FlashSim::instance().restore_power();
+    }
+    return QSPI_STATUS_OK;
+}
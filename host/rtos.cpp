@@ -0,0 +1,240 @@
+#include "rtos.h"
+
+#include <algorithm>
+
+typedef std::unique_lock<std::mutex> sim_guard_t;
+
+// Deadline of a wait of millisec from now
+static uint64_t deadline(sim_guard_t &guard, uint32_t millisec)
+{
+    if (millisec == osWaitForever) {
+        return SIM_FOREVER;
+    }
+    return SimScheduler::current(guard)->now_ns + (uint64_t)millisec * 1000000;
+}
+
+template <typename T>
+static void remove_waiter(std::deque<T> &waiters, T waiter)
+{
+    waiters.erase(std::remove(waiters.begin(), waiters.end(), waiter), waiters.end());
+}
+
+namespace rtos {
+
+Thread::Thread(osPriority priority, uint32_t stack_size, unsigned char *stack_mem, const char *name)
+    : _sim(NULL), _priority(priority)
+{
+    (void)stack_size;
+    (void)stack_mem;
+    (void)name;
+}
+
+Thread::~Thread()
+{
+    join();
+}
+
+osStatus Thread::start(mbed::Callback<void()> task)
+{
+    sim_guard_t guard(SimScheduler::lock());
+    SimThread *sim = SimScheduler::create(SimScheduler::current(guard)->now_ns);
+    _sim = sim;
+    _thread = std::thread([sim, task]() {
+        {
+            sim_guard_t guard(SimScheduler::lock());
+            SimScheduler::attach(guard, sim);
+        }
+        task();
+        sim_guard_t guard(SimScheduler::lock());
+        SimScheduler::exit(guard);
+    });
+    return osOK;
+}
+
+osStatus Thread::join()
+{
+    if (_sim == NULL) {
+        return osOK;
+    }
+    {
+        sim_guard_t guard(SimScheduler::lock());
+        if (_sim->state != SimThread::EXITED) {
+            _sim->joiners.push_back(SimScheduler::current(guard));
+            SimScheduler::block(guard);
+        }
+    }
+    _thread.join();
+    _sim = NULL;
+    return osOK;
+}
+
+osStatus Thread::yield()
+{
+    return osOK;
+}
+
+Mutex::Mutex() : _owner(NULL), _count(0)
+{
+}
+
+osStatus Mutex::lock(uint32_t millisec)
+{
+    (void)millisec;
+    sim_guard_t guard(SimScheduler::lock());
+    SimThread *self = SimScheduler::current(guard);
+    if (_owner == NULL || _owner == self) {
+        _owner = self;
+        _count++;
+        return osOK;
+    }
+    // Ownership is handed over by unlock()
+    _waiters.push_back(self);
+    SimScheduler::block(guard);
+    return osOK;
+}
+
+bool Mutex::trylock()
+{
+    sim_guard_t guard(SimScheduler::lock());
+    SimThread *self = SimScheduler::current(guard);
+    if (_owner == NULL || _owner == self) {
+        _owner = self;
+        _count++;
+        return true;
+    }
+    return false;
+}
+
+osStatus Mutex::unlock()
+{
+    sim_guard_t guard(SimScheduler::lock());
+    if (--_count == 0) {
+        _owner = NULL;
+        if (!_waiters.empty()) {
+            _owner = _waiters.front();
+            _count = 1;
+            _waiters.pop_front();
+            SimScheduler::wake(guard, _owner);
+        }
+    }
+    return osOK;
+}
+
+Semaphore::Semaphore(int32_t count) : _count(count)
+{
+}
+
+int32_t Semaphore::wait(uint32_t millisec)
+{
+    sim_guard_t guard(SimScheduler::lock());
+    if (_count > 0) {
+        return _count--;
+    }
+    if (millisec == 0) {
+        return 0;
+    }
+
+    // A token is handed over directly by release()
+    SimThread *self = SimScheduler::current(guard);
+    _waiters.push_back(self);
+    if (!SimScheduler::block(guard, deadline(guard, millisec))) {
+        remove_waiter(_waiters, self);
+        return 0;
+    }
+    return 1;
+}
+
+osStatus Semaphore::release()
+{
+    sim_guard_t guard(SimScheduler::lock());
+    if (!_waiters.empty()) {
+        SimThread *waiter = _waiters.front();
+        _waiters.pop_front();
+        SimScheduler::wake(guard, waiter);
+    } else {
+        _count++;
+    }
+    return osOK;
+}
+
+EventFlags::EventFlags() : _flags(0)
+{
+}
+
+bool EventFlags::satisfied(const Waiter &waiter) const
+{
+    return waiter.all ? ((_flags & waiter.flags) == waiter.flags) : ((_flags & waiter.flags) != 0);
+}
+
+uint32_t EventFlags::set(uint32_t flags)
+{
+    sim_guard_t guard(SimScheduler::lock());
+    _flags |= flags;
+    uint32_t result = _flags;
+
+    std::list<Waiter *>::iterator it = _waiters.begin();
+    while (it != _waiters.end()) {
+        Waiter *waiter = *it;
+        if (satisfied(*waiter)) {
+            waiter->result = _flags;
+            if (waiter->clear) {
+                _flags &= ~waiter->flags;
+            }
+            SimScheduler::wake(guard, waiter->thread);
+            it = _waiters.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    return result;
+}
+
+uint32_t EventFlags::clear(uint32_t flags)
+{
+    sim_guard_t guard(SimScheduler::lock());
+    uint32_t old = _flags;
+    _flags &= ~flags;
+    return old;
+}
+
+uint32_t EventFlags::get()
+{
+    sim_guard_t guard(SimScheduler::lock());
+    return _flags;
+}
+
+uint32_t EventFlags::wait_all(uint32_t flags, uint32_t millisec, bool clear)
+{
+    return wait(flags, millisec, clear, true);
+}
+
+uint32_t EventFlags::wait_any(uint32_t flags, uint32_t millisec, bool clear)
+{
+    return wait(flags, millisec, clear, false);
+}
+
+uint32_t EventFlags::wait(uint32_t flags, uint32_t millisec, bool clear, bool all)
+{
+    sim_guard_t guard(SimScheduler::lock());
+    Waiter waiter = { SimScheduler::current(guard), flags, all, clear, 0 };
+
+    if (satisfied(waiter)) {
+        uint32_t result = _flags;
+        if (clear) {
+            _flags &= ~flags;
+        }
+        return result;
+    }
+    if (millisec == 0) {
+        return osFlagsErrorTimeout;
+    }
+
+    _waiters.push_back(&waiter);
+    if (!SimScheduler::block(guard, deadline(guard, millisec))) {
+        _waiters.remove(&waiter);
+        return osFlagsErrorTimeout;
+    }
+    return waiter.result;
+}
+
+}
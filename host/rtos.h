@@ -0,0 +1,125 @@
+/* Host stand-in for the mbed RTOS API, on the simulator's virtual clock.
+ *
+ * Threads are real host threads run one at a time by SimScheduler, each with
+ * its own virtual clock. A thread starts at its creator's time and a thread
+ * woken by another (mutex hand-over, semaphore, event flags, join) continues
+ * at the waker's time. Priorities are recorded but not used for scheduling.
+ */
+#ifndef RTOS_H
+#define RTOS_H
+
+#include <stdint.h>
+#include <deque>
+#include <list>
+#include <thread>
+
+#include "cmsis_os.h"
+#include "SimScheduler.h"
+#include "Callback.h"
+
+#define osWaitForever       0xFFFFFFFFU
+#define OS_STACK_SIZE       4096
+
+typedef enum {
+    osPriorityIdle          = 1,
+    osPriorityLow           = 8,
+    osPriorityBelowNormal   = 16,
+    osPriorityNormal        = 24,
+    osPriorityAboveNormal   = 32,
+    osPriorityHigh          = 40,
+    osPriorityRealtime      = 48,
+} osPriority;
+
+namespace rtos {
+
+class Thread {
+public:
+    Thread(osPriority priority = osPriorityNormal, uint32_t stack_size = OS_STACK_SIZE,
+           unsigned char *stack_mem = NULL, const char *name = NULL);
+    ~Thread();
+
+    osStatus start(mbed::Callback<void()> task);
+    osStatus join();
+    osPriority get_priority() const
+    {
+        return _priority;
+    }
+    osStatus set_priority(osPriority priority)
+    {
+        _priority = priority;
+        return osOK;
+    }
+
+    /** Sleep the calling thread; spends virtual time only */
+    static osStatus wait(uint32_t millisec)
+    {
+        return osDelay(millisec);
+    }
+
+    /** Give the host CPU to another thread; no virtual time passes */
+    static osStatus yield();
+
+private:
+    std::thread _thread;
+    SimThread *_sim;
+    osPriority _priority;
+};
+
+class Mutex {
+public:
+    osStatus lock(uint32_t millisec = osWaitForever);
+    bool trylock();
+    osStatus unlock();
+
+    Mutex();
+
+private:
+    SimThread *_owner;
+    uint32_t _count;
+    std::deque<SimThread *> _waiters;
+};
+
+class Semaphore {
+public:
+    Semaphore(int32_t count = 0);
+
+    /** Take a token; returns the tokens available before, 0 on timeout */
+    int32_t wait(uint32_t millisec = osWaitForever);
+    osStatus release();
+
+private:
+    int32_t _count;
+    std::deque<SimThread *> _waiters;
+};
+
+class EventFlags {
+public:
+    EventFlags();
+
+    uint32_t set(uint32_t flags);
+    uint32_t clear(uint32_t flags = 0x7fffffff);
+    uint32_t get();
+    uint32_t wait_all(uint32_t flags = 0, uint32_t millisec = osWaitForever, bool clear = true);
+    uint32_t wait_any(uint32_t flags = 0, uint32_t millisec = osWaitForever, bool clear = true);
+
+private:
+    struct Waiter {
+        SimThread *thread;
+        uint32_t flags;
+        bool all;
+        bool clear;
+        uint32_t result;
+    };
+
+    uint32_t wait(uint32_t flags, uint32_t millisec, bool clear, bool all);
+    bool satisfied(const Waiter &waiter) const;
+
+    uint32_t _flags;
+    std::list<Waiter *> _waiters;
+};
+
+}
+
+using namespace rtos;
+
+#endif // RTOS_H
@@ -2,62 +2,68 @@
 #include "cmsis_os.h"
 #include "PinNames.h"
 #include "QSPI.h"
-
-// The below values are command codes defined in Datasheet for MX25R6435F Macronix Flash Memory
-// Command for reading status register
-#define QSPI_STD_CMD_RDSR                   0x05
-// Command for writing status register
-#define QSPI_STD_CMD_WRSR                   0x01
-// Command for reading control register (supported only by some memories)
-#define QSPI_STD_CMD_RDCR                   0x35
-// Command for writing control register (supported only by some memories)
-#define QSPI_STD_CMD_WRCR                   0x3E
-// Command for setting Reset Enable (supported only by some memories)
-#define QSPI_STD_CMD_RSTEN                  0x66
-// Command for setting Reset (supported only by some memories)
-#define QSPI_STD_CMD_RST                    0x99
-// Command for setting WREN (supported only by some memories)
-#define QSPI_STD_CMD_WREN                   0x06
-// Command for Sector erase (supported only by some memories)
-#define QSPI_STD_CMD_SECT_ERASE             0x20
-// Read/Write commands
-#define QSPI_PP_COMMAND_NRF_ENUM            (0x0) //This corresponds to Flash command 0x02
-#define QSPI_READ2O_COMMAND_NRF_ENUM        (0x1) //This corresponds to Flash command 0x3B
-#define QSPI_READ2IO_COMMAND_NRF_ENUM       (0x2) //This corresponds to Flash command 0xBB
-#define QSPI_PP4IO_COMMAND_NRF_ENUM         (0x3) //This corresponds to Flash command 0x38
-#define QSPI_READ4IO_COMMAND_NRF_ENUM       (0x4) //This corresponds to Flash command 0xEB
-
-//#define DEBUG_ON 1
-#ifdef DEBUG_ON
-    #define VERBOSE_PRINT(x) printf x
-#else    
-    #define VERBOSE_PRINT(x)
-#endif
+#include "qspi_test.h"
+#include "QSPIFlashBlockDevice.h"
+#include "QSPIFlashFTL.h"
+#include "QSPIFlashSFDP.h"
+#include "QSPIFlashCalibrate.h"
+#include "QSPIFlashPower.h"
+#include "QSPIFlashPreErase.h"
+#include "QSPIWriteBuffer.h"
+#include "QSPIFlashSectorMap.h"
+#include "benchmark.h"
 
 #define DO_TEST( test )                                 \
     {                                                   \
+        Timer test_timer;                               \
         printf("\nExecuting test: %-40s :", #test );    \
-        if( false == test() ) {                         \
+        test_timer.start();                             \
+        bool test_passed = test();                      \
+        test_timer.stop();                              \
+        if( false == test_passed ) {                    \
             printf(" FAILED" );                         \
         } else {                                        \
             printf(" PASSED" );                         \
         }                                               \
+        printf(" (%d ms)", test_timer.read_ms() );      \
     }                                                   \
 
 QSPI *myQspi = NULL;
 QSPI *myQspiOther = NULL;
-#define _1_K_ (0x400)
-#define _4_K_ (_1_K_ * 4)
+QSPIFlash *myFlash = NULL;
+QSPIFlashSectorMap *mySectorMap = NULL;
     
-bool InitializeFlashMem();
-bool WaitForMemReady();
-bool SectorErase(unsigned int flash_addr);
 bool TestWriteReadSimple();
 bool TestWriteReadBlockMultiplePattern();
 bool TestWriteSingleReadMultiple();
 bool TestWriteMultipleReadSingle();
 bool TestWriteReadMultipleObjects();
 bool TestWriteReadCustomCommands();
+bool TestProgramEngine();
+bool TestAsyncOrdering();
+bool TestEraseRange();
+bool TestReadLatencyUnderErase();
+bool TestReadCache();
+bool TestContinuousRead();
+bool TestSmartWrite();
+bool TestBlockDevice();
+bool TestFTL();
+#if QSPI_TRACE_ENABLED
+bool TestTrace();
+#endif
+bool TestSFDP();
+bool TestCalibrate();
+bool TestBusSharing();
+bool TestContention();
+bool TestAsyncStreamRead();
+bool TestHighAddress();
+bool TestBufferPool();
+bool TestVerify();
+bool TestPowerModes();
+bool TestCommandBatch();
+bool TestPreErase();
+bool TestWriteBuffer();
+bool TestSectorMap();
     
 // main() runs in its own thread in the OS
 int main() {
@@ -68,13 +74,15 @@ int main() {
         printf("\nERROR: Failed creating QSPI driver object");
         return -1;
     }
+    myFlash = new QSPIFlash(myQspi);
     
     ///////////////////////////////////////////
     // Run tests in QUADSPI 1_1_1 mode
     ///////////////////////////////////////////
     printf("\n\nQSPI Config = 1_1_1");
-    if(QSPI_STATUS_OK == myQspi->configure_format( QSPI_CFG_BUS_SINGLE, QSPI_CFG_BUS_SINGLE, QSPI_CFG_ADDR_SIZE_24, QSPI_CFG_BUS_SINGLE, QSPI_CFG_ALT_SIZE_NONE, QSPI_CFG_BUS_SINGLE, 0, 0 )) {
+    if(QSPI_STATUS_OK == myQspi->configure_format( QSPI_CFG_BUS_SINGLE, QSPI_CFG_BUS_SINGLE, QSPI_FLASH_ADDR_SIZE, QSPI_CFG_BUS_SINGLE, QSPI_CFG_ALT_SIZE_NONE, QSPI_CFG_BUS_SINGLE, 0, 0 )) {
         printf("\nConfigured QSPI driver configured succesfully");
+        myFlash->set_trace_format( QSPI_TRACE_FORMAT( QSPI_CFG_BUS_SINGLE, QSPI_CFG_BUS_SINGLE, QSPI_CFG_BUS_SINGLE ));
     } else {
         printf("\nERROR: Failed configuring QSPI driver");
         return -1;
@@ -84,18 +92,30 @@ int main() {
         printf("\nUnable to initialize flash memory, tests failed\n");
         return -1;
     }
+    
+#if MBED_HEAP_STATS_ENABLED
+    mbed_stats_heap_t heap_stats;
+    mbed_stats_heap_get( &heap_stats );
+    uint32_t heap_start = heap_stats.current_size;
+    uint32_t heap_total = heap_stats.total_size;
+#endif
         
     DO_TEST( TestWriteReadSimple );
     DO_TEST( TestWriteReadBlockMultiplePattern );
     DO_TEST( TestWriteMultipleReadSingle );
     DO_TEST( TestWriteSingleReadMultiple );
+    DO_TEST( TestProgramEngine );
+    DO_TEST( TestAsyncOrdering );
+    DO_TEST( TestAsyncStreamRead );
+    DO_TEST( TestHighAddress );
             
     ///////////////////////////////////////////
     // Run tests in QUADSPI 1_1_4 mode
     ///////////////////////////////////////////
     printf("\n\nQSPI Config = 1_1_4");
-    if(QSPI_STATUS_OK == myQspi->configure_format( QSPI_CFG_BUS_SINGLE, QSPI_CFG_BUS_SINGLE, QSPI_CFG_ADDR_SIZE_24, QSPI_CFG_BUS_SINGLE, QSPI_CFG_ALT_SIZE_NONE, QSPI_CFG_BUS_QUAD, 0, 0 )) {
+    if(QSPI_STATUS_OK == myQspi->configure_format( QSPI_CFG_BUS_SINGLE, QSPI_CFG_BUS_SINGLE, QSPI_FLASH_ADDR_SIZE, QSPI_CFG_BUS_SINGLE, QSPI_CFG_ALT_SIZE_NONE, QSPI_CFG_BUS_QUAD, 0, 0 )) {
         printf("\nConfigured QSPI driver configured succesfully");
+        myFlash->set_trace_format( QSPI_TRACE_FORMAT( QSPI_CFG_BUS_SINGLE, QSPI_CFG_BUS_SINGLE, QSPI_CFG_BUS_QUAD ));
     } else {
         printf("\nERROR: Failed configuring QSPI driver");
         return -1;
@@ -110,13 +130,18 @@ int main() {
     DO_TEST( TestWriteReadBlockMultiplePattern );
     DO_TEST( TestWriteMultipleReadSingle );
     DO_TEST( TestWriteSingleReadMultiple );
+    DO_TEST( TestProgramEngine );
+    DO_TEST( TestAsyncOrdering );
+    DO_TEST( TestAsyncStreamRead );
+    DO_TEST( TestHighAddress );
             
     ///////////////////////////////////////////
     // Run tests in QUADSPI 1_4_4 mode
     ///////////////////////////////////////////
     printf("\n\nQSPI Config = 1_4_4");
-    if(QSPI_STATUS_OK == myQspi->configure_format( QSPI_CFG_BUS_SINGLE, QSPI_CFG_BUS_QUAD, QSPI_CFG_ADDR_SIZE_24, QSPI_CFG_BUS_SINGLE, QSPI_CFG_ALT_SIZE_NONE, QSPI_CFG_BUS_QUAD, 0, 0 )) {
+    if(QSPI_STATUS_OK == myQspi->configure_format( QSPI_CFG_BUS_SINGLE, QSPI_CFG_BUS_QUAD, QSPI_FLASH_ADDR_SIZE, QSPI_CFG_BUS_SINGLE, QSPI_CFG_ALT_SIZE_NONE, QSPI_CFG_BUS_QUAD, 0, 0 )) {
         printf("\nConfigured QSPI driver configured succesfully");
+        myFlash->set_trace_format( QSPI_TRACE_FORMAT( QSPI_CFG_BUS_SINGLE, QSPI_CFG_BUS_QUAD, QSPI_CFG_BUS_QUAD ));
     } else {
         printf("\nERROR: Failed configuring QSPI driver");
         return -1;
@@ -131,11 +156,16 @@ int main() {
     DO_TEST( TestWriteReadBlockMultiplePattern );
     DO_TEST( TestWriteMultipleReadSingle );
     DO_TEST( TestWriteSingleReadMultiple );
+    DO_TEST( TestProgramEngine );
+    DO_TEST( TestAsyncOrdering );
+    DO_TEST( TestAsyncStreamRead );
+    DO_TEST( TestHighAddress );
   
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 // The Macronix Flash part on NRF52840_DK does not support Dual Mode writes. The only testing we can
 // is to do a single line write and Dual-line reads which is covered by TestWriteReadCustomCommands.
-// So, for now keep this tests disabled using the below DUAL_MODE_READ_ENABLED flag.    
+// So, for now keep this tests disabled using the below DUAL_MODE_READ_ENABLED flag. TestSFDP reads
+// in every mode the part's SFDP lists, dual ones included.
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 //#define DUAL_MODE_READ_ENABLED    
 #ifdef DUAL_MODE_READ_ENABLED    
@@ -143,8 +173,9 @@ int main() {
     // Run tests in QUADSPI 1_1_2 mode
     ///////////////////////////////////////////
     printf("\n\nQSPI Config = 1_1_2");
-    if(QSPI_STATUS_OK == myQspi->configure_format( QSPI_CFG_BUS_SINGLE, QSPI_CFG_BUS_SINGLE, QSPI_CFG_ADDR_SIZE_24, QSPI_CFG_BUS_SINGLE, QSPI_CFG_ALT_SIZE_NONE, QSPI_CFG_BUS_DUAL, 0, 0 )) {
+    if(QSPI_STATUS_OK == myQspi->configure_format( QSPI_CFG_BUS_SINGLE, QSPI_CFG_BUS_SINGLE, QSPI_FLASH_ADDR_SIZE, QSPI_CFG_BUS_SINGLE, QSPI_CFG_ALT_SIZE_NONE, QSPI_CFG_BUS_DUAL, 0, 0 )) {
         printf("\nConfigured QSPI driver configured succesfully");
+        myFlash->set_trace_format( QSPI_TRACE_FORMAT( QSPI_CFG_BUS_SINGLE, QSPI_CFG_BUS_SINGLE, QSPI_CFG_BUS_DUAL ));
     } else {
         printf("\nERROR: Failed configuring QSPI driver");
         return -1;
@@ -159,13 +190,18 @@ int main() {
     DO_TEST( TestWriteReadBlockMultiplePattern );
     DO_TEST( TestWriteMultipleReadSingle );
     DO_TEST( TestWriteSingleReadMultiple );
+    DO_TEST( TestProgramEngine );
+    DO_TEST( TestAsyncOrdering );
+    DO_TEST( TestAsyncStreamRead );
+    DO_TEST( TestHighAddress );
         
     ///////////////////////////////////////////
     // Run tests in QUADSPI 1_2_2 mode
     ///////////////////////////////////////////
     printf("\n\nQSPI Config = 1_2_2");
-    if(QSPI_STATUS_OK == myQspi->configure_format( QSPI_CFG_BUS_SINGLE, QSPI_CFG_BUS_DUAL, QSPI_CFG_ADDR_SIZE_24, QSPI_CFG_BUS_SINGLE, QSPI_CFG_ALT_SIZE_NONE, QSPI_CFG_BUS_DUAL, 0, 0 )) {
+    if(QSPI_STATUS_OK == myQspi->configure_format( QSPI_CFG_BUS_SINGLE, QSPI_CFG_BUS_DUAL, QSPI_FLASH_ADDR_SIZE, QSPI_CFG_BUS_SINGLE, QSPI_CFG_ALT_SIZE_NONE, QSPI_CFG_BUS_DUAL, 0, 0 )) {
         printf("\nConfigured QSPI driver configured succesfully");
+        myFlash->set_trace_format( QSPI_TRACE_FORMAT( QSPI_CFG_BUS_SINGLE, QSPI_CFG_BUS_DUAL, QSPI_CFG_BUS_DUAL ));
     } else {
         printf("\nERROR: Failed configuring QSPI driver");
         return -1;
@@ -180,10 +216,16 @@ int main() {
     DO_TEST( TestWriteReadBlockMultiplePattern );
     DO_TEST( TestWriteMultipleReadSingle );
     DO_TEST( TestWriteSingleReadMultiple );
+    DO_TEST( TestProgramEngine );
+    DO_TEST( TestAsyncOrdering );
+    DO_TEST( TestAsyncStreamRead );
+    DO_TEST( TestHighAddress );
 #endif //DUAL_MODE_READ_ENABLED    
     
     printf("\n\nCustom commands test uses Dual-Mode QSPI to access the flash memory" );
     DO_TEST( TestWriteReadCustomCommands );
+    DO_TEST( TestEraseRange );
+    DO_TEST( TestReadLatencyUnderErase );
     
     if( true == TestWriteReadMultipleObjects()) {
         printf("\nExecuting test: %-40s : PASSED", "TestWriteReadMultipleObjects" );
@@ -191,11 +233,52 @@ int main() {
         printf("\nExecuting test: %-40s : FAILED", "TestWriteReadMultipleObjects" );        
     }
     
+    // Needs myQspiOther from TestWriteReadMultipleObjects
+    DO_TEST( TestReadCache );
+    DO_TEST( TestContinuousRead );
+    DO_TEST( TestSmartWrite );
+    DO_TEST( TestBlockDevice );
+    DO_TEST( TestFTL );
+#if QSPI_TRACE_ENABLED
+    DO_TEST( TestTrace );
+#endif
+    DO_TEST( TestSFDP );
+    DO_TEST( TestCalibrate );
+    DO_TEST( TestBusSharing );
+    DO_TEST( TestContention );
+    DO_TEST( TestBufferPool );
+    DO_TEST( TestVerify );
+    DO_TEST( TestPowerModes );
+    DO_TEST( TestCommandBatch );
+    DO_TEST( TestPreErase );
+    DO_TEST( TestWriteBuffer );
+    DO_TEST( TestSectorMap );
+    
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Define BENCHMARK_ENABLED (here or on the command line) to follow the tests with a throughput and
+// latency sweep over all the bus formats above. See benchmark.h for the output format.
+////////////////////////////////////////////////////////////////////////////////////////////////////
+//#define BENCHMARK_ENABLED
+#ifdef BENCHMARK_ENABLED
+    printf("\n\nRunning benchmarks" );
+    RunBenchmarks();
+#endif //BENCHMARK_ENABLED
+    
     if(NULL != myQspi)    
         delete myQspi;
     if(NULL != myQspiOther)
         delete myQspiOther;
+    if(NULL != myFlash)
+        delete myFlash;
     
+#if MBED_HEAP_STATS_ENABLED
+    mbed_stats_heap_get( &heap_stats );
+    printf("\nHeap peak %lu B above the %lu B in use before the tests, %lu B allocated by them", (unsigned long)(heap_stats.max_size - heap_start),
+           (unsigned long)heap_start, (unsigned long)(heap_stats.total_size - heap_total) );
+#endif
+    qspi_buffer_pool_stats_t pool_stats;
+    qspi_buffer_pool_stats( &pool_stats, false );
+    printf("\nBuffer pool peak %lu of %d buffers, %lu acquires", (unsigned long)pool_stats.peak, QSPI_BUFFER_COUNT, (unsigned long)pool_stats.acquires );
     printf("\nDone...\n");
 }
 
@@ -247,44 +330,28 @@ bool TestWriteReadSimple()
 
 bool TestWriteReadBlockMultiplePattern()
 {
-    char *test_tx_buf = NULL;
-    char *test_rx_buf = NULL;
-    char *test_tx_buf_aligned = NULL;
+    QSPIBuffer test_tx_buf;
+    QSPIBuffer test_rx_buf;
     uint32_t flash_addr = 0;
     int result = 0;
     size_t buf_len = 0;
     char pattern_buf[] = { 0x12, 0x23, 0x34, 0x45, 0x56, 0x67, 0x78, 0x89, 0x10, 0x1A, 0x1B, 0x1C, 0x1D, 0x1E, 0x1F, 0x2F };    
             
-    test_tx_buf = NULL;
-    test_tx_buf = (char *)malloc( _1_K_ * 2 ); //Alloc 2k to get a 1K boundary
-    if(test_tx_buf == NULL) {
-        printf("\nERROR: tx buf alloc failed");
-        return -1;
+    if(test_tx_buf.data() == NULL || test_rx_buf.data() == NULL) {
+        printf("\nERROR: buf alloc failed");
+        return false;
     }
-    test_tx_buf_aligned = (char *)((((uint32_t)test_tx_buf) + _1_K_) & 0xFFFFFC00);
     
-    test_rx_buf = NULL;
-    test_rx_buf = (char *)malloc( _1_K_ ); //Alloc 2k to get a 1K boundary
-    if(test_rx_buf == NULL) {
-        printf("\nERROR: rx buf alloc failed");
+    flash_addr = 0x2000;
+    if( QSPI_STATUS_OK != myFlash->erase_range( flash_addr, 16 * _4_K_ )) {
+        printf("\nERROR: Erase failed(addr = 0x%08X)\n", flash_addr);
         return false;
     }
     
-    flash_addr = 0x2000;
     for(int i=0; i < 16; i++) {
-        if( false == SectorErase(flash_addr)) {
-            printf("\nERROR: SectorErase failed(addr = 0x%08X)\n", flash_addr);
-            return false;
-        }
-        
-        if( false == WaitForMemReady()) {
-            printf("\nDevice not ready, tests failed\n");
-            return false;
-        }
-        
-        memset( test_tx_buf_aligned, pattern_buf[i], _1_K_ );
+        memset( test_tx_buf.data(), pattern_buf[i], _1_K_ );
         buf_len = _1_K_; //1k 
-        result = myQspi->write( flash_addr, test_tx_buf_aligned, &buf_len );
+        result = myQspi->write( flash_addr, test_tx_buf.data(), &buf_len );
         if( ( result != QSPI_STATUS_OK ) || buf_len != _1_K_ ) {
             printf("\nERROR: Write failed");
         }
@@ -294,9 +361,9 @@ bool TestWriteReadBlockMultiplePattern()
             return false;
         }
         
-        memset( test_rx_buf, 0, _1_K_ );
+        memset( test_rx_buf.data(), 0, _1_K_ );
         buf_len = _1_K_; //1k
-        result = myQspi->read( flash_addr, test_rx_buf, &buf_len );
+        result = myQspi->read( flash_addr, test_rx_buf.data(), &buf_len );
         if( result != QSPI_STATUS_OK ) {
             printf("\nERROR: Read failed");
             return false;
@@ -305,7 +372,7 @@ bool TestWriteReadBlockMultiplePattern()
             printf( "\nERROR: Unable to read the entire buffer" );
             return false;
         }
-        if(0 != (memcmp( test_rx_buf, test_tx_buf_aligned, _1_K_))) {
+        if(0 != (memcmp( test_rx_buf.data(), test_tx_buf.data(), _1_K_))) {
             printf("\nERROR: Buffer contents are invalid"); 
             return false;
         }
@@ -313,18 +380,13 @@ bool TestWriteReadBlockMultiplePattern()
         flash_addr += 0x1000;
     }
     
-    free(test_rx_buf);
-    free(test_tx_buf);
-    
     return true;
 }
 
 bool TestWriteMultipleReadSingle()
 {
-    char *test_tx_buf = NULL;
-    char *test_rx_buf = NULL;
-    char *test_tx_buf_aligned = NULL;
-    char *test_rx_buf_aligned = NULL;
+    QSPIBuffer test_tx_buf;
+    QSPIBuffer test_rx_buf;
     char *tmp = NULL;
     uint32_t flash_addr = 0;
     int result = 0;
@@ -332,21 +394,10 @@ bool TestWriteMultipleReadSingle()
     char pattern_buf[] = { 0x12, 0x23, 0x34, 0x45, 0x56, 0x67, 0x78, 0x89, 0x10, 0x1A, 0x1B, 0x1C, 0x1D, 0x1E, 0x1F, 0x2F };  
     unsigned int start_addr = 0x2000;
             
-    test_tx_buf = NULL;
-    test_tx_buf = (char *)malloc( _1_K_ * 5 ); //Alloc 5k to get a 1K boundary
-    if(test_tx_buf == NULL) {
-        printf("\nERROR: tx buf alloc failed");
-        return -1;
-    }
-    test_tx_buf_aligned = (char *)((((uint32_t)test_tx_buf) + _1_K_) & 0xFFFFFC00);
-    
-    test_rx_buf = NULL;
-    test_rx_buf = (char *)malloc( _1_K_ * 5 ); //Alloc 5k to get a 1K boundary
-    if(test_rx_buf == NULL) {
-        printf("\nERROR: rx buf alloc failed");
+    if(test_tx_buf.data() == NULL || test_rx_buf.data() == NULL) {
+        printf("\nERROR: buf alloc failed");
         return false;
     }
-    test_rx_buf_aligned = (char *)((((uint32_t)test_rx_buf) + _1_K_) & 0xFFFFFC00);
     
     flash_addr = start_addr;
     if( false == SectorErase(flash_addr)) {
@@ -359,7 +410,7 @@ bool TestWriteMultipleReadSingle()
         return false;
     }
     
-    tmp = test_tx_buf_aligned;
+    tmp = test_tx_buf.data();
     for( int i=0; i < 4; i++) {
         memset( tmp, pattern_buf[i], _1_K_ );
         buf_len = _1_K_; //1k 
@@ -376,10 +427,10 @@ bool TestWriteMultipleReadSingle()
         tmp += _1_K_;
     }
     
-    memset( test_rx_buf_aligned, 0, _4_K_ );
+    memset( test_rx_buf.data(), 0, _4_K_ );
     buf_len = _4_K_; //1k
     flash_addr = start_addr;
-    result = myQspi->read( flash_addr, test_rx_buf_aligned, &buf_len );
+    result = myQspi->read( flash_addr, test_rx_buf.data(), &buf_len );
     if( result != QSPI_STATUS_OK ) {
         printf("\nERROR: Read failed");
         return false;
@@ -388,23 +439,18 @@ bool TestWriteMultipleReadSingle()
         printf( "\nERROR: Unable to read the entire buffer" );
         return false;
     }
-    if(0 != (memcmp( test_rx_buf_aligned, test_tx_buf_aligned, _4_K_))) {
+    if(0 != (memcmp( test_rx_buf.data(), test_tx_buf.data(), _4_K_))) {
         printf("\nERROR: Buffer contents are invalid"); 
         return false;
     } 
     
-    free(test_rx_buf);
-    free(test_tx_buf);
-    
     return true;
 }
 
 bool TestWriteSingleReadMultiple()
 {
-    char *test_tx_buf = NULL;
-    char *test_rx_buf = NULL;
-    char *test_tx_buf_aligned = NULL;
-    char *test_rx_buf_aligned = NULL;
+    QSPIBuffer test_tx_buf;
+    QSPIBuffer test_rx_buf;
     char *tmp = NULL;
     uint32_t flash_addr = 0;
     int result = 0;
@@ -412,21 +458,10 @@ bool TestWriteSingleReadMultiple()
     char pattern_buf[] = { 0x12, 0x23, 0x34, 0x45, 0x56, 0x67, 0x78, 0x89, 0x10, 0x1A, 0x1B, 0x1C, 0x1D, 0x1E, 0x1F, 0x2F };  
     unsigned int start_addr = 0x2000;
             
-    test_tx_buf = NULL;
-    test_tx_buf = (char *)malloc( _1_K_ * 5 ); //Alloc 5k to get a 1K boundary
-    if(test_tx_buf == NULL) {
-        printf("\nERROR: tx buf alloc failed");
-        return -1;
-    }
-    test_tx_buf_aligned = (char *)((((uint32_t)test_tx_buf) + _1_K_) & 0xFFFFFC00);
-    
-    test_rx_buf = NULL;
-    test_rx_buf = (char *)malloc( _1_K_ * 5 ); //Alloc 5k to get a 1K boundary
-    if(test_rx_buf == NULL) {
-        printf("\nERROR: rx buf alloc failed");
+    if(test_tx_buf.data() == NULL || test_rx_buf.data() == NULL) {
+        printf("\nERROR: buf alloc failed");
         return false;
     }
-    test_rx_buf_aligned = (char *)((((uint32_t)test_rx_buf) + _1_K_) & 0xFFFFFC00);
     
     flash_addr = start_addr;
     if( false == SectorErase(flash_addr)) {
@@ -439,14 +474,14 @@ bool TestWriteSingleReadMultiple()
         return false;
     }
     
-    tmp = test_tx_buf_aligned;
+    tmp = test_tx_buf.data();
     for( int i=0; i < 4; i++) {
         memset( tmp, pattern_buf[i], _1_K_ );
         tmp += _1_K_;
     }
     
     buf_len = _4_K_; //4k 
-    result = myQspi->write( flash_addr, test_tx_buf_aligned, &buf_len );
+    result = myQspi->write( flash_addr, test_tx_buf.data(), &buf_len );
     if( ( result != QSPI_STATUS_OK ) || buf_len != _4_K_ ) {
         printf("\nERROR: Write failed");
     }
@@ -456,11 +491,11 @@ bool TestWriteSingleReadMultiple()
         return false;
     }
     
-    memset( test_rx_buf_aligned, 0, _4_K_ );
+    memset( test_rx_buf.data(), 0, _4_K_ );
     
     buf_len = _1_K_; //1k
     flash_addr = start_addr;
-    tmp = test_rx_buf_aligned;
+    tmp = test_rx_buf.data();
     for( int i=0; i < 4; i++) {
         result = myQspi->read( flash_addr, tmp, &buf_len );
         if( result != QSPI_STATUS_OK ) {
@@ -474,14 +509,11 @@ bool TestWriteSingleReadMultiple()
         tmp += _1_K_;
         flash_addr += _1_K_;
     }
-    if(0 != (memcmp( test_rx_buf_aligned, test_tx_buf_aligned, _4_K_))) {
+    if(0 != (memcmp( test_rx_buf.data(), test_tx_buf.data(), _4_K_))) {
         printf("\nERROR: Buffer contents are invalid"); 
         return false;
     } 
     
-    free(test_rx_buf);
-    free(test_tx_buf);
-    
     return true;
 }
 
@@ -501,7 +533,7 @@ bool TestWriteReadMultipleObjects()
     ////////////////////////////////////////////////////
     // Configure myQspiOther object to do 1_1_1 mode
     ////////////////////////////////////////////////////
-    if( QSPI_STATUS_OK == myQspiOther->configure_format( QSPI_CFG_BUS_SINGLE, QSPI_CFG_BUS_SINGLE, QSPI_CFG_ADDR_SIZE_24, QSPI_CFG_BUS_SINGLE, QSPI_CFG_ALT_SIZE_NONE, QSPI_CFG_BUS_SINGLE, 0, 0 )) {
+    if( QSPI_STATUS_OK == myQspiOther->configure_format( QSPI_CFG_BUS_SINGLE, QSPI_CFG_BUS_SINGLE, QSPI_FLASH_ADDR_SIZE, QSPI_CFG_BUS_SINGLE, QSPI_CFG_ALT_SIZE_NONE, QSPI_CFG_BUS_SINGLE, 0, 0 )) {
         printf("\nConfigured 2nd QSPI driver configured succesfully");
     } else {
         printf("\nERROR: Failed configuring 2nd QSPI object");
@@ -512,8 +544,9 @@ bool TestWriteReadMultipleObjects()
     // Configure myQspi object to do 1_4_4 mode
     //////////////////////////////////////////////
     printf("\n\nQSPI Config = 1_4_4");
-    if(QSPI_STATUS_OK == myQspi->configure_format( QSPI_CFG_BUS_SINGLE, QSPI_CFG_BUS_QUAD, QSPI_CFG_ADDR_SIZE_24, QSPI_CFG_BUS_SINGLE, QSPI_CFG_ALT_SIZE_NONE, QSPI_CFG_BUS_QUAD, 0, 0 )) {
+    if(QSPI_STATUS_OK == myQspi->configure_format( QSPI_CFG_BUS_SINGLE, QSPI_CFG_BUS_QUAD, QSPI_FLASH_ADDR_SIZE, QSPI_CFG_BUS_SINGLE, QSPI_CFG_ALT_SIZE_NONE, QSPI_CFG_BUS_QUAD, 0, 0 )) {
         printf("\nConfigured QSPI driver configured succesfully");
+        myFlash->set_trace_format( QSPI_TRACE_FORMAT( QSPI_CFG_BUS_SINGLE, QSPI_CFG_BUS_QUAD, QSPI_CFG_BUS_QUAD ));
     } else {
         printf("\nERROR: Failed configuring QSPI driver");
         return -1;
@@ -687,127 +720,2155 @@ bool TestWriteReadCustomCommands()
     return true;
 }
 
-bool InitializeFlashMem()
+bool TestProgramEngine()
 {
-    bool ret_status = true;
-    char status_value[2];
+    QSPIBuffer test_tx_buf;
+    QSPIBuffer test_rx_buf;
+    size_t buf_len = 0;
+    int result = 0;
+    // Odd start and length so the range begins and ends mid-page and mid-word
+    unsigned int flash_addr = 0x2000 + 0x83;
+    unsigned int len = _1_K_ + 0x25;
     
-    //Read the Status Register from device
-    if (QSPI_STATUS_OK == myQspi->command_transfer(QSPI_STD_CMD_RDSR, // command to send
-                              0,                 // do not transmit
-                              NULL,              // do not transmit
-                              status_value,                 // just receive two bytes of data
-                              2)) {   // store received values in status_value
-        VERBOSE_PRINT(("\nReading Status Register Success: value = 0x%02X:0x%02X\n", status_value[0], status_value[1]));
-    } else {
-        printf("\nERROR: Reading Status Register failed\n");
-        ret_status = false;
+    if(test_tx_buf.data() == NULL || test_rx_buf.data() == NULL) {
+        printf("\nERROR: buf alloc failed");
+        return false;
+    }
+    for(unsigned int i=0; i < len; i++) {
+        test_tx_buf.data()[i] = (char)(i ^ 0x5A);
     }
     
-    if(ret_status)
+    if( false == SectorErase(0x2000)) {
+        printf("\nERROR: SectorErase failed(addr = 0x%08X)\n", 0x2000);
+        return false;
+    }
+    
+    if( false == WaitForMemReady()) {
+        printf("\nERROR: Device not ready, tests failed\n");
+        return false;
+    }
+    
+    if( QSPI_STATUS_OK != myFlash->program( flash_addr, test_tx_buf.data(), len )) {
+        printf("\nERROR: Program failed");
+        return false;
+    }
+    
+    // Read one byte either side as well, they must still be erased
+    memset( test_rx_buf.data(), 0, len );
+    buf_len = len;
+    result = myQspi->read( flash_addr, test_rx_buf.data(), &buf_len );
+    if( result != QSPI_STATUS_OK || buf_len != len ) {
+        printf("\nERROR: Read failed");
+        return false;
+    }
+    if(0 != (memcmp( test_rx_buf.data(), test_tx_buf.data(), len))) {
+        printf("\nERROR: Buffer contents are invalid"); 
+        return false;
+    }
+    
+    char edges[2];
+    buf_len = 1;
+    myQspi->read( flash_addr - 1, &edges[0], &buf_len );
+    buf_len = 1;
+    myQspi->read( flash_addr + len, &edges[1], &buf_len );
+    if( edges[0] != (char)0xFF || edges[1] != (char)0xFF ) {
+        printf("\nERROR: Program touched bytes outside the range"); 
+        return false;
+    }
+    
+    return true;
+}
+
+// Records the order in which asynchronous requests complete
+class AsyncRecorder {
+public:
+    AsyncRecorder() : order(NULL), count(NULL), id(0), result(QSPI_STATUS_ERROR) {}
+    
+    void done(qspi_status_t status)
     {
-        //Send Reset Enable
-        if (QSPI_STATUS_OK == myQspi->command_transfer(QSPI_STD_CMD_RSTEN, // command to send
-                                  0,                 // do not transmit
-                                  NULL,              // do not transmit
-                                  0,                 // just receive two bytes of data
-                                  NULL)) {   // store received values in status_value
-            VERBOSE_PRINT(("\nSending RSTEN Success\n"));
-        } else {
-            printf("\nERROR: Sending RSTEN failed\n");
-            ret_status = false;
+        result = status;
+        order[(*count)++] = id;
+    }
+    
+    int *order;
+    volatile int *count;
+    int id;
+    qspi_status_t result;
+};
+
+bool TestAsyncOrdering()
+{
+    char tx_buf[2][256];
+    char rx_buf[2][256];
+    int order[4];
+    volatile int count = 0;
+    AsyncRecorder recorder[4];
+    EventFlags flags;
+    unsigned int flash_addr = 0x5000;
+    
+    for(unsigned int i=0; i < sizeof(tx_buf[0]); i++) {
+        tx_buf[0][i] = (char)(i + 0x11);
+        tx_buf[1][i] = (char)(i ^ 0xA5);
+    }
+    for(int i=0; i < 4; i++) {
+        recorder[i].order = order;
+        recorder[i].count = &count;
+        recorder[i].id = i;
+    }
+    
+    if( false == SectorErase(flash_addr)) {
+        printf("\nERROR: SectorErase failed(addr = 0x%08X)\n", flash_addr);
+        return false;
+    }
+    
+    if( false == WaitForMemReady()) {
+        printf("\nERROR: Device not ready, tests failed\n");
+        return false;
+    }
+    
+    // Each read is queued right behind the write of the same page and must see its data
+    memset( rx_buf, 0, sizeof(rx_buf) );
+    if( QSPI_STATUS_OK != myFlash->write_async( flash_addr, tx_buf[0], sizeof(tx_buf[0]), callback(&recorder[0], &AsyncRecorder::done) ) ||
+        QSPI_STATUS_OK != myFlash->read_async( flash_addr, rx_buf[0], sizeof(rx_buf[0]), callback(&recorder[1], &AsyncRecorder::done) ) ||
+        QSPI_STATUS_OK != myFlash->write_async( flash_addr + 0x100, tx_buf[1], sizeof(tx_buf[1]), callback(&recorder[2], &AsyncRecorder::done) ) ||
+        QSPI_STATUS_OK != myFlash->read_async( flash_addr + 0x100, rx_buf[1], sizeof(rx_buf[1]), callback(&recorder[3], &AsyncRecorder::done), &flags, 0x1 )) {
+        printf("\nERROR: Queueing failed");
+        return false;
+    }
+    
+    flags.wait_all( 0x1 );
+    
+    if( count != 4 ) {
+        printf("\nERROR: %d of 4 requests completed", count);
+        return false;
+    }
+    for(int i=0; i < 4; i++) {
+        if( order[i] != i || recorder[i].result != QSPI_STATUS_OK ) {
+            printf("\nERROR: Request %d completed out of order or failed", i);
+            return false;
         }
-        
-        if(ret_status)
-        {
-            //Send Reset
-            if (QSPI_STATUS_OK == myQspi->command_transfer(QSPI_STD_CMD_RST, // command to send
-                                      0,                 // do not transmit
-                                      NULL,              // do not transmit
-                                      status_value,                 // just receive two bytes of data
-                                      2)) {   // store received values in status_value
-                VERBOSE_PRINT(("\nSending RST Success\n"));
-            } else {
-                printf("\nERROR: Sending RST failed\n");
-                ret_status = false;
+    }
+    if(0 != (memcmp( rx_buf, tx_buf, sizeof(rx_buf)))) {
+        printf("\nERROR: Buffer contents are invalid"); 
+        return false;
+    }
+    
+    return true;
+}
+
+bool TestEraseRange()
+{
+    qspi_flash_erase_plan_t plan;
+    char marker[4] = { 0x12, 0x34, 0x56, 0x78 };
+    char rx_buf[4];
+    // A sector either side of a 64K and a 32K block
+    uint32_t flash_addr = 0x1F000;
+    uint32_t len = 0x1A000;
+    
+    // Unaligned ranges are refused
+    if( QSPI_STATUS_INVALID_PARAMETER != myFlash->plan_erase( flash_addr + 0x100, len, &plan ) ||
+        QSPI_STATUS_INVALID_PARAMETER != myFlash->plan_erase( flash_addr, len + 0x100, &plan )) {
+        printf("\nERROR: Unaligned range accepted");
+        return false;
+    }
+    
+    // The whole part is one chip erase
+    if( QSPI_STATUS_OK != myFlash->plan_erase( 0, QSPI_FLASH_SIZE, &plan ) || plan.chip != 1 || plan.blocks64 || plan.blocks32 || plan.sectors ) {
+        printf("\nERROR: Whole part not planned as a chip erase");
+        return false;
+    }
+    
+    // Mark the first and last word of the range and the words just outside it
+    uint32_t marks[] = { flash_addr - 4, flash_addr, flash_addr + len - 4, flash_addr + len };
+    if( QSPI_STATUS_OK != myFlash->erase_range( flash_addr - _4_K_, len + 2 * _4_K_ )) {
+        printf("\nERROR: Erase failed(addr = 0x%08X)\n", flash_addr - _4_K_);
+        return false;
+    }
+    for(int i=0; i < 4; i++) {
+        if( QSPI_STATUS_OK != myFlash->program( marks[i], marker, sizeof(marker) )) {
+            printf("\nERROR: Program failed");
+            return false;
+        }
+    }
+    
+    if( QSPI_STATUS_OK != myFlash->erase_range( flash_addr, len, &plan )) {
+        printf("\nERROR: Erase failed(addr = 0x%08X)\n", flash_addr);
+        return false;
+    }
+    if( plan.chip != 0 || plan.blocks64 != 1 || plan.blocks32 != 1 || plan.sectors != 2 ) {
+        printf("\nERROR: Unexpected plan %lu/%lu/%lu/%lu", (unsigned long)plan.chip, (unsigned long)plan.blocks64, (unsigned long)plan.blocks32, (unsigned long)plan.sectors);
+        return false;
+    }
+    
+    for(int i=0; i < 4; i++) {
+        if( QSPI_STATUS_OK != myFlash->read( marks[i], rx_buf, sizeof(rx_buf) )) {
+            printf("\nERROR: Read failed");
+            return false;
+        }
+        bool inside = (i == 1 || i == 2);
+        for(int j=0; j < 4; j++) {
+            if( rx_buf[j] != (inside ? (char)0xFF : marker[j]) ) {
+                printf("\nERROR: Wrong contents at 0x%08lX after erase", (unsigned long)marks[i]);
+                return false;
             }
-            
-            if(ret_status)
-            {
-                status_value[0] |= 0x40;
-                //Write the Status Register to set QE enable bit
-                if (QSPI_STATUS_OK == myQspi->command_transfer(QSPI_STD_CMD_WRSR, // command to send
-                                          status_value,                 
-                                          1,      
-                                          NULL,                 
-                                          0)) {   // store received values in status_value
-                    VERBOSE_PRINT(("\nWriting Status Register Success\n"));
-                } else {
-                    printf("\nERROR: Writing Status Register failed\n");
-                    ret_status = false;
-                }
+        }
+    }
+    
+    // Sector-by-sector would have been 26 sector erases
+    printf(" estimated %lu us, measured %lu us", (unsigned long)plan.estimated_us, (unsigned long)plan.measured_us);
+    if( plan.measured_us < plan.estimated_us || plan.measured_us > plan.estimated_us + plan.estimated_us / 10 ) {
+        printf("\nERROR: Measured time far from the estimate");
+        return false;
+    }
+    
+    return true;
+}
+
+#define LATENCY_ERASE_ADDR      0x40000
+#define LATENCY_ERASE_SIZE      (_4_K_ * 32)
+#define LATENCY_READ_ADDR       0x60000
+
+static EventFlags latency_erase_done;
+static qspi_status_t latency_erase_result;
+
+static void LatencyEraser()
+{
+    latency_erase_result = myFlash->erase_range( LATENCY_ERASE_ADDR, LATENCY_ERASE_SIZE );
+    latency_erase_done.set( 0x1 );
+}
+
+// Reads 256 bytes every 5ms while another thread erases 128K, returns the worst read time
+static bool MeasureReadLatency(const char *expected, uint32_t *max_us, int *reads)
+{
+    char rx_buf[256];
+    Thread eraser;
+    Timer timer;
+    
+    *max_us = 0;
+    *reads = 0;
+    latency_erase_done.clear( 0x1 );
+    eraser.start( callback(LatencyEraser) );
+    timer.start();
+    while( 0 == (latency_erase_done.get() & 0x1) ) {
+        Thread::wait(5);
+        timer.reset();
+        if( QSPI_STATUS_OK != myFlash->read( LATENCY_READ_ADDR, rx_buf, sizeof(rx_buf) )) {
+            printf("\nERROR: Read failed");
+            eraser.join();
+            return false;
+        }
+        uint32_t latency_us = timer.read_us();
+        if( latency_us > *max_us ) {
+            *max_us = latency_us;
+        }
+        (*reads)++;
+        if(0 != (memcmp( rx_buf, expected, sizeof(rx_buf)))) {
+            printf("\nERROR: Buffer contents are invalid"); 
+            eraser.join();
+            return false;
+        }
+    }
+    eraser.join();
+    
+    if( latency_erase_result != QSPI_STATUS_OK ) {
+        printf("\nERROR: Erase failed(addr = 0x%08X)\n", LATENCY_ERASE_ADDR);
+        return false;
+    }
+    return true;
+}
+
+bool TestReadLatencyUnderErase()
+{
+    char tx_buf[256];
+    char check[16];
+    uint32_t blocking_us = 0;
+    uint32_t suspend_us = 0;
+    int blocking_reads = 0;
+    int suspend_reads = 0;
+    
+    for(unsigned int i=0; i < sizeof(tx_buf); i++) {
+        tx_buf[i] = (char)(i * 3 + 1);
+    }
+    if( QSPI_STATUS_OK != myFlash->erase_range( LATENCY_READ_ADDR, _4_K_ ) ||
+        QSPI_STATUS_OK != myFlash->program( LATENCY_READ_ADDR, tx_buf, sizeof(tx_buf) )) {
+        printf("\nERROR: Setup failed");
+        return false;
+    }
+    
+    // Hardware status polling keeps the bus for the whole wait, use software polling
+    myFlash->set_hw_autopoll( false );
+    myFlash->set_suspend( false );
+    bool ret_status = MeasureReadLatency( tx_buf, &blocking_us, &blocking_reads );
+    myFlash->set_suspend( true );
+    if( ret_status ) {
+        ret_status = MeasureReadLatency( tx_buf, &suspend_us, &suspend_reads );
+    }
+    myFlash->set_hw_autopoll( true );
+    if( !ret_status ) {
+        return false;
+    }
+    printf(" max read latency %lu us blocking, %lu us suspending", (unsigned long)blocking_us, (unsigned long)suspend_us);
+    
+    // A suspended erase has to let the read in within the resume guard time,
+    // the suspend latency and a few status polls
+    if( suspend_us > QSPI_FLASH_RESUME_MIN_US + QSPI_FLASH_TSUS_MAX_US + 2000 || suspend_us * 10 > blocking_us ) {
+        printf("\nERROR: Read latency not bounded by suspend");
+        return false;
+    }
+    
+    // The erase itself must still have completed
+    for(uint32_t offset = 0; offset < LATENCY_ERASE_SIZE; offset += _4_K_ * 4) {
+        if( QSPI_STATUS_OK != myFlash->read( LATENCY_ERASE_ADDR + offset, check, sizeof(check) )) {
+            printf("\nERROR: Read failed");
+            return false;
+        }
+        for(unsigned int i=0; i < sizeof(check); i++) {
+            if( check[i] != (char)0xFF ) {
+                printf("\nERROR: Range not erased at 0x%08lX", (unsigned long)(LATENCY_ERASE_ADDR + offset));
+                return false;
+            }
+        }
+    }
+    
+    return true;
+}
+
+// Reads len bytes at flash_addr through myFlash and checks they all equal value
+static bool CheckFlashContents(uint32_t flash_addr, size_t len, char value)
+{
+    char rx_buf[64];
+    
+    for(size_t offset = 0; offset < len; offset += sizeof(rx_buf)) {
+        size_t chunk = (len - offset < sizeof(rx_buf)) ? len - offset : sizeof(rx_buf);
+        if( QSPI_STATUS_OK != myFlash->read( flash_addr + offset, rx_buf, chunk )) {
+            printf("\nERROR: Read failed");
+            return false;
+        }
+        for(size_t i=0; i < chunk; i++) {
+            if( rx_buf[i] != value ) {
+                printf("\nERROR: Stale data at 0x%08lX", (unsigned long)(flash_addr + offset + i));
+                return false;
             }
         }
     }
+    return true;
+}
+
+bool TestReadCache()
+{
+    QSPIReadCache cache(4);
+    qspi_read_cache_stats_t stats;
+    char tx_buf[64];
+    size_t buf_len = 0;
+    uint32_t flash_addr = 0x70000;
+    bool ret_status = false;
+    
+    if( QSPI_STATUS_OK != myFlash->erase_range( flash_addr, 5 * _4_K_ )) {
+        printf("\nERROR: Erase failed(addr = 0x%08X)\n", flash_addr);
+        return false;
+    }
+    
+    myFlash->set_read_cache( &cache );
+    do {
+        // Second read of the same sector is a hit
+        if( !CheckFlashContents( flash_addr + 0x10, 16, (char)0xFF ) || !CheckFlashContents( flash_addr + 0x100, 16, (char)0xFF )) {
+            break;
+        }
+        stats = cache.get_stats();
+        if( stats.misses != 1 || stats.hits != 1 || stats.fills != 1 ) {
+            printf("\nERROR: Expected 1 miss and 1 hit, got %lu and %lu", (unsigned long)stats.misses, (unsigned long)stats.hits);
+            break;
+        }
+        
+        // Program through QSPIFlash
+        memset( tx_buf, 0x11, sizeof(tx_buf) );
+        if( QSPI_STATUS_OK != myFlash->program( flash_addr, tx_buf, sizeof(tx_buf) ) || !CheckFlashContents( flash_addr, sizeof(tx_buf), 0x11 )) {
+            break;
+        }
+        
+        // Program through the second QSPI object, which only WaitForMemReady sees
+        memset( tx_buf, 0x22, sizeof(tx_buf) );
+        buf_len = sizeof(tx_buf);
+        if( QSPI_STATUS_OK != myQspiOther->write( flash_addr + 0x200, tx_buf, &buf_len ) || false == WaitForMemReady() ||
+            !CheckFlashContents( flash_addr + 0x200, sizeof(tx_buf), 0x22 )) {
+            break;
+        }
+        
+        // SectorErase
+        if( false == SectorErase( flash_addr ) || false == WaitForMemReady() || !CheckFlashContents( flash_addr, 0x240, (char)0xFF )) {
+            break;
+        }
+        
+        // Five sectors through four lines: the first is the least recently used one
+        cache.invalidate_all();
+        cache.reset_stats();
+        for(int i=0; i < 5; i++) {
+            if( !CheckFlashContents( flash_addr + i * _4_K_, 16, (char)0xFF )) {
+                break;
+            }
+        }
+        if( !CheckFlashContents( flash_addr + _4_K_, 16, (char)0xFF ) || !CheckFlashContents( flash_addr, 16, (char)0xFF )) {
+            break;
+        }
+        stats = cache.get_stats();
+        if( stats.evictions != 2 || stats.hits != 1 || stats.misses != 6 ) {
+            printf("\nERROR: LRU order wrong: %lu evictions, %lu hits, %lu misses", (unsigned long)stats.evictions, (unsigned long)stats.hits, (unsigned long)stats.misses);
+            break;
+        }
+        
+        ret_status = true;
+    } while(false);
+    myFlash->set_read_cache( NULL );
     
     return ret_status;
 }
 
-bool WaitForMemReady()
+#define CONTINUOUS_READ_ADDR    0x80000
+
+// Reads 4K at CONTINUOUS_READ_ADDR through myFlash 1K at a time and compares it with expected
+static bool ReadSequential(const char *expected, char *rx_buf, int *elapsed_us)
 {
-    char status_value[2];
-    int retries = 0;
+    Timer timer;
     
-    do
-    {
-        retries++;
-        //Read the Status Register from device
-        if (QSPI_STATUS_OK == myQspi->command_transfer(QSPI_STD_CMD_RDSR, // command to send
-                                  0,                 // do not transmit
-                                  NULL,              // do not transmit
-                                  status_value,                 // just receive two bytes of data
-                                  2)) {   // store received values in status_value
-            VERBOSE_PRINT(("\nReadng Status Register Success: value = 0x%02X:0x%02X\n", status_value[0], status_value[1]));
-        } else {
-            printf("\nERROR: Reading Status Register failed\n");
+    timer.start();
+    for(unsigned int offset=0; offset < _4_K_; offset += _1_K_) {
+        if( QSPI_STATUS_OK != myFlash->read( CONTINUOUS_READ_ADDR + offset, rx_buf + offset, _1_K_ )) {
+            printf("\nERROR: Read failed");
+            return false;
         }
-    } while( (status_value[0] & 0x1) != 0 && retries <10000 );
+    }
+    *elapsed_us = timer.read_us();
     
-    if((status_value[0] & 0x1) != 0) return false;
+    if( memcmp( expected, rx_buf, _4_K_ )) {
+        printf("\nERROR: Data mismatch");
+        return false;
+    }
     return true;
 }
 
-bool SectorErase(unsigned int flash_addr)
+bool TestContinuousRead()
 {
-    char addrbytes[3] = {0};
+    QSPIBuffer tx;
+    QSPIBuffer rx;
+    char *tx_buf = tx.data();
+    char *rx_buf = rx.data();
+    char page[256];
+    size_t buf_len = 0;
+    int plain_us = 0;
+    int continuous_us = 0;
+    bool ret_status = false;
     
-    addrbytes[2]=flash_addr & 0xFF;
-    addrbytes[1]=(flash_addr >> 8) & 0xFF;
-    addrbytes[0]=(flash_addr >> 16) & 0xFF;
-            
-    //Send WREN
-    if (QSPI_STATUS_OK == myQspi->command_transfer(QSPI_STD_CMD_WREN, // command to send
-                              0,                 // do not transmit
-                              NULL,              // do not transmit
-                              0,                 // just receive two bytes of data
-                              NULL)) {   // store received values in status_value
-        VERBOSE_PRINT(("\nSending WREN command success\n"));
-    } else {
-        printf("\nERROR: Sending WREN command failed\n");
+    if(tx_buf == NULL || rx_buf == NULL) {
+        printf("\nERROR: buf alloc failed");
         return false;
     }
+    for(unsigned int i=0; i < _4_K_; i++) {
+        tx_buf[i] = (char)(i * 5 + 7);
+    }
     
-    if (QSPI_STATUS_OK == myQspi->command_transfer(QSPI_STD_CMD_SECT_ERASE, // command to send
-                              addrbytes,                 // do not transmit
-                              3,              // do not transmit
-                              0,                 // just receive two bytes of data
-                              NULL)) {   // store received values in status_value
-        VERBOSE_PRINT(("\nSending SECT_ERASE command success\n"));
-    } else {
-        printf("\nERROR: Readng SECT_ERASE command failed\n");
+    do {
+        if( QSPI_STATUS_OK != myFlash->erase_range( CONTINUOUS_READ_ADDR, 2 * _4_K_ ) ||
+            QSPI_STATUS_OK != myFlash->program( CONTINUOUS_READ_ADDR, tx_buf, _4_K_ )) {
+            printf("\nERROR: Setup failed");
+            break;
+        }
+        if( !ReadSequential( tx_buf, rx_buf, &plain_us )) {
+            break;
+        }
+        
+        myFlash->set_continuous_read( true );
+        bool read_ok = ReadSequential( tx_buf, rx_buf, &continuous_us );
+        
+        // A program has to take the part out of the mode first
+        memset( page, 0x5A, sizeof(page) );
+        if( read_ok && QSPI_STATUS_OK != myFlash->program( CONTINUOUS_READ_ADDR + _4_K_, page, sizeof(page) )) {
+            printf("\nERROR: Program failed");
+            read_ok = false;
+        }
+        if( read_ok && !CheckFlashContents( CONTINUOUS_READ_ADDR + _4_K_, sizeof(page), 0x5A )) {
+            read_ok = false;
+        }
+        myFlash->set_continuous_read( false );
+        if( !read_ok ) {
+            break;
+        }
+        
+        // Plain QSPI commands work again
+        memset( page, 0, sizeof(page) );
+        buf_len = sizeof(page);
+        if( QSPI_STATUS_OK != myQspi->read( CONTINUOUS_READ_ADDR + _4_K_, page, &buf_len ) || page[0] != 0x5A || page[sizeof(page) - 1] != 0x5A ) {
+            printf("\nERROR: Part left in continuous read mode");
+            break;
+        }
+        
+        printf(" 4x1K sequential read %d us, %d us continuous", plain_us, continuous_us);
+        ret_status = true;
+    } while(false);
+    
+    return ret_status;
+}
+
+#define SMART_WRITE_ADDR        0x90000
+
+// smart_write, then read back and compare
+static bool SmartWriteCheck(uint32_t flash_addr, const char *data, size_t len)
+{
+    char rx_buf[64];
+    
+    if( QSPI_STATUS_OK != myFlash->smart_write( flash_addr, data, len )) {
+        printf("\nERROR: smart_write failed(addr = 0x%08lX)", (unsigned long)flash_addr);
         return false;
     }
-    
+    for(size_t offset = 0; offset < len; offset += sizeof(rx_buf)) {
+        size_t chunk = (len - offset < sizeof(rx_buf)) ? len - offset : sizeof(rx_buf);
+        if( QSPI_STATUS_OK != myFlash->read( flash_addr + offset, rx_buf, chunk ) || memcmp( rx_buf, data + offset, chunk )) {
+            printf("\nERROR: Data mismatch at 0x%08lX", (unsigned long)(flash_addr + offset));
+            return false;
+        }
+    }
     return true;
 }
 
+bool TestSmartWrite()
+{
+    char marker[16];
+    char data[600];
+    qspi_flash_write_stats_t stats;
+    uint32_t programmed = 0;
+    
+    if( QSPI_STATUS_OK != myFlash->erase_range( SMART_WRITE_ADDR, 2 * _4_K_ )) {
+        printf("\nERROR: Erase failed(addr = 0x%08X)\n", SMART_WRITE_ADDR);
+        return false;
+    }
+    myFlash->reset_write_stats();
+    
+    // Blank target: no erase
+    memset( marker, 0x3C, sizeof(marker) );
+    for(unsigned int i=0; i < sizeof(data); i++) {
+        data[i] = (char)(i * 13 + 5);
+    }
+    if( !SmartWriteCheck( SMART_WRITE_ADDR + 0xF00, marker, sizeof(marker) ) || !SmartWriteCheck( SMART_WRITE_ADDR + 0x10, data, sizeof(data) )) {
+        return false;
+    }
+    
+    // Same data again: nothing to program
+    programmed = myFlash->get_write_stats().pages_programmed;
+    if( !SmartWriteCheck( SMART_WRITE_ADDR + 0x10, data, sizeof(data) )) {
+        return false;
+    }
+    if( myFlash->get_write_stats().pages_programmed != programmed ) {
+        printf("\nERROR: Unchanged pages programmed again");
+        return false;
+    }
+    
+    // Clearing bits only: programmed over
+    for(unsigned int i=0; i < sizeof(data); i++) {
+        data[i] &= 0xF0;
+    }
+    if( !SmartWriteCheck( SMART_WRITE_ADDR + 0x10, data, sizeof(data) )) {
+        return false;
+    }
+    
+    // Setting bits: the sector is erased, the marker next to the data must survive
+    for(unsigned int i=0; i < sizeof(data); i++) {
+        data[i] |= 0x0F;
+    }
+    if( !SmartWriteCheck( SMART_WRITE_ADDR + 0x10, data, sizeof(data) ) || !CheckFlashContents( SMART_WRITE_ADDR + 0xF00, sizeof(marker), 0x3C )) {
+        return false;
+    }
+    
+    // Across a sector boundary onto blank flash
+    if( !SmartWriteCheck( SMART_WRITE_ADDR + 0xF80, data, 0x100 )) {
+        return false;
+    }
+    
+    stats = myFlash->get_write_stats();
+    printf(" %lu writes, %lu erases, %lu avoided", (unsigned long)stats.writes, (unsigned long)stats.erases, (unsigned long)stats.erases_avoided);
+    if( stats.writes != 6 || stats.erases != 1 || stats.erases_avoided != 6 ) {
+        printf("\nERROR: Unexpected erase count");
+        return false;
+    }
+    return true;
+}
+
+#define BLOCK_DEVICE_ADDR       0xA0000
+#define BLOCK_DEVICE_RECORD     24
+#define BLOCK_DEVICE_RECORDS    20
+
+bool TestBlockDevice()
+{
+    QSPIFlashBlockDevice bd( myQspi );
+    char tx_buf[BLOCK_DEVICE_RECORD * BLOCK_DEVICE_RECORDS];
+    char rx_buf[BLOCK_DEVICE_RECORD * BLOCK_DEVICE_RECORDS];
+    uint32_t last = BLOCK_DEVICE_ADDR + sizeof(tx_buf) - BLOCK_DEVICE_RECORD;
+    bool ret_status = false;
+    
+    if( BD_ERROR_OK != bd.init()) {
+        printf("\nERROR: init failed");
+        return false;
+    }
+    do {
+        if( bd.get_read_size() != 1 || bd.get_program_size() != 1 || bd.get_erase_size() != _4_K_ ||
+            bd.get_erase_value() != 0xFF || bd.size() != QSPI_FLASH_SIZE ) {
+            printf("\nERROR: Wrong geometry");
+            break;
+        }
+        if( BD_ERROR_OK == bd.program( tx_buf, bd.size() - 1, 2 ) || BD_ERROR_OK == bd.erase( BLOCK_DEVICE_ADDR + 1, _4_K_ )) {
+            printf("\nERROR: Out of range request accepted");
+            break;
+        }
+        if( BD_ERROR_OK != bd.erase( BLOCK_DEVICE_ADDR, 2 * _4_K_ )) {
+            printf("\nERROR: Erase failed(addr = 0x%08X)\n", BLOCK_DEVICE_ADDR);
+            break;
+        }
+        
+        // Records appended one by one, across a page boundary
+        for(unsigned int i=0; i < sizeof(tx_buf); i++) {
+            tx_buf[i] = (char)(i * 11 + 1);
+        }
+        bool programmed = true;
+        for(unsigned int i=0; i < BLOCK_DEVICE_RECORDS && programmed; i++) {
+            programmed = (BD_ERROR_OK == bd.program( tx_buf + i * BLOCK_DEVICE_RECORD, BLOCK_DEVICE_ADDR + i * BLOCK_DEVICE_RECORD, BLOCK_DEVICE_RECORD ));
+        }
+        if( !programmed ) {
+            printf("\nERROR: Program failed");
+            break;
+        }
+        
+        // The last records are still gathered in RAM, but reads see them
+        if( BD_ERROR_OK != bd.read( rx_buf, BLOCK_DEVICE_ADDR, sizeof(rx_buf) ) || memcmp( tx_buf, rx_buf, sizeof(rx_buf) )) {
+            printf("\nERROR: Data mismatch before sync");
+            break;
+        }
+        if( !CheckFlashContents( last, BLOCK_DEVICE_RECORD, (char)0xFF )) {
+            printf("\nERROR: Last record not batched");
+            break;
+        }
+        if( BD_ERROR_OK != bd.sync() || QSPI_STATUS_OK != myFlash->read( last, rx_buf, BLOCK_DEVICE_RECORD ) ||
+            memcmp( tx_buf + sizeof(tx_buf) - BLOCK_DEVICE_RECORD, rx_buf, BLOCK_DEVICE_RECORD )) {
+            printf("\nERROR: Data mismatch after sync");
+            break;
+        }
+        
+        if( BD_ERROR_OK != bd.erase( BLOCK_DEVICE_ADDR, _4_K_ ) || !CheckFlashContents( BLOCK_DEVICE_ADDR, sizeof(tx_buf), (char)0xFF )) {
+            printf("\nERROR: Erase failed(addr = 0x%08X)\n", BLOCK_DEVICE_ADDR);
+            break;
+        }
+        ret_status = true;
+    } while(false);
+    
+    if( BD_ERROR_OK != bd.deinit()) {
+        printf("\nERROR: deinit failed");
+        ret_status = false;
+    }
+    return ret_status;
+}
+
+#define FTL_ADDR                0xC0000
+#define FTL_SECTORS             8
+#define FTL_RECORD              16
+#define FTL_HOT_RECORDS         200
+#define FTL_HOT_WRITES          3000
+#define FTL_MAX_CUTS            200
+
+// Compares the FTL's whole logical space with expected
+static bool CheckFTLContents(QSPIFlashFTL *ftl, const char *expected)
+{
+    char rx_buf[64];
+    
+    for(uint32_t offset = 0; offset < ftl->size(); offset += sizeof(rx_buf)) {
+        if( QSPI_STATUS_OK != ftl->read( offset, rx_buf, sizeof(rx_buf) ) || memcmp( rx_buf, expected + offset, sizeof(rx_buf) )) {
+            printf("\nERROR: Data mismatch at 0x%08lX", (unsigned long)offset);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Each block of the FTL's logical space as in before or as in after
+static bool CheckFTLBlocks(QSPIFlashFTL *ftl, const char *before, const char *after)
+{
+    char rx_buf[QSPI_FTL_BLOCK_SIZE];
+    
+    for(uint32_t offset = 0; offset < ftl->size(); offset += sizeof(rx_buf)) {
+        if( QSPI_STATUS_OK != ftl->read( offset, rx_buf, sizeof(rx_buf) ) ||
+            ( memcmp( rx_buf, before + offset, sizeof(rx_buf) ) && memcmp( rx_buf, after + offset, sizeof(rx_buf) ))) {
+            printf("\nERROR: Block at 0x%08lX neither old nor new", (unsigned long)offset);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool TestFTL()
+{
+    QSPIFlashFTL *ftl = new QSPIFlashFTL( myFlash, FTL_ADDR, FTL_SECTORS );
+    char *image = NULL;
+    char *next = NULL;
+    char record[FTL_RECORD];
+    bool ret_status = false;
+    
+    do {
+        if( QSPI_STATUS_OK != ftl->format()) {
+            printf("\nERROR: Format failed");
+            break;
+        }
+        image = (char *)malloc( ftl->size() );
+        if( image == NULL ) {
+            printf("\nERROR: buf alloc failed");
+            break;
+        }
+        
+        // Cold data over the whole space, then many small writes to a hot part of it
+        for(uint32_t i=0; i < ftl->size(); i++) {
+            image[i] = (char)(i * 7 + 3);
+        }
+        if( QSPI_STATUS_OK != ftl->write( 0, image, ftl->size() )) {
+            printf("\nERROR: Write failed");
+            break;
+        }
+        bool written = true;
+        for(int i=0; i < FTL_HOT_WRITES && written; i++) {
+            uint32_t offset = (i % FTL_HOT_RECORDS) * FTL_RECORD;
+            memset( record, (char)i, sizeof(record) );
+            memcpy( image + offset, record, sizeof(record) );
+            written = (QSPI_STATUS_OK == ftl->write( offset, record, sizeof(record) ));
+        }
+        if( !written || QSPI_STATUS_OK != ftl->sync()) {
+            printf("\nERROR: Write failed");
+            break;
+        }
+        if( !CheckFTLContents( ftl, image )) {
+            break;
+        }
+        
+        qspi_ftl_stats_t stats = ftl->get_stats();
+        uint32_t min_erase = 0xFFFFFFFF;
+        uint32_t max_erase = 0;
+        for(int s=0; s < FTL_SECTORS; s++) {
+            uint32_t count = ftl->get_erase_count( s );
+            min_erase = (count < min_erase) ? count : min_erase;
+            max_erase = (count > max_erase) ? count : max_erase;
+        }
+        printf(" %lu gc erases, %lu coalesced, erase counts %lu-%lu", (unsigned long)stats.gc_erases, (unsigned long)stats.coalesced,
+               (unsigned long)min_erase, (unsigned long)max_erase);
+        if( stats.gc_erases == 0 || max_erase - min_erase > QSPI_FTL_WEAR_DELTA + 1 ) {
+            printf("\nERROR: Erases not spread");
+            break;
+        }
+        
+        // Everything synced is found again by a fresh mount
+        delete ftl;
+        ftl = new QSPIFlashFTL( myFlash, FTL_ADDR, FTL_SECTORS, false );
+        if( QSPI_STATUS_OK != ftl->mount() || !CheckFTLContents( ftl, image )) {
+            printf("\nERROR: Remount failed");
+            break;
+        }
+        
+        // Cut the power at every program and erase of a rewrite of the whole
+        // space in turn: the next mount finds each block old or new, and the
+        // sectors it hands out take another rewrite
+        if( QSPI_STATUS_INVALID_PARAMETER == qspi_flash_hw_power_fail( 0 )) {
+            printf(" (no power-fail hook)");
+            ret_status = true;
+            break;
+        }
+        next = (char *)malloc( ftl->size() );
+        if( next == NULL ) {
+            printf("\nERROR: buf alloc failed");
+            break;
+        }
+        int cuts = 0;
+        uint32_t mount_erases = 0;
+        bool recovered = true;
+        for(int cut=1; cut <= FTL_MAX_CUTS && recovered; cut++) {
+            for(uint32_t i=0; i < ftl->size(); i++) {
+                next[i] = (char)(i * 11 + cut);
+            }
+            qspi_flash_hw_power_fail( cut );
+            qspi_status_t result = ftl->write( 0, next, ftl->size() );
+            if( QSPI_STATUS_OK == result ) {
+                result = ftl->sync();
+            }
+            qspi_flash_hw_power_fail( 0 );
+            if( QSPI_STATUS_OK == result ) {
+                // Every operation made it
+                memcpy( image, next, ftl->size() );
+                break;
+            }
+            cuts++;
+            
+            recovered = InitializeFlashMem();
+            delete ftl;
+            ftl = new QSPIFlashFTL( myFlash, FTL_ADDR, FTL_SECTORS, false );
+            if( recovered && QSPI_STATUS_OK == ftl->mount() && CheckFTLBlocks( ftl, image, next )) {
+                mount_erases += ftl->get_stats().mount_erases;
+                recovered = ( QSPI_STATUS_OK == ftl->write( 0, next, ftl->size() ) && QSPI_STATUS_OK == ftl->sync() &&
+                              CheckFTLContents( ftl, next ));
+                memcpy( image, next, ftl->size() );
+            } else {
+                recovered = false;
+            }
+            if( !recovered ) {
+                printf("\nERROR: FTL wrong after a power cut at operation %d", cut );
+            }
+        }
+        if( !recovered ) {
+            break;
+        }
+        printf(", %d power cuts, %lu sectors erased again by mount", cuts, (unsigned long)mount_erases );
+        if( cuts == 0 || mount_erases == 0 ) {
+            printf("\nERROR: No erase cut short");
+            break;
+        }
+        ret_status = true;
+    } while(false);
+    
+    delete ftl;
+    free(image);
+    free(next);
+    return ret_status;
+}
+
+static uint32_t stream_checksum = 0;
+
+// Stands in for application work on each chunk: sums it up and sleeps 2ms
+static bool ProcessChunk(uint32_t addr, const char *data, size_t len)
+{
+    (void)addr;
+    for(size_t i=0; i < len; i++) {
+        stream_checksum = stream_checksum * 31 + (uint8_t)data[i];
+    }
+    Thread::wait(2);
+    return true;
+}
+
+bool TestAsyncStreamRead()
+{
+    QSPIBuffer pooled_a;
+    QSPIBuffer pooled_b;
+    char *buf_a = pooled_a.data();
+    char *buf_b = pooled_b.data();
+    unsigned int flash_addr = 0;
+    unsigned int len = _4_K_ * 4;
+    Timer timer;
+    int blocking_us = 0;
+    int stream_us = 0;
+    uint32_t blocking_checksum = 0;
+    bool ret_status = true;
+    
+    if(buf_a == NULL || buf_b == NULL) {
+        printf("\nERROR: buf alloc failed");
+        return false;
+    }
+    
+    // Read, then process, one chunk at a time
+    stream_checksum = 0;
+    timer.start();
+    for(unsigned int offset=0; offset < len; offset += _1_K_) {
+        if( QSPI_STATUS_OK != myFlash->read( flash_addr + offset, buf_a, _1_K_ )) {
+            printf("\nERROR: Read failed");
+            ret_status = false;
+            break;
+        }
+        ProcessChunk( flash_addr + offset, buf_a, _1_K_ );
+    }
+    blocking_us = timer.read_us();
+    blocking_checksum = stream_checksum;
+    
+    // Same work with the next chunk read while the current one is processed
+    stream_checksum = 0;
+    timer.reset();
+    if( ret_status && QSPI_STATUS_OK != myFlash->stream_read( flash_addr, len, buf_a, buf_b, _1_K_, callback(ProcessChunk) )) {
+        printf("\nERROR: Stream read failed");
+        ret_status = false;
+    }
+    stream_us = timer.read_us();
+    
+    if( ret_status && stream_checksum != blocking_checksum ) {
+        printf("\nERROR: Streamed data differs from blocking reads");
+        ret_status = false;
+    }
+    if( ret_status && stream_us >= blocking_us ) {
+        printf("\nERROR: Streaming gave no overlap");
+        ret_status = false;
+    }
+    printf(" blocking %d us, streamed %d us", blocking_us, stream_us);
+    
+    return ret_status;
+}
+
+#define HIGH_ADDR_BOUNDARY      QSPI_FLASH_3BYTE_MAX_SIZE
+#define HIGH_ADDR_LEN           512
+
+bool TestHighAddress()
+{
+    char tx_buf[HIGH_ADDR_LEN];
+    char rx_buf[HIGH_ADDR_LEN];
+    uint32_t flash_addr = HIGH_ADDR_BOUNDARY - HIGH_ADDR_LEN / 2;
+    
+    for(unsigned int i=0; i < sizeof(tx_buf); i++) {
+        tx_buf[i] = (char)(i * 7 + 3);
+    }
+    
+#if QSPI_FLASH_SIZE > QSPI_FLASH_3BYTE_MAX_SIZE
+    // The sectors either side of 16 MB, then a program across the boundary
+    if( QSPI_STATUS_OK != myFlash->erase_range( HIGH_ADDR_BOUNDARY - _4_K_, _4_K_ * 2 ) ||
+        QSPI_STATUS_OK != myFlash->program( flash_addr, tx_buf, sizeof(tx_buf) )) {
+        printf("\nERROR: Erase or program across 16 MB failed");
+        return false;
+    }
+    
+    // Read back in one transaction, no split at the boundary
+    memset( rx_buf, 0, sizeof(rx_buf) );
+    qspi_trace_clear();
+    if( QSPI_STATUS_OK != myFlash->read( flash_addr, rx_buf, sizeof(rx_buf) ) || memcmp( rx_buf, tx_buf, sizeof(rx_buf) )) {
+        printf("\nERROR: Read across 16 MB failed");
+        return false;
+    }
+#if QSPI_TRACE_ENABLED
+    if( qspi_trace_count() != 1 ) {
+        printf("\nERROR: Read split into %lu transactions", (unsigned long)qspi_trace_count());
+        return false;
+    }
+#endif
+    
+    // With 3-byte addresses the upper half would have landed at address 0
+    if( QSPI_STATUS_OK != myFlash->read( 0, rx_buf, HIGH_ADDR_LEN / 2 ) || 0 == memcmp( rx_buf, tx_buf + HIGH_ADDR_LEN / 2, HIGH_ADDR_LEN / 2 )) {
+        printf("\nERROR: Program wrapped around to address 0");
+        return false;
+    }
+    
+    // Plain QSPI writes and reads near the top of the part (the last sector
+    // holds the calibration record)
+    uint32_t top_addr = QSPI_FLASH_SIZE - _4_K_ * 2;
+    size_t buf_len = sizeof(tx_buf);
+    if( false == SectorErase( top_addr ) || false == WaitForMemReady()) {
+        return false;
+    }
+    if( QSPI_STATUS_OK != myQspi->write( top_addr, tx_buf, &buf_len ) || buf_len != sizeof(tx_buf) || false == WaitForMemReady()) {
+        printf("\nERROR: Write at 0x%08lX failed", (unsigned long)top_addr);
+        return false;
+    }
+    memset( rx_buf, 0, sizeof(rx_buf) );
+    if( QSPI_STATUS_OK != myQspi->read( top_addr, rx_buf, &buf_len ) || buf_len != sizeof(rx_buf) || memcmp( rx_buf, tx_buf, sizeof(rx_buf) )) {
+        printf("\nERROR: Read at 0x%08lX failed", (unsigned long)top_addr);
+        return false;
+    }
+    printf(" 4-byte addresses up to 0x%08lX", (unsigned long)(top_addr + sizeof(tx_buf) - 1));
+#else
+    // 3-byte addresses would wrap, so accesses past 16 MB are refused
+    if( QSPI_STATUS_INVALID_PARAMETER != myFlash->read( flash_addr, rx_buf, sizeof(rx_buf) ) ||
+        QSPI_STATUS_INVALID_PARAMETER != myFlash->program( flash_addr, tx_buf, sizeof(tx_buf) ) ||
+        QSPI_STATUS_INVALID_PARAMETER != myFlash->erase_sector( HIGH_ADDR_BOUNDARY )) {
+        printf("\nERROR: Access past 16 MB with 3-byte addresses");
+        return false;
+    }
+    printf(" 3-byte addresses, part of %lu MB", (unsigned long)(QSPI_FLASH_SIZE >> 20));
+#endif
+    
+    return true;
+}
+
+bool InitializeFlashMem()
+{
+    bool ret_status = true;
+    char status_value[2];
+    
+    //Read the Status Register from device
+    if (QSPI_STATUS_OK == myQspi->command_transfer(QSPI_STD_CMD_RDSR, // command to send
+                              0,                 // do not transmit
+                              NULL,              // do not transmit
+                              status_value,                 // just receive two bytes of data
+                              2)) {   // store received values in status_value
+        VERBOSE_PRINT(("\nReading Status Register Success: value = 0x%02X:0x%02X\n", status_value[0], status_value[1]));
+    } else {
+        printf("\nERROR: Reading Status Register failed\n");
+        ret_status = false;
+    }
+    
+    if(ret_status)
+    {
+        //Reset the device and write the Status Register to set QE enable bit, as one batch
+        status_value[0] |= 0x40;
+        const qspi_flash_command_t reset_commands[] = {
+            QSPI_FLASH_COMMAND( QSPI_STD_CMD_RSTEN, NULL, 0, NULL, 0 ),
+            QSPI_FLASH_COMMAND( QSPI_STD_CMD_RST, NULL, 0, NULL, 0 ),
+            QSPI_FLASH_COMMAND( QSPI_STD_CMD_WRSR, status_value, 1, NULL, 0 ),
+        };
+        if (QSPI_STATUS_OK == myFlash->command_batch( reset_commands, 3 )) {
+            VERBOSE_PRINT(("\nSending RSTEN, RST and WRSR Success\n"));
+        } else {
+            printf("\nERROR: Sending RSTEN, RST and WRSR failed\n");
+            ret_status = false;
+        }
+    }
+    
+    // The reset left the part taking 3-byte addresses
+    if(ret_status && QSPI_FLASH_ADDR_SIZE == QSPI_CFG_ADDR_SIZE_32)
+    {
+        if (QSPI_STATUS_OK == myFlash->set_address_size( QSPI_CFG_ADDR_SIZE_32 )) {
+            VERBOSE_PRINT(("\nSending EN4B Success\n"));
+        } else {
+            printf("\nERROR: Sending EN4B failed\n");
+            ret_status = false;
+        }
+    }
+    
+    // Sector states from the map's journal rather than a scan of the part;
+    // the first time there is no map to mount and the scan writes it
+    if(ret_status && NULL != mySectorMap)
+    {
+        qspi_status_t result = mySectorMap->mount();
+        if (QSPI_STATUS_ERROR == result) {
+            result = mySectorMap->rebuild();
+        }
+        if (QSPI_STATUS_OK == result) {
+            VERBOSE_PRINT(("\nMounting sector map Success\n"));
+        } else {
+            printf("\nERROR: Mounting sector map failed\n");
+            ret_status = false;
+        }
+    }
+    
+    return ret_status;
+}
+
+bool WaitForMemReady()
+{
+    uint32_t busy_us = 0;
+    
+    if( QSPI_STATUS_OK != myFlash->wait_ready( &busy_us )) {
+        printf("\nERROR: Device still busy after %lu us\n", (unsigned long)busy_us);
+        return false;
+    }
+    VERBOSE_PRINT(("\nDevice ready after %lu us\n", (unsigned long)busy_us));
+    return true;
+}
+
+bool SectorErase(unsigned int flash_addr)
+{
+    if( QSPI_STATUS_OK != myFlash->erase_sector( flash_addr )) {
+        printf("\nERROR: Sending SECT_ERASE command failed\n");
+        return false;
+    }
+    VERBOSE_PRINT(("\nSending SECT_ERASE command success\n"));
+    
+    return true;
+}
+
+#if QSPI_TRACE_ENABLED
+#define TRACE_ADDR              0xB0000
+#define TRACE_THREAD_RECORDS    100
+
+static void TraceRecorder(uint32_t *tag)
+{
+    for(int i=0; i < TRACE_THREAD_RECORDS; i++) {
+        qspi_trace_record( QSPI_TRACE_COMMAND, 0, QSPI_TRACE_FORMAT_UNKNOWN, *tag, i, qspi_trace_start(), QSPI_STATUS_OK );
+        if( (i % 10) == 0 ) {
+            Thread::wait( 1 );
+        }
+    }
+}
+
+// Entries form one run of sequence numbers ending at the last one recorded
+static bool CheckTraceSequence(const qspi_trace_entry_t *entries, size_t count)
+{
+    if( count == 0 || entries[count - 1].seq != qspi_trace_count() ) {
+        printf("\nERROR: Last entry %lu, %lu recorded", count ? (unsigned long)entries[count - 1].seq : 0UL, (unsigned long)qspi_trace_count());
+        return false;
+    }
+    for(size_t i=1; i < count; i++) {
+        if( entries[i].seq != entries[i - 1].seq + 1 || entries[i].end_us < entries[i].start_us ) {
+            printf("\nERROR: Bad entry %lu", (unsigned long)entries[i].seq);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool TestTrace()
+{
+    static qspi_trace_entry_t entries[QSPI_TRACE_DEPTH];
+    char tx_buf[300];
+    char rx_buf[64];
+    uint32_t tags[2] = { 0x1000, 0x2000 };
+    uint32_t tag_count[2] = { 0, 0 };
+    bool found_erase = false;
+    bool found_read = false;
+    int found_writes = 0;
+    
+    memset( tx_buf, 0x3C, sizeof(tx_buf) );
+    qspi_trace_clear();
+    if( QSPI_STATUS_OK != myFlash->erase_sector( TRACE_ADDR ) || QSPI_STATUS_OK != myFlash->wait_ready() ||
+        QSPI_STATUS_OK != myFlash->program( TRACE_ADDR, tx_buf, sizeof(tx_buf) ) ||
+        QSPI_STATUS_OK != myFlash->read( TRACE_ADDR, rx_buf, sizeof(rx_buf) )) {
+        printf("\nERROR: Flash access failed");
+        return false;
+    }
+    
+    // The erase, both page programs and the read, with the opcodes of 1_4_4
+    size_t count = qspi_trace_snapshot( entries, QSPI_TRACE_DEPTH );
+    if( !CheckTraceSequence( entries, count )) {
+        return false;
+    }
+    for(size_t i=0; i < count; i++) {
+        const qspi_trace_entry_t *entry = &entries[i];
+        if( entry->status != QSPI_STATUS_OK ) {
+            printf("\nERROR: Entry %lu failed", (unsigned long)entry->seq);
+            return false;
+        }
+        if( entry->kind == QSPI_TRACE_COMMAND && entry->opcode == QSPI_STD_CMD_SECT_ERASE && entry->addr == TRACE_ADDR ) {
+            found_erase = true;
+        } else if( entry->kind == QSPI_TRACE_WRITE && entry->opcode == 0x38 &&
+                   ((entry->addr == TRACE_ADDR && entry->length == 256) || (entry->addr == TRACE_ADDR + 256 && entry->length == 44)) ) {
+            found_writes++;
+        } else if( entry->kind == QSPI_TRACE_READ && entry->opcode == 0xEB && entry->addr == TRACE_ADDR && entry->length == sizeof(rx_buf) ) {
+            found_read = true;
+        }
+    }
+    if( !found_erase || found_writes != 2 || !found_read ) {
+        printf("\nERROR: Missing entries (erase %d, writes %d, read %d)", found_erase, found_writes, found_read);
+        return false;
+    }
+    
+    // Two threads wrapping the ring; only complete entries come back
+    Thread recorder_a;
+    Thread recorder_b;
+    recorder_a.start( callback( TraceRecorder, &tags[0] ));
+    recorder_b.start( callback( TraceRecorder, &tags[1] ));
+    recorder_a.join();
+    recorder_b.join();
+    count = qspi_trace_snapshot( entries, QSPI_TRACE_DEPTH );
+    if( count != QSPI_TRACE_DEPTH || !CheckTraceSequence( entries, count )) {
+        printf("\nERROR: %lu entries after wrap", (unsigned long)count);
+        return false;
+    }
+    for(size_t i=0; i < count; i++) {
+        tag_count[entries[i].addr == tags[1]]++;
+    }
+    printf(" %lu transactions, %lu + %lu entries from 2 threads", (unsigned long)qspi_trace_count(),
+           (unsigned long)tag_count[0], (unsigned long)tag_count[1]);
+    return true;
+}
+#endif // QSPI_TRACE_ENABLED
+
+#define SFDP_ADDR               0xB8000
+
+// JESD216 table of a 16Mbit part with 1-1-2 and 1-1-4 reads and only the 4K
+// erase; 16 DWORDs long when it also says how to set QE (status register 2
+// bit 1)
+static const uint32_t sfdp_other_part[] = {
+    0xFF4120E5, 0x00FFFFFF, 0x6B08FFFF, 0xFFFF3B08, 0xFFFFFFEE, 0xFF00FFFF, 0xFF00FFFF, 0x0000200C,
+    0x00000000, 0x00000000, 0x00000081, 0x00000000, 0x00000000, 0x00000000, 0x00100000, 0x00000000,
+};
+
+bool TestSFDP()
+{
+    static const struct {
+        qspi_sfdp_read_mode_t mode;
+        qspi_bus_width_t address_width;
+        qspi_bus_width_t data_width;
+    } read_modes[] = {
+        { QSPI_SFDP_READ_1_1_1, QSPI_CFG_BUS_SINGLE, QSPI_CFG_BUS_SINGLE },
+        { QSPI_SFDP_READ_1_1_2, QSPI_CFG_BUS_SINGLE, QSPI_CFG_BUS_DUAL },
+        { QSPI_SFDP_READ_1_2_2, QSPI_CFG_BUS_DUAL, QSPI_CFG_BUS_DUAL },
+        { QSPI_SFDP_READ_1_1_4, QSPI_CFG_BUS_SINGLE, QSPI_CFG_BUS_QUAD },
+        { QSPI_SFDP_READ_1_4_4, QSPI_CFG_BUS_QUAD, QSPI_CFG_BUS_QUAD },
+    };
+    qspi_flash_sfdp_t sfdp;
+    qspi_flash_erase_plan_t plan;
+    uint32_t dwords[QSPI_SFDP_BFPT_MAX_DWORDS];
+    char tx_buf[256];
+    char rx_buf[256];
+    size_t buf_len;
+    int modes_read = 0;
+    bool ret_status = false;
+    
+    for(unsigned int i=0; i < sizeof(tx_buf); i++) {
+        tx_buf[i] = (char)(i * 13 + 1);
+    }
+    
+    do {
+        // The MX25R6435F: 1_4_4 with 4 wait states and 2 mode clocks
+        if( QSPI_STATUS_OK != qspi_flash_sfdp_read( myQspi, &sfdp )) {
+            printf("\nERROR: SFDP read failed");
+            break;
+        }
+        if( sfdp.size != QSPI_FLASH_SIZE || sfdp.address_size != QSPI_FLASH_ADDR_SIZE || sfdp.page_size != QSPI_FLASH_PAGE_SIZE || sfdp.major != 1 || sfdp.minor != 6 ||
+            sfdp.read_mode != QSPI_SFDP_READ_1_4_4 || sfdp.dummy_cycles != 6 || sfdp.quad_enable != QSPI_SFDP_QE_SR1_BIT6 ||
+            !sfdp.continuous_read || qspi_flash_sfdp_erase_types( &sfdp ) != QSPI_FLASH_ERASE_ALL ) {
+            printf("\nERROR: Unexpected parameters (size %lu, page %lu, mode %d, dummy %d, QE %d)", (unsigned long)sfdp.size,
+                   (unsigned long)sfdp.page_size, sfdp.read_mode, sfdp.dummy_cycles, sfdp.quad_enable);
+            break;
+        }
+        if( QSPI_STATUS_OK != qspi_flash_sfdp_enable_quad( myQspi, &sfdp ) || QSPI_STATUS_OK != qspi_flash_sfdp_configure( myQspi, &sfdp ) ||
+            QSPI_STATUS_OK != myFlash->erase_range( SFDP_ADDR, _4_K_ ) || QSPI_STATUS_OK != myFlash->program( SFDP_ADDR, tx_buf, sizeof(tx_buf) )) {
+            printf("\nERROR: Setup failed");
+            break;
+        }
+        
+        // Every read mode listed, dual ones included, with its dummy cycles
+        bool read_ok = true;
+        for(unsigned int m=0; m < sizeof(read_modes) / sizeof(read_modes[0]) && read_ok; m++) {
+            const qspi_sfdp_read_t *read = &sfdp.reads[read_modes[m].mode];
+            if( !read->supported ) {
+                continue;
+            }
+            memset( rx_buf, 0, sizeof(rx_buf) );
+            buf_len = sizeof(rx_buf);
+            if( QSPI_STATUS_OK != myQspi->configure_format( QSPI_CFG_BUS_SINGLE, read_modes[m].address_width, QSPI_FLASH_ADDR_SIZE, QSPI_CFG_BUS_SINGLE, QSPI_CFG_ALT_SIZE_NONE, read_modes[m].data_width, read->dummy_cycles, 0 ) ||
+                QSPI_STATUS_OK != myQspi->read( SFDP_ADDR, rx_buf, &buf_len ) || memcmp( rx_buf, tx_buf, sizeof(tx_buf) )) {
+                printf("\nERROR: Read in mode %d failed", read_modes[m].mode);
+                read_ok = false;
+            }
+            modes_read++;
+        }
+        myQspi->configure_format( QSPI_CFG_BUS_SINGLE, QSPI_CFG_BUS_QUAD, QSPI_FLASH_ADDR_SIZE, QSPI_CFG_BUS_SINGLE, QSPI_CFG_ALT_SIZE_NONE, QSPI_CFG_BUS_QUAD, 0, 0 );
+        if( !read_ok ) {
+            break;
+        }
+        
+        // Without DWORD15 nothing says how to enable quad: stay in 1_1_1
+        if( QSPI_STATUS_OK != qspi_flash_sfdp_parse( sfdp_other_part, QSPI_SFDP_BFPT_MIN_DWORDS, &sfdp ) ||
+            sfdp.size != 2 * 1024 * 1024 || sfdp.read_mode != QSPI_SFDP_READ_1_1_1 || sfdp.quad_enable != QSPI_SFDP_QE_UNKNOWN ||
+            !sfdp.reads[QSPI_SFDP_READ_1_1_2].supported || sfdp.reads[QSPI_SFDP_READ_1_4_4].supported ) {
+            printf("\nERROR: JESD216 table parsed wrong");
+            break;
+        }
+        if( QSPI_STATUS_OK != qspi_flash_sfdp_parse( sfdp_other_part, QSPI_SFDP_BFPT_MAX_DWORDS, &sfdp ) ||
+            sfdp.read_mode != QSPI_SFDP_READ_1_1_4 || sfdp.dummy_cycles != 8 || sfdp.quad_enable != QSPI_SFDP_QE_SR2_BIT1 ||
+            qspi_flash_sfdp_erase_types( &sfdp ) != QSPI_FLASH_ERASE_SECTOR ) {
+            printf("\nERROR: JESD216B table parsed wrong");
+            break;
+        }
+        
+        // As a 512Mbit part it needs 4-byte addresses: with EN4B all of it is
+        // used, without only the first 16 MB
+        memcpy( dwords, sfdp_other_part, sizeof(dwords) );
+        dwords[0] |= 1UL << 17;
+        dwords[1] = 0x1FFFFFFF;
+        dwords[15] = (uint32_t)QSPI_SFDP_4BYTE_ENTER_B7 << 24;
+        if( QSPI_STATUS_OK != qspi_flash_sfdp_parse( dwords, QSPI_SFDP_BFPT_MAX_DWORDS, &sfdp ) ||
+            sfdp.address_size != QSPI_CFG_ADDR_SIZE_32 || qspi_flash_sfdp_usable_size( &sfdp ) != sfdp.size ) {
+            printf("\nERROR: 4-byte addressing not selected");
+            break;
+        }
+        dwords[15] = 0;
+        if( QSPI_STATUS_OK != qspi_flash_sfdp_parse( dwords, QSPI_SFDP_BFPT_MAX_DWORDS, &sfdp ) ||
+            sfdp.address_size != QSPI_CFG_ADDR_SIZE_24 || qspi_flash_sfdp_usable_size( &sfdp ) != QSPI_FLASH_3BYTE_MAX_SIZE ) {
+            printf("\nERROR: 4-byte addressing selected without EN4B");
+            break;
+        }
+        
+        // The 16Mbit part gets only sector erases, and only within its size
+        qspi_flash_sfdp_parse( sfdp_other_part, QSPI_SFDP_BFPT_MAX_DWORDS, &sfdp );
+        QSPIFlash flash( myQspi );
+        flash.set_geometry( sfdp.size, qspi_flash_sfdp_erase_types( &sfdp ));
+        if( QSPI_STATUS_OK != flash.plan_erase( 0, QSPI_FLASH_BLOCK64_SIZE, &plan ) || plan.sectors != 16 || plan.blocks32 || plan.blocks64 ||
+            QSPI_STATUS_INVALID_PARAMETER != flash.plan_erase( sfdp.size, _4_K_, &plan )) {
+            printf("\nERROR: Erase plan ignores the geometry");
+            break;
+        }
+        
+        printf(" %d read modes", modes_read);
+        ret_status = true;
+    } while(false);
+    
+    return ret_status;
+}
+
+#define CALIBRATE_TEST_ADDR     0xBA000
+
+bool TestCalibrate()
+{
+    qspi_flash_calibration_t cal;
+    qspi_flash_calibration_t loaded;
+    char tx_buf[1024];
+    char rx_buf[1024];
+    char corrupt = 0;
+    bool swept = false;
+    bool ret_status = false;
+    
+    for(unsigned int i=0; i < sizeof(tx_buf); i++) {
+        tx_buf[i] = (char)(i * 29 + 5);
+    }
+    
+    // Continuous reads or a read cache would not read the bus each time
+    QSPIFlash flash( myQspi );
+    if( QSPI_FLASH_ADDR_SIZE == QSPI_CFG_ADDR_SIZE_32 ) {
+        flash.set_address_size( QSPI_CFG_ADDR_SIZE_32 );
+    }
+    do {
+        if( QSPI_STATUS_OK != flash.erase_sector( QSPI_CALIBRATE_ADDR ) ||
+            QSPI_STATUS_OK != qspi_flash_calibrate( &flash, myQspi, QSPI_CFG_BUS_QUAD, QSPI_CFG_BUS_QUAD, &cal, &swept ) || !swept ) {
+            printf("\nERROR: First calibration failed");
+            break;
+        }
+        // Too few dummy cycles at the faster clocks must have been seen to fail
+        if( cal.hz < QSPI_CALIBRATE_DEFAULT_HZ || cal.hz > cal.fastest_hz || cal.dummy_cycles < cal.min_dummy_cycles ||
+            cal.failed_reads == 0 || cal.format != QSPI_TRACE_FORMAT( QSPI_CFG_BUS_SINGLE, QSPI_CFG_BUS_QUAD, QSPI_CFG_BUS_QUAD )) {
+            printf("\nERROR: Unexpected calibration (%lu Hz, %d dummy, %d failed)", (unsigned long)cal.hz, cal.dummy_cycles, cal.failed_reads);
+            break;
+        }
+        
+        // Programs and reads at the calibrated setting
+        if( QSPI_STATUS_OK != flash.erase_sector( CALIBRATE_TEST_ADDR ) || QSPI_STATUS_OK != flash.program( CALIBRATE_TEST_ADDR, tx_buf, sizeof(tx_buf) ) ||
+            QSPI_STATUS_OK != flash.read( CALIBRATE_TEST_ADDR, rx_buf, sizeof(rx_buf) ) || memcmp( rx_buf, tx_buf, sizeof(tx_buf) )) {
+            printf("\nERROR: Access at %lu Hz failed", (unsigned long)cal.hz);
+            break;
+        }
+        
+        // The next boot finds the record and skips the sweep
+        if( QSPI_STATUS_OK != qspi_flash_calibrate( &flash, myQspi, QSPI_CFG_BUS_QUAD, QSPI_CFG_BUS_QUAD, &loaded, &swept ) || swept ||
+            loaded.hz != cal.hz || loaded.dummy_cycles != cal.dummy_cycles ) {
+            printf("\nERROR: Persisted calibration not used");
+            break;
+        }
+        
+        // A damaged record means a new sweep
+        if( QSPI_STATUS_OK != flash.program( QSPI_CALIBRATE_ADDR, &corrupt, 1 ) ||
+            QSPI_STATUS_OK != qspi_flash_calibrate( &flash, myQspi, QSPI_CFG_BUS_QUAD, QSPI_CFG_BUS_QUAD, &loaded, &swept ) || !swept ||
+            QSPI_STATUS_OK != qspi_flash_calibration_load( &flash, &loaded ) || loaded.hz != cal.hz ) {
+            printf("\nERROR: Damaged record not replaced");
+            break;
+        }
+        
+        printf(" %lu Hz, %d dummy cycles, %d points", (unsigned long)cal.hz, cal.dummy_cycles, cal.points);
+        ret_status = true;
+    } while(false);
+    
+    // Back to the defaults the other tests and the benchmarks run at
+    myQspi->set_frequency( QSPI_CALIBRATE_DEFAULT_HZ );
+    myQspi->configure_format( QSPI_CFG_BUS_SINGLE, QSPI_CFG_BUS_QUAD, QSPI_FLASH_ADDR_SIZE, QSPI_CFG_BUS_SINGLE, QSPI_CFG_ALT_SIZE_NONE, QSPI_CFG_BUS_QUAD, 0, 0 );
+    return ret_status;
+}
+
+#define BUS_SHARING_ADDR        0xBC000
+#define BUS_SHARING_ROUNDS      20
+
+// Reads alternating between the two bus objects
+static bool BusPingPong(const char *expected, size_t len)
+{
+    char rx_buf[16];
+    QSPI *objects[2] = { myQspi, myQspiOther };
+    
+    for(int i=0; i < 2 * BUS_SHARING_ROUNDS; i++) {
+        size_t buf_len = len;
+        memset( rx_buf, 0, sizeof(rx_buf) );
+        if( QSPI_STATUS_OK != objects[i & 1]->read( BUS_SHARING_ADDR, rx_buf, &buf_len ) || memcmp( rx_buf, expected, len )) {
+            printf("\nERROR: Read %d failed", i);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool TestBusSharing()
+{
+    char tx_buf[] = { 0x5A, 0x6B, 0x7C, 0x8D, 0x9E, 0xAF, 0x10, 0x21, 0x32, 0x43, 0x54, 0x65, 0x76, 0x87, 0x98, 0xA9 };
+    qspi_flash_bus_stats_t stats;
+    qspi_flash_bus_stats_t same;
+    bool ret_status = false;
+    
+    if( QSPI_STATUS_OK != myFlash->erase_sector( BUS_SHARING_ADDR ) || QSPI_STATUS_OK != myFlash->program( BUS_SHARING_ADDR, tx_buf, sizeof(tx_buf) ) ||
+        QSPI_STATUS_OK != myFlash->wait_ready() ) {
+        printf("\nERROR: Setup failed");
+        return false;
+    }
+    
+    // Without driver counters only the data can be checked
+    bool counted = (QSPI_STATUS_OK == qspi_flash_hw_bus_stats( &stats, true ));
+    do {
+        // 1_4_4 and 1_1_1: every switch writes the registers
+        if( !BusPingPong( tx_buf, sizeof(tx_buf) )) {
+            break;
+        }
+        qspi_flash_hw_bus_stats( &stats, true );
+        if( counted && (stats.switches < 2 * BUS_SHARING_ROUNDS - 1 || stats.reconfigurations != stats.switches || stats.avoided) ) {
+            printf("\nERROR: Formats differ, %lu switches, %lu reconfigurations", (unsigned long)stats.switches, (unsigned long)stats.reconfigurations);
+            break;
+        }
+        
+        // Both in 1_4_4: only the first switch may write them
+        if( QSPI_STATUS_OK != myQspiOther->configure_format( QSPI_CFG_BUS_SINGLE, QSPI_CFG_BUS_QUAD, QSPI_FLASH_ADDR_SIZE, QSPI_CFG_BUS_SINGLE, QSPI_CFG_ALT_SIZE_NONE, QSPI_CFG_BUS_QUAD, 0, 0 ) ||
+            !BusPingPong( tx_buf, sizeof(tx_buf) )) {
+            break;
+        }
+        qspi_flash_hw_bus_stats( &same, true );
+        if( counted && (same.switches < 2 * BUS_SHARING_ROUNDS - 1 || same.reconfigurations > 1 || same.avoided + same.reconfigurations != same.switches) ) {
+            printf("\nERROR: Same format, %lu switches, %lu reconfigurations", (unsigned long)same.switches, (unsigned long)same.reconfigurations);
+            break;
+        }
+        
+        // Configuring what is already in place writes nothing either
+        size_t buf_len = sizeof(tx_buf);
+        char rx_buf[sizeof(tx_buf)];
+        if( QSPI_STATUS_OK != myQspi->configure_format( QSPI_CFG_BUS_SINGLE, QSPI_CFG_BUS_QUAD, QSPI_FLASH_ADDR_SIZE, QSPI_CFG_BUS_SINGLE, QSPI_CFG_ALT_SIZE_NONE, QSPI_CFG_BUS_QUAD, 0, 0 ) ||
+            QSPI_STATUS_OK != myQspi->read( BUS_SHARING_ADDR, rx_buf, &buf_len ) || memcmp( rx_buf, tx_buf, sizeof(tx_buf) )) {
+            printf("\nERROR: Read after configure failed");
+            break;
+        }
+        qspi_flash_hw_bus_stats( &stats, true );
+        if( counted && stats.reconfigurations ) {
+            printf("\nERROR: Unchanged format written again");
+            break;
+        }
+        
+        if( counted ) {
+            printf(" %lu of %lu switches without reconfiguration", (unsigned long)same.avoided, (unsigned long)same.switches);
+        } else {
+            printf(" driver keeps no counters");
+        }
+        ret_status = true;
+    } while(false);
+    
+    myQspiOther->configure_format( QSPI_CFG_BUS_SINGLE, QSPI_CFG_BUS_SINGLE, QSPI_FLASH_ADDR_SIZE, QSPI_CFG_BUS_SINGLE, QSPI_CFG_ALT_SIZE_NONE, QSPI_CFG_BUS_SINGLE, 0, 0 );
+    return ret_status;
+}
+
+#define CONTENTION_ADDR         0xE0000
+#define CONTENTION_THREADS      4
+#define CONTENTION_SECTORS      2
+#define CONTENTION_ROUNDS       2
+
+typedef struct {
+    int id;
+    int errors;
+} contention_ctx_t;
+
+static char ContentionByte(int id, int round, uint32_t offset)
+{
+    return (char)(id * 37 + round * 11 + offset * 7 + (offset >> 8));
+}
+
+// Erases, programs and reads back its own sectors, a page at a time
+static void ContentionWorker(contention_ctx_t *ctx)
+{
+    char tx_buf[256];
+    char rx_buf[256];
+    uint32_t base = CONTENTION_ADDR + ctx->id * CONTENTION_SECTORS * _4_K_;
+    
+    for(int round=0; round < CONTENTION_ROUNDS; round++) {
+        for(uint32_t offset = 0; offset < CONTENTION_SECTORS * _4_K_; offset += sizeof(tx_buf)) {
+            if( (offset % _4_K_) == 0 && QSPI_STATUS_OK != myFlash->erase_sector( base + offset )) {
+                ctx->errors++;
+            }
+            for(uint32_t i=0; i < sizeof(tx_buf); i++) {
+                tx_buf[i] = ContentionByte( ctx->id, round, offset + i );
+            }
+            memset( rx_buf, 0, sizeof(rx_buf) );
+            if( QSPI_STATUS_OK != myFlash->program( base + offset, tx_buf, sizeof(tx_buf) ) ||
+                QSPI_STATUS_OK != myFlash->read( base + offset, rx_buf, sizeof(rx_buf) ) || memcmp( rx_buf, tx_buf, sizeof(tx_buf) )) {
+                ctx->errors++;
+            }
+        }
+    }
+}
+
+bool TestContention()
+{
+    contention_ctx_t ctx[CONTENTION_THREADS];
+    Thread *threads[CONTENTION_THREADS];
+    char rx_buf[256];
+    int errors = 0;
+    
+    myFlash->reset_lock_stats();
+    for(int t=0; t < CONTENTION_THREADS; t++) {
+        ctx[t].id = t;
+        ctx[t].errors = 0;
+        threads[t] = new Thread();
+        threads[t]->start( callback( ContentionWorker, &ctx[t] ));
+    }
+    for(int t=0; t < CONTENTION_THREADS; t++) {
+        threads[t]->join();
+        delete threads[t];
+        errors += ctx[t].errors;
+    }
+    if( errors ) {
+        printf("\nERROR: %d failed accesses", errors);
+        return false;
+    }
+    
+    // Every thread's last round survived the others
+    for(int t=0; t < CONTENTION_THREADS; t++) {
+        uint32_t base = CONTENTION_ADDR + t * CONTENTION_SECTORS * _4_K_;
+        for(uint32_t offset = 0; offset < CONTENTION_SECTORS * _4_K_; offset += sizeof(rx_buf)) {
+            if( QSPI_STATUS_OK != myFlash->read( base + offset, rx_buf, sizeof(rx_buf) )) {
+                printf("\nERROR: Read failed");
+                return false;
+            }
+            for(uint32_t i=0; i < sizeof(rx_buf); i++) {
+                if( rx_buf[i] != ContentionByte( t, CONTENTION_ROUNDS - 1, offset + i )) {
+                    printf("\nERROR: Thread %d data wrong at 0x%08lX", t, (unsigned long)(base + offset + i));
+                    return false;
+                }
+            }
+        }
+    }
+    
+    qspi_flash_lock_stats_t op_stats = myFlash->get_op_lock_stats();
+    qspi_flash_lock_stats_t bus_stats = myFlash->get_bus_lock_stats();
+    if( op_stats.contended == 0 || op_stats.locks < op_stats.contended || bus_stats.locks == 0 ) {
+        printf("\nERROR: No contention seen");
+        return false;
+    }
+    printf(" %lu of %lu operations waited, up to %lu us", (unsigned long)op_stats.contended,
+           (unsigned long)op_stats.locks, (unsigned long)op_stats.wait_max_us);
+    return true;
+}
+
+#define BUFFER_POOL_ADDR        0xBE000
+
+bool TestBufferPool()
+{
+    qspi_buffer_pool_stats_t stats;
+    bool ret_status = false;
+    
+    qspi_buffer_pool_stats( &stats, false );
+    uint32_t failures = stats.failures;
+    if( stats.in_use != 0 ) {
+        printf("\nERROR: %lu buffers still held", (unsigned long)stats.in_use);
+        return false;
+    }
+    
+    do {
+        // Every buffer aligned and distinct, then the pool runs dry
+        QSPIBuffer buffers[QSPI_BUFFER_COUNT];
+        bool layout_ok = true;
+        for(int i=0; i < QSPI_BUFFER_COUNT; i++) {
+            if( buffers[i].data() == NULL || ((uintptr_t)buffers[i].data() & (QSPI_BUFFER_ALIGN - 1)) ||
+                !qspi_buffer_owns( buffers[i].data(), buffers[i].size() ) || (i && buffers[i].data() == buffers[i - 1].data()) ) {
+                layout_ok = false;
+            }
+        }
+        QSPIBuffer extra;
+        qspi_buffer_pool_stats( &stats, false );
+        if( !layout_ok || extra.data() != NULL || extra.size() != 0 || stats.in_use != QSPI_BUFFER_COUNT || stats.failures != failures + 1 ) {
+            printf("\nERROR: Pool handed out bad buffers");
+            break;
+        }
+        ret_status = true;
+    } while(false);
+    
+    // Leaving the scope gave them all back
+    qspi_buffer_pool_stats( &stats, false );
+    if( !ret_status || stats.in_use != 0 || stats.peak != QSPI_BUFFER_COUNT ) {
+        printf("\nERROR: Buffers not released");
+        return false;
+    }
+    
+    // Programs straight from a pool buffer, then from an odd address in it
+    QSPIBuffer tx;
+    QSPIBuffer rx;
+    if( tx.data() == NULL || rx.data() == NULL ) {
+        printf("\nERROR: buf alloc failed");
+        return false;
+    }
+    for(unsigned int i=0; i < _1_K_; i++) {
+        tx.data()[i] = (char)(i * 3 + 1);
+    }
+    if( QSPI_STATUS_OK != myFlash->erase_sector( BUFFER_POOL_ADDR ) ||
+        QSPI_STATUS_OK != myFlash->program( BUFFER_POOL_ADDR, tx.data(), _1_K_ / 2 ) ||
+        QSPI_STATUS_OK != myFlash->program( BUFFER_POOL_ADDR + _1_K_ / 2 + 1, tx.data() + _1_K_ / 2 + 1, _1_K_ / 2 - 1 )) {
+        printf("\nERROR: Program failed");
+        return false;
+    }
+    memset( rx.data(), 0, _1_K_ );
+    if( QSPI_STATUS_OK != myFlash->read( BUFFER_POOL_ADDR, rx.data(), _1_K_ ) ||
+        memcmp( rx.data(), tx.data(), _1_K_ / 2 ) || rx.data()[_1_K_ / 2] != (char)0xFF ||
+        memcmp( rx.data() + _1_K_ / 2 + 1, tx.data() + _1_K_ / 2 + 1, _1_K_ / 2 - 1 )) {
+        printf("\nERROR: Data programmed from the pool is wrong");
+        return false;
+    }
+    
+    printf(" %d x %d B buffers", QSPI_BUFFER_COUNT, QSPI_BUFFER_SIZE);
+    return true;
+}
+
+#define VERIFY_ADDR             0xBF000
+#define VERIFY_MISMATCH         3001
+
+bool TestVerify()
+{
+    QSPIBuffer expected;
+    size_t mismatch = 0;
+    
+    if( expected.data() == NULL ) {
+        printf("\nERROR: buf alloc failed");
+        return false;
+    }
+    for(unsigned int i=0; i < _4_K_; i++) {
+        expected.data()[i] = (char)(i * 13 + 5);
+    }
+    if( QSPI_STATUS_OK != myFlash->erase_sector( VERIFY_ADDR ) || QSPI_STATUS_OK != myFlash->program( VERIFY_ADDR, expected.data(), _4_K_ )) {
+        printf("\nERROR: Setup failed");
+        return false;
+    }
+    
+    // Whole sector, and an unaligned piece of it compared byte-wise
+    if( QSPI_STATUS_OK != myFlash->verify( VERIFY_ADDR, expected.data(), _4_K_, &mismatch ) || mismatch != _4_K_ ||
+        QSPI_STATUS_OK != myFlash->verify( VERIFY_ADDR + 1, expected.data() + 1, _4_K_ - 2, &mismatch ) || mismatch != _4_K_ - 2 ) {
+        printf("\nERROR: Verify of matching data failed");
+        return false;
+    }
+    
+    // One byte off: found at its offset, aligned or not
+    expected.data()[VERIFY_MISMATCH] ^= 0x10;
+    bool found = ( QSPI_STATUS_ERROR == myFlash->verify( VERIFY_ADDR, expected.data(), _4_K_, &mismatch ) && mismatch == VERIFY_MISMATCH ) &&
+                 ( QSPI_STATUS_ERROR == myFlash->verify( VERIFY_ADDR + 3, expected.data() + 3, _4_K_ - 3, &mismatch ) && mismatch == VERIFY_MISMATCH - 3 );
+    expected.data()[VERIFY_MISMATCH] ^= 0x10;
+    if( !found ) {
+        printf("\nERROR: Mismatch not reported at its offset");
+        return false;
+    }
+    
+    if( QSPI_STATUS_INVALID_PARAMETER != myFlash->verify( VERIFY_ADDR, NULL, 16, &mismatch ) || mismatch != 16 ) {
+        printf("\nERROR: Verify without data accepted");
+        return false;
+    }
+    
+    printf(" mismatch found at offset %d", VERIFY_MISMATCH);
+    return true;
+}
+
+#define POWER_ADDR              0xD0000
+#define POWER_LOW_IDLE_MS       5
+#define POWER_DEEP_IDLE_MS      50
+#define POWER_IDLE_MS           50
+
+bool TestPowerModes()
+{
+    char tx_buf[256];
+    char rx_buf[256];
+    char regs[3];
+    
+    for(unsigned int i=0; i < sizeof(tx_buf); i++) {
+        tx_buf[i] = (char)(i * 5 + 1);
+    }
+    if( QSPI_STATUS_OK != myFlash->set_power_mode( QSPI_FLASH_POWER_LOW ) ||
+        QSPI_STATUS_OK != myFlash->erase_sector( POWER_ADDR ) || QSPI_STATUS_OK != myFlash->program( POWER_ADDR, tx_buf, sizeof(tx_buf) )) {
+        printf("\nERROR: Setup failed");
+        return false;
+    }
+    myFlash->reset_power_stats();
+    
+    // High performance is the L/H bit of configuration register 2, written once
+    if( QSPI_STATUS_OK != myFlash->set_power_mode( QSPI_FLASH_POWER_HIGH ) || QSPI_STATUS_OK != myFlash->set_power_mode( QSPI_FLASH_POWER_HIGH ) ||
+        myFlash->get_power_mode() != QSPI_FLASH_POWER_HIGH || myFlash->get_power_stats().switches != 1 ) {
+        printf("\nERROR: Switch to high performance failed");
+        return false;
+    }
+    if( QSPI_STATUS_OK != myQspi->command_transfer( QSPI_STD_CMD_RDCR_MX, NULL, 0, regs, 2 ) || !( regs[1] & QSPI_FLASH_CR2_HIGH_PERFORMANCE )) {
+        printf("\nERROR: L/H bit not set");
+        return false;
+    }
+    
+    // Nothing but the release gets through to a part in deep power-down;
+    // the next access through the flash object releases it
+    if( QSPI_STATUS_OK != myFlash->set_power_mode( QSPI_FLASH_POWER_DEEP_DOWN ) || myFlash->get_power_mode() != QSPI_FLASH_POWER_DEEP_DOWN ) {
+        printf("\nERROR: Deep power-down failed");
+        return false;
+    }
+    memset( regs, 0, sizeof(regs) );
+    myQspi->command_transfer( QSPI_STD_CMD_RDID, NULL, 0, regs, 3 );
+    if( regs[0] == (char)0xC2 ) {
+        printf("\nERROR: Part answered in deep power-down");
+        return false;
+    }
+    memset( rx_buf, 0, sizeof(rx_buf) );
+    qspi_flash_power_stats_t stats;
+    if( QSPI_STATUS_OK != myFlash->read( POWER_ADDR, rx_buf, sizeof(rx_buf) ) || memcmp( tx_buf, rx_buf, sizeof(rx_buf) )) {
+        printf("\nERROR: Read after deep power-down failed");
+        return false;
+    }
+    stats = myFlash->get_power_stats();
+    if( myFlash->get_power_mode() != QSPI_FLASH_POWER_HIGH || stats.wakeups != 1 || stats.wake_max_us < QSPI_FLASH_TRES1_MAX_US ) {
+        printf("\nERROR: Wake-up not accounted");
+        return false;
+    }
+    uint32_t wake_us = stats.wake_max_us;
+    
+    // Policy: a bulk read goes out in high performance mode, idling steps
+    // back to low power and then deep power-down
+    if( QSPI_STATUS_OK != myFlash->set_power_mode( QSPI_FLASH_POWER_LOW )) {
+        printf("\nERROR: Switch to low power failed");
+        return false;
+    }
+    {
+        QSPIFlashPower power( myFlash, sizeof(rx_buf), POWER_LOW_IDLE_MS, POWER_DEEP_IDLE_MS );
+        if( QSPI_STATUS_OK != power.read( POWER_ADDR, rx_buf, sizeof(rx_buf) / 2 ) || myFlash->get_power_mode() != QSPI_FLASH_POWER_LOW ||
+            QSPI_STATUS_OK != power.read( POWER_ADDR, rx_buf, sizeof(rx_buf) ) || myFlash->get_power_mode() != QSPI_FLASH_POWER_HIGH ) {
+            printf("\nERROR: Bulk read not in high performance mode");
+            return false;
+        }
+        // Low power takes tW to switch back to
+        Thread::wait( POWER_LOW_IDLE_MS + QSPI_FLASH_TW_MAX_US / 1000 );
+        if( myFlash->get_power_mode() != QSPI_FLASH_POWER_LOW ) {
+            printf("\nERROR: Idle part not back in low power");
+            return false;
+        }
+        Thread::wait( POWER_DEEP_IDLE_MS * 2 );
+        if( myFlash->get_power_mode() != QSPI_FLASH_POWER_DEEP_DOWN ) {
+            printf("\nERROR: Idle part not in deep power-down");
+            return false;
+        }
+        memset( rx_buf, 0, sizeof(rx_buf) );
+        if( QSPI_STATUS_OK != power.read( POWER_ADDR, rx_buf, sizeof(rx_buf) / 2 ) || memcmp( tx_buf, rx_buf, sizeof(rx_buf) / 2 ) ||
+            myFlash->get_power_mode() != QSPI_FLASH_POWER_LOW ) {
+            printf("\nERROR: Read after idle deep power-down failed");
+            return false;
+        }
+    }
+    
+    // Where the board measures the supply: deep power-down draws less than standby
+    uint64_t charge[4];
+    if( QSPI_STATUS_OK == qspi_flash_hw_charge( &charge[0] )) {
+        Thread::wait( POWER_IDLE_MS );
+        qspi_flash_hw_charge( &charge[1] );
+        myFlash->set_power_mode( QSPI_FLASH_POWER_DEEP_DOWN );
+        qspi_flash_hw_charge( &charge[2] );
+        Thread::wait( POWER_IDLE_MS );
+        qspi_flash_hw_charge( &charge[3] );
+        // pC per ms is nA
+        uint32_t standby_na = (uint32_t)(( charge[1] - charge[0] ) / POWER_IDLE_MS );
+        uint32_t deep_na = (uint32_t)(( charge[3] - charge[2] ) / POWER_IDLE_MS );
+        if( deep_na >= standby_na ) {
+            printf("\nERROR: Deep power-down drew %lu nA, standby %lu nA", (unsigned long)deep_na, (unsigned long)standby_na );
+            return false;
+        }
+        printf(" standby %lu nA, deep power-down %lu nA,", (unsigned long)standby_na, (unsigned long)deep_na );
+    }
+    
+    if( QSPI_STATUS_OK != myFlash->set_power_mode( QSPI_FLASH_POWER_LOW ) || myFlash->get_power_mode() != QSPI_FLASH_POWER_LOW ) {
+        printf("\nERROR: Switch back to low power failed");
+        return false;
+    }
+    printf(" wake-up %lu us", (unsigned long)wake_us );
+    return true;
+}
+
+#define BATCH_ADDR              0xD8000
+#define BATCH_STATUS_READS      8
+
+bool TestCommandBatch()
+{
+    char tx_buf[QSPI_FLASH_PAGE_SIZE];
+    char addrbytes[4];
+    char status = 0;
+    size_t addr_len = ( myFlash->get_address_size() == QSPI_CFG_ADDR_SIZE_32 ) ? 4 : 3;
+    
+    for(size_t i=0; i < addr_len; i++) {
+        addrbytes[i] = ( BATCH_ADDR >> ( 8 * ( addr_len - 1 - i ))) & 0xFF;
+    }
+    memset( tx_buf, 0x5A, sizeof(tx_buf) );
+    
+    // WREN, erase and the wait for it as one transaction
+    const qspi_flash_command_t erase_commands[] = {
+        QSPI_FLASH_COMMAND( QSPI_STD_CMD_WREN, NULL, 0, NULL, 0 ),
+        QSPI_FLASH_COMMAND( QSPI_STD_CMD_SECT_ERASE, addrbytes, addr_len, NULL, 0 ),
+        QSPI_FLASH_COMMAND_POLL( QSPI_STD_CMD_RDSR, &status, QSPI_FLASH_SR_WIP, 0, QSPI_FLASH_TSE_MAX_US ),
+    };
+    if( QSPI_STATUS_OK != myFlash->erase_sector( BATCH_ADDR ) || QSPI_STATUS_OK != myFlash->program( BATCH_ADDR, tx_buf, sizeof(tx_buf) )) {
+        printf("\nERROR: Preparing the sector failed");
+        return false;
+    }
+    myFlash->reset_batch_stats();
+    if( QSPI_STATUS_OK != myFlash->command_batch( erase_commands, 3, BATCH_ADDR ) || !CheckFlashContents( BATCH_ADDR, sizeof(tx_buf), (char)0xFF )) {
+        printf("\nERROR: Batched erase failed");
+        return false;
+    }
+    qspi_flash_batch_stats_t stats = myFlash->get_batch_stats();
+    if( stats.batches != 1 || stats.commands != 3 || stats.driver_calls == 0 ) {
+        printf("\nERROR: Batch stats %lu batches, %lu commands", (unsigned long)stats.batches, (unsigned long)stats.commands );
+        return false;
+    }
+    
+    // A poll that times out fails the batch; the erase it started is then
+    // declared to the flash object and waited for as usual
+    const qspi_flash_command_t short_poll[] = {
+        QSPI_FLASH_COMMAND( QSPI_STD_CMD_WREN, NULL, 0, NULL, 0 ),
+        QSPI_FLASH_COMMAND( QSPI_STD_CMD_SECT_ERASE, addrbytes, addr_len, NULL, 0 ),
+        QSPI_FLASH_COMMAND_POLL( QSPI_STD_CMD_RDSR, &status, QSPI_FLASH_SR_WIP, 0, 100 ),
+    };
+    if( QSPI_STATUS_OK != myFlash->program( BATCH_ADDR, tx_buf, sizeof(tx_buf) ) ||
+        QSPI_STATUS_ERROR != myFlash->command_batch( short_poll, 3, BATCH_ADDR )) {
+        printf("\nERROR: Poll did not time out");
+        return false;
+    }
+    myFlash->start_busy( QSPI_FLASH_OP_SECTOR_ERASE, BATCH_ADDR, QSPI_FLASH_SECTOR_SIZE );
+    if( false == WaitForMemReady() || !CheckFlashContents( BATCH_ADDR, sizeof(tx_buf), (char)0xFF )) {
+        printf("\nERROR: Erase after the timed out poll failed");
+        return false;
+    }
+    
+    // Malformed steps are refused before anything is sent
+    qspi_flash_command_t bad_step = QSPI_FLASH_COMMAND_POLL( QSPI_STD_CMD_RDSR, &status, QSPI_FLASH_SR_WIP, 0, 100 );
+    bad_step.rx_length = 0;
+    if( QSPI_STATUS_INVALID_PARAMETER != myFlash->command_batch( &bad_step, 1 ) || QSPI_STATUS_INVALID_PARAMETER != myFlash->command_batch( NULL, 0 )) {
+        printf("\nERROR: Malformed batch accepted");
+        return false;
+    }
+    
+    // The same status reads sent as one batch and one driver call each
+    char regs[BATCH_STATUS_READS];
+    qspi_flash_command_t reads[BATCH_STATUS_READS];
+    for(int i=0; i < BATCH_STATUS_READS; i++) {
+        qspi_flash_command_t read = QSPI_FLASH_COMMAND( QSPI_STD_CMD_RDSR, NULL, 0, &regs[i], 1 );
+        reads[i] = read;
+    }
+    uint32_t time_us[2];
+    for(int separate=0; separate < 2; separate++) {
+        Timer timer;
+        myFlash->set_hw_batch( separate == 0 );
+        myFlash->reset_batch_stats();
+        timer.start();
+        if( QSPI_STATUS_OK != myFlash->command_batch( reads, BATCH_STATUS_READS )) {
+            printf("\nERROR: Status reads failed");
+            myFlash->set_hw_batch( true );
+            return false;
+        }
+        time_us[separate] = timer.read_us();
+    }
+    myFlash->set_hw_batch( true );
+    stats = myFlash->get_batch_stats();
+    if( stats.driver_calls != BATCH_STATUS_READS ) {
+        printf("\nERROR: %lu driver calls for %d separate commands", (unsigned long)stats.driver_calls, BATCH_STATUS_READS );
+        return false;
+    }
+    printf(" %d status reads: %lu us batched, %lu us separate", BATCH_STATUS_READS, (unsigned long)time_us[0], (unsigned long)time_us[1] );
+    return true;
+}
+
+#define PRE_ERASE_ADDR          0xDA000
+#define PRE_ERASE_SECTORS       4
+#define PRE_ERASE_DEPTH         2
+#define PRE_ERASE_IDLE_MS       5
+
+bool TestPreErase()
+{
+    char tx_buf[QSPI_FLASH_PAGE_SIZE];
+    uint32_t addr = 0;
+    
+    // Leave data in every sector of the ring, so that each needs an erase
+    memset( tx_buf, 0x3C, sizeof(tx_buf) );
+    for(int i=0; i < PRE_ERASE_SECTORS; i++) {
+        uint32_t sector = PRE_ERASE_ADDR + i * QSPI_FLASH_SECTOR_SIZE;
+        if( QSPI_STATUS_OK != myFlash->erase_sector( sector ) || QSPI_STATUS_OK != myFlash->program( sector, tx_buf, sizeof(tx_buf) )) {
+            printf("\nERROR: Preparing the ring failed");
+            return false;
+        }
+    }
+    
+    QSPIFlashPreErase pre_erase( myFlash, PRE_ERASE_ADDR, PRE_ERASE_SECTORS, PRE_ERASE_DEPTH, PRE_ERASE_IDLE_MS );
+    
+    // Idle: the thread erases as many sectors ahead as asked, and no more
+    Thread::wait(( PRE_ERASE_IDLE_MS + QSPI_FLASH_TSE_MAX_US / 1000 ) * ( PRE_ERASE_DEPTH + 1 ));
+    qspi_pre_erase_stats_t stats = pre_erase.get_stats();
+    if( pre_erase.erased_ahead() != PRE_ERASE_DEPTH || stats.background_erases != PRE_ERASE_DEPTH ) {
+        printf("\nERROR: %u sectors erased ahead, %lu erases", pre_erase.erased_ahead(), (unsigned long)stats.background_erases );
+        return false;
+    }
+    
+    // A pre-erased sector costs the writer program time only
+    Timer timer;
+    timer.start();
+    if( QSPI_STATUS_OK != pre_erase.next_sector( &addr ) || addr != PRE_ERASE_ADDR ||
+        QSPI_STATUS_OK != pre_erase.program( addr, tx_buf, sizeof(tx_buf) )) {
+        printf("\nERROR: Writing the first sector failed");
+        return false;
+    }
+    uint32_t write_us = timer.read_us();
+    if( write_us >= QSPI_FLASH_TSE_TYP_US || !CheckFlashContents( addr, sizeof(tx_buf), 0x3C ) ||
+        !CheckFlashContents( addr + sizeof(tx_buf), sizeof(tx_buf), (char)0xFF )) {
+        printf("\nERROR: Pre-erased write took %lu us", (unsigned long)write_us );
+        return false;
+    }
+    
+    // Taken back to back, the writer runs out of erased sectors: every
+    // sector still comes erased, the thread's or its own, in ring order
+    for(int i=1; i <= PRE_ERASE_SECTORS; i++) {
+        if( QSPI_STATUS_OK != pre_erase.next_sector( &addr ) || addr != (uint32_t)( PRE_ERASE_ADDR + ( i % PRE_ERASE_SECTORS ) * QSPI_FLASH_SECTOR_SIZE ) ||
+            !CheckFlashContents( addr, sizeof(tx_buf), (char)0xFF )) {
+            printf("\nERROR: Sector %d not erased", i );
+            return false;
+        }
+    }
+    stats = pre_erase.get_stats();
+    if( stats.sectors != PRE_ERASE_SECTORS + 1 || stats.pre_erased + stats.foreground_erases != stats.sectors || stats.foreground_erases == 0 ) {
+        printf("\nERROR: Pre-erase stats %lu sectors, %lu pre-erased, %lu erased in the foreground", (unsigned long)stats.sectors,
+               (unsigned long)stats.pre_erased, (unsigned long)stats.foreground_erases );
+        return false;
+    }
+    printf(" write to a pre-erased sector %lu us, %lu of %lu sectors pre-erased", (unsigned long)write_us,
+           (unsigned long)stats.pre_erased, (unsigned long)stats.sectors );
+    return true;
+}
+
+#define WRITE_BUFFER_ADDR       0xDE000
+#define WRITE_BUFFER_RECORD     16
+#define WRITE_BUFFER_TIMEOUT_MS 20
+
+bool TestWriteBuffer()
+{
+    char tx_buf[WRITE_BUFFER_RECORD];
+    char rx_buf[QSPI_FLASH_PAGE_SIZE];
+    
+    if( false == SectorErase( WRITE_BUFFER_ADDR ) || false == WaitForMemReady() ) {
+        return false;
+    }
+    QSPIWriteBuffer wbuf( myFlash, 2, WRITE_BUFFER_TIMEOUT_MS );
+    
+    // Records filling a page go out as one program once the last one is in;
+    // until then only reads through the buffer see them
+    int records = QSPI_FLASH_PAGE_SIZE / WRITE_BUFFER_RECORD;
+    for(int i=0; i < records; i++) {
+        memset( tx_buf, 0x40 + i, sizeof(tx_buf) );
+        if( QSPI_STATUS_OK != wbuf.program( WRITE_BUFFER_ADDR + i * WRITE_BUFFER_RECORD, tx_buf, sizeof(tx_buf) )) {
+            printf("\nERROR: Buffered write failed");
+            return false;
+        }
+        if( i == records - 2 ) {
+            if( QSPI_STATUS_OK != wbuf.read( WRITE_BUFFER_ADDR + i * WRITE_BUFFER_RECORD, rx_buf, sizeof(tx_buf) ) || memcmp( rx_buf, tx_buf, sizeof(tx_buf) ) ||
+                wbuf.get_stats().page_programs != 0 || !CheckFlashContents( WRITE_BUFFER_ADDR, QSPI_FLASH_PAGE_SIZE, (char)0xFF )) {
+                printf("\nERROR: Gathered records not coherent");
+                return false;
+            }
+        }
+    }
+    qspi_write_buffer_stats_t stats = wbuf.get_stats();
+    if( stats.writes != (uint32_t)records || stats.page_programs != 1 || stats.full_flushes != 1 || wbuf.dirty_pages() != 0 ||
+        !CheckFlashContents( WRITE_BUFFER_ADDR + ( records - 1 ) * WRITE_BUFFER_RECORD, WRITE_BUFFER_RECORD, 0x40 + records - 1 )) {
+        printf("\nERROR: %lu programs for a page of records", (unsigned long)stats.page_programs );
+        return false;
+    }
+    
+    // Overlapping writes combine as programming twice would; nothing is
+    // programmed until the timeout
+    uint32_t addr = WRITE_BUFFER_ADDR + QSPI_FLASH_PAGE_SIZE;
+    memset( tx_buf, 0x0F, sizeof(tx_buf) );
+    wbuf.program( addr, tx_buf, sizeof(tx_buf) );
+    memset( tx_buf, 0x3C, sizeof(tx_buf) );
+    wbuf.program( addr + sizeof(tx_buf) / 2, tx_buf, sizeof(tx_buf) );
+    if( QSPI_STATUS_OK != wbuf.read( addr, rx_buf, sizeof(tx_buf) * 2 ) || rx_buf[0] != 0x0F || rx_buf[sizeof(tx_buf) - 1] != 0x0C ||
+        rx_buf[sizeof(tx_buf) + 1] != 0x3C || rx_buf[sizeof(tx_buf) * 2 - 1] != (char)0xFF || wbuf.dirty_pages() != 1 ) {
+        printf("\nERROR: Overlapping writes not merged");
+        return false;
+    }
+    Thread::wait( WRITE_BUFFER_TIMEOUT_MS * 2 );
+    stats = wbuf.get_stats();
+    if( stats.timeout_flushes != 1 || wbuf.dirty_pages() != 0 || !CheckFlashContents( addr + sizeof(tx_buf) / 2, sizeof(tx_buf) / 2, 0x0C )) {
+        printf("\nERROR: Page not programmed after the timeout");
+        return false;
+    }
+    
+    // A third page evicts the oldest of two; sync programs the rest, and an
+    // erase drops what is gathered for its range
+    for(int i=2; i < 5; i++) {
+        memset( tx_buf, 0x50 + i, sizeof(tx_buf) );
+        wbuf.program( WRITE_BUFFER_ADDR + i * QSPI_FLASH_PAGE_SIZE, tx_buf, sizeof(tx_buf) );
+    }
+    if( wbuf.get_stats().evictions != 1 || !CheckFlashContents( WRITE_BUFFER_ADDR + 2 * QSPI_FLASH_PAGE_SIZE, sizeof(tx_buf), 0x52 ) ||
+        QSPI_STATUS_OK != wbuf.sync() || wbuf.dirty_pages() != 0 || !CheckFlashContents( WRITE_BUFFER_ADDR + 4 * QSPI_FLASH_PAGE_SIZE, sizeof(tx_buf), 0x54 )) {
+        printf("\nERROR: Eviction or sync failed");
+        return false;
+    }
+    wbuf.program( WRITE_BUFFER_ADDR + 5 * QSPI_FLASH_PAGE_SIZE, tx_buf, sizeof(tx_buf) );
+    if( QSPI_STATUS_OK != wbuf.erase_range( WRITE_BUFFER_ADDR, QSPI_FLASH_SECTOR_SIZE ) || wbuf.dirty_pages() != 0 ||
+        QSPI_STATUS_OK != wbuf.read( WRITE_BUFFER_ADDR + 5 * QSPI_FLASH_PAGE_SIZE, rx_buf, sizeof(tx_buf) ) || rx_buf[0] != (char)0xFF ) {
+        printf("\nERROR: Erase did not drop the gathered page");
+        return false;
+    }
+    
+#if QSPI_FLASH_SIZE <= QSPI_FLASH_3BYTE_MAX_SIZE
+    // A page that fails to program, past what 3-byte addresses reach, stays
+    // gathered: evicting it fails without taking the new write, and the
+    // thread's failure goes to the next sync
+    memset( tx_buf, 0x61, sizeof(tx_buf) );
+    wbuf.program( QSPI_FLASH_3BYTE_MAX_SIZE, tx_buf, sizeof(tx_buf) );
+    wbuf.program( WRITE_BUFFER_ADDR + 6 * QSPI_FLASH_PAGE_SIZE, tx_buf, sizeof(tx_buf) );
+    if( QSPI_STATUS_OK == wbuf.program( WRITE_BUFFER_ADDR + 7 * QSPI_FLASH_PAGE_SIZE, tx_buf, sizeof(tx_buf) ) || wbuf.dirty_pages() != 2 ||
+        QSPI_STATUS_OK != wbuf.read( WRITE_BUFFER_ADDR + 7 * QSPI_FLASH_PAGE_SIZE, rx_buf, sizeof(tx_buf) ) || rx_buf[0] != (char)0xFF ) {
+        printf("\nERROR: Failed eviction took the write");
+        return false;
+    }
+    Thread::wait( WRITE_BUFFER_TIMEOUT_MS * 2 );
+    if( wbuf.dirty_pages() != 1 || wbuf.get_stats().failed_flushes < 2 || !CheckFlashContents( WRITE_BUFFER_ADDR + 6 * QSPI_FLASH_PAGE_SIZE, sizeof(tx_buf), 0x61 )) {
+        printf("\nERROR: Failed page not kept");
+        return false;
+    }
+    wbuf.erase_range( QSPI_FLASH_3BYTE_MAX_SIZE, QSPI_FLASH_SECTOR_SIZE );
+    if( QSPI_STATUS_OK == wbuf.sync() || QSPI_STATUS_OK != wbuf.sync() ) {
+        printf("\nERROR: Timeout flush failure not reported");
+        return false;
+    }
+#endif
+    stats = wbuf.get_stats();
+    printf(" %lu writes, %lu page programs", (unsigned long)stats.writes, (unsigned long)stats.page_programs );
+    return true;
+}
+
+#define SECTOR_MAP_ADDR         0xF0000
+#define SECTOR_MAP_SECTORS      8
+#define SECTOR_MAP_MAP_ADDR     0xF8000
+#define SECTOR_MAP_JOURNAL      8
+#define SECTOR_MAP_MAX_CUTS     32
+
+// Sectors 0 and 1 written before there was a map, the rest erased
+static bool SetUpSectorMap()
+{
+    char tx_buf[16];
+    
+    memset( tx_buf, 0x5A, sizeof(tx_buf) );
+    if( QSPI_STATUS_OK != myFlash->erase_range( SECTOR_MAP_ADDR, SECTOR_MAP_SECTORS * QSPI_FLASH_SECTOR_SIZE ) ||
+        QSPI_STATUS_OK != myFlash->program( SECTOR_MAP_ADDR, tx_buf, sizeof(tx_buf) ) ||
+        QSPI_STATUS_OK != myFlash->program( SECTOR_MAP_ADDR + QSPI_FLASH_SECTOR_SIZE, tx_buf, sizeof(tx_buf) )) {
+        printf("\nERROR: Sector map setup failed");
+        return false;
+    }
+    return true;
+}
+
+// Program sector 2, retire sector 0 and erase it, write the map afresh and
+// program sector 0 again: 10 programs and erases
+static qspi_status_t SectorMapSequence( QSPIFlashSectorMap *map )
+{
+    char tx_buf[16];
+    
+    memset( tx_buf, 0xA5, sizeof(tx_buf) );
+    qspi_status_t result = map->program( SECTOR_MAP_ADDR + 2 * QSPI_FLASH_SECTOR_SIZE, tx_buf, sizeof(tx_buf) );
+    if( QSPI_STATUS_OK == result ) {
+        result = map->mark_dirty( SECTOR_MAP_ADDR, QSPI_FLASH_SECTOR_SIZE );
+    }
+    if( QSPI_STATUS_OK == result ) {
+        result = map->erase_range( SECTOR_MAP_ADDR, QSPI_FLASH_SECTOR_SIZE );
+    }
+    if( QSPI_STATUS_OK == result ) {
+        result = map->compact();
+    }
+    if( QSPI_STATUS_OK == result ) {
+        result = map->program( SECTOR_MAP_ADDR, tx_buf, sizeof(tx_buf) );
+    }
+    return result;
+}
+
+// Whatever the map has as erased must be blank, and sector 1 was never touched
+static bool CheckSectorMap( QSPIFlashSectorMap *map )
+{
+    for(int s=0; s < SECTOR_MAP_SECTORS; s++) {
+        uint32_t addr = SECTOR_MAP_ADDR + s * QSPI_FLASH_SECTOR_SIZE;
+        if( QSPI_SECTOR_ERASED == map->get_state( addr ) && !CheckFlashContents( addr, QSPI_FLASH_SECTOR_SIZE, (char)0xFF )) {
+            printf("\nERROR: Sector %d is in the map as erased but holds data", s );
+            return false;
+        }
+    }
+    if( QSPI_SECTOR_IN_USE != map->get_state( SECTOR_MAP_ADDR + QSPI_FLASH_SECTOR_SIZE )) {
+        printf("\nERROR: Sector map lost sector 1");
+        return false;
+    }
+    return true;
+}
+
+bool TestSectorMap()
+{
+    bool ret_status = true;
+    
+    // No map yet: InitializeFlashMem scans the range and writes one
+    if( false == SetUpSectorMap() ||
+        QSPI_STATUS_OK != myFlash->erase_range( SECTOR_MAP_MAP_ADDR, QSPIFlashSectorMap::map_size( SECTOR_MAP_SECTORS, SECTOR_MAP_JOURNAL ))) {
+        return false;
+    }
+    QSPIFlashSectorMap map( myFlash, SECTOR_MAP_ADDR, SECTOR_MAP_SECTORS, SECTOR_MAP_MAP_ADDR, SECTOR_MAP_JOURNAL );
+    mySectorMap = &map;
+    if( false == InitializeFlashMem() || map.get_stats().sectors_scanned != SECTOR_MAP_SECTORS ||
+        map.count( QSPI_SECTOR_IN_USE ) != 2 || map.count( QSPI_SECTOR_ERASED ) != SECTOR_MAP_SECTORS - 2 ) {
+        printf("\nERROR: Sector map not built from a scan");
+        mySectorMap = NULL;
+        return false;
+    }
+    
+    // The next start finds the map and only replays the journal
+    if( QSPI_STATUS_OK != SectorMapSequence( &map ) || map.get_state( SECTOR_MAP_ADDR + 2 * QSPI_FLASH_SECTOR_SIZE ) != QSPI_SECTOR_IN_USE ) {
+        printf("\nERROR: Sector map sequence failed");
+        mySectorMap = NULL;
+        return false;
+    }
+    // A full journal has the map written afresh
+    char tx_buf[16];
+    memset( tx_buf, 0x33, sizeof(tx_buf) );
+    for(int i=0; i < SECTOR_MAP_JOURNAL && ret_status; i++) {
+        if( QSPI_STATUS_OK != map.program( SECTOR_MAP_ADDR + 3 * QSPI_FLASH_SECTOR_SIZE, tx_buf, sizeof(tx_buf) ) ||
+            QSPI_STATUS_OK != map.erase_range( SECTOR_MAP_ADDR + 3 * QSPI_FLASH_SECTOR_SIZE, QSPI_FLASH_SECTOR_SIZE )) {
+            ret_status = false;
+        }
+    }
+    if( false == ret_status || map.get_stats().compactions < 3 ) {
+        printf("\nERROR: Sector map journal did not roll over");
+        mySectorMap = NULL;
+        return false;
+    }
+    QSPIFlashSectorMap remount( myFlash, SECTOR_MAP_ADDR, SECTOR_MAP_SECTORS, SECTOR_MAP_MAP_ADDR, SECTOR_MAP_JOURNAL );
+    mySectorMap = &remount;
+    if( false == InitializeFlashMem() || remount.get_stats().sectors_scanned != 0 || remount.get_stats().replayed > SECTOR_MAP_JOURNAL ) {
+        printf("\nERROR: Sector map not mounted");
+        ret_status = false;
+    }
+    for(int s=0; s < SECTOR_MAP_SECTORS && ret_status; s++) {
+        uint32_t addr = SECTOR_MAP_ADDR + s * QSPI_FLASH_SECTOR_SIZE;
+        if( remount.get_state( addr ) != map.get_state( addr )) {
+            printf("\nERROR: Sector %d changed state across a restart", s );
+            ret_status = false;
+        }
+    }
+    
+    // Cut the power at every program and erase of the sequence in turn;
+    // the map found afterwards may miss an erase but never claims one
+    int cuts = 0;
+    uint32_t torn = 0;
+    // Restoring a supply that is on changes nothing
+    if( ret_status && QSPI_STATUS_INVALID_PARAMETER == qspi_flash_hw_power_fail( 0 )) {
+        printf(" (no power-fail hook)");
+        mySectorMap = NULL;
+        return true;
+    }
+    for(int cut=1; cut <= SECTOR_MAP_MAX_CUTS && ret_status; cut++) {
+        QSPIFlashSectorMap before( myFlash, SECTOR_MAP_ADDR, SECTOR_MAP_SECTORS, SECTOR_MAP_MAP_ADDR, SECTOR_MAP_JOURNAL );
+        if( false == SetUpSectorMap() || QSPI_STATUS_OK != before.rebuild() ) {
+            ret_status = false;
+            break;
+        }
+        qspi_flash_hw_power_fail( cut );
+        qspi_status_t result = SectorMapSequence( &before );
+        qspi_flash_hw_power_fail( 0 );
+        if( QSPI_STATUS_OK == result ) {
+            // Every operation made it
+            break;
+        }
+        cuts++;
+        
+        QSPIFlashSectorMap after( myFlash, SECTOR_MAP_ADDR, SECTOR_MAP_SECTORS, SECTOR_MAP_MAP_ADDR, SECTOR_MAP_JOURNAL );
+        mySectorMap = &after;
+        if( false == InitializeFlashMem() || after.get_stats().sectors_scanned != 0 || false == CheckSectorMap( &after )) {
+            printf("\nERROR: Sector map wrong after a power cut at operation %d", cut );
+            ret_status = false;
+            break;
+        }
+        torn += after.get_stats().torn_entries;
+        
+        // and carries on from there
+        if( QSPI_STATUS_OK != SectorMapSequence( &after ) || false == CheckSectorMap( &after ) ||
+            QSPI_SECTOR_IN_USE != after.get_state( SECTOR_MAP_ADDR )) {
+            printf("\nERROR: Sector map unusable after a power cut at operation %d", cut );
+            ret_status = false;
+        }
+    }
+    mySectorMap = NULL;
+    if( ret_status && ( cuts == 0 || torn == 0 )) {
+        printf("\nERROR: %d power cuts, %lu torn journal entries", cuts, (unsigned long)torn );
+        ret_status = false;
+    }
+    if( ret_status ) {
+        printf(" %d power cuts recovered from, %lu torn journal entries skipped", cuts, (unsigned long)torn );
+    }
+    return ret_status;
+}
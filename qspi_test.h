@@ -0,0 +1,29 @@
+#ifndef QSPI_TEST_H
+#define QSPI_TEST_H
+
+#include "QSPI.h"
+#include "QSPIFlash.h"
+
+//#define DEBUG_ON 1
+#ifdef DEBUG_ON
+    #define VERBOSE_PRINT(x) printf x
+#else    
+    #define VERBOSE_PRINT(x)
+#endif
+
+#define _1_K_ (0x400)
+#define _4_K_ (_1_K_ * 4)
+
+class QSPIFlashSectorMap;
+
+extern QSPI *myQspi;
+extern QSPI *myQspiOther;
+extern QSPIFlash *myFlash;
+// Mounted by InitializeFlashMem when set
+extern QSPIFlashSectorMap *mySectorMap;
+
+bool InitializeFlashMem();
+bool WaitForMemReady();
+bool SectorErase(unsigned int flash_addr);
+
+#endif // QSPI_TEST_H
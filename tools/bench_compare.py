@@ -0,0 +1,71 @@
+#!/usr/bin/env python3
+"""Compare two benchmark runs produced by RunBenchmarks().
+
+Both inputs may be raw console logs or files holding only the CSV rows: every
+line starting with "BENCH," is picked up. A row regresses when its MB/s drops,
+or its p99 latency grows, by more than the threshold. Exits with status 1 if
+anything regressed so it can gate CI.
+
+    tools/bench_compare.py baseline.log current.log [--threshold 5]
+"""
+import argparse
+import sys
+
+FIELDS = ("format", "op", "size", "iterations", "mbps", "p50_us", "p99_us")
+
+
+def load(path):
+    rows = {}
+    with open(path) as f:
+        for line in f:
+            line = line.strip()
+            if not line.startswith("BENCH,"):
+                continue
+            values = dict(zip(FIELDS, line.split(",")[1:]))
+            key = (values["format"], values["op"], int(values["size"]))
+            rows[key] = {
+                "mbps": float(values["mbps"]),
+                "p99_us": int(values["p99_us"]),
+            }
+    return rows
+
+
+def change(old, new):
+    return 0.0 if old == 0 else (new - old) * 100.0 / old
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("baseline")
+    parser.add_argument("current")
+    parser.add_argument("--threshold", type=float, default=5.0,
+                        help="allowed slowdown in percent (default 5)")
+    args = parser.parse_args()
+
+    baseline = load(args.baseline)
+    current = load(args.current)
+    regressions = 0
+
+    print("%-6s %-8s %8s %10s %10s %8s %8s" %
+          ("format", "op", "size", "MB/s old", "MB/s new", "MB/s %", "p99 %"))
+    for key in sorted(baseline):
+        if key not in current:
+            print("%-6s %-8s %8d  missing from current run" % key)
+            regressions += 1
+            continue
+        old, new = baseline[key], current[key]
+        mbps_delta = change(old["mbps"], new["mbps"])
+        p99_delta = change(old["p99_us"], new["p99_us"])
+        flag = ""
+        if mbps_delta < -args.threshold or p99_delta > args.threshold:
+            flag = "  REGRESSION"
+            regressions += 1
+        print("%-6s %-8s %8d %10.3f %10.3f %+7.1f%% %+7.1f%%%s" %
+              (key + (old["mbps"], new["mbps"], mbps_delta, p99_delta, flag)))
+
+    print("\n%d regression(s) over %.1f%%" % (regressions, args.threshold))
+    return 1 if regressions else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
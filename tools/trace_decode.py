@@ -0,0 +1,95 @@
+#!/usr/bin/env python3
+"""Decode a QSPI transaction trace printed by qspi_trace_dump() into a timeline.
+
+The input may be a raw console log: every line starting with "TRACE," is picked
+up. Each transaction is printed with its start relative to the first one, its
+duration and the idle time since the previous one ended, followed by totals
+per opcode.
+
+    tools/trace_decode.py console.log [--failed-only]
+"""
+import argparse
+import collections
+import sys
+
+FIELDS = ("seq", "kind", "opcode", "format", "addr", "length", "start_us", "end_us", "status")
+
+KINDS = {0: "command", 1: "read", 2: "write", 3: "read_cont"}
+
+OPCODES = {
+    0x01: "WRSR", 0x02: "PP", 0x05: "RDSR", 0x06: "WREN", 0x0B: "FAST_READ",
+    0x20: "SE", 0x30: "RESUME", 0x32: "PP_1_1_4", 0x35: "RDCR", 0x38: "4PP",
+    0x3B: "DREAD", 0x3E: "WRCR", 0x52: "BE32K", 0x5A: "RDSFDP", 0x60: "CE",
+    0x66: "RSTEN", 0x6B: "QREAD", 0x99: "RST", 0x9F: "RDID", 0xA2: "PP_1_1_2",
+    0xB0: "SUSPEND", 0xB9: "DP", 0xAB: "RDP", 0xBB: "2READ", 0xC7: "CE",
+    0xD8: "BE", 0xEB: "4READ",
+}
+
+STATUSES = {0: "ok", -1: "error", -2: "invalid"}
+
+BUS_LINES = {0: 1, 1: 2, 2: 4}
+
+
+def bus_format(value):
+    if value == 0xFF:
+        return "?"
+    return "_".join(str(BUS_LINES.get((value >> shift) & 3, "?")) for shift in (4, 2, 0))
+
+
+def load(path):
+    entries = []
+    with open(path) as f:
+        for line in f:
+            line = line.strip()
+            if not line.startswith("TRACE,"):
+                continue
+            values = dict(zip(FIELDS, line.split(",")[1:]))
+            entries.append({name: int(value, 0) for name, value in values.items()})
+    entries.sort(key=lambda entry: entry["seq"])
+    return entries
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("log")
+    parser.add_argument("--failed-only", action="store_true", help="only list transactions that did not return ok")
+    args = parser.parse_args()
+
+    entries = load(args.log)
+    if not entries:
+        print("no TRACE lines in %s" % args.log, file=sys.stderr)
+        return 1
+
+    # Timestamps are 32-bit microseconds; differences wrap with them
+    base = entries[0]["start_us"]
+    prev_end = None
+    totals = collections.OrderedDict()
+    print("%8s %10s %8s %8s  %-9s %-14s %-6s %10s %6s  %s" %
+          ("seq", "t_us", "dur_us", "gap_us", "kind", "opcode", "format", "addr", "len", "status"))
+    for entry in entries:
+        duration = (entry["end_us"] - entry["start_us"]) & 0xFFFFFFFF
+        gap = "-" if prev_end is None else str((entry["start_us"] - prev_end) & 0xFFFFFFFF)
+        prev_end = entry["end_us"]
+        name = OPCODES.get(entry["opcode"], "") if entry["opcode"] else "default"
+        label = "0x%02X %s" % (entry["opcode"], name)
+        kind = KINDS.get(entry["kind"], str(entry["kind"]))
+        total = totals.setdefault((kind, label), [0, 0, 0])
+        total[0] += 1
+        total[1] += duration
+        total[2] = max(total[2], duration)
+        if args.failed_only and entry["status"] == 0:
+            continue
+        print("%8d %10d %8d %8s  %-9s %-14s %-6s %10s %6d  %s" %
+              (entry["seq"], (entry["start_us"] - base) & 0xFFFFFFFF, duration, gap, kind, label,
+               bus_format(entry["format"]), "0x%06X" % entry["addr"], entry["length"],
+               STATUSES.get(entry["status"], str(entry["status"]))))
+
+    print()
+    print("%-9s %-14s %6s %10s %8s" % ("kind", "opcode", "count", "total_us", "max_us"))
+    for (kind, label), (count, total_us, max_us) in totals.items():
+        print("%-9s %-14s %6d %10d %8d" % (kind, label, count, total_us, max_us))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())